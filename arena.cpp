@@ -0,0 +1,68 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <stdlib.h>
+
+#include "arena.h"
+
+void * arena::refill(size_t size)
+{
+	chunk * fresh;
+	if(size > chunk_size / 4)
+	{
+		/* large allocations get their own chunk, behind the current one so
+		 * that we can keep using what's left of it */
+		fresh = (chunk *) malloc(header + size);
+		if(!fresh)
+			return NULL;
+		fresh->size = header + size;
+		total += fresh->size;
+		if(chunks)
+		{
+			fresh->older = chunks->older;
+			chunks->older = fresh;
+		}
+		else
+		{
+			/* there is no current chunk; make this one current, but full */
+			fresh->older = NULL;
+			chunks = fresh;
+			next = (uint8_t *) fresh + fresh->size;
+			remaining = 0;
+		}
+		return (uint8_t *) fresh + header;
+	}
+	fresh = (chunk *) malloc(header + chunk_size);
+	if(!fresh)
+		return NULL;
+	fresh->size = header + chunk_size;
+	fresh->older = chunks;
+	chunks = fresh;
+	total += fresh->size;
+	next = (uint8_t *) fresh + header + size;
+	remaining = chunk_size - size;
+	return (uint8_t *) fresh + header;
+}
+
+void arena::clear()
+{
+	if(!chunks)
+		return;
+	/* keep the newest chunk, so a cleared arena doesn't need to call
+	 * malloc() again right away */
+	release(chunks->older);
+	chunks->older = NULL;
+	total = chunks->size;
+	next = (uint8_t *) chunks + header;
+	remaining = chunks->size - header;
+}
+
+void arena::release(chunk * list)
+{
+	while(list)
+	{
+		chunk * older = list->older;
+		free(list);
+		list = older;
+	}
+}
@@ -0,0 +1,79 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error arena.h is a C++ header file
+#endif
+
+/* the default size of the chunks arenas get from malloc() */
+#define ARENA_CHUNK_SIZE 65536
+/* enough for any of the types we put in arenas */
+#define ARENA_ALIGN 16
+
+/* A bump allocator for lots of small objects that are all freed at the same
+ * time, like the nodes of an in-memory index. Allocation just advances a
+ * pointer through large chunks of memory, so objects allocated together end
+ * up next to each other, and there is no per-object header or free() call.
+ * Individual objects can't be freed: clear() frees them all at once (keeping
+ * one chunk to reuse), without running any destructors. An arena is not
+ * thread safe, though other threads can use the memory it returns. */
+
+class arena
+{
+public:
+	/* the memory stays valid until clear() or the arena is destroyed;
+	 * returns NULL if a new chunk is needed and malloc() fails */
+	inline void * allocate(size_t size)
+	{
+		void * memory;
+		size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+		if(size > remaining)
+			return refill(size);
+		memory = next;
+		next += size;
+		remaining -= size;
+		return memory;
+	}
+	
+	void clear();
+	
+	/* the total size of the chunks, for reporting memory use */
+	inline size_t size() const { return total; }
+	
+	inline arena(size_t chunk_size = ARENA_CHUNK_SIZE) : chunks(NULL), next(NULL), remaining(0), total(0), chunk_size(chunk_size) {}
+	inline ~arena()
+	{
+		clear();
+		release(chunks);
+	}
+	
+private:
+	struct chunk
+	{
+		chunk * older;
+		size_t size;
+	};
+	
+	/* the space for chunk headers, rounded up to keep the rest aligned */
+	static const size_t header = (sizeof(chunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	
+	void * refill(size_t size);
+	/* free the given chunk and all older ones */
+	static void release(chunk * list);
+	
+	/* the newest chunk, which we are allocating from, is first */
+	chunk * chunks;
+	uint8_t * next;
+	size_t remaining, total, chunk_size;
+	
+	void operator=(const arena &);
+	arena(const arena &);
+};
+
+#endif /* __ARENA_H */
@@ -10,6 +10,8 @@
 
 #include "openat.h"
 
+#include <vector>
+
 #include "util.h"
 #include "rofile.h"
 #include "rwfile.h"
@@ -247,6 +249,27 @@ blob array_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return get_value(key.u32 - min_key, found);
 }
 
+void array_dtable::lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	std::vector<size_t> order(count);
+	if(!count)
+		return;
+	/* each key is found directly, but reading them in order makes the reads sequential */
+	sort_keys(keys, count, &order[0]);
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t k = order[i];
+		assert(keys[k].type == dtype::UINT32);
+		if(keys[k].u32 < min_key || min_key + array_size <= keys[k].u32)
+		{
+			found[k] = false;
+			values[k] = blob();
+		}
+		else
+			values[k] = get_value(keys[k].u32 - min_key, &found[k]);
+	}
+}
+
 blob array_dtable::index(size_t index) const
 {
 	bool found;
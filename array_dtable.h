@@ -33,7 +33,16 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	virtual blob index(size_t index) const;
+	inline virtual bool key_bounds(dtype * min, dtype * max) const
+	{
+		if(!array_size)
+			return false;
+		*min = dtype(min_key);
+		*max = dtype((uint32_t) (min_key + array_size - 1));
+		return true;
+	}
 	virtual bool contains_index(size_t index) const;
 	inline virtual size_t size() const { return key_count; }
 	
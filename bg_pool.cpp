@@ -0,0 +1,122 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <assert.h>
+#include <unistd.h>
+
+#include "bg_pool.h"
+
+bg_pool bg_pool::global_pool;
+
+bg_pool::~bg_pool()
+{
+	scopelock scope(lock);
+	stopping = true;
+	scope.broadcast(more);
+	while(started)
+		scope.wait(finished);
+}
+
+void bg_pool::submit(job * job, int priority)
+{
+	scopelock scope(lock);
+	assert(!job->busy);
+	job->priority = priority;
+	job->sequence = sequence++;
+	job->busy = true;
+	job->queued = true;
+	queue.insert(job);
+	if(idle)
+		scope.signal(more);
+	else if(started < threads)
+	{
+		pthread_t thread;
+		/* if this fails, the job waits for an existing thread */
+		if(!pthread_create(&thread, NULL, worker_static, this))
+		{
+			pthread_detach(thread);
+			started++;
+		}
+	}
+}
+
+bool bg_pool::cancel(job * job)
+{
+	scopelock scope(lock);
+	if(!job->queued)
+		return false;
+	queue.erase(job);
+	job->queued = false;
+	job->busy = false;
+	scope.broadcast(finished);
+	return true;
+}
+
+void bg_pool::wait(job * job)
+{
+	scopelock scope(lock);
+	while(job->busy)
+		scope.wait(finished);
+}
+
+void bg_pool::set_threads(size_t count)
+{
+	scopelock scope(lock);
+	if(!count)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = (cpus > 0) ? cpus : 1;
+	}
+	threads = count;
+	/* wake up idle threads so extra ones can exit */
+	scope.broadcast(more);
+}
+
+void bg_pool::worker()
+{
+	scopelock scope(lock);
+	while(started <= threads)
+	{
+		job * next;
+		if(queue.empty())
+		{
+			if(stopping)
+				break;
+			idle++;
+			scope.wait(more);
+			idle--;
+			continue;
+		}
+		next = *queue.begin();
+		queue.erase(queue.begin());
+		next->queued = false;
+		/* start another thread if there is more work and room for it */
+		if(!queue.empty() && !idle && started < threads)
+		{
+			pthread_t thread;
+			if(!pthread_create(&thread, NULL, worker_static, this))
+			{
+				pthread_detach(thread);
+				started++;
+			}
+		}
+		scope.unlock();
+		next->run();
+		scope.lock();
+		next->busy = false;
+		scope.broadcast(finished);
+	}
+	started--;
+	/* let another thread take over any work left behind */
+	if(!queue.empty())
+		scope.signal(more);
+	/* the destructor waits for the threads to exit */
+	if(stopping)
+		scope.broadcast(finished);
+}
+
+void * bg_pool::worker_static(void * arg)
+{
+	((bg_pool *) arg)->worker();
+	return NULL;
+}
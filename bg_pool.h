@@ -0,0 +1,101 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __BG_POOL_H
+#define __BG_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifndef __cplusplus
+#error bg_pool.h is a C++ header file
+#endif
+
+#include <set>
+
+#include "locking.h"
+
+/* A process-wide pool of background threads that run maintenance jobs (like
+ * managed_dtable digests and combines) from a shared priority queue, instead
+ * of each object having its own mostly idle thread. Jobs with higher priority
+ * run first, and jobs with the same priority run in the order submitted. A
+ * job can only be in the queue or running once at a time; objects that have
+ * more work to do should submit their job again when it finishes. Jobs that
+ * need to synchronize with the foreground use their own bg_token, as when
+ * they each had their own bg_thread. */
+
+class bg_pool
+{
+public:
+	class job
+	{
+	public:
+		/* called in a pool thread */
+		virtual void run() = 0;
+		
+		inline job() : priority(0), sequence(0), busy(false), queued(false) {}
+		virtual ~job() {}
+		
+	private:
+		int priority;
+		uint64_t sequence;
+		/* busy while queued or running, queued only until it starts running */
+		bool busy, queued;
+		friend class bg_pool;
+	};
+	
+	/* queue the job, which must not already be queued or running */
+	void submit(job * job, int priority);
+	/* remove the job from the queue if no thread has started running it yet,
+	 * returning true if it was removed; the caller can then run it itself */
+	bool cancel(job * job);
+	/* wait until the job is neither queued nor running; call this before
+	 * destroying a job that has been submitted */
+	void wait(job * job);
+	
+	/* change the number of threads, or 0 for one per processor; threads are
+	 * only started as needed, and extra threads exit after their jobs */
+	void set_threads(size_t count);
+	inline size_t get_threads() const { return threads; }
+	
+	static inline bg_pool * get_global_pool() { return &global_pool; }
+	
+	inline bg_pool() : threads(0), started(0), idle(0), sequence(0), stopping(false)
+	{
+		set_threads(0);
+	}
+	/* runs the jobs still queued and waits for the threads to exit, so that
+	 * they are not left running while the process exits */
+	~bg_pool();
+	
+private:
+	struct job_order
+	{
+		inline bool operator()(const job * a, const job * b) const
+		{
+			/* higher priority first, then first come first served */
+			if(a->priority != b->priority)
+				return a->priority > b->priority;
+			return a->sequence < b->sequence;
+		}
+	};
+	typedef std::set<job *, job_order> job_queue;
+	
+	size_t threads, started, idle;
+	uint64_t sequence;
+	bool stopping;
+	job_queue queue;
+	init_mutex lock;
+	/* signaled when jobs are queued, and when they (or threads) finish */
+	init_cond more, finished;
+	
+	void worker();
+	static void * worker_static(void * arg);
+	
+	static bg_pool global_pool;
+	
+	void operator=(const bg_pool &);
+	bg_pool(const bg_pool &);
+};
+
+#endif /* __BG_POOL_H */
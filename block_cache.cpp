@@ -0,0 +1,175 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <stdlib.h>
+
+#include "block_cache.h"
+
+block_cache block_cache::global;
+atomic<uint64_t> block_cache::next_file_id;
+
+block_cache::~block_cache()
+{
+	for(size_t i = 0; i < BLOCK_CACHE_SHARDS; i++)
+		shrink(&shards[i], 0);
+}
+
+void block_cache::insert(shard * s, block * b)
+{
+	s->blocks[b->key] = b;
+	s->bytes += sizeof(*b) + b->size;
+	if(s->hand)
+	{
+		/* insert just behind the hand, so it is the last to be considered */
+		b->next = s->hand;
+		b->prev = s->hand->prev;
+		b->prev->next = b;
+		s->hand->prev = b;
+	}
+	else
+	{
+		b->next = b;
+		b->prev = b;
+		s->hand = b;
+	}
+}
+
+void block_cache::evict(shard * s)
+{
+	block * victim;
+	assert(s->hand);
+	/* give recently used blocks a second chance; this terminates
+	 * since we clear the referenced bits as we go around */
+	while(s->hand->referenced)
+	{
+		s->hand->referenced = false;
+		s->hand = s->hand->next;
+	}
+	victim = s->hand;
+	if(victim->next == victim)
+		s->hand = NULL;
+	else
+	{
+		victim->prev->next = victim->next;
+		victim->next->prev = victim->prev;
+		s->hand = victim->next;
+	}
+	s->blocks.erase(victim->key);
+	s->bytes -= sizeof(*victim) + victim->size;
+	s->evictions++;
+	free(victim);
+}
+
+void block_cache::shrink(shard * s, size_t limit)
+{
+	while(s->hand && s->bytes > limit)
+		evict(s);
+}
+
+void block_cache::set_budget(size_t bytes)
+{
+	budget = bytes;
+	for(size_t i = 0; i < BLOCK_CACHE_SHARDS; i++)
+	{
+		scopelock scope(shards[i].lock);
+		shards[i].limit = bytes / BLOCK_CACHE_SHARDS;
+		shrink(&shards[i], shards[i].limit);
+	}
+}
+
+ssize_t block_cache::copy(const block * b, size_t offset, void * data, size_t size)
+{
+	if(offset >= b->size)
+		return 0;
+	if(size > b->size - offset)
+		size = b->size - offset;
+	util::memcpy(data, &b->data[offset], size);
+	return size;
+}
+
+ssize_t block_cache::read_direct(int fd, off_t index, size_t block_size, size_t offset, void * data, size_t size)
+{
+	if(offset >= block_size)
+		return 0;
+	if(size > block_size - offset)
+		size = block_size - offset;
+	return pread(fd, data, size, index * block_size + offset);
+}
+
+ssize_t block_cache::read(int fd, uint64_t file, off_t index, size_t block_size, size_t offset, void * data, size_t size)
+{
+	block_map::iterator iter;
+	block * b;
+	ssize_t r;
+	block_key key = {file, index};
+	shard * s = get_shard(key);
+	scopelock scope(s->lock);
+	iter = s->blocks.find(key);
+	if(iter != s->blocks.end())
+	{
+		b = iter->second;
+		b->referenced = true;
+		s->hits++;
+		return copy(b, offset, data, size);
+	}
+	s->misses++;
+	if(sizeof(*b) + block_size > s->limit)
+	{
+		/* too big to cache, or the cache has been disabled, so
+		 * don't bother reading the whole block: just the range needed */
+		scope.unlock();
+		return read_direct(fd, index, block_size, offset, data, size);
+	}
+	/* don't hold the lock while doing I/O */
+	scope.unlock();
+	b = (block *) malloc(sizeof(*b) + block_size);
+	if(!b)
+		return read_direct(fd, index, block_size, offset, data, size);
+	r = pread(fd, b->data, block_size, index * block_size);
+	if(r <= 0)
+	{
+		free(b);
+		return r;
+	}
+	b->key = key;
+	b->size = r;
+	b->referenced = false;
+	scope.lock();
+	iter = s->blocks.find(key);
+	if(iter != s->blocks.end())
+	{
+		/* someone else loaded it while we were reading */
+		free(b);
+		return copy(iter->second, offset, data, size);
+	}
+	if(sizeof(*b) + b->size > s->limit)
+	{
+		/* too big to cache, or the cache has been disabled */
+		scope.unlock();
+		r = copy(b, offset, data, size);
+		free(b);
+		return r;
+	}
+	shrink(s, s->limit - sizeof(*b) - b->size);
+	insert(s, b);
+	return copy(b, offset, data, size);
+}
+
+void block_cache::get_stats(stats * stats) const
+{
+	stats->hits = 0;
+	stats->misses = 0;
+	stats->evictions = 0;
+	stats->blocks = 0;
+	stats->bytes = 0;
+	for(size_t i = 0; i < BLOCK_CACHE_SHARDS; i++)
+	{
+		shard * s = &shards[i];
+		scopelock scope(s->lock);
+		stats->hits += s->hits;
+		stats->misses += s->misses;
+		stats->evictions += s->evictions;
+		stats->blocks += s->blocks.size();
+		stats->bytes += s->bytes;
+	}
+}
@@ -0,0 +1,131 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __BLOCK_CACHE_H
+#define __BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error block_cache.h is a C++ header file
+#endif
+
+#include <ext/hash_map>
+
+#include "util.h"
+#include "atomic.h"
+#include "locking.h"
+
+/* A process-wide cache of file blocks, shared by all the rofiles opened while
+ * it is enabled (see rofile.h). Blocks are keyed by a file ID, which rofiles
+ * obtain from new_file_id() when they are opened, and a block index; the block
+ * size is up to each file, but must not change for a given file ID. IDs are
+ * never reused, so blocks of closed files are never read again and just age
+ * out of the cache. The cache has a total byte budget rather than a block
+ * count, so hot blocks of one file can displace cold blocks of another. */
+
+/* The cache is split into shards with separate locks to reduce contention
+ * between threads, and each shard uses the CLOCK replacement policy. Each
+ * shard gets an equal part of the budget, so the budget should be many times
+ * BLOCK_CACHE_SHARDS times the largest block size (typically 64K). */
+#define BLOCK_CACHE_SHARDS 16
+
+class block_cache
+{
+public:
+	struct stats
+	{
+		size_t hits, misses, evictions;
+		size_t blocks, bytes;
+	};
+	
+	/* set the total budget in bytes; 0 disables the cache for newly opened
+	 * files and drops all cached blocks (files already using it still work) */
+	void set_budget(size_t bytes);
+	inline size_t get_budget() const { return budget; }
+	inline bool enabled() const { return budget != 0; }
+	
+	/* read up to size bytes starting at offset within the given block of the
+	 * file, loading the block with pread() on fd if it is not cached */
+	/* returns the number of bytes read, which may be short at end of file */
+	ssize_t read(int fd, uint64_t file, off_t index, size_t block_size, size_t offset, void * data, size_t size);
+	
+	void get_stats(stats * stats) const;
+	
+	static inline uint64_t new_file_id() { return next_file_id.inc(); }
+	
+	/* the one shared by all rofiles */
+	static block_cache global;
+	
+	inline block_cache() : budget(0) {}
+	~block_cache();
+	
+private:
+	struct block_key
+	{
+		uint64_t file;
+		off_t index;
+		inline bool operator==(const block_key & x) const
+		{
+			return file == x.file && index == x.index;
+		}
+	};
+	
+	struct block_key_hash
+	{
+		inline size_t operator()(const block_key & key) const
+		{
+			return (size_t) (key.file * 0x9E3779B97F4A7C15ull) ^ (size_t) key.index;
+		}
+	};
+	
+	/* blocks are kept in a circular list, which the clock hand goes around */
+	struct block
+	{
+		block_key key;
+		size_t size;
+		bool referenced;
+		block * prev;
+		block * next;
+		uint8_t data[0];
+	};
+	
+	typedef __gnu_cxx::hash_map<block_key, block *, block_key_hash> block_map;
+	
+	struct shard
+	{
+		init_mutex lock;
+		block_map blocks;
+		block * hand;
+		/* bytes includes the block headers; limit is this shard's part of the budget */
+		size_t bytes, limit;
+		size_t hits, misses, evictions;
+		inline shard() : hand(NULL), bytes(0), limit(0), hits(0), misses(0), evictions(0) {}
+	};
+	
+	inline shard * get_shard(const block_key & key) const
+	{
+		size_t hash = block_key_hash()(key);
+		return &shards[(hash ^ (hash >> 16)) % BLOCK_CACHE_SHARDS];
+	}
+	
+	/* these require the shard lock to be held */
+	void insert(shard * s, block * b);
+	void evict(shard * s);
+	void shrink(shard * s, size_t limit);
+	static ssize_t copy(const block * b, size_t offset, void * data, size_t size);
+	/* reads the same range as copy() would, straight from the file */
+	static ssize_t read_direct(int fd, off_t index, size_t block_size, size_t offset, void * data, size_t size);
+	
+	size_t budget;
+	mutable shard shards[BLOCK_CACHE_SHARDS];
+	
+	static atomic<uint64_t> next_file_id;
+	
+	void operator=(const block_cache &);
+	block_cache(const block_cache &);
+};
+
+#endif /* __BLOCK_CACHE_H */
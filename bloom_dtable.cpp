@@ -3,9 +3,19 @@
 
 #define _ATFILE_SOURCE
 
+#include <stdlib.h>
+
+#include <vector>
+
 #include "md5.h"
 #include "openat.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "util.h"
 #include "rofile.h"
 #include "bloom_dtable.h"
@@ -24,6 +34,15 @@ bool bloom_dtable::perf_enable = false;
 #define HASH_SIZE 16 /* MD5 */
 #define HASH_BITS (HASH_SIZE * 8)
 
+/* the filter is aligned so that each block is exactly one cache line */
+static uint8_t * alloc_filter(size_t bytes)
+{
+	void * filter;
+	if(posix_memalign(&filter, BLOOM_BLOCK_SIZE, bytes))
+		return NULL;
+	return (uint8_t *) filter;
+}
+
 /* a little helper class to read bit arrays */
 class bitreader
 {
@@ -38,17 +57,19 @@ public:
 		uint32_t value = 0;
 		while(need)
 		{
+			/* only move on when we need more bits, so we never
+			 * read past the end once all the bits are used */
+			if(!left)
+			{
+				byte = *++array;
+				left = 8;
+			}
 			uint8_t take = (need > left) ? left : need;
 			value <<= take;
 			value |= byte & ((1 << take) - 1);
 			byte >>= take;
 			left -= take;
 			need -= take;
-			if(!left)
-			{
-				byte = *++array;
-				left = 8;
-			}
 		}
 		return value;
 	}
@@ -70,12 +91,17 @@ int bloom_dtable::bloom::init(int dfd, const char * file, size_t * m, size_t * k
 		return -1;
 	if(data->read_type(0, &header) < 0)
 		goto fail_close;
-	if(header.magic != BLOOM_DTABLE_MAGIC || header.version != BLOOM_DTABLE_VERSION)
+	if(header.magic != BLOOM_DTABLE_MAGIC || header.version > BLOOM_DTABLE_VERSION)
+		goto fail_close;
+	/* version 1 filters are made of whole blocks */
+	if(header.version && (!header.m || header.m % BLOOM_BLOCK_BITS))
 		goto fail_close;
 	bytes = (header.m + 7) / 8;
-	filter = new uint8_t[bytes];
+	filter = alloc_filter(bytes);
 	if(!filter)
 		goto fail_close;
+	version = header.version;
+	blocks = header.m / BLOOM_BLOCK_BITS;
 	if(data->read(sizeof(header), filter, bytes) != bytes)
 		goto fail_free;
 	*m = header.m;
@@ -94,21 +120,25 @@ int bloom_dtable::bloom::init(int dfd, const char * file, size_t * m, size_t * k
 	return 0;
 
 fail_free:
-	delete[] filter;
+	free(filter);
 	filter = NULL;
 fail_close:
 	delete data;
 	return -1;
 }
 
-int bloom_dtable::bloom::init(size_t bytes)
+int bloom_dtable::bloom::init(size_t bytes, uint32_t version)
 {
 	if(filter)
 		deinit();
-	filter = new uint8_t[bytes];
+	assert(version <= BLOOM_DTABLE_VERSION);
+	assert(!version || !(bytes % BLOOM_BLOCK_SIZE));
+	filter = alloc_filter(bytes);
 	if(!filter)
 		return -ENOMEM;
 	util::memset(filter, 0, bytes);
+	this->version = version;
+	blocks = bytes / BLOOM_BLOCK_SIZE;
 #if BFDT_PERF_TEST
 	total_lookups = 0;
 	blocked_lookups = 0;
@@ -120,7 +150,7 @@ void bloom_dtable::bloom::deinit()
 {
 	if(filter)
 	{
-		delete[] filter;
+		free(filter);
 		filter = NULL;
 #if BFDT_PERF_TEST
 		if(perf_enable && total_lookups)
@@ -142,7 +172,7 @@ int bloom_dtable::bloom::write(int dfd, const char * file, size_t m, size_t k) c
 	bloom_dtable_header header;
 
 	header.magic = BLOOM_DTABLE_MAGIC;
-	header.version = BLOOM_DTABLE_VERSION;
+	header.version = version;
 	header.m = m;
 	header.k = k;
 	
@@ -192,62 +222,162 @@ void bloom_dtable::bloom::add(const uint8_t * hash, size_t k, size_t bits)
 		set(indices.next());
 }
 
-bool bloom_dtable::bloom::check(const dtype & key, size_t k, size_t bits) const
+/* The block is picked by the high half of the hash, and the k bits within it
+ * by double hashing: the low half of the hash is the first index, and a
+ * second, odd value derived from the whole hash is the stride. */
+#define BLOCK_INDEX(hash, blocks) ((size_t) (((hash) >> 32) * (uint64_t) (blocks) >> 32))
+#define BLOCK_STRIDE(hash) ((uint32_t) (((hash) * 0x9E3779B97F4A7C15ULL) >> 32) | 1)
+
+bool bloom_dtable::bloom::check_blocked(uint64_t hash, size_t k) const
+{
+#if BFDT_PERF_TEST
+	if(perf_enable)
+		total_lookups++;
+#endif
+	const uint64_t * block = (const uint64_t *) &filter[BLOCK_INDEX(hash, blocks) * BLOOM_BLOCK_SIZE];
+	uint32_t index = hash, stride = BLOCK_STRIDE(hash);
+	for(size_t i = 0; i < k; i++, index += stride)
+	{
+		uint32_t bit = index % BLOOM_BLOCK_BITS;
+		if(!(block[bit / 64] & (1ULL << (bit % 64))))
+		{
+#if BFDT_PERF_TEST
+			if(perf_enable)
+				blocked_lookups++;
+#endif
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Tests a whole block at once: build a mask of the k bits, then check
+ * (block & mask) == mask with as few wide operations as are available. Only
+ * that final compare is vectorized; the mask is built with scalar shifts, as
+ * each probe sets one bit in an arbitrary word. AVX2 is only used if it is
+ * enabled at compile time (e.g. with -mavx2). */
+static inline bool test_block(const uint64_t * block, uint32_t index, uint32_t stride, size_t k)
+{
+	uint64_t mask[BLOOM_BLOCK_SIZE / sizeof(uint64_t)] __attribute__((aligned(BLOOM_BLOCK_SIZE))) = {0};
+	for(size_t i = 0; i < k; i++, index += stride)
+	{
+		uint32_t bit = index % BLOOM_BLOCK_BITS;
+		mask[bit / 64] |= 1ULL << (bit % 64);
+	}
+#if defined(__AVX2__)
+	const __m256i * b = (const __m256i *) block;
+	const __m256i * m = (const __m256i *) mask;
+	__m256i miss = _mm256_or_si256(_mm256_andnot_si256(_mm256_load_si256(&b[0]), _mm256_load_si256(&m[0])),
+	                               _mm256_andnot_si256(_mm256_load_si256(&b[1]), _mm256_load_si256(&m[1])));
+	return _mm256_testz_si256(miss, miss);
+#elif defined(__SSE2__)
+	const __m128i * b = (const __m128i *) block;
+	const __m128i * m = (const __m128i *) mask;
+	__m128i miss = _mm_andnot_si128(_mm_load_si128(&b[0]), _mm_load_si128(&m[0]));
+	miss = _mm_or_si128(miss, _mm_andnot_si128(_mm_load_si128(&b[1]), _mm_load_si128(&m[1])));
+	miss = _mm_or_si128(miss, _mm_andnot_si128(_mm_load_si128(&b[2]), _mm_load_si128(&m[2])));
+	miss = _mm_or_si128(miss, _mm_andnot_si128(_mm_load_si128(&b[3]), _mm_load_si128(&m[3])));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(miss, _mm_setzero_si128())) == 0xFFFF;
+#else
+	uint64_t miss = 0;
+	for(size_t i = 0; i < BLOOM_BLOCK_SIZE / sizeof(uint64_t); i++)
+		miss |= mask[i] & ~block[i];
+	return !miss;
+#endif
+}
+
+void bloom_dtable::bloom::check_blocked(const uint64_t * hashes, size_t count, size_t k, bool * out) const
+{
+	/* get all the cache misses going at once */
+	for(size_t i = 0; i < count; i++)
+		__builtin_prefetch(&filter[BLOCK_INDEX(hashes[i], blocks) * BLOOM_BLOCK_SIZE]);
+	for(size_t i = 0; i < count; i++)
+	{
+		const uint64_t * block = (const uint64_t *) &filter[BLOCK_INDEX(hashes[i], blocks) * BLOOM_BLOCK_SIZE];
+		out[i] = test_block(block, hashes[i], BLOCK_STRIDE(hashes[i]), k);
+#if BFDT_PERF_TEST
+		if(perf_enable)
+		{
+			total_lookups++;
+			if(!out[i])
+				blocked_lookups++;
+		}
+#endif
+	}
+}
+
+void bloom_dtable::bloom::add_blocked(uint64_t hash, size_t k)
+{
+	uint64_t * block = (uint64_t *) &filter[BLOCK_INDEX(hash, blocks) * BLOOM_BLOCK_SIZE];
+	uint32_t index = hash, stride = BLOCK_STRIDE(hash);
+	for(size_t i = 0; i < k; i++, index += stride)
+	{
+		uint32_t bit = index % BLOOM_BLOCK_BITS;
+		block[bit / 64] |= 1ULL << (bit % 64);
+	}
+}
+
+uint64_t bloom_dtable::bloom::hash(const dtype & key)
 {
-	MD5_CTX ctx;
-	uint8_t hash[HASH_SIZE];
-	MD5Init(&ctx);
 	switch(key.type)
 	{
 		case dtype::UINT32:
-			MD5Update(&ctx, (const uint8_t *) &key.u32, sizeof(key.u32));
-			MD5Final(hash, &ctx);
-			return check(hash, k, bits);
+			return util::hash64(&key.u32, sizeof(key.u32));
 		case dtype::DOUBLE:
-			MD5Update(&ctx, (const uint8_t *) &key.dbl, sizeof(key.dbl));
-			MD5Final(hash, &ctx);
-			return check(hash, k, bits);
+			return util::hash64(&key.dbl, sizeof(key.dbl));
 		case dtype::STRING:
-			if(key.str)
-				MD5Update(&ctx, (const uint8_t *) key.str.str(), key.str.length());
-			MD5Final(hash, &ctx);
-			return check(hash, k, bits);
+			if(!key.str)
+				return util::hash64(NULL, 0);
+			return util::hash64(key.str.str(), key.str.length());
 		case dtype::BLOB:
-			if(key.blb.exists())
-				MD5Update(&ctx, &key.blb[0], key.blb.size());
-			MD5Final(hash, &ctx);
-			return check(hash, k, bits);
+			if(!key.blb.exists())
+				return util::hash64(NULL, 0);
+			return util::hash64(&key.blb[0], key.blb.size());
 	}
 	abort();
 }
 
-void bloom_dtable::bloom::add(const dtype & key, size_t k, size_t bits)
+/* the old MD5 hash, for version 0 filters */
+static void md5_hash(const dtype & key, uint8_t * hash)
 {
 	MD5_CTX ctx;
-	uint8_t hash[HASH_SIZE];
 	MD5Init(&ctx);
 	switch(key.type)
 	{
 		case dtype::UINT32:
 			MD5Update(&ctx, (const uint8_t *) &key.u32, sizeof(key.u32));
-			MD5Final(hash, &ctx);
-			return add(hash, k, bits);
+			break;
 		case dtype::DOUBLE:
 			MD5Update(&ctx, (const uint8_t *) &key.dbl, sizeof(key.dbl));
-			MD5Final(hash, &ctx);
-			return add(hash, k, bits);
+			break;
 		case dtype::STRING:
 			if(key.str)
 				MD5Update(&ctx, (const uint8_t *) key.str.str(), key.str.length());
-			MD5Final(hash, &ctx);
-			return add(hash, k, bits);
+			break;
 		case dtype::BLOB:
 			if(key.blb.exists())
 				MD5Update(&ctx, &key.blb[0], key.blb.size());
-			MD5Final(hash, &ctx);
-			return add(hash, k, bits);
+			break;
 	}
-	abort();
+	MD5Final(hash, &ctx);
+}
+
+bool bloom_dtable::bloom::check(const dtype & key, size_t k, size_t bits) const
+{
+	uint8_t hash[HASH_SIZE];
+	if(version)
+		return check_blocked(this->hash(key), k);
+	md5_hash(key, hash);
+	return check(hash, k, bits);
+}
+
+void bloom_dtable::bloom::add(const dtype & key, size_t k, size_t bits)
+{
+	uint8_t hash[HASH_SIZE];
+	if(version)
+		return add_blocked(this->hash(key), k);
+	md5_hash(key, hash);
+	add(hash, k, bits);
 }
 
 bool bloom_dtable::present(const dtype & key, bool * found, ATX_DEF) const
@@ -260,6 +390,53 @@ bool bloom_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 	return base->present(key, found);
 }
 
+/* how many keys to hash and prefetch at a time in present_many() */
+#define BLOOM_BATCH 16
+
+void bloom_dtable::present_many(const dtype * keys, size_t count, bool * out, bool * found, ATX_DEF) const
+{
+	std::vector<size_t> pass;
+	std::vector<dtype> batch;
+	bool pass_out[BLOOM_BATCH], pass_found[BLOOM_BATCH];
+	if(!filter.blocked())
+	{
+		dtable::present_many(keys, count, out, found, atx);
+		return;
+	}
+	pass.reserve(BLOOM_BATCH);
+	batch.reserve(BLOOM_BATCH);
+	for(size_t start = 0; start < count; start += BLOOM_BATCH)
+	{
+		uint64_t hashes[BLOOM_BATCH];
+		size_t batch_size = count - start;
+		if(batch_size > BLOOM_BATCH)
+			batch_size = BLOOM_BATCH;
+		for(size_t i = 0; i < batch_size; i++)
+			hashes[i] = bloom::hash(keys[start + i]);
+		filter.check_blocked(hashes, batch_size, k, &out[start]);
+		/* only the keys that got through the filter need to go to the base */
+		pass.clear();
+		batch.clear();
+		for(size_t i = start; i < start + batch_size; i++)
+		{
+			found[i] = false;
+			if(out[i])
+			{
+				pass.push_back(i);
+				batch.push_back(keys[i]);
+			}
+		}
+		if(pass.empty())
+			continue;
+		base->present_many(&batch[0], pass.size(), pass_out, pass_found);
+		for(size_t i = 0; i < pass.size(); i++)
+		{
+			out[pass[i]] = pass_out[i];
+			found[pass[i]] = pass_found[i];
+		}
+	}
+}
+
 blob bloom_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
 	if(!filter.check(key, k, bits))
@@ -270,6 +447,55 @@ blob bloom_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return base->lookup(key, found);
 }
 
+void bloom_dtable::lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	std::vector<size_t> pass;
+	std::vector<dtype> batch;
+	std::vector<blob> pass_values;
+	bool * pass_found;
+	for(size_t start = 0; start < count; start += BLOOM_BATCH)
+	{
+		uint64_t hashes[BLOOM_BATCH];
+		bool out[BLOOM_BATCH];
+		size_t batch_size = count - start;
+		if(batch_size > BLOOM_BATCH)
+			batch_size = BLOOM_BATCH;
+		if(filter.blocked())
+		{
+			for(size_t i = 0; i < batch_size; i++)
+				hashes[i] = bloom::hash(keys[start + i]);
+			filter.check_blocked(hashes, batch_size, k, out);
+		}
+		else
+			for(size_t i = 0; i < batch_size; i++)
+				out[i] = filter.check(keys[start + i], k, bits);
+		for(size_t i = 0; i < batch_size; i++)
+		{
+			if(out[i])
+			{
+				pass.push_back(start + i);
+				batch.push_back(keys[start + i]);
+				continue;
+			}
+			values[start + i] = blob();
+			found[start + i] = false;
+		}
+	}
+	if(pass.empty())
+		return;
+	/* unlike present_many(), send all the keys that got through the filter
+	 * to the base in one batch, so that it can look them up in key order */
+	pass_values.resize(pass.size());
+	pass_found = new bool[pass.size()];
+	base->lookup_many(&batch[0], pass.size(), &pass_values[0], pass_found);
+	for(size_t i = 0; i < pass.size(); i++)
+	{
+		values[pass[i]] = pass_values[i];
+		found[pass[i]] = pass_found[i];
+	}
+	delete[] pass_found;
+}
+
 bool bloom_dtable::static_indexed_access(const params & config)
 {
 	const dtable_factory * factory;
@@ -307,6 +533,7 @@ int bloom_dtable::init(int dfd, const char * file, const params & config, sys_jo
 	r = filter.init(bf_dfd, "bloom", &m, &k);
 	if(r < 0)
 		goto fail_filter;
+	/* only used by version 0 filters */
 	bits = HASH_BITS / k;
 	
 	close(bf_dfd);
@@ -331,21 +558,17 @@ void bloom_dtable::deinit()
 	}
 }
 
-/* The "bloom_k" parameter should be a divisor of 128 (the size in bits of an
- * MD5 hash). An MD5 hash of the key will be taken, and divided into bloom_k
- * indices, each of which will be used to set a bit of an appropriately sized
- * bloom filter. Picking a value that divides 160 as well, for SHA1, will avoid
- * having to change anything if we switch to that hash instead. The default
- * value is 8, resulting in 16-bit indices and and an 8KiB bloom filter. (For
- * SHA1 it would be a 128KiB bloom filter with 20-bit indices.) */
-/* FIXME: Should this be given as index_bits instead, and divide to get k? It
- * might be more stable in case of hash changes. */
+/* The "bloom_k" parameter is the number of bits set in the filter for each
+ * key, all within a single cache line sized block. The "bloom_bits" parameter
+ * is the size of the filter in bits per key, rounded up to a whole number of
+ * blocks. The defaults, 8 and 12, give a false positive rate of about 0.5%. */
 int bloom_dtable::create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow)
 {
 	bool valid;
 	bloom filter;
 	int bf_dfd, r;
-	size_t m, k, bits;
+	uint32_t version;
+	size_t m, k, bits, keys;
 	params base_config;
 	dtable::iter * iter;
 	dtable * base_dtable;
@@ -354,11 +577,22 @@ int bloom_dtable::create(int dfd, const char * file, const params & config, dtab
 		return -ENOENT;
 	if(!config.get("base_config", &base_config, params()))
 		return -EINVAL;
-	if(!config.get("bloom_k", &r, 8) || r < 5 || r > 32)
+	if(!config.get("bloom_k", &r, 8) || r < 1 || r > 32)
 		return -EINVAL;
 	k = r;
-	bits = HASH_BITS / k;
-	m = 1 << bits;
+	if(!config.get("bloom_bits", &r, 12) || r < 1)
+		return -EINVAL;
+	bits = r;
+	if(!config.get("bloom_version", &r, BLOOM_DTABLE_VERSION) || r < 0 || r > BLOOM_DTABLE_VERSION)
+		return -EINVAL;
+	version = r;
+	if(!version)
+	{
+		/* version 0 takes k indices of this many bits from the MD5 hash */
+		if(k < 5)
+			return -EINVAL;
+		bits = HASH_BITS / k;
+	}
 	
 	if(!source_shadow_ok(source, shadow))
 		return -EINVAL;
@@ -378,7 +612,34 @@ int bloom_dtable::create(int dfd, const char * file, const params & config, dtab
 	if(!base_dtable)
 		goto fail_reopen;
 	
-	r = filter.init((m + 7) / 8);
+	keys = base_dtable->size();
+	if(keys == (size_t) -1)
+	{
+		/* no indexed access, so count the keys the hard way */
+		keys = 0;
+		iter = base_dtable->iterator();
+		if(!iter)
+			goto fail_write;
+		for(valid = iter->valid(); valid; valid = iter->next())
+			keys++;
+		delete iter;
+	}
+	if(version)
+	{
+		m = (keys * bits + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+		/* even an empty filter gets one block */
+		if(!m)
+			m = 1;
+		/* the header only has 32 bits for m */
+		if(m > ((uint32_t) -1) / BLOOM_BLOCK_BITS)
+			m = ((uint32_t) -1) / BLOOM_BLOCK_BITS;
+		m *= BLOOM_BLOCK_BITS;
+	}
+	else
+		/* version 0 filters are sized by the index size */
+		m = 1 << bits;
+	
+	r = filter.init((m + 7) / 8, version);
 	if(r < 0)
 		goto fail_write;
 	iter = base_dtable->iterator();
@@ -20,7 +20,16 @@
 #define BFDT_PERF_TEST 0
 
 #define BLOOM_DTABLE_MAGIC 0x1138B893
-#define BLOOM_DTABLE_VERSION 0
+#define BLOOM_DTABLE_VERSION 1
+
+/* Version 0 filters take k indices from the bits of an MD5 hash of the key,
+ * spread over the whole filter. Version 1 filters use a fast 64-bit hash to
+ * pick one cache line sized block and then double hashing to pick k bits all
+ * within that block, so each lookup touches just one cache line. Version 0
+ * filters can still be read, and new filters are version 1 unless the
+ * "bloom_version" parameter asks for version 0 (e.g. for older readers). */
+#define BLOOM_BLOCK_SIZE 64
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_SIZE * 8)
 
 class bloom_dtable : public dtable
 {
@@ -31,8 +40,12 @@ public:
 		return iterator_chain_usage(&chain, base, atx);
 	}
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void present_many(const dtype * keys, size_t count, bool * out, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	virtual blob index(size_t index) const { return base->index(index); }
+	virtual bool key_bounds(dtype * min, dtype * max) const { return base->key_bounds(min, max); }
+	virtual bool may_contain(const dtype & key) const { return filter.check(key, k, bits) && base->may_contain(key); }
 	virtual bool contains_index(size_t index) const { return base->contains_index(index); }
 	virtual size_t size() const { return base->size(); }
 	
@@ -72,11 +85,11 @@ private:
 	class bloom
 	{
 	public:
-		bloom() : filter(NULL) {}
+		bloom() : filter(NULL), blocks(0), version(BLOOM_DTABLE_VERSION) {}
 		/* for reading */
 		int init(int dfd, const char * file, size_t * m, size_t * k);
 		/* for writing */
-		int init(size_t bytes);
+		int init(size_t bytes, uint32_t version = BLOOM_DTABLE_VERSION);
 		int write(int dfd, const char * file, size_t m, size_t k) const;
 		void deinit();
 		~bloom()
@@ -92,12 +105,23 @@ private:
 		{
 			filter[number / 8] |= 1 << (number % 8);
 		}
+		/* version 0 */
 		bool check(const uint8_t * hash, size_t k, size_t bits) const;
 		void add(const uint8_t * hash, size_t k, size_t bits);
+		/* version 1 */
+		bool check_blocked(uint64_t hash, size_t k) const;
+		void add_blocked(uint64_t hash, size_t k);
+		/* checks a batch of hashes, prefetching all their blocks first */
+		void check_blocked(const uint64_t * hashes, size_t count, size_t k, bool * out) const;
+		static uint64_t hash(const dtype & key);
+		inline bool blocked() const { return version > 0; }
+		/* these use whichever version this filter is */
 		bool check(const dtype & key, size_t k, size_t bits) const;
 		void add(const dtype & key, size_t k, size_t bits);
 	private:
 		uint8_t * filter;
+		size_t blocks;
+		uint32_t version;
 #if BFDT_PERF_TEST
 		istr dir_name, file_name;
 		mutable size_t total_lookups, blocked_lookups;
@@ -116,7 +140,7 @@ private:
 	bloom filter;
 	/* m: number of bits in filter
 	 * k: number of hash indices
-	 * bits: size of each index */
+	 * bits: size of each index (version 0 only) */
 	size_t m, k, bits;
 };
 
@@ -0,0 +1,451 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __BPLUS_MAP_H
+#define __BPLUS_MAP_H
+
+#include <new>
+#include <errno.h>
+#include <assert.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error bplus_map.h is a C++ header file
+#endif
+
+#include "arena.h"
+#include "magic_test.h"
+
+/* An insert-only B+tree map, for ordered indices like journal_dtable's which
+ * never remove keys. Unlike avl::map, which allocates a node for every key,
+ * this stores up to N keys and values in arrays in each node and links the
+ * leaves together, so ordered walks and lookups touch far fewer cache lines:
+ * a walk reads each leaf sequentially, and a lookup does a binary search in
+ * one node per level of a tree that is typically only a few levels deep. When
+ * keys are inserted in order (as when appending), full leaves are left full
+ * instead of being split in half. Since keys and values move between nodes as
+ * they split, insert() invalidates all iterators; version() changes whenever
+ * that happens, so holders of iterators can tell when to find their place again
+ * (see journal_dtable::tree_iter). The key type need not have a default
+ * constructor, but must be copy constructible and assignable. Nodes are
+ * allocated from an arena supplied by the owner of the map, which must not
+ * clear the arena until after clearing (or destroying) the map; clear() only
+ * destroys the keys, and leaves the memory for the arena to free. */
+
+template<class K, class V, class C, size_t N = 16>
+class bplus_map
+{
+private:
+	/* enough to split even a full tree on 64-bit machines */
+	enum { MAX_DEPTH = 64 };
+
+	/* keys are constructed in place in these, only as they are used */
+	union key_slot
+	{
+		char bytes[sizeof(K)];
+		void * pointer;
+		double number;
+		uint64_t integer;
+	};
+
+	struct node
+	{
+		/* entries in a leaf, or children of an inner node */
+		size_t count;
+		bool leaf;
+		inline node(bool leaf) : count(0), leaf(leaf) {}
+	};
+
+	struct leaf_node : public node
+	{
+		leaf_node * prev;
+		leaf_node * next;
+		V values[N];
+		key_slot slots[N];
+		inline K & key(size_t i) { return *(K *) &slots[i]; }
+		inline const K & key(size_t i) const { return *(const K *) &slots[i]; }
+		inline leaf_node() : node(true), prev(NULL), next(NULL) {}
+	};
+
+	/* key i is the smallest key under child i + 1 */
+	struct inner_node : public node
+	{
+		node * children[N];
+		key_slot slots[N - 1];
+		inline K & key(size_t i) { return *(K *) &slots[i]; }
+		inline const K & key(size_t i) const { return *(const K *) &slots[i]; }
+		inline inner_node() : node(false) {}
+	};
+
+public:
+	class const_iterator
+	{
+	public:
+		inline const K & key() const { return leaf->key(index); }
+		inline const V & value() const { return leaf->values[index]; }
+
+		inline const_iterator & operator++()
+		{
+			if(leaf && ++index == leaf->count)
+			{
+				leaf = leaf->next;
+				index = 0;
+			}
+			return *this;
+		}
+
+		/* decrementing end() gives the last entry, if there is one */
+		inline const_iterator & operator--()
+		{
+			if(!leaf)
+			{
+				leaf = map->tail;
+				index = leaf ? leaf->count - 1 : 0;
+			}
+			else if(index)
+				index--;
+			else
+			{
+				leaf = leaf->prev;
+				index = leaf ? leaf->count - 1 : 0;
+			}
+			return *this;
+		}
+
+		inline bool operator==(const const_iterator & x) const { return leaf == x.leaf && index == x.index; }
+		inline bool operator!=(const const_iterator & x) const { return leaf != x.leaf || index != x.index; }
+
+		inline const_iterator() : map(NULL), leaf(NULL), index(0) {}
+
+	private:
+		inline const_iterator(const bplus_map * map, const leaf_node * leaf, size_t index)
+			: map(map), leaf(leaf), index(index)
+		{
+		}
+
+		const bplus_map * map;
+		/* NULL at the end */
+		const leaf_node * leaf;
+		size_t index;
+
+		friend class bplus_map;
+	};
+
+	inline const_iterator begin() const { return const_iterator(this, head, 0); }
+	inline const_iterator end() const { return const_iterator(this, NULL, 0); }
+
+	/* the first entry not less than the key */
+	inline const_iterator lower_bound(const K & key) const
+	{
+		return find_first(key_below(comp, key));
+	}
+
+	/* the first entry for which the test is not negative */
+	inline const_iterator lower_bound(const magic_test<K> & test) const
+	{
+		return find_first(test_below(test));
+	}
+
+	/* returns 1 if the key was added, or 0, without changing anything, if it
+	 * is already present; returns -ENOMEM if the arena is out of memory, also
+	 * without changing anything (though the arena may have grown) */
+	int insert(const K & key, const V & value);
+	void clear();
+
+	inline bool empty() const { return !entries; }
+	inline size_t size() const { return entries; }
+	/* changes whenever iterators are invalidated */
+	inline uint32_t version() const { return changes; }
+
+	inline bplus_map(const C & comp, arena * nodes) : comp(comp), nodes(nodes), root(NULL), head(NULL), tail(NULL), entries(0), changes(0) {}
+	inline ~bplus_map() { clear(); }
+
+private:
+	/* predicates for find_first(), true for keys before the one we want */
+	struct key_below
+	{
+		const C & comp;
+		const K & key;
+		inline bool operator()(const K & x) const { return comp(x, key); }
+		inline key_below(const C & comp, const K & key) : comp(comp), key(key) {}
+	};
+	struct key_not_above
+	{
+		const C & comp;
+		const K & key;
+		inline bool operator()(const K & x) const { return !comp(key, x); }
+		inline key_not_above(const C & comp, const K & key) : comp(comp), key(key) {}
+	};
+	struct test_below
+	{
+		const magic_test<K> & test;
+		inline bool operator()(const K & x) const { return test(x) < 0; }
+		inline test_below(const magic_test<K> & test) : test(test) {}
+	};
+
+	/* binary search: the number of leading keys among the first count keys
+	 * in the node for which the predicate is true */
+	template<class T, class P>
+	static inline size_t rank(const T * node, size_t count, const P & below)
+	{
+		size_t low = 0, high = count;
+		while(low < high)
+		{
+			size_t mid = (low + high) / 2;
+			if(below(node->key(mid)))
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		return low;
+	}
+
+	template<class P>
+	inline const_iterator find_first(const P & below) const
+	{
+		const node * n = root;
+		const leaf_node * leaf;
+		size_t index;
+		if(!n)
+			return end();
+		while(!n->leaf)
+		{
+			const inner_node * inner = (const inner_node *) n;
+			n = inner->children[rank(inner, inner->count - 1, below)];
+		}
+		leaf = (const leaf_node *) n;
+		index = rank(leaf, leaf->count, below);
+		if(index == leaf->count)
+		{
+			leaf = leaf->next;
+			index = 0;
+		}
+		return const_iterator(this, leaf, index);
+	}
+
+	/* move a constructed key into an unconstructed slot */
+	static inline void move_key(K & from, K & to)
+	{
+		new (&to) K(from);
+		from.~K();
+	}
+
+	/* these return NULL if the arena is out of memory */
+	inline leaf_node * new_leaf()
+	{
+		void * memory = nodes->allocate(sizeof(leaf_node));
+		return memory ? new (memory) leaf_node : NULL;
+	}
+	inline inner_node * new_inner()
+	{
+		void * memory = nodes->allocate(sizeof(inner_node));
+		return memory ? new (memory) inner_node : NULL;
+	}
+
+	static void leaf_insert(leaf_node * leaf, size_t index, const K & key, const V & value);
+	static void inner_insert(inner_node * inner, size_t index, const K & key, node * child);
+	static void destroy_keys(node * n);
+
+	const C comp;
+	arena * nodes;
+	node * root;
+	leaf_node * head;
+	leaf_node * tail;
+	size_t entries;
+	uint32_t changes;
+
+	/* no copying */
+	void operator=(const bplus_map &);
+	bplus_map(const bplus_map &);
+};
+
+template<class K, class V, class C, size_t N>
+void bplus_map<K, V, C, N>::leaf_insert(leaf_node * leaf, size_t index, const K & key, const V & value)
+{
+	assert(leaf->count < N && index <= leaf->count);
+	for(size_t i = leaf->count; i > index; i--)
+	{
+		move_key(leaf->key(i - 1), leaf->key(i));
+		leaf->values[i] = leaf->values[i - 1];
+	}
+	new (&leaf->key(index)) K(key);
+	leaf->values[index] = value;
+	leaf->count++;
+}
+
+/* insert the key before child index + 1, and the child there */
+template<class K, class V, class C, size_t N>
+void bplus_map<K, V, C, N>::inner_insert(inner_node * inner, size_t index, const K & key, node * child)
+{
+	assert(inner->count < N && index < inner->count);
+	for(size_t i = inner->count - 1; i > index; i--)
+	{
+		move_key(inner->key(i - 1), inner->key(i));
+		inner->children[i + 1] = inner->children[i];
+	}
+	new (&inner->key(index)) K(key);
+	inner->children[index + 1] = child;
+	inner->count++;
+}
+
+template<class K, class V, class C, size_t N>
+int bplus_map<K, V, C, N>::insert(const K & key, const V & value)
+{
+	inner_node * path[MAX_DEPTH];
+	size_t slots[MAX_DEPTH];
+	/* the inner nodes a split will need, including a new root */
+	inner_node * spare[MAX_DEPTH + 1];
+	size_t levels = 0, full = 0, used = 0;
+	leaf_node * leaf;
+	leaf_node * right;
+	node * child;
+	size_t index, keep;
+
+	if(!root)
+	{
+		leaf = new_leaf();
+		if(!leaf)
+			return -ENOMEM;
+		root = head = tail = leaf;
+	}
+	else
+	{
+		node * n = root;
+		while(!n->leaf)
+		{
+			inner_node * inner = (inner_node *) n;
+			index = rank(inner, inner->count - 1, key_not_above(comp, key));
+			assert(levels < MAX_DEPTH);
+			path[levels] = inner;
+			slots[levels++] = index;
+			n = inner->children[index];
+		}
+		leaf = (leaf_node *) n;
+	}
+	index = rank(leaf, leaf->count, key_below(comp, key));
+	if(index < leaf->count && !comp(key, leaf->key(index)))
+		return 0;
+
+	if(leaf->count < N)
+	{
+		entries++;
+		changes++;
+		leaf_insert(leaf, index, key, value);
+		return 1;
+	}
+
+	/* get all the nodes the split needs before changing anything */
+	right = new_leaf();
+	if(!right)
+		return -ENOMEM;
+	while(full < levels && path[levels - full - 1]->count == N)
+		full++;
+	for(size_t i = 0; i < full + (full == levels); i++)
+	{
+		spare[i] = new_inner();
+		if(!spare[i])
+			return -ENOMEM;
+	}
+	entries++;
+	changes++;
+
+	/* split the leaf, leaving it full if we're appending */
+	keep = (leaf == tail && index == N) ? N : N / 2;
+	for(size_t i = keep; i < N; i++)
+	{
+		move_key(leaf->key(i), right->key(i - keep));
+		right->values[i - keep] = leaf->values[i];
+	}
+	right->count = N - keep;
+	leaf->count = keep;
+	right->prev = leaf;
+	right->next = leaf->next;
+	if(leaf->next)
+		leaf->next->prev = right;
+	else
+		tail = right;
+	leaf->next = right;
+	if(index < keep)
+		leaf_insert(leaf, index, key, value);
+	else
+		leaf_insert(right, index - keep, key, value);
+
+	/* add the new leaf to its parent, splitting inner nodes as necessary */
+	K separator(right->key(0));
+	child = right;
+	while(levels)
+	{
+		inner_node * inner = path[--levels];
+		inner_node * sibling;
+		size_t half = N / 2;
+		index = slots[levels];
+		if(inner->count < N)
+		{
+			inner_insert(inner, index, separator, child);
+			return 1;
+		}
+		sibling = spare[used++];
+		/* the key between the halves moves up rather than to either half */
+		K middle(inner->key(half - 1));
+		inner->key(half - 1).~K();
+		for(size_t i = half; i < N; i++)
+		{
+			if(i < N - 1)
+				move_key(inner->key(i), sibling->key(i - half));
+			sibling->children[i - half] = inner->children[i];
+		}
+		sibling->count = N - half;
+		inner->count = half;
+		if(index < half)
+			inner_insert(inner, index, separator, child);
+		else
+			inner_insert(sibling, index - half, separator, child);
+		separator = middle;
+		child = sibling;
+	}
+
+	/* we split the root, so add a new one */
+	inner_node * top = spare[used++];
+	top->children[0] = root;
+	top->children[1] = child;
+	new (&top->key(0)) K(separator);
+	top->count = 2;
+	root = top;
+	return 1;
+}
+
+template<class K, class V, class C, size_t N>
+void bplus_map<K, V, C, N>::destroy_keys(node * n)
+{
+	if(n->leaf)
+	{
+		leaf_node * leaf = (leaf_node *) n;
+		for(size_t i = 0; i < leaf->count; i++)
+			leaf->key(i).~K();
+	}
+	else
+	{
+		inner_node * inner = (inner_node *) n;
+		for(size_t i = 0; i < inner->count; i++)
+		{
+			if(i)
+				inner->key(i - 1).~K();
+			destroy_keys(inner->children[i]);
+		}
+	}
+}
+
+template<class K, class V, class C, size_t N>
+void bplus_map<K, V, C, N>::clear()
+{
+	if(root)
+		destroy_keys(root);
+	root = NULL;
+	head = NULL;
+	tail = NULL;
+	entries = 0;
+	changes++;
+}
+
+#endif /* __BPLUS_MAP_H */
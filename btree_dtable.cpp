@@ -5,6 +5,8 @@
 
 #include "openat.h"
 
+#include <vector>
+
 #include "util.h"
 #include "rofile.h"
 #include "btree_dtable.h"
@@ -100,6 +102,22 @@ blob btree_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return base->index(index);
 }
 
+void btree_dtable::lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	std::vector<size_t> order(count);
+	if(!count)
+		return;
+	/* in key order, consecutive searches mostly revisit the same btree pages,
+	 * and the base dtable is read in a single forward pass */
+	sort_keys(keys, count, &order[0]);
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t k = order[i];
+		size_t index = btree_lookup(keys[k], &found[k]);
+		values[k] = found[k] ? base->index(index) : blob();
+	}
+}
+
 blob btree_dtable::index(size_t index) const
 {
 	return base->index(index);
@@ -119,6 +137,7 @@ int btree_dtable::init(int dfd, const char * file, const params & config, sys_jo
 {
 	const dtable_factory * factory;
 	params base_config;
+	bool concurrent;
 	int r, bt_dfd;
 	if(base)
 		deinit();
@@ -127,6 +146,8 @@ int btree_dtable::init(int dfd, const char * file, const params & config, sys_jo
 		return -ENOENT;
 	if(!config.get("base_config", &base_config, params()))
 		return -EINVAL;
+	if(!config.get("concurrent_reads", &concurrent, false))
+		return -EINVAL;
 	if(!factory->indexed_access(base_config))
 		return -ENOSYS;
 	bt_dfd = openat(dfd, file, O_RDONLY);
@@ -140,7 +161,10 @@ int btree_dtable::init(int dfd, const char * file, const params & config, sys_jo
 	cmp_name = base->get_cmp_name();
 	
 	/* open the btree */
-	btree = rofile::open<BTREE_PAGE_KB, 8>(bt_dfd, "btree");
+	if(concurrent)
+		btree = rofile::open_mapped<BTREE_PAGE_KB>(bt_dfd, "btree");
+	else
+		btree = rofile::open<BTREE_PAGE_KB, 8>(bt_dfd, "btree");
 	if(!btree)
 		goto fail_open;
 	r = btree->read_type(0, &header);
@@ -214,7 +238,7 @@ size_t btree_dtable::btree_lookup(const T & test, bool * found) const
 	size_t depth = 1;
 	size_t keys, index;
 	bool full = header.root_page <= header.last_full;
-	scopelock scope(btree->lock);
+	scopelock scope(btree->lock, !btree->lock_free());
 	page.page = btree->page(header.root_page);
 	
 	while(depth < header.depth)
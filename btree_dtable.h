@@ -32,7 +32,9 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	virtual blob index(size_t index) const;
+	inline virtual bool key_bounds(dtype * min, dtype * max) const { return base->key_bounds(min, max); }
 	virtual bool contains_index(size_t index) const;
 	virtual size_t size() const;
 	
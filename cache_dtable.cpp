@@ -1,6 +1,8 @@
 /* This file is part of the Casa Mia Datastore Project at UBC.It is distributed under the terms of
  * version 2 of the GNU GPL. See the file LICENSE for details. */
 
+#include <vector>
+
 #include "cache_dtable.h"
 
 dtable::iter * cache_dtable::iterator(ATX_DEF) const
@@ -14,91 +16,358 @@ dtable::iter * cache_dtable::iterator(ATX_DEF) const
 bool cache_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 {
 	if(atx != NO_ABORTABLE_TX)
+	{
+		scoperwlock scope(base_lock, false);
 		return base->present(key, found, atx);
-	cache_map::const_iterator iter = cache.find(key);
-	if(iter != cache.end())
+	}
+	shard * s = get_shard(key);
+	scopelock scope(s->lock);
+	cache_map::iterator iter = s->cache.find(key);
+	if(iter != s->cache.end())
 	{
-		*found = true;
+		s->hits++;
+		(*iter).second.referenced = true;
+		*found = (*iter).second.found;
 		return (*iter).second.value.exists();
 	}
+	s->misses++;
+	scope.unlock();
+	scoperwlock base_scope(base_lock, false);
 	return base->present(key, found);
 }
 
-void cache_dtable::add_cache(const dtype & key, const blob & value, bool found) const
+void cache_dtable::present_many(const dtype * keys, size_t count, bool * out, bool * found, ATX_DEF) const
 {
-	/* FIXME: this is a very simple eviction algorithm: evict
-	 * the oldest item, regardless of when it has been used */
-	assert(!cache.count(key));
-	if(cache_size)
+	std::vector<size_t> miss;
+	std::vector<dtype> batch;
+	bool * batch_out;
+	bool * batch_found;
+	if(atx != NO_ABORTABLE_TX)
 	{
-		if(cache.size() == cache_size)
+		scoperwlock scope(base_lock, false);
+		base->present_many(keys, count, out, found, atx);
+		return;
+	}
+	for(size_t i = 0; i < count; i++)
+	{
+		shard * s = get_shard(keys[i]);
+		scopelock scope(s->lock);
+		cache_map::iterator iter = s->cache.find(keys[i]);
+		if(iter != s->cache.end())
 		{
-			cache.erase(order.front());
-			order.pop();
+			s->hits++;
+			(*iter).second.referenced = true;
+			found[i] = (*iter).second.found;
+			out[i] = (*iter).second.value.exists();
+			continue;
 		}
-		assert(cache.size() < cache_size);
+		s->misses++;
+		miss.push_back(i);
+		batch.push_back(keys[i]);
+	}
+	if(miss.empty())
+		return;
+	/* send all the misses to the underlying dtable in one batch */
+	batch_out = new bool[miss.size()];
+	batch_found = new bool[miss.size()];
+	scoperwlock base_scope(base_lock, false);
+	base->present_many(&batch[0], miss.size(), batch_out, batch_found);
+	for(size_t i = 0; i < miss.size(); i++)
+	{
+		out[miss[i]] = batch_out[i];
+		found[miss[i]] = batch_found[i];
+	}
+	delete[] batch_found;
+	delete[] batch_out;
+}
+
+/* approximately how much memory caching this entry will use */
+size_t cache_dtable::entry_size(const dtype & key, const blob & value)
+{
+	size_t size = sizeof(entry) + value.size();
+	switch(key.type)
+	{
+		case dtype::UINT32:
+		case dtype::DOUBLE:
+			break;
+		case dtype::STRING:
+			if(key.str)
+				size += key.str.length();
+			break;
+		case dtype::BLOB:
+			size += key.blb.size();
+			break;
+	}
+	return size;
+}
+
+void cache_dtable::evict_front(shard * s, std::queue<dtype> * queue) const
+{
+	cache_map::iterator iter = s->cache.find(queue->front());
+	assert(iter != s->cache.end());
+	s->used_bytes -= (*iter).second.size;
+	if(!(*iter).second.hot)
+		s->cold_bytes -= (*iter).second.size;
+	s->cache.erase(iter);
+	queue->pop();
+	s->evictions++;
+}
+
+void cache_dtable::remember_ghost(shard * s, const dtype & key) const
+{
+	s->ghosts.insert(key);
+	s->ghost_order.push(key);
+	/* remember about half as many evicted keys as we have cached */
+	while(s->ghost_order.size() > s->cache.size() / 2 + 1)
+	{
+		s->ghosts.erase(s->ghost_order.front());
+		s->ghost_order.pop();
+	}
+}
+
+void cache_dtable::evict(shard * s) const
+{
+	std::queue<dtype> * queue = &s->order;
+	assert(!s->cache.empty());
+	switch(replacement)
+	{
+		case FIFO:
+			evict_front(s, &s->order);
+			return;
+		case TWO_Q:
+			/* the probationary queue gets about a quarter of the cache */
+			if(!s->order.empty() && (s->hot_order.empty() || 4 * s->order.size() > s->cache.size() || 4 * s->cold_bytes > s->used_bytes))
+			{
+				dtype key = s->order.front();
+				evict_front(s, &s->order);
+				remember_ghost(s, key);
+				return;
+			}
+			queue = &s->hot_order;
+			/* fall through */
+		case CLOCK:
+			/* give recently used entries a second chance; this terminates
+			 * since we clear the referenced bits as we go around */
+			for(;;)
+			{
+				entry * front = &s->cache.find(queue->front())->second;
+				if(!front->referenced)
+					break;
+				front->referenced = false;
+				queue->push(queue->front());
+				queue->pop();
+			}
+			evict_front(s, queue);
+			return;
+	}
+}
+
+void cache_dtable::add_cache(shard * s, const dtype & key, const blob & value, bool found) const
+{
+	bool hot = false;
+	size_t size = entry_size(key, value);
+	assert(!s->cache.count(key));
+	/* admission control: don't let a few huge values flush everything else */
+	if(max_entry && value.size() > max_entry)
+		return;
+	if(over_budget(1, size))
+		return;
+	if(replacement == TWO_Q)
+	{
+		ghost_set::iterator ghost = s->ghosts.find(key);
+		if(ghost != s->ghosts.end())
+		{
+			/* requested again soon after eviction: this one is hot */
+			s->ghosts.erase(ghost);
+			hot = true;
+		}
+	}
+	while(!s->cache.empty() && over_budget(s->cache.size() + 1, s->used_bytes + size))
+		evict(s);
+	s->cache[key] = (entry) {value, size, found, false, hot};
+	s->used_bytes += size;
+	if(hot)
+		s->hot_order.push(key);
+	else
+	{
+		s->order.push(key);
+		s->cold_bytes += size;
+	}
+	assert(s->cache.size() == s->order.size() + s->hot_order.size());
+}
+
+void cache_dtable::update_cache(shard * s, const dtype & key, const blob & value, bool found) const
+{
+	cache_map::iterator iter = s->cache.find(key);
+	if(iter == s->cache.end())
+	{
+		add_cache(s, key, value, found);
+		return;
+	}
+	entry * cached = &(*iter).second;
+	size_t size = entry_size(key, value);
+	/* the same admission control as add_cache() */
+	if((max_entry && value.size() > max_entry) || over_budget(1, size))
+	{
+		uncache(s, iter);
+		return;
+	}
+	s->used_bytes += size - cached->size;
+	if(!cached->hot)
+		s->cold_bytes += size - cached->size;
+	cached->size = size;
+	cached->found = found;
+	cached->value = value;
+	cached->referenced = true;
+	/* the new value may be larger than the old one */
+	while(!s->cache.empty() && over_budget(s->cache.size(), s->used_bytes))
+		evict(s);
+}
+
+void cache_dtable::uncache(shard * s, const cache_map::iterator & iter) const
+{
+	std::queue<dtype> * queue = (*iter).second.hot ? &s->hot_order : &s->order;
+	std::queue<dtype> rest;
+	/* queues can't remove from the middle, so rebuild this one without the
+	 * key; this is rare, since add_cache() won't cache such a value again */
+	while(!queue->empty())
+	{
+		if(queue->front().compare((*iter).first, blob_cmp))
+			rest.push(queue->front());
+		queue->pop();
 	}
-	cache[key] = (entry) {value, found};
-	order.push(key);
-	assert(cache.size() == order.size());
+	*queue = rest;
+	s->used_bytes -= (*iter).second.size;
+	if(!(*iter).second.hot)
+		s->cold_bytes -= (*iter).second.size;
+	s->cache.erase(iter);
+	assert(s->cache.size() == s->order.size() + s->hot_order.size());
 }
 
 blob cache_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
 	if(atx != NO_ABORTABLE_TX)
+	{
+		scoperwlock scope(base_lock, false);
 		return base->lookup(key, found, atx);
-	cache_map::const_iterator iter = cache.find(key);
-	if(iter != cache.end())
+	}
+	shard * s = get_shard(key);
+	scopelock scope(s->lock);
+	cache_map::iterator iter = s->cache.find(key);
+	if(iter != s->cache.end())
 	{
+		s->hits++;
+		(*iter).second.referenced = true;
 		*found = (*iter).second.found;
 		return (*iter).second.value;
 	}
+	s->misses++;
+	/* don't hold the shard lock during the (possibly slow) base lookup */
+	scope.unlock();
+	scoperwlock base_scope(base_lock, false);
 	blob value = base->lookup(key, found);
-	add_cache(key, value, *found);
+	/* we still hold the base lock, so no write can have slipped in; but
+	 * another reader may have filled in the same key while we were away */
+	scope.lock();
+	if(!s->cache.count(key))
+		add_cache(s, key, value, *found);
 	return value;
 }
 
+void cache_dtable::lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	std::vector<size_t> miss;
+	std::vector<dtype> batch;
+	std::vector<blob> batch_values;
+	bool * batch_found;
+	if(atx != NO_ABORTABLE_TX)
+	{
+		scoperwlock scope(base_lock, false);
+		base->lookup_many(keys, count, values, found, atx);
+		return;
+	}
+	for(size_t i = 0; i < count; i++)
+	{
+		shard * s = get_shard(keys[i]);
+		scopelock scope(s->lock);
+		cache_map::iterator iter = s->cache.find(keys[i]);
+		if(iter != s->cache.end())
+		{
+			s->hits++;
+			(*iter).second.referenced = true;
+			found[i] = (*iter).second.found;
+			values[i] = (*iter).second.value;
+			continue;
+		}
+		s->misses++;
+		miss.push_back(i);
+		batch.push_back(keys[i]);
+	}
+	if(miss.empty())
+		return;
+	/* send all the misses to the underlying dtable in one batch */
+	batch_values.resize(miss.size());
+	batch_found = new bool[miss.size()];
+	scoperwlock base_scope(base_lock, false);
+	base->lookup_many(&batch[0], miss.size(), &batch_values[0], batch_found);
+	for(size_t i = 0; i < miss.size(); i++)
+	{
+		shard * s = get_shard(batch[i]);
+		values[miss[i]] = batch_values[i];
+		found[miss[i]] = batch_found[i];
+		/* as in lookup(), another reader may have filled it in already,
+		 * and the same key may appear more than once in the batch */
+		scopelock scope(s->lock);
+		if(!s->cache.count(batch[i]))
+			add_cache(s, batch[i], batch_values[i], batch_found[i]);
+	}
+	delete[] batch_found;
+}
+
 int cache_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
+	scoperwlock base_scope(base_lock, true);
 	if(atx != NO_ABORTABLE_TX)
 		return base->insert(key, blob, append, atx);
-	cache_map::iterator iter;
 	int value = base->insert(key, blob, append);
 	if(value < 0)
 		return value;
-	iter = cache.find(key);
-	if(iter != cache.end())
-	{
-		(*iter).second.found = true;
-		(*iter).second.value = blob;
-	}
-	else
-		add_cache(key, blob, true);
+	shard * s = get_shard(key);
+	scopelock scope(s->lock);
+	update_cache(s, key, blob, true);
 	return value;
 }
 
 int cache_dtable::remove(const dtype & key, ATX_DEF)
 {
+	scoperwlock base_scope(base_lock, true);
 	if(atx != NO_ABORTABLE_TX)
 		return base->remove(key, atx);
-	cache_map::iterator iter;
 	int value = base->remove(key);
 	if(value < 0)
 		return value;
-	iter = cache.find(key);
-	if(iter != cache.end())
+	shard * s = get_shard(key);
+	scopelock scope(s->lock);
+	update_cache(s, key, blob(), false);
+	return value;
+}
+
+size_t cache_dtable::sum_stat(size_t shard::*stat) const
+{
+	size_t total = 0;
+	for(size_t i = 0; i < shard_count; i++)
 	{
-		(*iter).second.found = false;
-		(*iter).second.value = blob();
+		scopelock scope(shards[i]->lock);
+		total += shards[i]->*stat;
 	}
-	else
-		add_cache(key, blob(), false);
-	return value;
+	return total;
 }
 
 int cache_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	int r;
+	size_t cache_size, cache_bytes;
+	istr policy_name;
 	const dtable_factory * factory;
 	params base_config;
 	if(base)
@@ -106,6 +375,28 @@ int cache_dtable::init(int dfd, const char * file, const params & config, sys_jo
 	if(!config.get("cache_size", &r, 0) || r < 0)
 		return -EINVAL;
 	cache_size = r;
+	if(!config.get("cache_bytes", &r, 0) || r < 0)
+		return -EINVAL;
+	cache_bytes = r;
+	if(!config.get("cache_max_entry", &r, 0) || r < 0)
+		return -EINVAL;
+	max_entry = r;
+	if(!config.get("cache_shards", &r, 1) || r < 1)
+		return -EINVAL;
+	shard_count = r;
+	if(!config.get("cache_policy", &policy_name, "fifo"))
+		return -EINVAL;
+	if(!strcmp(policy_name, "fifo"))
+		replacement = FIFO;
+	else if(!strcmp(policy_name, "clock"))
+		replacement = CLOCK;
+	else if(!strcmp(policy_name, "2q"))
+		replacement = TWO_Q;
+	else
+		return -EINVAL;
+	/* round up, so that each shard can hold at least one entry */
+	shard_size = (cache_size + shard_count - 1) / shard_count;
+	shard_bytes = (cache_bytes + shard_count - 1) / shard_count;
 	factory = dtable_factory::lookup(config, "base");
 	if(!factory)
 		return -EINVAL;
@@ -116,6 +407,9 @@ int cache_dtable::init(int dfd, const char * file, const params & config, sys_jo
 		return -1;
 	ktype = base->key_type();
 	cmp_name = base->get_cmp_name();
+	shards = new shard *[shard_count];
+	for(size_t i = 0; i < shard_count; i++)
+		shards[i] = new shard(blob_cmp);
 	return 0;
 }
 
@@ -123,9 +417,11 @@ void cache_dtable::deinit()
 {
 	if(base)
 	{
-		cache.clear();
-		while(!order.empty())
-			order.pop();
+		for(size_t i = 0; i < shard_count; i++)
+			delete shards[i];
+		delete[] shards;
+		shards = NULL;
+		shard_count = 0;
 		base->destroy();
 		base = NULL;
 		dtable::deinit();
@@ -14,17 +14,42 @@
 
 #include <queue>
 #include <ext/hash_map>
+#include <ext/hash_set>
 
+#include "locking.h"
 #include "dtable_factory.h"
 
 /* The cache dtable sits on top of another dtable, and merely adds caching. */
 
+/* Configuration parameters:
+ * "cache_size": maximum number of entries to cache (0 for no limit)
+ * "cache_bytes": maximum total size of cached keys and values (0 for no limit)
+ * "cache_max_entry": values larger than this are never admitted (0 for no limit)
+ * "cache_policy": the replacement policy, one of:
+ *     "fifo" (the default): evict the oldest entry, regardless of use
+ *     "clock": evict the oldest entry not used since the clock hand last passed
+ *     "2q": new entries start in a small FIFO queue and are promoted into the
+ *           main (clock) queue only if they are requested again soon after
+ *           being evicted from it, so that large scans do not flush hot keys
+ * "cache_shards": number of independently locked shards to split the cache
+ *     into (default 1); the size limits above are divided evenly among them
+ *
+ * The cache itself is safe to use from multiple threads concurrently, and
+ * lookups and present() calls may run concurrently with each other on the
+ * underlying dtable as well, so it must support that (e.g. disk dtables with
+ * "concurrent_reads" set). Writes are serialized against all other accesses
+ * to the underlying dtable, so that a lookup racing with an insert or remove
+ * can never leave a stale value in the cache. Iterators are passed directly
+ * through to the underlying dtable and get no such protection. */
+
 class cache_dtable : public dtable
 {
 public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void present_many(const dtype * keys, size_t count, bool * out, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	inline virtual bool writable() const { return base->writable(); }
 	virtual int insert(const dtype & key, const blob & blob, bool append = false, ATX_OPT);
 	virtual int remove(const dtype & key, ATX_OPT);
@@ -46,11 +71,21 @@ public:
 		return value;
 	}
 	
-	inline virtual int maintain(bool force = false) { return base->maintain(force); }
+	inline virtual int maintain(bool force = false)
+	{
+		scoperwlock scope(base_lock, true);
+		return base->maintain(force);
+	}
+	
+	/* cache statistics, summed over all shards */
+	inline size_t cache_hits() const { return sum_stat(&shard::hits); }
+	inline size_t cache_misses() const { return sum_stat(&shard::misses); }
+	inline size_t cache_evictions() const { return sum_stat(&shard::evictions); }
+	inline size_t cache_used_bytes() const { return sum_stat(&shard::used_bytes); }
 	
 	DECLARE_WRAP_FACTORY(cache_dtable);
 	
-	inline cache_dtable() : base(NULL), chain(this), cache(10, blob_cmp, blob_cmp) {}
+	inline cache_dtable() : base(NULL), chain(this), hasher(blob_cmp), shards(NULL), shard_count(0) {}
 	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
 	
 protected:
@@ -62,21 +97,74 @@ protected:
 	}
 	
 private:
+	enum policy { FIFO, CLOCK, TWO_Q };
+	
 	struct entry
 	{
 		blob value;
+		size_t size;
 		bool found;
+		/* for clock and 2q */
+		bool referenced;
+		/* for 2q: true if in the main queue */
+		bool hot;
 	};
 	
-	void add_cache(const dtype & key, const blob & value, bool found) const;
-	
 	typedef __gnu_cxx::hash_map<const dtype, entry, dtype_hashing_comparator, dtype_hashing_comparator> cache_map;
+	typedef __gnu_cxx::hash_set<dtype, dtype_hashing_comparator, dtype_hashing_comparator> ghost_set;
+	
+	/* each shard caches the keys whose hashes map to it, and is protected by its own lock */
+	struct shard
+	{
+		init_mutex lock;
+		cache_map cache;
+		/* the only queue for fifo and clock; the probationary queue for 2q */
+		std::queue<dtype> order;
+		/* for 2q: the main queue, and keys recently evicted from order */
+		std::queue<dtype> hot_order;
+		ghost_set ghosts;
+		std::queue<dtype> ghost_order;
+		size_t used_bytes, cold_bytes;
+		size_t hits, misses, evictions;
+		inline shard(const blob_comparator * const & blob_cmp)
+			: cache(10, blob_cmp, blob_cmp), ghosts(10, blob_cmp, blob_cmp),
+			  used_bytes(0), cold_bytes(0), hits(0), misses(0), evictions(0)
+		{
+		}
+	};
+	
+	inline shard * get_shard(const dtype & key) const
+	{
+		size_t hash = hasher(key);
+		/* the hash maps use the low bits too; mix in the high ones */
+		return shards[(hash ^ (hash >> 16)) % shard_count];
+	}
+	
+	static size_t entry_size(const dtype & key, const blob & value);
+	/* these all require the shard lock to be held */
+	void add_cache(shard * s, const dtype & key, const blob & value, bool found) const;
+	void update_cache(shard * s, const dtype & key, const blob & value, bool found) const;
+	void uncache(shard * s, const cache_map::iterator & iter) const;
+	inline bool over_budget(size_t entries, size_t bytes) const
+	{
+		return (shard_size && entries > shard_size) || (shard_bytes && bytes > shard_bytes);
+	}
+	/* evict one entry according to the policy */
+	void evict(shard * s) const;
+	void evict_front(shard * s, std::queue<dtype> * queue) const;
+	void remember_ghost(shard * s, const dtype & key) const;
+	
+	size_t sum_stat(size_t shard::*stat) const;
 	
 	dtable * base;
 	mutable chain_callback chain;
-	size_t cache_size;
-	mutable cache_map cache;
-	mutable std::queue<dtype> order;
+	/* held for reading around base reads, and for writing around base writes */
+	mutable init_rwlock base_lock;
+	size_t shard_size, shard_bytes, max_entry;
+	policy replacement;
+	dtype_hashing_comparator hasher;
+	shard ** shards;
+	size_t shard_count;
 };
 
 #endif /* __CACHE_DTABLE_H */
@@ -45,13 +45,12 @@ public:
 	
 	inline void invoke()
 	{
-		callback_set::iterator it = set.begin();
-		while(it != set.end())
-		{
-			callback * cb = *it;
-			set.erase(it++);
-			cb->invoke();
-		}
+		/* a callback may destroy the object that owns us (e.g. a doomed
+		 * dtable's callback), so don't touch the set after calling any */
+		callback_set pending;
+		pending.swap(set);
+		for(callback_set::iterator it = pending.begin(); it != pending.end(); ++it)
+			(*it)->invoke();
 	}
 	
 	inline void release()
@@ -8,6 +8,7 @@
 
 #include "util.h"
 #include "sys_journal.h"
+#include "block_cache.h"
 #include "dtable_factory.h"
 #include "ctable_factory.h"
 #include "dtable_cache_iter.h"
@@ -68,6 +69,26 @@ int anvil_init(const char * path)
 	return r;
 }
 
+void anvil_set_block_cache(size_t bytes)
+{
+	block_cache::global.set_budget(bytes);
+}
+
+void anvil_set_recovery(size_t threads, void (*progress)(size_t done, size_t total, void * user), void * user)
+{
+	sys_journal::set_playback(threads, progress, user);
+}
+
+void anvil_set_journal_segments(size_t segment_size, int background, int preallocate)
+{
+	sys_journal::set_segments(segment_size, background, preallocate);
+}
+
+void anvil_set_journal_writes(size_t buffer_size, int direct)
+{
+	sys_journal::set_write_buffer(buffer_size, direct);
+}
+
 static inline int init_anvil_istr(anvil_istr * c, const istr & value)
 {
 	anvil_istr_union safer(c);
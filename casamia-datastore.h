@@ -94,6 +94,24 @@ typedef int (*blob_test)(const void *, size_t, void *);
 /* use Anvil runtime environment (journals, etc.) at this path */
 int anvil_init(const char * path);
 
+/* share a cache of this many bytes among all disk files opened afterward, in
+ * place of their individual buffers; 0 (the default) disables it */
+void anvil_set_block_cache(size_t bytes);
+
+/* replay the system journal on this many threads during anvil_init(), calling
+ * progress (if not NULL) periodically with the number of bytes replayed */
+void anvil_set_recovery(size_t threads, void (*progress)(size_t done, size_t total, void * user), void * user);
+
+/* split the system journal into segments of about this many bytes, which are
+ * retired or compacted (in the background, if requested) as their entries are
+ * discarded instead of filtering the whole journal; 0 (the default) disables it;
+ * if preallocate is set, disk space for each segment is allocated up front */
+void anvil_set_journal_segments(size_t segment_size, int background, int preallocate);
+
+/* append to the system journal through a buffer of this many KiB (8 by
+ * default), and if direct is set, write it with O_DIRECT where possible */
+void anvil_set_journal_writes(size_t buffer_size, int direct);
+
 /* istr */
 int anvil_istr_new(anvil_istr * c, const char * str);
 int anvil_istr_copy(anvil_istr * c, const anvil_istr * src);
@@ -0,0 +1,142 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <errno.h>
+
+#include "combine_policy.h"
+
+/* don't trust the read statistics until there have been this many lookups */
+#define CP_MIN_LOOKUPS 1024
+
+bool combine_policy::overlap(const generation & a, const generation & b, const blob_comparator * blob_cmp)
+{
+	if(!a.bounded || !b.bounded)
+		return true;
+	return a.min.compare(b.max, blob_cmp) <= 0 && b.min.compare(a.max, blob_cmp) <= 0;
+}
+
+bool combine_policy::hot(const read_stats & reads, float max_probes)
+{
+	if(max_probes <= 0 || reads.lookups < CP_MIN_LOOKUPS)
+		return false;
+	return reads.probed > max_probes * reads.lookups;
+}
+
+int size_tiered_policy::choose(const generation_list & gens, const read_stats & reads, const blob_comparator * blob_cmp, size_t * first, size_t * last) const
+{
+	/* if lookups are probing too many generations, combine smaller runs */
+	size_t need = hot(reads, max_probes) ? 2 : min_merge;
+	size_t end = gens.size();
+	/* prefer the newest run that qualifies, since it is the cheapest to combine */
+	while(end >= need)
+	{
+		size_t start = end - 1;
+		double total = (gens[start].bytes > min_bytes) ? gens[start].bytes : min_bytes;
+		bool overlapping = false;
+		while(start > 0 && end - start < max_merge)
+		{
+			const generation & older = gens[start - 1];
+			double bytes = (older.bytes > min_bytes) ? older.bytes : min_bytes;
+			double average = total / (end - start);
+			if(bytes > average * tier_ratio || bytes * tier_ratio < average)
+				break;
+			for(size_t i = start; i < end && !overlapping; i++)
+				overlapping = overlap(older, gens[i], blob_cmp);
+			total += bytes;
+			start--;
+		}
+		if(end - start >= need && overlapping)
+		{
+			*first = start;
+			*last = end - 1;
+			return 1;
+		}
+		end = start;
+	}
+	return 0;
+}
+
+int size_tiered_policy::init(const params & config)
+{
+	int value;
+	if(!config.get("min_merge", &value, 4) || value < 2)
+		return -EINVAL;
+	min_merge = value;
+	if(!config.get("max_merge", &value, 32) || value < (int) min_merge)
+		return -EINVAL;
+	max_merge = value;
+	/* smaller generations are treated as though they were this size */
+	if(!config.get("min_bytes", &value, 1048576) || value < 0)
+		return -EINVAL;
+	min_bytes = value;
+	if(!config.get("tier_ratio", &tier_ratio, 2) || tier_ratio < 1)
+		return -EINVAL;
+	/* 0 means to ignore the read statistics */
+	if(!config.get("max_probes", &max_probes, 0))
+		return -EINVAL;
+	return 0;
+}
+
+DEFINE_CP_FACTORY(size_tiered_policy);
+
+size_t leveled_policy::level(size_t bytes) const
+{
+	size_t level = 0;
+	for(size_t limit = base_bytes; bytes >= limit; limit *= fanout)
+	{
+		level++;
+		/* watch out for overflow! */
+		if(limit > ((size_t) -1) / fanout)
+			break;
+	}
+	return level;
+}
+
+int leveled_policy::choose(const generation_list & gens, const read_stats & reads, const blob_comparator * blob_cmp, size_t * first, size_t * last) const
+{
+	size_t count = gens.size();
+	/* if lookups are probing too many generations, don't let level 0 grow */
+	size_t l0 = 0, limit = hot(reads, max_probes) ? 2 : l0_count;
+	while(l0 < count && !level(gens[count - l0 - 1].bytes))
+		l0++;
+	if(l0 >= limit)
+	{
+		*first = count - l0;
+		*last = count - 1;
+		/* push level 0 down into level 1, if there is one right before it */
+		if(*first && level(gens[*first - 1].bytes) == 1)
+			--*first;
+		return 1;
+	}
+	if(l0 + 2 > count)
+		return 0;
+	/* otherwise look for the newest adjacent pair whose levels are out of order */
+	for(size_t i = count - l0 - 1; i > 0; i--)
+		if(level(gens[i].bytes) >= level(gens[i - 1].bytes) && overlap(gens[i - 1], gens[i], blob_cmp))
+		{
+			*first = i - 1;
+			*last = i;
+			return 1;
+		}
+	return 0;
+}
+
+int leveled_policy::init(const params & config)
+{
+	int value;
+	if(!config.get("fanout", &value, 10) || value < 2)
+		return -EINVAL;
+	fanout = value;
+	if(!config.get("base_bytes", &value, 8388608) || value < 1)
+		return -EINVAL;
+	base_bytes = value;
+	if(!config.get("l0_count", &value, 4) || value < 2)
+		return -EINVAL;
+	l0_count = value;
+	/* 0 means to ignore the read statistics */
+	if(!config.get("max_probes", &max_probes, 0))
+		return -EINVAL;
+	return 0;
+}
+
+DEFINE_CP_FACTORY(leveled_policy);
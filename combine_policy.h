@@ -0,0 +1,140 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __COMBINE_POLICY_H
+#define __COMBINE_POLICY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error combine_policy.h is a C++ header file
+#endif
+
+#include <vector>
+
+#include "dtype.h"
+#include "params.h"
+#include "factory.h"
+
+/* A combine policy decides which of a managed_dtable's disk dtables (its
+ * "generations") should be combined during maintenance, based on their sizes
+ * on disk, how their key ranges overlap, and how many generations lookups have
+ * had to probe recently. Policies are found by name through the factory
+ * registry below, so they can be added without changing managed_dtable. */
+
+class combine_policy
+{
+public:
+	struct generation
+	{
+		/* bytes on disk, and the number of keys or (size_t) -1 if unknown */
+		size_t bytes, keys;
+		/* the key bounds, if known */
+		bool bounded;
+		dtype min, max;
+		inline generation() : bytes(0), keys(0), bounded(false), min(0u), max(0u) {}
+	};
+	/* oldest first, like managed_dtable's disk dtables */
+	typedef std::vector<generation> generation_list;
+	
+	/* lookup activity since the last combine */
+	struct read_stats
+	{
+		/* probed counts the generations actually searched, so probed / lookups
+		 * is the average read amplification of point lookups */
+		size_t lookups, probed;
+		inline read_stats() : lookups(0), probed(0) {}
+	};
+	
+	/* Returns 1 and sets *first and *last (inclusive indices into gens) if the
+	 * given range should be combined now, or 0 if nothing should be. */
+	virtual int choose(const generation_list & gens, const read_stats & reads, const blob_comparator * blob_cmp, size_t * first, size_t * last) const = 0;
+	
+	virtual ~combine_policy() {}
+	
+protected:
+	/* true unless the generations' key bounds are known not to overlap */
+	static bool overlap(const generation & a, const generation & b, const blob_comparator * blob_cmp);
+	/* true if there have been enough lookups to trust reads, and they have
+	 * probed more than max_probes generations each on average */
+	static bool hot(const read_stats & reads, float max_probes);
+};
+
+class combine_policy_factory_base
+{
+public:
+	virtual combine_policy * open(const params & config) const = 0;
+	
+	virtual ~combine_policy_factory_base() {}
+	
+	/* wrapper for open() that does lookup() */
+	static combine_policy * load(const istr & type, const params & config);
+};
+
+typedef factory<combine_policy_factory_base> combine_policy_factory;
+
+template<class T>
+class combine_policy_static_factory : public combine_policy_factory
+{
+public:
+	combine_policy_static_factory(const istr & class_name) : combine_policy_factory(class_name) {}
+	
+	virtual combine_policy * open(const params & config) const
+	{
+		T * policy = new T;
+		int r = policy->init(config);
+		if(r < 0)
+		{
+			delete policy;
+			policy = NULL;
+		}
+		return policy;
+	}
+};
+
+#define DECLARE_CP_FACTORY(class_name) static const combine_policy_static_factory<class_name> factory
+#define DEFINE_CP_FACTORY(class_name) const combine_policy_static_factory<class_name> class_name::factory(#class_name)
+
+/* Size-tiered: combines runs of adjacent generations of similar size (within
+ * a factor of tier_ratio of their average), once a run has min_merge of them.
+ * Runs whose key ranges do not overlap at all are left alone, since lookups
+ * can already skip the generations that cannot contain the key. */
+class size_tiered_policy : public combine_policy
+{
+public:
+	virtual int choose(const generation_list & gens, const read_stats & reads, const blob_comparator * blob_cmp, size_t * first, size_t * last) const;
+	
+	int init(const params & config);
+	
+	DECLARE_CP_FACTORY(size_tiered_policy);
+	
+private:
+	size_t min_merge, max_merge, min_bytes;
+	float tier_ratio, max_probes;
+};
+
+/* Leveled: each generation is assigned a level by its size, where level 0 is
+ * anything under base_bytes and each level above that is fanout times larger.
+ * Levels should strictly decrease from the oldest generation to the newest,
+ * except that up to l0_count generations may be at level 0. Once there are
+ * that many, they are combined together with the generation before them if
+ * it is at level 1; otherwise the newest adjacent pair out of order (a newer
+ * generation at the same or a higher level) is combined. */
+class leveled_policy : public combine_policy
+{
+public:
+	virtual int choose(const generation_list & gens, const read_stats & reads, const blob_comparator * blob_cmp, size_t * first, size_t * last) const;
+	
+	int init(const params & config);
+	
+	DECLARE_CP_FACTORY(leveled_policy);
+	
+private:
+	size_t level(size_t bytes) const;
+	
+	size_t fanout, base_bytes, l0_count;
+	float max_probes;
+};
+
+#endif /* __COMBINE_POLICY_H */
@@ -0,0 +1,14 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include "combine_policy.h"
+#include "factory_impl.h"
+
+/* force the template to instantiate */
+template class factory<combine_policy_factory_base>;
+
+combine_policy * combine_policy_factory_base::load(const istr & type, const params & config)
+{
+	const combine_policy_factory * factory = combine_policy_factory::lookup(type);
+	return factory ? factory->open(config) : NULL;
+}
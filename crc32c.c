@@ -0,0 +1,142 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define CRC32C_X86 1
+#else
+#define CRC32C_X86 0
+#endif
+
+#include "crc32c.h"
+
+/* the reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+/* tables for the slicing-by-8 software version, filled in by crc32c_init() */
+static uint32_t crc32c_table[8][256];
+static int crc32c_have_hw = 0;
+static int crc32c_use_hw = 0;
+
+static void crc32c_init(void) __attribute__((constructor));
+static void crc32c_init(void)
+{
+	uint32_t i, j, crc;
+	for(i = 0; i < 256; i++)
+	{
+		crc = i;
+		for(j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for(i = 0; i < 256; i++)
+	{
+		crc = crc32c_table[0][i];
+		for(j = 1; j < 8; j++)
+		{
+			crc = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+#if CRC32C_X86
+	{
+		unsigned int eax, ebx, ecx, edx;
+		if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+			crc32c_have_hw = 1;
+	}
+#endif
+	crc32c_use_hw = crc32c_have_hw;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t * data, size_t length)
+{
+	/* get to an 8-byte boundary first */
+	while(length && ((uintptr_t) data & 7))
+	{
+		crc = crc32c_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+		length--;
+	}
+	while(length >= 8)
+	{
+		uint32_t low, high;
+		memcpy(&low, data, 4);
+		memcpy(&high, data + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		low = __builtin_bswap32(low);
+		high = __builtin_bswap32(high);
+#endif
+		low ^= crc;
+		crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+		      crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+		      crc32c_table[3][high & 0xFF] ^ crc32c_table[2][(high >> 8) & 0xFF] ^
+		      crc32c_table[1][(high >> 16) & 0xFF] ^ crc32c_table[0][high >> 24];
+		data += 8;
+		length -= 8;
+	}
+	while(length--)
+		crc = crc32c_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if CRC32C_X86
+/* use inline assembly rather than the intrinsics, so that this
+ * file need not be compiled with -msse4.2 to get the fallback */
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t * data, size_t length)
+{
+	while(length && ((uintptr_t) data & 7))
+	{
+		__asm__("crc32b %1, %0" : "+r" (crc) : "rm" (*data));
+		data++;
+		length--;
+	}
+#ifdef __x86_64__
+	{
+		uint64_t crc64 = crc;
+		while(length >= 8)
+		{
+			__asm__("crc32q %1, %0" : "+r" (crc64) : "rm" (*(const uint64_t *) data));
+			data += 8;
+			length -= 8;
+		}
+		crc = crc64;
+	}
+#endif
+	while(length >= 4)
+	{
+		__asm__("crc32l %1, %0" : "+r" (crc) : "rm" (*(const uint32_t *) data));
+		data += 4;
+		length -= 4;
+	}
+	while(length--)
+	{
+		__asm__("crc32b %1, %0" : "+r" (crc) : "rm" (*data));
+		data++;
+	}
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void * data, size_t length)
+{
+	crc = ~crc;
+#if CRC32C_X86
+	if(crc32c_use_hw)
+		crc = crc32c_hw(crc, (const uint8_t *) data, length);
+	else
+#endif
+		crc = crc32c_sw(crc, (const uint8_t *) data, length);
+	return ~crc;
+}
+
+int crc32c_hardware(void)
+{
+	return crc32c_use_hw;
+}
+
+void crc32c_set_hardware(int enable)
+{
+	crc32c_use_hw = enable && crc32c_have_hw;
+}
@@ -0,0 +1,32 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* CRC-32C (Castagnoli), as used by iSCSI and ext4. Uses the SSE4.2 crc32
+ * instruction if the CPU has it, and a table-driven version otherwise. Start
+ * with crc = 0, and pass the previous return value to continue a checksum
+ * over data split across several calls. */
+uint32_t crc32c(uint32_t crc, const void * data, size_t length);
+
+/* returns nonzero if crc32c() is using the hardware instruction */
+int crc32c_hardware(void);
+
+/* if enable is zero, crc32c() uses the table-driven version even when the CPU
+ * has the instruction (e.g. to test it); otherwise it goes back to using the
+ * instruction if it can */
+void crc32c_set_hardware(int enable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CRC32C_H */
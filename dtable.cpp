@@ -1,7 +1,32 @@
 /* This file is part of the Casa Mia Datastore Project at UBC.It is distributed under the terms of
  * version 2 of the GNU GPL. See the file LICENSE for details. */
 
+#include <algorithm>
+
 #include "dtable.h"
 
-/* that's it, that's all this file is here for */
 atomic<abortable_tx> dtable::atx_handle(NO_ABORTABLE_TX);
+
+struct key_order_cmp
+{
+	const dtype * keys;
+	const blob_comparator * blob_cmp;
+	inline key_order_cmp(const dtype * keys, const blob_comparator * blob_cmp) : keys(keys), blob_cmp(blob_cmp) {}
+	inline bool operator()(size_t a, size_t b) const
+	{
+		return keys[a].compare(keys[b], blob_cmp) < 0;
+	}
+};
+
+void dtable::sort_keys(const dtype * keys, size_t count, size_t * order) const
+{
+	for(size_t i = 0; i < count; i++)
+		order[i] = i;
+	/* batches are often already sorted; don't bother sorting those */
+	for(size_t i = 1; i < count; i++)
+		if(keys[i - 1].compare(keys[i], blob_cmp) > 0)
+		{
+			std::sort(order, order + count, key_order_cmp(keys, blob_cmp));
+			break;
+		}
+}
@@ -24,6 +24,13 @@ public:
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const = 0;
 	/* contains(key) == dtable::find(key).exists(), but maybe more efficient */
 	inline bool contains(const dtype & key, ATX_OPT) const { bool found; return present(key, &found, atx); }
+	/* sets out[i] = present(keys[i], &found[i]) for each key; subclasses can
+	 * override this to amortize per-key costs over the batch (see bloom_dtable) */
+	virtual void present_many(const dtype * keys, size_t count, bool * out, bool * found, ATX_OPT) const
+	{
+		for(size_t i = 0; i < count; i++)
+			out[i] = present(keys[i], &found[i], atx);
+	}
 	inline dtype::ctype key_type() const { return ktype; }
 	inline const blob_comparator * get_blob_cmp() const { return blob_cmp; }
 	inline const istr & get_cmp_name() const { return cmp_name; }
@@ -142,6 +149,20 @@ public:
 	virtual iter * iterator(ATX_OPT) const = 0;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const = 0;
 	inline blob find(const dtype & key, ATX_OPT) const { bool found; return lookup(key, &found, atx); }
+	/* sets values[i] = lookup(keys[i], &found[i]) for each key; sorted dtables
+	 * override this to probe for the keys in order, in a single forward pass */
+	virtual void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const
+	{
+		for(size_t i = 0; i < count; i++)
+			values[i] = lookup(keys[i], &found[i], atx);
+	}
+	/* If all the keys in the dtable (including those of nonexistent entries)
+	 * are known to lie within [*min, *max], and this will never change, sets
+	 * *min and *max and returns true. Must be cheap: no I/O, just a copy. */
+	inline virtual bool key_bounds(dtype * min, dtype * max) const { return false; }
+	/* Returns false only if the key is definitely not in the dtable, not even
+	 * as a nonexistent entry; this is a cheap filter (e.g. a bloom filter) */
+	inline virtual bool may_contain(const dtype & key) const { return true; }
 	/* index(), contains_index(), and size() only work when iter::seek_index() works, see above */
 	inline virtual blob index(size_t index) const { return blob(); }
 	inline virtual bool contains_index(size_t index) const { return false; }
@@ -215,6 +236,9 @@ protected:
 	/* iterator usage counting */
 	inline void retain() const { usage.inc(); }
 	inline void release() const { if(!usage.dec()) unused_callbacks.invoke(); }
+	/* fills order with the indices of keys, sorted by key, for lookup_many() */
+	void sort_keys(const dtype * keys, size_t count, size_t * order) const;
+	
 	inline iter * iterator_chain_usage(chain_callback * chain, dtable * source, ATX_OPT) const
 	{
 		iter * it = source->iterator(atx);
@@ -166,19 +166,35 @@ dtype fixed_dtable::get_key(size_t index, bool * data_exists, off_t * data_offse
 			return dtype(value);
 		}
 		case dtype::STRING:
-			return dtype(st.get(util::read_bytes(bytes, 0, key_size)));
+			return dtype(st.fetch(util::read_bytes(bytes, 0, key_size)));
 		case dtype::BLOB:
-			return dtype(st.get_blob(util::read_bytes(bytes, 0, key_size)));
+			return dtype(st.fetch_blob(util::read_bytes(bytes, 0, key_size)));
 	}
 	abort();
 }
 
 template<class T>
-int fixed_dtable::find_key(const T & test, size_t * index, bool * data_exists, off_t * data_offset) const
+int fixed_dtable::find_key(const T & test, size_t * index, bool * data_exists, off_t * data_offset, size_t start) const
 {
 	/* binary search */
-	ssize_t min = 0, max = key_count - 1;
+	ssize_t min = start, max = key_count - 1;
 	assert(ktype != dtype::BLOB || !cmp_name == !blob_cmp);
+	if(start)
+	{
+		/* gallop forward from start to bracket the key */
+		for(size_t step = 1; min <= max; step *= 2)
+		{
+			ssize_t probe = start + step - 1;
+			if(probe > max)
+				break;
+			if(test(get_key(probe)) >= 0)
+			{
+				max = probe;
+				break;
+			}
+			min = probe + 1;
+		}
+	}
 	while(min <= max)
 	{
 		/* watch out for overflow! */
@@ -240,6 +256,32 @@ blob fixed_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return get_value(index, data_offset);
 }
 
+void fixed_dtable::lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	size_t start = 0;
+	std::vector<size_t> order(count);
+	if(!count)
+		return;
+	sort_keys(keys, count, &order[0]);
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t k = order[i], index;
+		bool data_exists;
+		off_t data_offset;
+		int r = find_key(dtype_static_test(keys[k], blob_cmp), &index, &data_exists, &data_offset, start);
+		/* the remaining keys are all at or after this one */
+		start = index;
+		if(r < 0)
+		{
+			found[k] = false;
+			values[k] = blob();
+			continue;
+		}
+		found[k] = true;
+		values[k] = data_exists ? get_value(index, data_offset) : blob();
+	}
+}
+
 blob fixed_dtable::index(size_t index) const
 {
 	if(index < 0 || index >= key_count)
@@ -259,10 +301,16 @@ bool fixed_dtable::contains_index(size_t index) const
 int fixed_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	int r = -1;
+	bool concurrent;
 	dtable_header header;
 	if(fp)
 		deinit();
-	fp = rofile::open_mmap<64, 24>(dfd, file);
+	if(!config.get("concurrent_reads", &concurrent, false))
+		return -EINVAL;
+	if(concurrent)
+		fp = rofile::open_mapped<64>(dfd, file);
+	else
+		fp = rofile::open_mmap<64, 24>(dfd, file);
 	if(!fp)
 		return -1;
 	if(fp->read_type(0, &header) < 0)
@@ -313,6 +361,13 @@ int fixed_dtable::init(int dfd, const char * file, const params & config, sys_jo
 			goto fail;
 	}
 	
+	if(key_count)
+	{
+		/* remember the first and last keys for key_bounds() */
+		first_key = get_key(0);
+		last_key = get_key(key_count - 1);
+	}
+	
 	return 0;
 	
 fail:
@@ -325,6 +380,8 @@ void fixed_dtable::deinit()
 {
 	if(fp)
 	{
+		first_key = dtype(0u);
+		last_key = dtype(0u);
 		if(ktype == dtype::STRING)
 			st.deinit();
 		delete fp;
@@ -32,7 +32,16 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	virtual blob index(size_t index) const;
+	inline virtual bool key_bounds(dtype * min, dtype * max) const
+	{
+		if(!key_count)
+			return false;
+		*min = first_key;
+		*max = last_key;
+		return true;
+	}
 	virtual bool contains_index(size_t index) const;
 	inline virtual size_t size() const { return key_count; }
 	
@@ -41,7 +50,7 @@ public:
 	static int create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow = NULL);
 	DECLARE_RO_FACTORY(fixed_dtable);
 	
-	inline fixed_dtable() : fp(NULL) {}
+	inline fixed_dtable() : fp(NULL), first_key(0u), last_key(0u) {}
 	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
 	
 protected:
@@ -89,13 +98,16 @@ private:
 	{
 		return find_key(dtype_static_test(key, blob_cmp), index, data_exists, data_offset);
 	}
+	/* only searches at or after start, which must not be after the key's position */
 	template<class T>
-	int find_key(const T & test, size_t * index, bool * data_exists = NULL, off_t * data_offset = NULL) const;
+	int find_key(const T & test, size_t * index, bool * data_exists = NULL, off_t * data_offset = NULL, size_t start = 0) const;
 	blob get_value(size_t index, off_t data_offset) const;
 	blob get_value(size_t index) const;
 	
 	rofile * fp;
 	size_t key_count;
+	/* for key_bounds() */
+	dtype first_key, last_key;
 	size_t value_size, record_size;
 	stringtbl st;
 	uint8_t key_size;
@@ -11,6 +11,7 @@
 #include <time.h>
 
 #include "md5.h"
+#include "crc32c.h"
 #include "openat.h"
 #include "journal.h"
 
@@ -55,15 +56,124 @@ int journal::wait()
 		return -EINVAL;
 	return patchgroup_sync(last_commit);
 #else /* }}} */
+	uint64_t ticket;
+	scopelock scope(group.lock);
+	if(!group.running || group.stop)
+	{
+		/* no flusher (or it is on its way out), so sync directly */
+		scope.unlock();
+		return sync_fs();
+	}
+	/* any sync that starts after this point covers our commit */
+	ticket = ++group.requested;
+	group.waiting++;
+	scope.signal(group.wake);
+	while(group.synced < ticket)
+		scope.wait(group.done);
+	group.waiting--;
+	return 0;
+#endif
+}
+
+#if !HAVE_FSTITCH
+int journal::sync_fs()
+{
 	int r;
 	/* by changing the timestamp and calling fsync() on a file within
 	 * the target file system, we force the ext3 transaction to end */
+	group.lock.lock();
 	fd_tv[0].tv_sec++;
 	r = futimes(fs_fd, fd_tv);
+	group.lock.unlock();
 	assert(r >= 0);
 	r = fsync(fs_fd);
 	assert(r >= 0);
 	return 0;
+}
+
+void * journal::flusher(void * arg)
+{
+	scopelock scope(group.lock);
+	for(;;)
+	{
+		uint64_t target;
+		while(!group.stop && group.synced == group.requested)
+			scope.wait(group.wake);
+		if(group.synced == group.requested)
+			/* stopping, and nobody is waiting */
+			break;
+		if(group.max_delay && group.waiting < group.max_batch && !group.stop)
+		{
+			/* give other committers a chance to join this sync */
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += (group.max_delay % 1000000) * 1000;
+			deadline.tv_sec += group.max_delay / 1000000 + deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			while(group.waiting < group.max_batch && !group.stop)
+				if(scope.timedwait(group.wake, &deadline) == ETIMEDOUT)
+					break;
+		}
+		target = group.requested;
+		scope.unlock();
+		sync_fs();
+		scope.lock();
+		group.synced = target;
+		scope.broadcast(group.done);
+	}
+	return NULL;
+}
+
+int journal::start_flusher()
+{
+	int r;
+	if(group.running)
+		return 0;
+	group.stop = false;
+	r = pthread_create(&group.thread, NULL, flusher, NULL);
+	if(r)
+		return -r;
+	group.lock.lock();
+	group.running = true;
+	group.lock.unlock();
+	return 0;
+}
+
+void journal::stop_flusher()
+{
+	if(!group.running)
+		return;
+	group.lock.lock();
+	group.stop = true;
+	group.wake.signal();
+	group.lock.unlock();
+	/* the flusher finishes any pending sync before it exits */
+	pthread_join(group.thread, NULL);
+	group.lock.lock();
+	group.running = false;
+	group.lock.unlock();
+}
+#endif
+
+int journal::set_group_commit(unsigned int max_delay, size_t max_batch)
+{
+#if HAVE_FSTITCH
+	/* patchgroup_sync() already only syncs the requested commit */
+	return -ENOSYS;
+#else
+	group.lock.lock();
+	group.max_delay = max_delay;
+	group.max_batch = max_batch;
+	group.lock.unlock();
+	if(fs_fd < 0)
+		/* the flusher will be started by init() */
+		return 0;
+	if(!max_batch)
+	{
+		stop_flusher();
+		return 0;
+	}
+	return start_flusher();
 #endif
 }
 
@@ -153,21 +263,26 @@ int journal::end_external(bool success)
 	return 0;
 }
 
-int journal::checksum(off_t start, off_t end, uint8_t * checksum)
+int journal::checksum(off_t start, off_t end, uint8_t * checksum, bool crc)
 {
-	/* this can be replaced with any other hash function;
-	 * I already had MD5 lying around so I used it here */
+	/* new journals use CRC32C, which is much cheaper to compute
+	 * than MD5; we still support MD5 to verify old journals */
 	MD5_CTX ctx;
-	uint8_t buffer[4096];
+	uint32_t crc32 = 0;
+	uint8_t buffer[65536];
 	ssize_t size = end - start;
-	MD5Init(&ctx);
+	if(!crc)
+		MD5Init(&ctx);
 	if(size > (ssize_t) sizeof(buffer))
 		size = sizeof(buffer);
 	size = data_file.read(start, buffer, size);
 	while(size > 0 && end > start)
 	{
 		start += size;
-		MD5Update(&ctx, buffer, size);
+		if(crc)
+			crc32 = crc32c(crc32, buffer, size);
+		else
+			MD5Update(&ctx, buffer, size);
 		size = end - start;
 		if(size > (ssize_t) sizeof(buffer))
 			size = sizeof(buffer);
@@ -175,10 +290,23 @@ int journal::checksum(off_t start, off_t end, uint8_t * checksum)
 	}
 	if(size < 0)
 		return -1;
-	MD5Final(checksum, &ctx);
+	if(crc)
+	{
+		static_assert(sizeof(crc32) + sizeof(J_CRC32C_TAG) == J_CHECKSUM_LEN);
+		util::memcpy(checksum, &crc32, sizeof(crc32));
+		util::memcpy(&checksum[sizeof(crc32)], J_CRC32C_TAG, sizeof(J_CRC32C_TAG));
+	}
+	else
+		MD5Final(checksum, &ctx);
 	return 0;
 }
 
+bool journal::is_crc32c(const uint8_t * checksum)
+{
+	/* an MD5 could match this by chance, but only with probability 2^-96 */
+	return !memcmp(&checksum[sizeof(uint32_t)], J_CRC32C_TAG, sizeof(J_CRC32C_TAG));
+}
+
 int journal::commit()
 {
 	commit_record cr;
@@ -200,7 +328,7 @@ int journal::commit()
 
 	cr.offset = prev_cr.offset + prev_cr.length;
 	cr.length = data_file.end() - cr.offset;
-	if(checksum(cr.offset, cr.offset + cr.length, cr.checksum) < 0)
+	if(checksum(cr.offset, cr.offset + cr.length, cr.checksum, !md5_commits) < 0)
 		return -1;
 #if HAVE_FSTITCH /* {{{ */
 	patchgroup_id_t commit;
@@ -487,7 +615,7 @@ int journal::verify()
 	{
 		if(pread(crfd, &cr, sizeof(cr), i * sizeof(cr)) != sizeof(cr))
 			return -1;
-		if(checksum(cr.offset, cr.offset + cr.length, actual) < 0)
+		if(checksum(cr.offset, cr.offset + cr.length, actual, is_crc32c(cr.checksum)) < 0)
 			return -1;
 		if(memcmp(cr.checksum, actual, J_CHECKSUM_LEN))
 			return 0;
@@ -642,8 +770,11 @@ error:
 #if !HAVE_FSTITCH
 int journal::fs_fd = -1;
 struct timeval journal::fd_tv[2];
+journal::group_commit journal::group;
 #endif
 
+bool journal::md5_commits = false;
+
 int journal::init(int dfd)
 {
 #if !HAVE_FSTITCH
@@ -654,6 +785,16 @@ int journal::init(int dfd)
 		return fs_fd;
 	unlinkat(dfd, ".fsync_fs", 0);
 	memset(fd_tv, 0, sizeof(fd_tv));
+	if(group.max_batch)
+	{
+		int r = start_flusher();
+		if(r < 0)
+		{
+			close(fs_fd);
+			fs_fd = -1;
+			return r;
+		}
+	}
 #endif
 	return 0;
 }
@@ -663,6 +804,7 @@ int journal::deinit()
 #if !HAVE_FSTITCH
 	if(fs_fd < 0)
 		return -EBUSY;
+	stop_flusher();
 	close(fs_fd);
 	fs_fd = -1;
 #endif
@@ -25,9 +25,15 @@ extern "C" {
 
 #include "istr.h"
 #include "rwfile.h"
+#include "locking.h"
 
 #define J_COMMIT_EXT ".commit."
 #define J_CHECKSUM_LEN 16
+/* Commit records originally held an MD5 of the committed records. Now they
+ * hold a CRC32C in the first 4 bytes of the checksum field, followed by this
+ * tag (with its terminating null) to tell the two formats apart, so that
+ * journals written by older versions can still be verified and recovered. */
+#define J_CRC32C_TAG "jnl-crc32c\0"
 #define J_ADD_N_COMMITS 50 /* in thousands of commits */
 
 class journal
@@ -58,7 +64,9 @@ public:
 	/* commits a journal atomically, but does not block waiting for it */
 	int commit();
 	
-	/* blocks waiting for a committed journal to be written to disk */
+	/* blocks waiting for a committed journal to be written to disk; this may
+	 * be called by several threads at once, and with group commit enabled
+	 * their waits will share a single sync (see set_group_commit() below) */
 	int wait();
 	
 	/* plays back a journal, possibly during recovery */
@@ -83,10 +91,53 @@ public:
 	static int init(int dfd);
 	static int deinit();
 	
+	/* Enables group commit: wait() calls are queued for a flusher thread,
+	 * which makes all commits done so far durable with a single sync and
+	 * then wakes up every waiter it covered. The flusher waits up to
+	 * max_delay microseconds for more waiters to arrive, or until max_batch
+	 * of them are waiting, before starting a sync. A max_batch of 0 disables
+	 * group commit again, so that each wait() does its own sync. */
+	static int set_group_commit(unsigned int max_delay, size_t max_batch);
+	
+	/* makes new commit records hold an MD5 again, as older versions wrote
+	 * them, to test recovery of journals written by those versions */
+	static inline void set_md5_commits(bool md5) { md5_commits = md5; }
+	
 private:
+	static bool md5_commits;
+	
 #if !HAVE_FSTITCH
 	static int fs_fd;
 	static struct timeval fd_tv[2];
+	
+	/* forces all commits done so far to disk */
+	static int sync_fs();
+	
+	/* group commit state */
+	struct group_commit
+	{
+		init_mutex lock;
+		/* the flusher waits on wake; waiters wait on done */
+		init_cond wake, done;
+		pthread_t thread;
+		bool running, stop;
+		/* requested is bumped by each waiter; synced is the
+		 * value of requested as of the start of the last sync */
+		uint64_t requested, synced;
+		size_t waiting;
+		unsigned int max_delay;
+		size_t max_batch;
+		inline group_commit()
+			: running(false), stop(false), requested(0), synced(0),
+			  waiting(0), max_delay(0), max_batch(0)
+		{
+		}
+	};
+	static group_commit group;
+	
+	static int start_flusher();
+	static void stop_flusher();
+	static void * flusher(void * arg);
 #endif
 	
 	/* a commit record */
@@ -131,7 +182,9 @@ private:
 	};
 #endif
 	
-	int checksum(off_t start, off_t end, uint8_t * checksum);
+	/* computes the checksum field of a commit record, using CRC32C or MD5 */
+	int checksum(off_t start, off_t end, uint8_t * checksum, bool crc = true);
+	static bool is_crc32c(const uint8_t * checksum);
 	int init_crfd(const istr & commit_name);
 	int verify();
 	
@@ -1,13 +1,22 @@
 /* This file is part of the Casa Mia Datastore Project at UBC.It is distributed under the terms of
  * version 2 of the GNU GPL. See the file LICENSE for details. */
 
+#include <new>
 #include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include "util.h"
+#include "bg_pool.h"
 #include "exception.h"
 #include "hack_avl_map.h"
 #include "journal_dtable.h"
 
+/* sort at least this many new entries per bg_pool thread in sort_run() */
+#define JDT_PARALLEL_SORT 65536
+
 bool journal_dtable::iter::valid() const
 {
 	return jit != dt_source->jdt_map.end();
@@ -79,13 +88,276 @@ const dtable * journal_dtable::iter::source() const
 	return dt_source;
 }
 
+void journal_dtable::tree_iter::sync() const
+{
+	const journal_dtable_tree & tree = dt_source->jdt_tree;
+	if(version == tree.version())
+		return;
+	tit = entry ? tree.lower_bound(entry->first) : tree.end();
+	version = tree.version();
+}
+
+bool journal_dtable::tree_iter::valid() const
+{
+	return entry != NULL;
+}
+
+bool journal_dtable::tree_iter::next()
+{
+	if(!entry)
+		return false;
+	sync();
+	++tit;
+	return found();
+}
+
+bool journal_dtable::tree_iter::prev()
+{
+	sync();
+	if(tit == dt_source->jdt_tree.begin())
+		return false;
+	--tit;
+	return found();
+}
+
+bool journal_dtable::tree_iter::first()
+{
+	tit = dt_source->jdt_tree.begin();
+	version = dt_source->jdt_tree.version();
+	return found();
+}
+
+bool journal_dtable::tree_iter::last()
+{
+	tit = dt_source->jdt_tree.end();
+	version = dt_source->jdt_tree.version();
+	if(tit == dt_source->jdt_tree.begin())
+		return false;
+	--tit;
+	return found();
+}
+
+dtype journal_dtable::tree_iter::key() const
+{
+	return entry->first;
+}
+
+bool journal_dtable::tree_iter::seek(const dtype & key)
+{
+	tit = dt_source->jdt_tree.lower_bound(key);
+	version = dt_source->jdt_tree.version();
+	if(!found())
+		return false;
+	return !key.compare(entry->first, dt_source->blob_cmp);
+}
+
+bool journal_dtable::tree_iter::seek(const dtype_test & test)
+{
+	tit = dt_source->jdt_tree.lower_bound(test);
+	version = dt_source->jdt_tree.version();
+	if(!found())
+		return false;
+	return !test(entry->first);
+}
+
+metablob journal_dtable::tree_iter::meta() const
+{
+	return entry->second;
+}
+
+blob journal_dtable::tree_iter::value() const
+{
+	return entry->second;
+}
+
+const dtable * journal_dtable::tree_iter::source() const
+{
+	return dt_source;
+}
+
+bool journal_dtable::skip_iter::valid() const
+{
+	return sit != dt_source->jdt_skip.end();
+}
+
+bool journal_dtable::skip_iter::next()
+{
+	if(sit != dt_source->jdt_skip.end())
+		++sit;
+	return sit != dt_source->jdt_skip.end();
+}
+
+bool journal_dtable::skip_iter::prev()
+{
+	journal_dtable_skiplist::const_iterator before = sit;
+	/* there are no backward links, so this searches for the previous key */
+	--before;
+	if(before == dt_source->jdt_skip.end())
+		return false;
+	sit = before;
+	return true;
+}
+
+bool journal_dtable::skip_iter::first()
+{
+	sit = dt_source->jdt_skip.begin();
+	return sit != dt_source->jdt_skip.end();
+}
+
+bool journal_dtable::skip_iter::last()
+{
+	sit = dt_source->jdt_skip.end();
+	--sit;
+	return sit != dt_source->jdt_skip.end();
+}
+
+dtype journal_dtable::skip_iter::key() const
+{
+	return sit.key();
+}
+
+bool journal_dtable::skip_iter::seek(const dtype & key)
+{
+	sit = dt_source->jdt_skip.lower_bound(key);
+	if(sit == dt_source->jdt_skip.end())
+		return false;
+	return !key.compare(sit.key(), dt_source->blob_cmp);
+}
+
+bool journal_dtable::skip_iter::seek(const dtype_test & test)
+{
+	sit = dt_source->jdt_skip.lower_bound(test);
+	if(sit == dt_source->jdt_skip.end())
+		return false;
+	return !test(sit.key());
+}
+
+metablob journal_dtable::skip_iter::meta() const
+{
+	return *sit.value();
+}
+
+blob journal_dtable::skip_iter::value() const
+{
+	return *sit.value();
+}
+
+const dtable * journal_dtable::skip_iter::source() const
+{
+	return dt_source;
+}
+
+void journal_dtable::run_iter::sync()
+{
+	dt_source->sort_run();
+	if(version == dt_source->run_version)
+		return;
+	position = entry ? dt_source->run_lower_bound(entry->first) : dt_source->jdt_run.size();
+	version = dt_source->run_version;
+}
+
+bool journal_dtable::run_iter::valid() const
+{
+	return entry != NULL;
+}
+
+bool journal_dtable::run_iter::next()
+{
+	if(!entry)
+		return false;
+	sync();
+	position++;
+	return found();
+}
+
+bool journal_dtable::run_iter::prev()
+{
+	sync();
+	if(!entry)
+		position = dt_source->jdt_run.size();
+	if(!position)
+		return false;
+	position--;
+	return found();
+}
+
+bool journal_dtable::run_iter::first()
+{
+	dt_source->sort_run();
+	version = dt_source->run_version;
+	position = 0;
+	return found();
+}
+
+bool journal_dtable::run_iter::last()
+{
+	dt_source->sort_run();
+	version = dt_source->run_version;
+	position = dt_source->jdt_run.size();
+	if(position)
+		position--;
+	return found();
+}
+
+dtype journal_dtable::run_iter::key() const
+{
+	return entry->first;
+}
+
+bool journal_dtable::run_iter::seek(const dtype & key)
+{
+	dt_source->sort_run();
+	version = dt_source->run_version;
+	position = dt_source->run_lower_bound(key);
+	if(!found())
+		return false;
+	return !key.compare(entry->first, dt_source->blob_cmp);
+}
+
+bool journal_dtable::run_iter::seek(const dtype_test & test)
+{
+	dt_source->sort_run();
+	version = dt_source->run_version;
+	position = dt_source->run_lower_bound(test);
+	if(!found())
+		return false;
+	return !test(entry->first);
+}
+
+metablob journal_dtable::run_iter::meta() const
+{
+	return entry->second;
+}
+
+blob journal_dtable::run_iter::value() const
+{
+	return entry->second;
+}
+
+const dtable * journal_dtable::run_iter::source() const
+{
+	return dt_source;
+}
+
 dtable::iter * journal_dtable::iterator(ATX_DEF) const
 {
+	if(index_type == DEFERRED_INDEX)
+		return new run_iter(this);
+	if(index_type == BTREE_INDEX)
+		return new tree_iter(this);
+	if(index_type == SKIPLIST_INDEX)
+		return new skip_iter(this);
 	return new iter(this);
 }
 
 bool journal_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 {
+	if(index_type == SKIPLIST_INDEX)
+	{
+		journal_dtable_skiplist::const_iterator it = jdt_skip.find(key);
+		*found = it != jdt_skip.end();
+		return *found && it.value()->exists();
+	}
 	journal_dtable_hash::const_iterator it = jdt_hash.find(key);
 	if(it != jdt_hash.end())
 	{
@@ -98,6 +370,12 @@ bool journal_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 
 blob journal_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
+	if(index_type == SKIPLIST_INDEX)
+	{
+		journal_dtable_skiplist::const_iterator it = jdt_skip.find(key);
+		*found = it != jdt_skip.end();
+		return *found ? *it.value() : blob();
+	}
 	journal_dtable_hash::const_iterator it = jdt_hash.find(key);
 	if(it != jdt_hash.end())
 	{
@@ -274,6 +552,8 @@ int journal_dtable::init(dtype::ctype key_type, sys_journal::listener_id lid, sy
 	if(initialized)
 		deinit();
 	assert(jdt_map.empty());
+	assert(jdt_tree.empty());
+	assert(jdt_skip.empty());
 	assert(jdt_hash.empty());
 	assert(!cmp_name);
 	ktype = key_type;
@@ -297,7 +577,7 @@ int journal_dtable::reinit(sys_journal::listener_id lid)
 	}
 	cmp_name = NULL;
 	jdt_hash.clear();
-	jdt_map.clear();
+	clear_index();
 	set_id(lid);
 	return 0;
 }
@@ -305,27 +585,248 @@ int journal_dtable::reinit(sys_journal::listener_id lid)
 void journal_dtable::deinit()
 {
 	jdt_hash.clear();
-	jdt_map.clear();
+	clear_index();
 	initialized = false;
 	dtable::deinit();
 }
 
 int journal_dtable::set_node(const dtype & key, const blob & value, bool append)
 {
+	int r;
 	journal_dtable_hash::value_type hash_pair(key, value);
 	std::pair<journal_dtable_hash::iterator, bool> insert = jdt_hash.insert(hash_pair);
 	if(insert.second)
 	{
 		/* add to map as well */
-		journal_dtable_map::value_type map_pair(key, &insert.first->second);
+		r = add_index(&*insert.first, append);
+		if(r < 0)
+			jdt_hash.erase(insert.first);
+	}
+	else if(index_type == SKIPLIST_INDEX)
+	{
+		/* the skiplist has its own copy */
+		blob previous = insert.first->second;
+		insert.first->second = value;
+		r = add_index(&*insert.first, append);
+		if(r < 0)
+			insert.first->second = previous;
+	}
+	else
+	{
+		/* update value in hash */
+		insert.first->second = value;
+		r = 0;
+	}
+	return (r < 0) ? r : 0;
+}
+
+int journal_dtable::add_index(const journal_dtable_hash::value_type * entry, bool append)
+{
+	if(index_type == BTREE_INDEX)
+		return jdt_tree.insert(entry->first, entry);
+	else if(index_type == DEFERRED_INDEX)
+	{
+		/* keys that arrive in order don't need to be sorted later */
+		if(jdt_unsorted.empty() && (jdt_run.empty() || jdt_run.back()->first.compare(entry->first, blob_cmp) < 0))
+			jdt_run.push_back(entry);
+		else
+			jdt_unsorted.push_back(entry);
+	}
+	else if(index_type == SKIPLIST_INDEX)
+	{
+		int r;
+		const blob * old;
+		blob * value;
+		void * memory = jdt_arena.allocate(sizeof(blob));
+		if(!memory)
+			return -ENOMEM;
+		value = new (memory) blob(entry->second);
+		r = jdt_skip.insert(entry->first, value, &old);
+		if(r < 0)
+		{
+			value->~blob();
+			return r;
+		}
+		if(!r)
+			/* readers may still be using the old value */
+			jdt_retired.push_back(old);
+	}
+	else
+	{
+		/* the map's values are not const, but we never change them through it */
+		journal_dtable_map::value_type map_pair(entry->first, const_cast<blob *>(&entry->second));
 		if(append)
 			jdt_map.insert(jdt_map.end(), map_pair);
 		else
 			jdt_map.insert(map_pair);
 	}
+	return 0;
+}
+
+void journal_dtable::clear_index()
+{
+	journal_dtable_skiplist::const_iterator it;
+	jdt_map.clear();
+	jdt_tree.clear();
+	for(it = jdt_skip.begin(); it != jdt_skip.end(); ++it)
+		it.value()->~blob();
+	jdt_skip.clear();
+	for(size_t i = 0; i < jdt_retired.size(); i++)
+		jdt_retired[i]->~blob();
+	jdt_retired.clear();
+	/* free all the nodes and values at once */
+	jdt_arena.clear();
+	jdt_run.clear();
+	jdt_unsorted.clear();
+	run_version++;
+}
+
+typedef std::pair<const dtype, blob> jdt_entry;
+
+struct jdt_entry_less
+{
+	const blob_comparator * blob_cmp;
+	inline bool operator()(const jdt_entry * a, const jdt_entry * b) const
+	{
+		return a->first.compare(b->first, blob_cmp) < 0;
+	}
+	inline jdt_entry_less(const blob_comparator * blob_cmp) : blob_cmp(blob_cmp) {}
+};
+
+class jdt_sort_job : public bg_pool::job
+{
+public:
+	virtual void run()
+	{
+		std::sort(first, last, less);
+	}
+	
+	inline jdt_sort_job(const jdt_entry_less & less) : first(NULL), last(NULL), less(less) {}
+	
+	const jdt_entry ** first;
+	const jdt_entry ** last;
+	
+private:
+	jdt_entry_less less;
+};
+
+/* sort pieces of the entries in the bg_pool threads, then merge them */
+static void jdt_sort(std::vector<const jdt_entry *> & entries, const jdt_entry_less & less)
+{
+	bg_pool * pool = bg_pool::get_global_pool();
+	size_t parts = entries.size() / JDT_PARALLEL_SORT;
+	if(parts > pool->get_threads())
+		parts = pool->get_threads();
+	if(parts < 2)
+	{
+		std::sort(entries.begin(), entries.end(), less);
+		return;
+	}
+	
+	std::vector<const jdt_entry **> bounds(parts + 1);
+	std::vector<jdt_sort_job> jobs(parts, jdt_sort_job(less));
+	for(size_t i = 0; i <= parts; i++)
+		bounds[i] = &entries[0] + entries.size() * i / parts;
+	for(size_t i = 0; i < parts; i++)
+	{
+		jobs[i].first = bounds[i];
+		jobs[i].last = bounds[i + 1];
+	}
+	/* the pool threads may be busy with background combines, so we sort one
+	 * piece ourselves and then take back any that haven't been started yet */
+	for(size_t i = 1; i < parts; i++)
+		pool->submit(&jobs[i], INT_MAX);
+	jobs[0].run();
+	for(size_t i = 1; i < parts; i++)
+		if(pool->cancel(&jobs[i]))
+			jobs[i].run();
+		else
+			pool->wait(&jobs[i]);
+	
+	for(size_t width = 1; width < parts; width *= 2)
+		for(size_t i = 0; i + width < parts; i += 2 * width)
+			std::inplace_merge(bounds[i], bounds[i + width], bounds[std::min(i + 2 * width, parts)], less);
+}
+
+void journal_dtable::sort_run() const
+{
+	jdt_entry_less less(blob_cmp);
+	if(jdt_unsorted.empty())
+		return;
+	jdt_sort(jdt_unsorted, less);
+	if(jdt_run.empty())
+		jdt_run.swap(jdt_unsorted);
 	else
-		/* update value in hash */
-		insert.first->second = value;
+	{
+		journal_dtable_run merged(jdt_run.size() + jdt_unsorted.size());
+		std::merge(jdt_run.begin(), jdt_run.end(), jdt_unsorted.begin(), jdt_unsorted.end(), merged.begin(), less);
+		jdt_run.swap(merged);
+		jdt_unsorted.clear();
+	}
+	run_version++;
+}
+
+size_t journal_dtable::run_lower_bound(const dtype & key) const
+{
+	size_t low = 0, high = jdt_run.size();
+	while(low < high)
+	{
+		size_t mid = (low + high) / 2;
+		if(jdt_run[mid]->first.compare(key, blob_cmp) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+size_t journal_dtable::run_lower_bound(const dtype_test & test) const
+{
+	size_t low = 0, high = jdt_run.size();
+	while(low < high)
+	{
+		size_t mid = (low + high) / 2;
+		if(test(jdt_run[mid]->first) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+int journal_dtable::set_index(const istr & type)
+{
+	int r;
+	ordered_index index;
+	journal_dtable_hash::const_iterator it;
+	if(!type || !strcmp(type, "avl"))
+		index = AVL_INDEX;
+	else if(!strcmp(type, "btree"))
+		index = BTREE_INDEX;
+	else if(!strcmp(type, "skiplist"))
+		index = SKIPLIST_INDEX;
+	else if(!strcmp(type, "deferred"))
+		index = DEFERRED_INDEX;
+	else
+		return -EINVAL;
+	if(index == index_type)
+		return 0;
+	/* rebuild the index from the hash */
+	clear_index();
+	index_type = index;
+	for(it = jdt_hash.begin(); it != jdt_hash.end(); ++it)
+	{
+		r = add_index(&*it, false);
+		if(r < 0)
+		{
+			/* fall back to the AVL tree, which does not use the arena */
+			clear_index();
+			index_type = AVL_INDEX;
+			for(it = jdt_hash.begin(); it != jdt_hash.end(); ++it)
+				add_index(&*it, false);
+			return r;
+		}
+	}
 	return 0;
 }
 
@@ -12,10 +12,14 @@
 #error journal_dtable.h is a C++ header file
 #endif
 
+#include <vector>
 #include <ext/hash_map>
 #include <ext/pool_allocator.h>
 #include "exception.h"
 #include "avl/map.h"
+#include "arena.h"
+#include "bplus_map.h"
+#include "skiplist_map.h"
 
 #include "dtable.h"
 #include "sys_journal.h"
@@ -31,8 +35,9 @@ public:
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
 	
-	/* journal_dtable supports size() even though it is not otherwise indexable */
-	inline virtual size_t size() const { return jdt_hash.size(); }
+	/* journal_dtable supports size() even though it is not otherwise indexable;
+	 * with the skiplist index, it can be called while another thread inserts */
+	inline virtual size_t size() const { return (index_type == SKIPLIST_INDEX) ? jdt_skip.size() : jdt_hash.size(); }
 	inline virtual bool writable() const { return true; }
 	virtual int insert(const dtype & key, const blob & blob, bool append = false, ATX_OPT);
 	virtual int remove(const dtype & key, ATX_OPT);
@@ -48,6 +53,11 @@ public:
 	virtual int real_rollover(listening_dtable * target) const;
 	inline virtual int accept(const dtype & key, const blob & value, bool append = false) { return set_node(key, value, append); }
 	
+	/* "avl" (the default), "btree", "skiplist", or "deferred"; see
+	 * journal_dtable_tree, journal_dtable_skiplist, and journal_dtable_run */
+	virtual int set_index(const istr & type);
+	inline virtual void finish_index() const { sort_run(); }
+	
 	class journal_dtable_warehouse : public sys_journal::listening_dtable_warehouse_impl<journal_dtable>
 	{
 	protected:
@@ -63,7 +73,7 @@ public:
 	
 protected:
 	/* journal_dtables should only be constructed by a journal_dtable_warehouse */
-	inline journal_dtable() : initialized(false), jdt_map(blob_cmp), jdt_hash(10, blob_cmp, blob_cmp) {}
+	inline journal_dtable() : initialized(false), index_type(AVL_INDEX), jdt_map(blob_cmp), jdt_tree(blob_cmp, &jdt_arena), jdt_skip(blob_cmp, &jdt_arena), run_version(0), jdt_hash(10, blob_cmp, blob_cmp) {}
 	int init(dtype::ctype key_type, sys_journal::listener_id lid, sys_journal * sysj);
 	void deinit();
 	inline virtual ~journal_dtable()
@@ -80,9 +90,48 @@ protected:
 	typedef __gnu_cxx::__pool_alloc<std::pair<const dtype, blob> > hash_pool_allocator;
 	typedef avl::map<dtype, blob *, dtype_comparator_refobject, tree_pool_allocator> journal_dtable_map;
 	typedef __gnu_cxx::hash_map<const dtype, blob, dtype_hashing_comparator, dtype_hashing_comparator, hash_pool_allocator> journal_dtable_hash;
+	/* the B+tree alternative to jdt_map, which is faster to build and walk
+	 * for large journals; its values point at the hash entries themselves */
+	typedef bplus_map<dtype, const journal_dtable_hash::value_type *, dtype_comparator_refobject> journal_dtable_tree;
+	/* with the skiplist, one thread can insert while others look up keys and
+	 * iterate; lookups then use the skiplist instead of the hash, which only
+	 * the inserting thread can use. The skiplist has its own copies of the
+	 * values (in jdt_arena, sharing the data), and replaced values are kept
+	 * until the index is cleared, since readers may still be using them; so
+	 * overwriting the same keys over and over uses more and more memory, until
+	 * the journal is digested and cleared. Only the writer may use the hash. */
+	typedef skiplist_map<dtype, const blob *, dtype_comparator_refobject> journal_dtable_skiplist;
+	/* when deferred, inserts just append hash entries to jdt_unsorted, which
+	 * is only sorted (in parallel, if it is large) and merged into jdt_run
+	 * when something needs the keys in order, like an iterator or a digest;
+	 * keys inserted in order go straight onto the end of jdt_run */
+	typedef std::vector<const journal_dtable_hash::value_type *> journal_dtable_run;
+	
+	enum ordered_index { AVL_INDEX, BTREE_INDEX, SKIPLIST_INDEX, DEFERRED_INDEX };
+	
+	/* add a new hash entry to whichever ordered index is in use; this fails
+	 * only if the arena used by the B+tree and skiplist runs out of memory */
+	int add_index(const journal_dtable_hash::value_type * entry, bool append);
+	void clear_index();
+	/* merge jdt_unsorted into jdt_run */
+	void sort_run() const;
+	/* the index in jdt_run of the first entry not less than the key, or for
+	 * which the test is not negative; call sort_run() first */
+	size_t run_lower_bound(const dtype & key) const;
+	size_t run_lower_bound(const dtype_test & test) const;
 	
 	bool initialized;
+	ordered_index index_type;
+	/* the tree and skiplist nodes, which are all freed at once when the index
+	 * is cleared; it must come before them so it outlives them */
+	arena jdt_arena;
 	journal_dtable_map jdt_map;
+	journal_dtable_tree jdt_tree;
+	journal_dtable_skiplist jdt_skip;
+	std::vector<const blob *> jdt_retired;
+	mutable journal_dtable_run jdt_run, jdt_unsorted;
+	/* changes whenever sort_run() moves entries around in jdt_run */
+	mutable uint32_t run_version;
 	journal_dtable_hash jdt_hash;
 	
 private:
@@ -106,6 +155,89 @@ private:
 		journal_dtable_map::const_iterator jit;
 	};
 	
+	class tree_iter : public iter_source<journal_dtable>
+	{
+	public:
+		virtual bool valid() const;
+		virtual bool next();
+		virtual bool prev();
+		virtual bool first();
+		virtual bool last();
+		virtual dtype key() const;
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		virtual metablob meta() const;
+		virtual blob value() const;
+		virtual const dtable * source() const;
+		inline tree_iter(const journal_dtable * source) : iter_source<journal_dtable>(source) { first(); }
+		virtual ~tree_iter() {}
+	private:
+		/* inserts invalidate tit, so we find our place again by key */
+		void sync() const;
+		/* set entry from tit */
+		inline bool found()
+		{
+			entry = (tit != dt_source->jdt_tree.end()) ? tit.value() : NULL;
+			return entry != NULL;
+		}
+		mutable journal_dtable_tree::const_iterator tit;
+		mutable uint32_t version;
+		/* NULL at the end */
+		const journal_dtable_hash::value_type * entry;
+	};
+	
+	class skip_iter : public iter_source<journal_dtable>
+	{
+	public:
+		virtual bool valid() const;
+		virtual bool next();
+		virtual bool prev();
+		virtual bool first();
+		virtual bool last();
+		virtual dtype key() const;
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		virtual metablob meta() const;
+		virtual blob value() const;
+		virtual const dtable * source() const;
+		inline skip_iter(const journal_dtable * source) : iter_source<journal_dtable>(source), sit(source->jdt_skip.begin()) {}
+		virtual ~skip_iter() {}
+	private:
+		journal_dtable_skiplist::const_iterator sit;
+	};
+	
+	class run_iter : public iter_source<journal_dtable>
+	{
+	public:
+		virtual bool valid() const;
+		virtual bool next();
+		virtual bool prev();
+		virtual bool first();
+		virtual bool last();
+		virtual dtype key() const;
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		virtual metablob meta() const;
+		virtual blob value() const;
+		virtual const dtable * source() const;
+		inline run_iter(const journal_dtable * source) : iter_source<journal_dtable>(source) { first(); }
+		virtual ~run_iter() {}
+	private:
+		/* sort any new entries, and find our place again if that moved it */
+		void sync();
+		/* set entry from position */
+		inline bool found()
+		{
+			const journal_dtable_run & run = dt_source->jdt_run;
+			entry = (position < run.size()) ? run[position] : NULL;
+			return entry != NULL;
+		}
+		size_t position;
+		uint32_t version;
+		/* NULL at the end, even if entries are added after position */
+		const journal_dtable_hash::value_type * entry;
+	};
+	
 	int log_blob_cmp();
 	template<class T> inline int log(T * entry, const blob & blob, size_t offset = 0);
 	int set_node(const dtype & key, const blob & value, bool append);
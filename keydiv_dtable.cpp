@@ -10,6 +10,7 @@
 #include "openat.h"
 
 #include "util.h"
+#include "blob_buffer.h"
 #include "keydiv_dtable.h"
 
 keydiv_dtable::iter::iter(const keydiv_dtable * source, ATX_DEF)
@@ -163,6 +164,50 @@ const dtable * keydiv_dtable::iter::source() const
 	return dt_source;
 }
 
+bool keydiv_dtable::iter::seek_index(size_t index)
+{
+	size_t count = dt_source->sub.size();
+	size_t target_index = 0;
+	for(; target_index < count; target_index++)
+	{
+		size_t size = dt_source->sub[target_index]->size();
+		if(size == (size_t) -1)
+			return false;
+		if(index < size)
+			break;
+		index -= size;
+	}
+	/* the other iterators will need to be moved to their first or last
+	 * elements before they are used again; see next() and prev() */
+	for(size_t i = 0; i < count; i++)
+		subs[i].at_first = subs[i].at_end = false;
+	current_index = target_index;
+	if(current_index == count)
+		/* seek to the end, like other dtables do */
+		return !index;
+	return subs[current_index].iter->seek_index(index);
+}
+
+size_t keydiv_dtable::iter::get_index() const
+{
+	size_t index = 0;
+	for(size_t i = 0; i < current_index; i++)
+	{
+		size_t size = dt_source->sub[i]->size();
+		if(size == (size_t) -1)
+			return size;
+		index += size;
+	}
+	if(current_index < dt_source->sub.size())
+	{
+		size_t sub_index = subs[current_index].iter->get_index();
+		if(sub_index == (size_t) -1)
+			return sub_index;
+		index += sub_index;
+	}
+	return index;
+}
+
 dtable::iter * keydiv_dtable::iterator(ATX_DEF) const
 {
 	if(atx != NO_ABORTABLE_TX)
@@ -203,6 +248,49 @@ blob keydiv_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return sub[index]->lookup(key, found, atx);
 }
 
+void keydiv_dtable::lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	std::vector<std::vector<size_t> > groups(sub.size());
+	std::vector<dtype> batch;
+	std::vector<blob> batch_values;
+	bool * batch_found = new bool[count];
+	/* group the keys by partition, keeping their order within each one,
+	 * so each underlying dtable gets a single batch */
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t index = key_index(keys[i]);
+		assert(index < sub.size());
+		groups[index].push_back(i);
+	}
+	for(size_t index = 0; index < sub.size(); index++)
+	{
+		const std::vector<size_t> & group = groups[index];
+		abortable_tx sub_atx = atx;
+		if(group.empty())
+			continue;
+		if(sub_atx != NO_ABORTABLE_TX && map_atx(&sub_atx, index) < 0)
+		{
+			for(size_t i = 0; i < group.size(); i++)
+			{
+				values[group[i]] = blob();
+				found[group[i]] = false;
+			}
+			continue;
+		}
+		batch.clear();
+		for(size_t i = 0; i < group.size(); i++)
+			batch.push_back(keys[group[i]]);
+		batch_values.resize(group.size());
+		sub[index]->lookup_many(&batch[0], group.size(), &batch_values[0], batch_found, sub_atx);
+		for(size_t i = 0; i < group.size(); i++)
+		{
+			values[group[i]] = batch_values[i];
+			found[group[i]] = batch_found[i];
+		}
+	}
+	delete[] batch_found;
+}
+
 int keydiv_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
 	size_t index = key_index(key);
@@ -386,19 +474,58 @@ int keydiv_dtable::maintain(bool force)
 	return r;
 }
 
+size_t keydiv_dtable::size() const
+{
+	size_t total = 0;
+	for(size_t i = 0; i < sub.size(); i++)
+	{
+		size_t size = sub[i]->size();
+		if(size == (size_t) -1)
+			return size;
+		total += size;
+	}
+	return total;
+}
+
+bool keydiv_dtable::key_bounds(dtype * min, dtype * max) const
+{
+	bool known = false;
+	for(size_t i = 0; i < sub.size(); i++)
+	{
+		dtype sub_min(0u), sub_max(0u);
+		if(sub[i]->key_bounds(&sub_min, &sub_max))
+		{
+			/* the underlying dtables are in key order */
+			if(!known)
+				*min = sub_min;
+			*max = sub_max;
+			known = true;
+		}
+		else if(sub[i]->size())
+			/* not known to be empty, so its keys could be anywhere in its range */
+			return false;
+	}
+	return known;
+}
+
 int keydiv_dtable::init(int dfd, const char * name, const params & config, sys_journal * sysj)
 {
-	abortable_tx atx;
-	int r, kdd_dfd, meta;
 	const dtable_factory * base;
 	params base_config;
-	if(sub.size() >= 0)
-		deinit();
 	base = dtable_factory::lookup(config, "base");
 	if(!base)
 		return -EINVAL;
 	if(!config.get("base_config", &base_config, params()))
 		return -EINVAL;
+	return init(dfd, name, base, base_config, sysj, &config);
+}
+
+int keydiv_dtable::init(int dfd, const char * name, const dtable_factory * base, const params & base_config, sys_journal * sysj, const params * config)
+{
+	abortable_tx atx;
+	int r, kdd_dfd, meta;
+	if(sub.size() >= 0)
+		deinit();
 	kdd_dfd = openat(dfd, name, O_RDONLY);
 	if(kdd_dfd < 0)
 		return kdd_dfd;
@@ -407,36 +534,38 @@ int keydiv_dtable::init(int dfd, const char * name, const params & config, sys_j
 		goto fail_meta;
 	
 	if(pread(meta, &header, sizeof(header), 0) != sizeof(header))
-	{
-		close(meta);
-		goto fail_meta;
-	}
-	close(meta);
-	if(header.magic != KDDTABLE_MAGIC || header.version != KDDTABLE_VERSION)
-		goto fail_meta;
-	if(!header.dt_count)
-		goto fail_meta;
+		goto fail_header;
+	if(header.magic != KDDTABLE_MAGIC || !header.dt_count)
+		goto fail_header;
+	if(header.version == KDDTABLE_VERSION_STORED)
+		/* ignore any dividers in the config; they are read below */
+		config = NULL;
+	else if(header.version != KDDTABLE_VERSION || !config)
+		goto fail_header;
 	switch(header.key_type)
 	{
 		case 1:
 			ktype = dtype::UINT32;
-			r = load_dividers<int, uint32_t>(config, header.dt_count, &dividers);
+			r = config ? load_dividers<int, uint32_t>(*config, header.dt_count, &dividers) : 0;
 			break;
 		case 2:
 			ktype = dtype::DOUBLE;
-			r = load_dividers<float, double>(config, header.dt_count, &dividers);
+			r = config ? load_dividers<float, double>(*config, header.dt_count, &dividers) : 0;
 			break;
 		case 3:
 			ktype = dtype::STRING;
-			r = load_dividers<istr, istr>(config, header.dt_count, &dividers);
+			r = config ? load_dividers<istr, istr>(*config, header.dt_count, &dividers) : 0;
 			break;
 		case 4:
 			ktype = dtype::BLOB;
-			r = load_dividers<blob, blob>(config, header.dt_count, &dividers, true);
+			r = config ? load_dividers<blob, blob>(*config, header.dt_count, &dividers, true) : 0;
 			break;
 		default:
-			goto fail_meta;
+			goto fail_header;
 	}
+	if(r >= 0 && !config)
+		r = read_dividers(meta, header.dt_count, ktype, &dividers);
+	close(meta);
 	if(r < 0)
 		goto fail_meta;
 	
@@ -461,6 +590,8 @@ int keydiv_dtable::init(int dfd, const char * name, const params & config, sys_j
 	
 	return 0;
 	
+fail_header:
+	close(meta);
 fail_sub:
 	for(size_t i = 0; i < sub.size(); i++)
 		sub[i]->destroy();
@@ -525,6 +656,38 @@ int keydiv_dtable::load_dividers(const params & config, size_t dt_count, divider
 	return 0;
 }
 
+/* reads the dividers stored after the header by create_dir() */
+int keydiv_dtable::read_dividers(int meta, size_t dt_count, dtype::ctype key_type, divider_list * list)
+{
+	off_t offset = sizeof(kddtable_header);
+	list->clear();
+	for(size_t i = 1; i < dt_count; i++)
+	{
+		uint32_t length;
+		void * data;
+		if(pread(meta, &length, sizeof(length), offset) != sizeof(length))
+			return -1;
+		offset += sizeof(length);
+		if(key_type == dtype::UINT32 && length != sizeof(uint32_t))
+			return -EINVAL;
+		if(key_type == dtype::DOUBLE && length != sizeof(double))
+			return -EINVAL;
+		/* avoid malloc(0) for empty strings */
+		data = malloc(length + 1);
+		if(!data)
+			return -ENOMEM;
+		if(pread(meta, data, length, offset) != (ssize_t) length)
+		{
+			free(data);
+			return -1;
+		}
+		offset += length;
+		list->push_back(dtype(blob(length, data), key_type));
+		free(data);
+	}
+	return 0;
+}
+
 /* The dividers are inclusive up: that is, if we have a keydiv dtable with a
  * single divider X, then sub[0] will contain all keys up to but not including
  * X, and sub[1] will contain X and up. This is mostly an arbitrary choice. */
@@ -633,4 +796,71 @@ fail:
 	return (r < 0) ? r : -1;
 }
 
+int keydiv_dtable::create_dir(int dfd, const char * name, dtype::ctype key_type, const std::vector<dtype> & dividers)
+{
+	int r, kdd_dfd, meta;
+	blob_buffer stored;
+	
+	kddtable_header header;
+	header.magic = KDDTABLE_MAGIC;
+	header.version = KDDTABLE_VERSION_STORED;
+	switch(key_type)
+	{
+		case dtype::UINT32:
+			header.key_type = 1;
+			break;
+		case dtype::DOUBLE:
+			header.key_type = 2;
+			break;
+		case dtype::STRING:
+			header.key_type = 3;
+			break;
+		case dtype::BLOB:
+			header.key_type = 4;
+			break;
+		default:
+			return -EINVAL;
+	}
+	header.dt_count = dividers.size() + 1;
+	/* make sure we don't overflow the header field */
+	if(header.dt_count != dividers.size() + 1)
+		return -EINVAL;
+	
+	stored.append(&header, sizeof(header));
+	for(size_t i = 0; i < dividers.size(); i++)
+	{
+		blob flat = dividers[i].flatten();
+		assert(dividers[i].type == key_type);
+		stored << (uint32_t) flat.size();
+		stored.append(flat);
+	}
+	
+	r = mkdirat(dfd, name, 0755);
+	if(r < 0)
+		return r;
+	kdd_dfd = openat(dfd, name, O_RDONLY);
+	if(kdd_dfd < 0)
+	{
+		unlinkat(dfd, name, AT_REMOVEDIR);
+		return kdd_dfd;
+	}
+	
+	meta = openat(kdd_dfd, "kdd_meta", O_WRONLY | O_CREAT, 0644);
+	if(meta < 0)
+	{
+		r = meta;
+		goto fail;
+	}
+	r = pwrite(meta, stored.data(), stored.size(), 0);
+	close(meta);
+	if(r != (int) stored.size())
+		goto fail;
+	return kdd_dfd;
+	
+fail:
+	close(kdd_dfd);
+	util::rm_r(dfd, name);
+	return (r < 0) ? r : -1;
+}
+
 DEFINE_RW_FACTORY(keydiv_dtable);
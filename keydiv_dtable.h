@@ -22,8 +22,13 @@
  * allows them to be maintained separately, although currently the maintain()
  * method for keydiv dtable just calls maintain() on all of them together. */
 
+/* Normally the dividers come from the configuration parameters. Keydiv dtables
+ * created with create_dir() instead store them in kdd_meta, after the header,
+ * as a 32-bit length followed by the flattened divider for each one. */
+
 #define KDDTABLE_MAGIC 0x11720081
 #define KDDTABLE_VERSION 1
+#define KDDTABLE_VERSION_STORED 2
 
 class keydiv_dtable : public dtable
 {
@@ -31,6 +36,7 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	
 	inline virtual bool writable() const { return sub[0]->writable(); }
 	
@@ -48,11 +54,28 @@ public:
 	
 	virtual int set_blob_cmp(const blob_comparator * cmp);
 	
+	/* only works when all the underlying dtables support it */
+	virtual size_t size() const;
+	virtual bool key_bounds(dtype * min, dtype * max) const;
+	
 	static int create(int dfd, const char * name, const params & config, dtype::ctype key_type);
 	DECLARE_RW_FACTORY(keydiv_dtable);
 	
+	/* Creates the directory and metadata for a keydiv dtable with the given
+	 * dividers stored on disk, but not the underlying dtables themselves: the
+	 * caller must create each one (named by sub_name()) in the returned
+	 * directory file descriptor, and then close it. This allows the caller
+	 * to fill them from existing data, e.g. in parallel. */
+	static int create_dir(int dfd, const char * name, dtype::ctype key_type, const std::vector<dtype> & dividers);
+	static inline void sub_name(char * name, uint32_t index)
+	{
+		sprintf(name, "kdd_data.%u", index);
+	}
+	
 	inline keydiv_dtable() : support_atx(false) {}
 	int init(int dfd, const char * name, const params & config, sys_journal * sysj);
+	/* config is only needed for the dividers when they are not stored on disk */
+	int init(int dfd, const char * name, const dtable_factory * base, const params & base_config, sys_journal * sysj, const params * config = NULL);
 	
 protected:
 	void deinit();
@@ -85,6 +108,8 @@ private:
 		virtual metablob meta() const;
 		virtual blob value() const;
 		virtual const dtable * source() const;
+		virtual bool seek_index(size_t index);
+		virtual size_t get_index() const;
 		inline iter(const keydiv_dtable * source, ATX_REQ);
 		virtual ~iter();
 		
@@ -123,6 +148,7 @@ private:
 	
 	template<class T, class C>
 	static int load_dividers(const params & config, size_t dt_count, divider_list * list, bool skip_check = false);
+	static int read_dividers(int meta, size_t dt_count, dtype::ctype key_type, divider_list * list);
 	
 	/* return index into sub array */
 	inline size_t key_index(const dtype & key) const
@@ -4,6 +4,7 @@
 #ifndef __LOCKING_H
 #define __LOCKING_H
 
+#include <time.h>
 #include <assert.h>
 #include <pthread.h>
 
@@ -87,6 +88,12 @@ public:
 		pthread_cond_wait(&cond, &lock.mutex);
 	}
 	
+	/* returns ETIMEDOUT if the (absolute, CLOCK_REALTIME) time passes first */
+	inline int timedwait(init_mutex & lock, const struct timespec * abstime)
+	{
+		return pthread_cond_timedwait(&cond, &lock.mutex, abstime);
+	}
+	
 	inline void signal()
 	{
 		pthread_cond_signal(&cond);
@@ -103,6 +110,42 @@ private:
 	init_cond(const init_cond &);
 };
 
+/* a simple wrapper class to handle initializing a reader/writer lock */
+
+class init_rwlock
+{
+public:
+	inline init_rwlock()
+	{
+		pthread_rwlock_init(&rwlock, NULL);
+	}
+	
+	inline ~init_rwlock()
+	{
+		pthread_rwlock_destroy(&rwlock);
+	}
+	
+	inline void rdlock()
+	{
+		pthread_rwlock_rdlock(&rwlock);
+	}
+	
+	inline void wrlock()
+	{
+		pthread_rwlock_wrlock(&rwlock);
+	}
+	
+	inline void unlock()
+	{
+		pthread_rwlock_unlock(&rwlock);
+	}
+	
+private:
+	pthread_rwlock_t rwlock;
+	void operator=(const init_rwlock &);
+	init_rwlock(const init_rwlock &);
+};
+
 /* a simple wrapper class to handle unlocking a mutex when exiting a
  * scope, and also shorten condition variable code using that mutex */
 
@@ -142,6 +185,12 @@ public:
 		cond.wait(*mutex);
 	}
 	
+	inline int timedwait(init_cond & cond, const struct timespec * abstime)
+	{
+		assert(locked);
+		return cond.timedwait(*mutex, abstime);
+	}
+	
 	inline void signal(init_cond & cond)
 	{
 		assert(locked);
@@ -161,4 +210,29 @@ private:
 	scopelock(const scopelock &);
 };
 
+/* like scopelock, but for reader/writer locks */
+
+class scoperwlock
+{
+public:
+	inline scoperwlock(init_rwlock & lock, bool write)
+		: rwlock(&lock)
+	{
+		if(write)
+			rwlock->wrlock();
+		else
+			rwlock->rdlock();
+	}
+	
+	inline ~scoperwlock()
+	{
+		rwlock->unlock();
+	}
+	
+private:
+	init_rwlock * rwlock;
+	void operator=(const scoperwlock &);
+	scoperwlock(const scoperwlock &);
+};
+
 #endif /* __LOCKING_H */
@@ -3,17 +3,27 @@
 
 #define _ATFILE_SOURCE
 
+#include <fcntl.h>
+#include <dirent.h>
 #include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "main.h"
 #include "openat.h"
 #include "transaction.h"
 
 #include "util.h"
+#include "crc32c.h"
+#include "bg_pool.h"
+#include "journal.h"
 #include "sys_journal.h"
 #include "journal_dtable.h"
 #include "simple_dtable.h"
+#include "bloom_dtable.h"
+#include "cache_dtable.h"
 #include "managed_dtable.h"
+#include "combine_policy.h"
 #include "usstate_dtable.h"
 #include "memory_dtable.h"
 #include "simple_stable.h"
@@ -25,58 +35,67 @@ int command_info(int argc, const char * argv[])
 	return 0;
 }
 
-int command_dtable(int argc, const char * argv[])
+/* looks up the keys with lookup_many() and one at a time, and returns the
+ * number of keys for which they disagree; found is only compared if asked */
+static size_t lookup_many_check(const dtable * dt, const std::vector<dtype> & keys, bool check_found = true)
+{
+	size_t wrong = 0;
+	blob * values = new blob[keys.size()];
+	bool * found = new bool[keys.size()];
+	dt->lookup_many(&keys[0], keys.size(), values, found);
+	for(size_t i = 0; i < keys.size(); i++)
+	{
+		bool one_found;
+		blob value = dt->lookup(keys[i], &one_found);
+		if((check_found && found[i] != one_found) || values[i].compare(value))
+			wrong++;
+	}
+	delete[] found;
+	delete[] values;
+	return wrong;
+}
+
+#define BLOOM_TEST_KEYS 4000
+
+/* digests keys into a bloom dtable with the given filter version and k, then
+ * reopens it and checks that the filter lets through every key it has */
+static void bloom_test(const char * path, int version, int k)
 {
 	int r;
+	size_t missing = 0, wrong = 0;
 	managed_dtable * mdt;
 	sys_journal * sysj = sys_journal::get_global_journal();
-	const char * path;
-	params config;
+	params config, base_config;
+	std::vector<dtype> keys;
+	bool * present;
+	bool * found;
 	
-	if(argc > 1)
-		path = argv[1];
-	else
-		path = "msdt_test";
-	if(argc > 2)
-		config.set("base", argv[2]);
-	else
-		config.set_class("base", simple_dtable);
+	base_config.set_class("base", simple_dtable);
+	base_config.set("bloom_k", k);
+	base_config.set("bloom_version", version);
+	config.set_class("base", bloom_dtable);
+	config.set("base_config", base_config);
 	
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
 	r = managed_dtable::create(AT_FDCWD, path, config, dtype::UINT32);
 	EXPECT_NOFAIL_FORMAT("dtable::create(%s)", r, path);
-	if(r < 0)
-	{
-		tx_end(0);
-		return r;
-	}
-	r = tx_end(0);
-	EXPECT_NOFAIL("tx_end", r);
-	
-	mdt = new managed_dtable;
-	r = mdt->init(AT_FDCWD, path, config, sysj);
-	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
-	r = tx_start();
-	EXPECT_NOFAIL("tx_start", r);
-	r = mdt->insert(6u, blob("hello"));
-	EXPECT_NOFAIL("mdt->insert", r);
-	r = mdt->insert(4u, blob("world"));
-	EXPECT_NOFAIL("mdt->insert", r);
-	run_iterator(mdt);
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
-	mdt->destroy();
 	
 	mdt = new managed_dtable;
 	r = mdt->init(AT_FDCWD, path, config, sysj);
 	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
-	run_iterator(mdt);
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < BLOOM_TEST_KEYS; i++)
+	{
+		uint32_t key = i * 3;
+		r = mdt->insert(key, blob(sizeof(key), &key));
+		EXPECT_NOFAIL_SILENT_BREAK("mdt->insert", r);
+	}
 	r = mdt->digest();
 	EXPECT_NOFAIL("mdt->digest", r);
-	run_iterator(mdt);
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
 	mdt->destroy();
@@ -84,279 +103,1047 @@ int command_dtable(int argc, const char * argv[])
 	mdt = new managed_dtable;
 	r = mdt->init(AT_FDCWD, path, config, sysj);
 	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
-	run_iterator(mdt);
-	r = tx_start();
-	EXPECT_NOFAIL("tx_start", r);
-	r = mdt->insert(8u, blob("icanhas"));
-	EXPECT_NOFAIL("mdt->insert", r);
-	r = mdt->insert(2u, blob("cheezburger"));
-	EXPECT_NOFAIL("mdt->insert", r);
-	run_iterator(mdt);
-	r = mdt->digest();
-	EXPECT_NOFAIL("mdt->digest", r);
-	run_iterator(mdt);
-	r = tx_end(0);
-	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("disk dtables", 1, mdt->disk_dtables());
+	/* every key must get through the filter, in lookups and in batches */
+	for(uint32_t key = 0; key < BLOOM_TEST_KEYS * 3; key++)
+	{
+		blob value = mdt->find(key);
+		if(!(key % 3) && value.size() != sizeof(key))
+			missing++;
+		else if((key % 3) && value.exists())
+			wrong++;
+		keys.push_back(dtype(key));
+	}
+	present = new bool[keys.size()];
+	found = new bool[keys.size()];
+	mdt->present_many(&keys[0], keys.size(), present, found);
+	for(size_t i = 0; i < keys.size(); i++)
+		if(present[i] != !(keys[i].u32 % 3))
+		{
+			if(present[i])
+				wrong++;
+			else
+				missing++;
+		}
+	delete[] found;
+	delete[] present;
+	EXPECT_SIZET("false negatives", 0, missing);
+	EXPECT_SIZET("wrong lookups", 0, wrong);
+	EXPECT_SIZET("wrong batch lookups", 0, lookup_many_check(mdt, keys));
 	mdt->destroy();
+}
+
+#define CACHE_BATCH_KEYS 3000
+
+/* batch lookups through a small cache must agree with single lookups, both
+ * when the keys miss and when some of them are cached already */
+static void cache_batch_test(const char * path, const char * policy)
+{
+	int r;
+	dtable * dt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	params config, base_config;
+	std::vector<dtype> keys;
+	
+	printf("cache batch test (%s)\n", policy);
+	base_config.set_class("base", simple_dtable);
+	config.set_class("base", managed_dtable);
+	config.set("base_config", base_config);
+	config.set("cache_size", 500);
+	config.set("cache_shards", 4);
+	config.set("cache_policy", policy);
 	
-	mdt = new managed_dtable;
-	r = mdt->init(AT_FDCWD, path, config, sysj);
-	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
-	run_iterator(mdt);
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
-	r = mdt->combine();
-	EXPECT_NOFAIL("mdt->combine", r);
-	run_iterator(mdt);
+	r = dtable_factory::setup("cache_dtable", AT_FDCWD, path, config, dtype::UINT32);
+	EXPECT_NOFAIL_FORMAT("dtable::create(%s)", r, path);
+	dt = dtable_factory::load("cache_dtable", AT_FDCWD, path, config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	for(uint32_t key = 0; key < CACHE_BATCH_KEYS; key += 2)
+	{
+		r = dt->insert(key, blob(sizeof(key), &key));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+	}
+	for(uint32_t key = 0; key < CACHE_BATCH_KEYS; key += 10)
+	{
+		r = dt->remove(key);
+		EXPECT_NOFAIL_SILENT_BREAK("remove", r);
+	}
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
-	mdt->destroy();
 	
-	mdt = new managed_dtable;
-	r = mdt->init(AT_FDCWD, path, config, sysj);
-	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
-	run_iterator(mdt);
-	mdt->destroy();
-	
-	return 0;
+	/* scattered keys, some repeated within the batch */
+	for(uint32_t i = 0; i < CACHE_BATCH_KEYS; i++)
+		keys.push_back(dtype((uint32_t) ((i * 7919ull) % (CACHE_BATCH_KEYS + 100))));
+	for(uint32_t i = 0; i < 200; i++)
+		keys.push_back(dtype(i * 3));
+	/* remove() caches removed keys as not found, while the base has
+	 * nonexistent entries for them, so only the values can be compared */
+	EXPECT_SIZET("wrong batch lookups", 0, lookup_many_check(dt, keys, false));
+	EXPECT_SIZET("wrong cached batch lookups", 0, lookup_many_check(dt, keys, false));
+	dt->destroy();
 }
 
-int command_edtable(int argc, const char * argv[])
+#define CACHE_POLICY_KEYS 100
+#define CACHE_POLICY_BIG_KEY 1000u
+#define CACHE_POLICY_BIG 100
+
+/* counts a lookup through the cache that doesn't return the expected value:
+ * the key itself, or CACHE_POLICY_BIG bytes for big values */
+static size_t cache_policy_wrong(const dtable * dt, uint32_t key, bool big = false)
 {
-	sys_journal * sysj = sys_journal::get_global_journal();
-	const size_t size = 10000;
-	const size_t ops = size * 3;
-	params config;
-	dtable * dt;
+	blob value = dt->find(key);
+	if(big)
+		return value.size() != CACHE_POLICY_BIG;
+	return value.size() != sizeof(key) || value.index<uint32_t>(0) != key;
+}
+
+/* runs the same lookups through a four entry cache with each replacement
+ * policy and checks its hit, miss, and eviction counts, then checks that a
+ * scan of new keys only flushes the keys looked up twice with 2q, that values
+ * over cache_max_entry are never admitted, and that a cached key whose new
+ * value is too large is dropped from the cache (uncache()) */
+static void cache_policy_test(const char * policy, size_t hits, size_t misses, size_t evictions, size_t rehits)
+{
+	static const uint32_t sequence[] = {0, 1, 2, 3, 0, 4, 0, 1};
 	int r;
-	
-	/* TODO: It might be nice to have a dne_dtable that can only store
-	 * nonexistent values. It's not clear that it could support rejection
-	 * though, since the replacements would have to be nonexistent. Even so
-	 * it would work for the dnebase of an exist_dtable. */
-	r = params::parse(LITERAL(
-	config [
-		"base" class(dt) exist_dtable
-		"base_config" config [
-			"base" class(dt) simple_dtable
-			"dnebase" class(dt) simple_dtable
-		]
-		"digest_interval" int 240
-		"combine_interval" int 1920
-		"combine_count" int 10
-		"autocombine" bool false
-	]), &config);
-	EXPECT_NOFAIL("params::parse", r);
-	config.print();
-	printf("\n");
+	dtable * dt;
+	cache_dtable * cdt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	params config, base_config;
+	uint8_t big[CACHE_POLICY_BIG] = {0};
+	size_t wrong = 0, before;
+	char path[32];
+	
+	printf("cache policy test (%s)\n", policy);
+	snprintf(path, sizeof(path), "cpol_test_%s", policy);
+	base_config.set_class("base", simple_dtable);
+	config.set_class("base", managed_dtable);
+	config.set("base_config", base_config);
+	config.set("cache_size", 4);
+	config.set("cache_shards", 1);
+	config.set("cache_max_entry", CACHE_POLICY_BIG / 2);
+	config.set("cache_policy", policy);
 	
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
-	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "exst_test", config, dtype::UINT32);
-	EXPECT_NOFAIL("dtable::create", r);
-	dt = dtable_factory::load("managed_dtable", AT_FDCWD, "exst_test", config, sysj);
+	r = dtable_factory::setup("cache_dtable", AT_FDCWD, path, config, dtype::UINT32);
+	EXPECT_NOFAIL_FORMAT("dtable::create(%s)", r, path);
+	dt = dtable_factory::load("cache_dtable", AT_FDCWD, path, config, sysj);
 	EXPECT_NONULL("dtable_factory::load", dt);
-	
-	printf("Populating exist_dtable... ");
-	fflush(stdout);
-	for(size_t i = 0; i < ops; i++)
+	for(uint32_t key = 0; key < CACHE_POLICY_KEYS; key++)
 	{
-		uint32_t key = rand() % size;
-		bool insert = !(rand() & 1);
-		if(insert)
-			r = dt->insert(key, blob(sizeof(key), &key));
-		else
-			r = dt->remove(key);
-		EXPECT_NOFAIL_SILENT_BREAK("insert/remove", r);
-		if(i == ops / 2 || (i > ops / 2 && !(i % (ops / 10))))
-		{
-			r = dt->maintain(true);
-			EXPECT_NOFAIL_SILENT_BREAK("maintain", r);
-		}
+		r = dt->insert(key, blob(sizeof(key), &key));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
 	}
-	r = dt->maintain(true);
-	if(r < 0)
-		EXPECT_NEVER("maintain failure");
-	else
-	printf("done.\n");
-	
+	r = dt->insert(CACHE_POLICY_BIG_KEY, blob(sizeof(big), big));
+	EXPECT_NOFAIL("insert big", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	/* start again with an empty cache, since inserts fill it */
 	dt->destroy();
-	
+	dt = dtable_factory::load("cache_dtable", AT_FDCWD, path, config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	cdt = (cache_dtable *) dt;
+	
+	for(size_t i = 0; i < sizeof(sequence) / sizeof(sequence[0]); i++)
+		wrong += cache_policy_wrong(cdt, sequence[i]);
+	EXPECT_SIZET("hits", hits, cdt->cache_hits());
+	EXPECT_SIZET("misses", misses, cdt->cache_misses());
+	EXPECT_SIZET("evictions", evictions, cdt->cache_evictions());
+	
+	/* a scan of new keys, and then the keys looked up again above */
+	for(uint32_t key = 5; key < 13; key++)
+		wrong += cache_policy_wrong(cdt, key);
+	before = cdt->cache_hits();
+	wrong += cache_policy_wrong(cdt, 0);
+	wrong += cache_policy_wrong(cdt, 1);
+	EXPECT_SIZET("hits after scan", rehits, cdt->cache_hits() - before);
+	
+	/* admission control */
+	before = cdt->cache_misses();
+	wrong += cache_policy_wrong(cdt, CACHE_POLICY_BIG_KEY, true);
+	wrong += cache_policy_wrong(cdt, CACHE_POLICY_BIG_KEY, true);
+	EXPECT_SIZET("big misses", 2, cdt->cache_misses() - before);
+	
+	/* a cached key that gets a value too large to cache is uncached */
+	wrong += cache_policy_wrong(cdt, 50);
+	before = cdt->cache_hits();
+	wrong += cache_policy_wrong(cdt, 50);
+	EXPECT_SIZET("cached hits", 1, cdt->cache_hits() - before);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dt->insert(50u, blob(sizeof(big), big));
+	EXPECT_NOFAIL("insert big", r);
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
-	
-	for(size_t i = 0; i <= 5; i++)
+	before = cdt->cache_misses();
+	wrong += cache_policy_wrong(cdt, 50, true);
+	EXPECT_SIZET("uncached misses", 1, cdt->cache_misses() - before);
+	/* while a small new value replaces the cached one */
+	wrong += cache_policy_wrong(cdt, 60);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dt->insert(60u, blob(sizeof(big) / 4, big));
+	EXPECT_NOFAIL("insert", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	before = cdt->cache_hits();
+	if(dt->find(60u).size() != sizeof(big) / 4)
+		wrong++;
+	EXPECT_SIZET("updated hits", 1, cdt->cache_hits() - before);
+	EXPECT_SIZET("wrong values", 0, wrong);
+	dt->destroy();
+}
+
+/* asks the policy which generations of the given sizes to combine, returning
+ * the chosen range as first * 100 + last, or -1 if it chooses none */
+static int policy_choice(const combine_policy * policy, const size_t * sizes, size_t count, size_t lookups = 0, size_t probed = 0, bool disjoint = false)
+{
+	size_t first, last;
+	combine_policy::generation_list gens(count);
+	combine_policy::read_stats reads;
+	for(size_t i = 0; i < count; i++)
 	{
-		bool ok;
-		char path[32];
-		istr base, dnebase;
-		dtable::iter * iter;
-		params exist_config, base_config, dnebase_config;
-		
-		ok = config.get("base_config", &exist_config);
-		assert(ok);
-		ok = exist_config.get("base", &base);
-		assert(ok);
-		ok = exist_config.get("dnebase", &dnebase);
-		assert(ok);
-		ok = exist_config.get("base_config", &base_config);
-		assert(ok);
-		ok = exist_config.get("dnebase_config", &dnebase_config);
-		assert(ok);
-		
-		sprintf(path, "exst_test/md_data.%zu/base", i);
-		dt = dtable_factory::load(base, AT_FDCWD, path, base_config, sysj);
-		EXPECT_NONULL("dtable_factory::load", dt);
-		iter = dt->iterator();
-		EXPECT_NONULL("iterator", iter);
-		if(!iter->valid())
-			EXPECT_NEVER("no values in base");
-		while(iter->valid())
-		{
-			if(!iter->value().exists())
-			{
-				EXPECT_NEVER("nonexistent value in base");
-				break;
-			}
-			iter->next();
-		}
-		delete iter;
-		dt->destroy();
-		
-		sprintf(path, "exst_test/md_data.%zu/dnebase", i);
-		dt = dtable_factory::load(dnebase, AT_FDCWD, path, dnebase_config, sysj);
-		EXPECT_NONULL("dtable_factory::load", dt);
-		iter = dt->iterator();
-		EXPECT_NONULL("iterator", iter);
-		if(!i && iter->valid())
-			EXPECT_NEVER("values in dnebase[0]");
-		if(i && !iter->valid())
-			EXPECT_NEVER("no values in dnebase");
-		while(iter->valid())
+		gens[i].bytes = sizes[i];
+		gens[i].keys = (size_t) -1;
+		if(disjoint)
 		{
-			if(iter->value().exists())
-			{
-				EXPECT_NEVER("extant value in dnebase");
-				break;
-			}
-			iter->next();
+			/* each generation gets its own range of keys */
+			gens[i].bounded = true;
+			gens[i].min = dtype((uint32_t) (i * 100));
+			gens[i].max = dtype((uint32_t) (i * 100 + 99));
 		}
-		delete iter;
-		dt->destroy();
 	}
+	reads.lookups = lookups;
+	reads.probed = probed;
+	if(policy->choose(gens, reads, NULL, &first, &last) <= 0)
+		return -1;
+	return first * 100 + last;
+}
+
+#define POLICY_CHOICE(policy, expect, sizes, args...) EXPECT_TYPE(#sizes, int, "d", expect, policy_choice(policy, sizes, sizeof(sizes) / sizeof(sizes[0]), ##args))
+
+/* checks which generations each combine policy chooses for some lists of
+ * generation sizes (oldest first) */
+static void policy_test()
+{
+	int r;
+	params config;
+	combine_policy * policy;
 	
-	util::rm_r(AT_FDCWD, "exst_test");
+	/* size-tiered: runs of similar sizes, at least 3 and at most 4 long */
+	r = params::parse(LITERAL(
+	config [
+		"min_merge" int 3
+		"max_merge" int 4
+		"min_bytes" int 1
+		"tier_ratio" float 2
+		"max_probes" float 1.5
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	policy = combine_policy_factory::load("size_tiered_policy", config);
+	EXPECT_NONULL("size_tiered_policy", policy);
+	if(policy)
+	{
+		const size_t tiered[] = {9000, 1000, 1000, 1000, 100, 100};
+		const size_t newest[] = {1000, 1000, 1000, 100, 100, 100};
+		const size_t same[] = {100, 100, 100, 100, 100, 100};
+		const size_t mixed[] = {100, 1000, 100, 1000, 100};
+		const size_t pair[] = {5000, 100, 100};
+		/* the newest run is too short, so the run before it is chosen */
+		POLICY_CHOICE(policy, 103, tiered);
+		/* with two qualifying runs, the newest one is cheaper */
+		POLICY_CHOICE(policy, 305, newest);
+		/* runs stop at max_merge, counting back from the newest */
+		POLICY_CHOICE(policy, 205, same);
+		POLICY_CHOICE(policy, -1, mixed);
+		/* generations known not to overlap are left alone */
+		POLICY_CHOICE(policy, -1, same, 0, 0, true);
+		/* a pair is enough once lookups probe too many generations */
+		POLICY_CHOICE(policy, -1, pair, 2000, 2000);
+		POLICY_CHOICE(policy, 102, pair, 2000, 4000);
+		/* but not before there have been enough lookups to tell */
+		POLICY_CHOICE(policy, -1, pair, 100, 400);
+		delete policy;
+	}
 	
-	return 0;
+	/* leveled: levels 0, 1 and 2 are under 100, 1000 and 10000 bytes */
+	r = params::parse(LITERAL(
+	config [
+		"fanout" int 10
+		"base_bytes" int 100
+		"l0_count" int 3
+		"max_probes" float 1.5
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	policy = combine_policy_factory::load("leveled_policy", config);
+	EXPECT_NONULL("leveled_policy", policy);
+	if(policy)
+	{
+		const size_t into_l1[] = {5000, 500, 50, 50, 50};
+		const size_t no_l1[] = {5000, 50, 50, 50};
+		const size_t ordered[] = {5000, 500, 50, 50};
+		const size_t inverted[] = {500, 5000, 600, 50};
+		const size_t equal[] = {5000, 500, 600, 50};
+		/* a full level 0 goes down into level 1 */
+		POLICY_CHOICE(policy, 104, into_l1);
+		/* or is just combined together if there is no level 1 before it */
+		POLICY_CHOICE(policy, 103, no_l1);
+		POLICY_CHOICE(policy, -1, ordered);
+		/* otherwise, the newest pair out of order */
+		POLICY_CHOICE(policy, 102, equal);
+		POLICY_CHOICE(policy, 1, inverted);
+		POLICY_CHOICE(policy, -1, inverted, 0, 0, true);
+		/* hot lookups lower the level 0 limit to 2 */
+		POLICY_CHOICE(policy, -1, ordered, 2000, 2000);
+		POLICY_CHOICE(policy, 103, ordered, 2000, 4000);
+		delete policy;
+	}
+	
+	config.reset();
+	config.set("fanout", 1);
+	policy = combine_policy_factory::load("leveled_policy", config);
+	EXPECT_TRUE("bad fanout", !policy);
+	if(policy)
+		delete policy;
 }
 
-int command_exdtable(int argc, const char * argv[])
+#define POLICY_TEST_KEYS 600
+
+/* a managed dtable with a combine policy combines when maintain() is called
+ * and the policy chooses to, without waiting for the combine interval */
+static void policy_maintain_test(const char * path)
 {
 	int r;
-	blob fixed("fixed");
-	blob exception("exception");
-	sys_journal * sysj = sys_journal::get_global_journal();
 	managed_dtable * mdt;
+	sys_journal * sysj = sys_journal::get_global_journal();
 	params config;
+	uint32_t key;
+	size_t wrong = 0;
 	
 	r = params::parse(LITERAL(
 	config [
-		"base" class(dt) exception_dtable
-		"base_config" config [
-			"base" class(dt) array_dtable
-			"alt" class(dt) simple_dtable
-			"reject_value" string "_____"
+		"base" class(dt) simple_dtable
+		"combine_policy" string "size_tiered_policy"
+		"combine_policy_config" config [
+			"min_merge" int 3
+			"min_bytes" int 1
 		]
-		"digest_interval" int 2
-		"combine_interval" int 4
-		"combine_count" int 4
+		"digest_interval" int 3600
+		"combine_interval" int 3600
 	]), &config);
 	EXPECT_NOFAIL("params::parse", r);
-	config.print();
-	printf("\n");
 	
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
-	r = managed_dtable::create(AT_FDCWD, "excp_test", config, dtype::UINT32);
-	EXPECT_NOFAIL("dtable::create", r);
+	r = managed_dtable::create(AT_FDCWD, path, config, dtype::UINT32);
+	EXPECT_NOFAIL_FORMAT("dtable::create(%s)", r, path);
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
 	
 	mdt = new managed_dtable;
-	r = mdt->init(AT_FDCWD, "excp_test", config, sysj);
+	r = mdt->init(AT_FDCWD, path, config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	/* three digests of the same size, calling maintain() after each one;
+	 * their keys are interleaved, since the policy leaves alone generations
+	 * whose key ranges do not overlap */
+	for(uint32_t i = 0; i < 3; i++)
+	{
+		r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		for(key = i; key < POLICY_TEST_KEYS; key += 3)
+		{
+			r = mdt->insert(key, blob(sizeof(key), &key));
+			EXPECT_NOFAIL_SILENT_BREAK("mdt->insert", r);
+		}
+		r = mdt->digest();
+		EXPECT_NOFAIL("mdt->digest", r);
+		r = mdt->maintain(false);
+		EXPECT_NOFAIL("mdt->maintain", r);
+		r = tx_end(0);
+		EXPECT_NOFAIL("tx_end", r);
+		/* the third one makes a run long enough to combine */
+		EXPECT_SIZET("disk dtables", (i < 2) ? i + 1 : 1, mdt->disk_dtables());
+	}
+	mdt->destroy();
+	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, path, config, sysj);
 	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	EXPECT_SIZET("disk dtables", 1, mdt->disk_dtables());
+	for(key = 0; key < POLICY_TEST_KEYS; key++)
+	{
+		blob value = mdt->find(key);
+		if(value.size() != sizeof(key) || value.index<uint32_t>(0) != key)
+			wrong++;
+	}
+	EXPECT_SIZET("wrong values", 0, wrong);
+	mdt->destroy();
+}
+
+/* records the order in which it runs, or just counts if order is NULL */
+struct pool_test_job : public bg_pool::job
+{
+	int id;
+	std::vector<int> * order;
+	size_t * count;
+	virtual void run()
+	{
+		if(order)
+			order->push_back(id);
+		else
+		{
+			/* give the other threads a chance to pick up jobs */
+			usleep(1000);
+			__atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+		}
+	}
+	inline pool_test_job() : id(0), order(NULL), count(NULL) {}
+};
+
+/* keeps the pool's thread busy until the gate opens */
+struct pool_block_job : public bg_pool::job
+{
+	bool started, gate;
+	virtual void run()
+	{
+		__atomic_store_n(&started, true, __ATOMIC_RELEASE);
+		while(!__atomic_load_n(&gate, __ATOMIC_ACQUIRE))
+			usleep(1000);
+	}
+	inline pool_block_job() : started(false), gate(false) {}
+};
+
+/* checks that queued jobs run by priority and then in the order submitted,
+ * that a queued job can be cancelled and run by the caller instead, and that
+ * destroying a pool runs what is left in its queue and waits for its threads */
+static void pool_test()
+{
+	static const int priorities[] = {1, 5, 3, 5, 3, 0};
+	/* the order they should run in, leaving out the cancelled one (2) */
+	static const int expect[] = {1, 3, 4, 0, 5};
+	const size_t jobs = sizeof(priorities) / sizeof(priorities[0]);
+	bg_pool * pool = new bg_pool;
+	pool_block_job block;
+	pool_test_job tests[jobs];
+	pool_test_job counted[16];
+	std::vector<int> order;
+	size_t count = 0, wrong = 0;
+	
+	printf("background pool test\n");
+	pool->set_threads(1);
+	pool->submit(&block, 10);
+	while(!__atomic_load_n(&block.started, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	for(size_t i = 0; i < jobs; i++)
+	{
+		tests[i].id = i;
+		tests[i].order = &order;
+		pool->submit(&tests[i], priorities[i]);
+	}
+	EXPECT_TRUE("cancel queued", pool->cancel(&tests[2]));
+	EXPECT_FALSE("cancel running", pool->cancel(&block));
+	__atomic_store_n(&block.gate, true, __ATOMIC_RELEASE);
+	for(size_t i = 0; i < jobs; i++)
+		pool->wait(&tests[i]);
+	pool->wait(&block);
+	EXPECT_FALSE("cancel finished", pool->cancel(&tests[0]));
+	EXPECT_SIZET("jobs run", jobs - 1, order.size());
+	for(size_t i = 0; i < order.size() && i < jobs - 1; i++)
+		if(order[i] != expect[i])
+			wrong++;
+	EXPECT_SIZET("out of order", 0, wrong);
+	/* the caller can run the cancelled one itself, and submit it again */
+	tests[2].run();
+	pool->submit(&tests[2], 0);
+	pool->wait(&tests[2]);
+	EXPECT_SIZET("jobs run", jobs + 1, order.size());
+	
+	pool->set_threads(4);
+	for(size_t i = 0; i < sizeof(counted) / sizeof(counted[0]); i++)
+	{
+		counted[i].count = &count;
+		pool->submit(&counted[i], 0);
+	}
+	/* without waiting for the jobs first */
+	delete pool;
+	EXPECT_SIZET("jobs run at shutdown", sizeof(counted) / sizeof(counted[0]), __atomic_load_n(&count, __ATOMIC_RELAXED));
+}
+
+#define THROTTLE_TEST_KEYS 12000
+#define THROTTLE_TEST_RATE 1048576
+
+/* walks both dtables together, counting the entries that differ */
+static size_t throttle_differences(const dtable * a, const dtable * b)
+{
+	size_t bad = 0;
+	dtable::iter * ait = a->iterator();
+	dtable::iter * bit = b->iterator();
+	for(; ait->valid() && bit->valid(); ait->next(), bit->next())
+		if(ait->key().compare(bit->key()) || ait->value().compare(bit->value()))
+			bad++;
+	if(ait->valid() || bit->valid())
+		bad++;
+	delete bit;
+	delete ait;
+	return bad;
+}
+
+/* fills a managed dtable with overlapping digests, overwrites and removes */
+static managed_dtable * throttle_fill(const char * path, const params & config)
+{
+	int r;
+	managed_dtable * mdt;
+	uint8_t value[16];
+	sys_journal * sysj = sys_journal::get_global_journal();
+	
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
-	r = mdt->insert(0u, fixed);
-	EXPECT_NOFAIL("mdt->insert", r);
-	r = mdt->insert(1u, fixed);
+	r = managed_dtable::create(AT_FDCWD, path, config, dtype::UINT32);
+	EXPECT_NOFAIL_FORMAT("dtable::create(%s)", r, path);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, path, config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	for(uint32_t round = 0; round < 3; round++)
+	{
+		r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		for(uint32_t i = 0; i < THROTTLE_TEST_KEYS; i++)
+		{
+			uint32_t key = (i * 7919u + round * 4000) % (THROTTLE_TEST_KEYS * 2);
+			memset(value, round, sizeof(value));
+			memcpy(value, &key, sizeof(key));
+			if(round && !(i % 9))
+				r = mdt->remove(key);
+			else
+				r = mdt->insert(key, blob(sizeof(value), value));
+			EXPECT_NOFAIL_SILENT_BREAK("mdt->insert", r);
+		}
+		r = mdt->digest();
+		EXPECT_NOFAIL("mdt->digest", r);
+		r = tx_end(0);
+		EXPECT_NOFAIL("tx_end", r);
+	}
+	return mdt;
+}
+
+/* a background combine reads its sources through a rate limited iterator; it
+ * must take longer, but end up with exactly what an unthrottled combine does */
+static void throttle_test()
+{
+	int r;
+	uint64_t start, elapsed;
+	managed_dtable * throttled;
+	managed_dtable * unthrottled;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	params config;
+	
+	printf("throttled combine test\n");
+	config.set_class("base", simple_dtable);
+	throttled = throttle_fill("thra_test", config);
+	unthrottled = throttle_fill("thru_test", config);
+	EXPECT_SIZET("throttled disk dtables", 3, throttled->disk_dtables());
+	EXPECT_SIZET("differences", 0, throttle_differences(throttled, unthrottled));
+	
+	managed_dtable::set_background_rate(THROTTLE_TEST_RATE, MDTE_THROTTLE_BYTES);
+	start = rate_limiter::now_usec();
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = throttled->combine(false, true);
+	EXPECT_NOFAIL("throttled->combine(background)", r);
+	r = throttled->background_join();
+	EXPECT_NOFAIL("throttled->background_join", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	elapsed = rate_limiter::now_usec() - start;
+	managed_dtable::set_background_rate(0);
+	/* at least 20 bytes for each of the last round's keys, less one burst */
+	printf("throttled combine took %u msec\n", (unsigned int) (elapsed / 1000));
+	EXPECT_TRUE("throttled", elapsed > (THROTTLE_TEST_KEYS * 20 - MDTE_THROTTLE_BYTES) * (uint64_t) 1000000 / THROTTLE_TEST_RATE);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = unthrottled->combine();
+	EXPECT_NOFAIL("unthrottled->combine", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("throttled disk dtables", 1, throttled->disk_dtables());
+	EXPECT_SIZET("unthrottled disk dtables", 1, unthrottled->disk_dtables());
+	EXPECT_SIZET("differences", 0, throttle_differences(throttled, unthrottled));
+	throttled->destroy();
+	unthrottled->destroy();
+	
+	throttled = new managed_dtable;
+	r = throttled->init(AT_FDCWD, "thra_test", config, sysj);
+	EXPECT_NOFAIL_COUNT("throttled->init", r, "disk dtables", throttled->disk_dtables());
+	unthrottled = new managed_dtable;
+	r = unthrottled->init(AT_FDCWD, "thru_test", config, sysj);
+	EXPECT_NOFAIL_COUNT("unthrottled->init", r, "disk dtables", unthrottled->disk_dtables());
+	EXPECT_SIZET("differences", 0, throttle_differences(throttled, unthrottled));
+	throttled->destroy();
+	unthrottled->destroy();
+}
+
+#define BACKGROUND_TEST_KEYS 3000
+
+/* the value background_test() expects for a key, given how many times it
+ * has been overwritten */
+static uint32_t background_value(uint32_t key, int round)
+{
+	return key * 5 + round;
+}
+
+/* checks that every key below keys has its expected value, counting those
+ * that don't; the first overwritten even keys of the first half have been
+ * overwritten once */
+static size_t background_check(managed_dtable * mdt, uint32_t keys, uint32_t overwritten)
+{
+	size_t wrong = 0;
+	for(uint32_t key = 0; key < keys; key++)
+	{
+		blob value = mdt->find(key);
+		bool again = !(key % 2) && key < overwritten * 2 && key < BACKGROUND_TEST_KEYS / 2;
+		uint32_t expect = background_value(key, again ? 1 : 0);
+		if(value.size() != sizeof(expect) || value.index<uint32_t>(0) != expect)
+			wrong++;
+	}
+	return wrong;
+}
+
+/* starts a background combine of several disk dtables and the journal, keeps
+ * inserting and looking up while it runs, and then joins it and reopens */
+static void background_test(const char * path)
+{
+	int r;
+	managed_dtable * mdt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const uint32_t keys = BACKGROUND_TEST_KEYS;
+	params config;
+	
+	printf("background combine test\n");
+	config.set_class("base", simple_dtable);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = managed_dtable::create(AT_FDCWD, path, config, dtype::UINT32);
+	EXPECT_NOFAIL_FORMAT("dtable::create(%s)", r, path);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, path, config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	/* three disk dtables, and the rest of the first half in the journal */
+	for(uint32_t key = 0; key < keys / 2; key++)
+	{
+		uint32_t value = background_value(key, 0);
+		r = mdt->insert(key, blob(sizeof(value), &value));
+		EXPECT_NOFAIL_SILENT_BREAK("mdt->insert", r);
+		if(key % 400 == 399 && mdt->disk_dtables() < 3)
+		{
+			r = mdt->digest();
+			EXPECT_NOFAIL("mdt->digest", r);
+		}
+	}
+	EXPECT_SIZET("disk dtables", 3, mdt->disk_dtables());
+	r = mdt->combine(false, true);
+	EXPECT_NOFAIL("mdt->combine(background)", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	/* insert the second half and overwrite some of the first while the
+	 * combine runs, checking everything so far as we go */
+	for(uint32_t key = keys / 2; key < keys; key++)
+	{
+		uint32_t value = background_value(key, 0);
+		uint32_t old = (key - keys / 2) * 2;
+		r = tx_start();
+		EXPECT_NOFAIL_SILENT_BREAK("tx_start", r);
+		r = mdt->insert(key, blob(sizeof(value), &value));
+		EXPECT_NOFAIL_SILENT_BREAK("mdt->insert", r);
+		if(old < keys / 2)
+		{
+			value = background_value(old, 1);
+			r = mdt->insert(old, blob(sizeof(value), &value));
+			EXPECT_NOFAIL_SILENT_BREAK("mdt->insert", r);
+		}
+		r = tx_end(0);
+		EXPECT_NOFAIL_SILENT_BREAK("tx_end", r);
+		if(!(key % 500))
+			EXPECT_SIZET("wrong values", 0, background_check(mdt, key + 1, key + 1 - keys / 2));
+	}
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	/* it may have been installed already by an insert */
+	r = mdt->background_join();
+	if(r != -EBUSY)
+		EXPECT_NOFAIL("mdt->background_join", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("disk dtables", 1, mdt->disk_dtables());
+	EXPECT_SIZET("wrong values", 0, background_check(mdt, keys, keys / 2));
+	mdt->destroy();
+	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, path, config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	EXPECT_SIZET("disk dtables", 1, mdt->disk_dtables());
+	EXPECT_SIZET("wrong values", 0, background_check(mdt, keys, keys / 2));
+	mdt->destroy();
+}
+
+int command_dtable(int argc, const char * argv[])
+{
+	int r;
+	managed_dtable * mdt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const char * path;
+	params config;
+	
+	if(argc > 1)
+		path = argv[1];
+	else
+		path = "msdt_test";
+	if(argc > 2)
+		config.set("base", argv[2]);
+	else
+		config.set_class("base", simple_dtable);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = managed_dtable::create(AT_FDCWD, path, config, dtype::UINT32);
+	EXPECT_NOFAIL_FORMAT("dtable::create(%s)", r, path);
+	if(r < 0)
+	{
+		tx_end(0);
+		return r;
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, path, config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdt->insert(6u, blob("hello"));
 	EXPECT_NOFAIL("mdt->insert", r);
-	r = mdt->insert(3u, fixed);
+	r = mdt->insert(4u, blob("world"));
 	EXPECT_NOFAIL("mdt->insert", r);
 	run_iterator(mdt);
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
 	mdt->destroy();
 	
-	wait_digest(3);
-	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, path, config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	run_iterator(mdt);
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
+	r = mdt->digest();
+	EXPECT_NOFAIL("mdt->digest", r);
+	run_iterator(mdt);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	mdt->destroy();
+	
 	mdt = new managed_dtable;
-	r = mdt->init(AT_FDCWD, "excp_test", config, sysj);
-	EXPECT_NOFAIL("mdt->init", r);
-	r = mdt->maintain();
-	EXPECT_NOFAIL_COUNT("mdt->maintain", r, "disk dtables", mdt->disk_dtables());
+	r = mdt->init(AT_FDCWD, path, config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
 	run_iterator(mdt);
-	r = mdt->insert(2u, exception);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdt->insert(8u, blob("icanhas"));
 	EXPECT_NOFAIL("mdt->insert", r);
-	r = mdt->insert(8u, exception);
+	r = mdt->insert(2u, blob("cheezburger"));
 	EXPECT_NOFAIL("mdt->insert", r);
 	run_iterator(mdt);
+	r = mdt->digest();
+	EXPECT_NOFAIL("mdt->digest", r);
+	run_iterator(mdt);
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
 	mdt->destroy();
 	
-	wait_digest(2);
-	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, path, config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	run_iterator(mdt);
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
-	mdt = new managed_dtable;
-	r = mdt->init(AT_FDCWD, "excp_test", config, sysj);
-	EXPECT_NOFAIL("mdt->init", r);
-	r = mdt->maintain();
-	EXPECT_NOFAIL_COUNT("mdt->maintain", r, "disk dtables", mdt->disk_dtables());
+	r = mdt->combine();
+	EXPECT_NOFAIL("mdt->combine", r);
 	run_iterator(mdt);
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
 	mdt->destroy();
 	
-	if(argc > 1 && !strcmp(argv[1], "perf"))
-		/* run the performance test as well */
-		exdtable_perf();
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, path, config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	run_iterator(mdt);
+	mdt->destroy();
+	
+	/* blocked filters, with the default and a small k, and an old-style one */
+	bloom_test("bfdt_test_1", 1, 8);
+	bloom_test("bfdt_test_1k", 1, 3);
+	bloom_test("bfdt_test_0", 0, 8);
+	
+	pool_test();
+	background_test("bgdt_test");
+	throttle_test();
+	policy_test();
+	policy_maintain_test("cpdt_test");
+	cache_batch_test("cbdt_test_fifo", "fifo");
+	cache_batch_test("cbdt_test_2q", "2q");
+	/* see cache_policy_test() for the expected counts */
+	cache_policy_test("fifo", 1, 7, 3, 0);
+	cache_policy_test("clock", 2, 6, 2, 0);
+	cache_policy_test("2q", 1, 7, 3, 2);
 	
 	return 0;
 }
 
-int command_ussdtable(int argc, const char * argv[])
+int command_edtable(int argc, const char * argv[])
 {
-	int r;
-	params config;
-	dtable * table;
-	memory_dtable mdt;
 	sys_journal * sysj = sys_journal::get_global_journal();
-	const dtable_factory * base = dtable_factory::lookup("usstate_dtable");
+	const size_t size = 10000;
+	const size_t ops = size * 3;
+	params config;
+	dtable * dt;
+	int r;
 	
+	/* TODO: It might be nice to have a dne_dtable that can only store
+	 * nonexistent values. It's not clear that it could support rejection
+	 * though, since the replacements would have to be nonexistent. Even so
+	 * it would work for the dnebase of an exist_dtable. */
 	r = params::parse(LITERAL(
 	config [
-		"base" class(dt) fixed_dtable
+		"base" class(dt) exist_dtable
+		"base_config" config [
+			"base" class(dt) simple_dtable
+			"dnebase" class(dt) simple_dtable
+		]
+		"digest_interval" int 240
+		"combine_interval" int 1920
+		"combine_count" int 10
+		"autocombine" bool false
 	]), &config);
 	EXPECT_NOFAIL("params::parse", r);
 	config.print();
 	printf("\n");
 	
-	mdt.init(dtype::UINT32, true);
-	mdt.insert(1u, "MA");
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "exst_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	dt = dtable_factory::load("managed_dtable", AT_FDCWD, "exst_test", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	
+	printf("Populating exist_dtable... ");
+	fflush(stdout);
+	for(size_t i = 0; i < ops; i++)
+	{
+		uint32_t key = rand() % size;
+		bool insert = !(rand() & 1);
+		if(insert)
+			r = dt->insert(key, blob(sizeof(key), &key));
+		else
+			r = dt->remove(key);
+		EXPECT_NOFAIL_SILENT_BREAK("insert/remove", r);
+		if(i == ops / 2 || (i > ops / 2 && !(i % (ops / 10))))
+		{
+			r = dt->maintain(true);
+			EXPECT_NOFAIL_SILENT_BREAK("maintain", r);
+		}
+	}
+	r = dt->maintain(true);
+	if(r < 0)
+		EXPECT_NEVER("maintain failure");
+	else
+	printf("done.\n");
+	
+	dt->destroy();
+	
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	for(size_t i = 0; i <= 5; i++)
+	{
+		bool ok;
+		char path[32];
+		istr base, dnebase;
+		dtable::iter * iter;
+		params exist_config, base_config, dnebase_config;
+		
+		ok = config.get("base_config", &exist_config);
+		assert(ok);
+		ok = exist_config.get("base", &base);
+		assert(ok);
+		ok = exist_config.get("dnebase", &dnebase);
+		assert(ok);
+		ok = exist_config.get("base_config", &base_config);
+		assert(ok);
+		ok = exist_config.get("dnebase_config", &dnebase_config);
+		assert(ok);
+		
+		sprintf(path, "exst_test/md_data.%zu/base", i);
+		dt = dtable_factory::load(base, AT_FDCWD, path, base_config, sysj);
+		EXPECT_NONULL("dtable_factory::load", dt);
+		iter = dt->iterator();
+		EXPECT_NONULL("iterator", iter);
+		if(!iter->valid())
+			EXPECT_NEVER("no values in base");
+		while(iter->valid())
+		{
+			if(!iter->value().exists())
+			{
+				EXPECT_NEVER("nonexistent value in base");
+				break;
+			}
+			iter->next();
+		}
+		delete iter;
+		dt->destroy();
+		
+		sprintf(path, "exst_test/md_data.%zu/dnebase", i);
+		dt = dtable_factory::load(dnebase, AT_FDCWD, path, dnebase_config, sysj);
+		EXPECT_NONULL("dtable_factory::load", dt);
+		iter = dt->iterator();
+		EXPECT_NONULL("iterator", iter);
+		if(!i && iter->valid())
+			EXPECT_NEVER("values in dnebase[0]");
+		if(i && !iter->valid())
+			EXPECT_NEVER("no values in dnebase");
+		while(iter->valid())
+		{
+			if(iter->value().exists())
+			{
+				EXPECT_NEVER("extant value in dnebase");
+				break;
+			}
+			iter->next();
+		}
+		delete iter;
+		dt->destroy();
+	}
+	
+	util::rm_r(AT_FDCWD, "exst_test");
+	
+	return 0;
+}
+
+int command_exdtable(int argc, const char * argv[])
+{
+	int r;
+	blob fixed("fixed");
+	blob exception("exception");
+	sys_journal * sysj = sys_journal::get_global_journal();
+	managed_dtable * mdt;
+	params config;
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) exception_dtable
+		"base_config" config [
+			"base" class(dt) array_dtable
+			"alt" class(dt) simple_dtable
+			"reject_value" string "_____"
+		]
+		"digest_interval" int 2
+		"combine_interval" int 4
+		"combine_count" int 4
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = managed_dtable::create(AT_FDCWD, "excp_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "excp_test", config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdt->insert(0u, fixed);
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = mdt->insert(1u, fixed);
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = mdt->insert(3u, fixed);
+	EXPECT_NOFAIL("mdt->insert", r);
+	run_iterator(mdt);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	mdt->destroy();
+	
+	wait_digest(3);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "excp_test", config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	r = mdt->maintain();
+	EXPECT_NOFAIL_COUNT("mdt->maintain", r, "disk dtables", mdt->disk_dtables());
+	run_iterator(mdt);
+	r = mdt->insert(2u, exception);
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = mdt->insert(8u, exception);
+	EXPECT_NOFAIL("mdt->insert", r);
+	run_iterator(mdt);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	mdt->destroy();
+	
+	wait_digest(2);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "excp_test", config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	r = mdt->maintain();
+	EXPECT_NOFAIL_COUNT("mdt->maintain", r, "disk dtables", mdt->disk_dtables());
+	run_iterator(mdt);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	mdt->destroy();
+	
+	if(argc > 1 && !strcmp(argv[1], "perf"))
+		/* run the performance test as well */
+		exdtable_perf();
+	
+	return 0;
+}
+
+int command_ussdtable(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	dtable * table;
+	memory_dtable mdt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const dtable_factory * base = dtable_factory::lookup("usstate_dtable");
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) fixed_dtable
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	
+	mdt.init(dtype::UINT32, true);
+	mdt.insert(1u, "MA");
 	mdt.insert(2u, "CA");
 	run_iterator(&mdt);
 	
@@ -809,59 +1596,209 @@ static void iterator_test(const istr & type, const char * name, const params & c
 	dt->destroy();
 }
 
-int command_kddtable(int argc, const char * argv[])
+#define PARTITION_TEST_KEYS (2 * MDTE_PARTITION_MIN_KEYS + 1000)
+
+/* returns the most partitions of any of the managed dtable's disk dtables */
+static size_t count_partitions(const char * path)
 {
-	int r;
-	size_t count = 0;
-	bool verbose = false;
-	params config;
-	
-	if(argc > 1 && !strcmp(argv[1], "perf"))
-		return kddtable_perf();
-	
-	if(argc > 1 && !strcmp(argv[1], "-v"))
+	size_t max = 0;
+	struct dirent * ent;
+	DIR * dir = opendir(path);
+	if(!dir)
+		return 0;
+	while((ent = readdir(dir)))
 	{
-		verbose = true;
-		argc--;
-		argv++;
+		size_t count = 0;
+		struct dirent * sub_ent;
+		DIR * sub;
+		if(strncmp(ent->d_name, "md_data.", 8))
+			continue;
+		sub = opendir(istr(path) + "/" + ent->d_name);
+		if(!sub)
+			continue;
+		while((sub_ent = readdir(sub)))
+			if(!strncmp(sub_ent->d_name, "kdd_data.", 9))
+				count++;
+		closedir(sub);
+		if(count > max)
+			max = count;
 	}
-	if(argc > 1)
-		count = atoi(argv[1]);
-	if(!count)
-		count = 2000000;
-	
-	r = params::parse(LITERAL(
-	config [
-		"base" class(dt) managed_dtable
-		"base_config" config [
-			"base" class(dt) simple_dtable
-			"digest_interval" int 2
-		]
-		"divider_0" int 8
-		"divider_1" int 11
-		"divider_2" int 12
-		"divider_3" int 15
-	]), &config);
-	EXPECT_NOFAIL("params::parse", r);
-	config.print();
-	printf("\n");
-	
-	iterator_test("keydiv_dtable", "kddt_test", config, count, verbose);
-	
-	return 0;
+	closedir(dir);
+	return max;
 }
 
-struct uniq_insert
-{
-	double key;
-	size_t index;
-};
-
-struct uniq_key
+/* the dtable should have the keys 0, 2, 4, ... up to twice count, each with
+ * itself as its value; the dividers are not known here, so every key and
+ * every gap between them is looked up, which covers those around them */
+static void partition_check(const dtable * dt, uint32_t count)
 {
-	double key;
-	size_t size;
-};
+	uint32_t next = 0;
+	size_t bad_order = 0, bad_lookups = 0;
+	std::vector<dtype> keys;
+	dtable::iter * it = dt->iterator();
+	for(; it->valid(); it->next())
+	{
+		dtype key = it->key();
+		blob value = it->value();
+		if(key.type != dtype::UINT32 || key.u32 != next || value.size() != sizeof(next) || value.index<uint32_t>(0) != next)
+			bad_order++;
+		next = key.u32 + 2;
+	}
+	delete it;
+	EXPECT_SIZET("iterated keys", count, next / 2);
+	EXPECT_SIZET("out of order", 0, bad_order);
+	for(uint32_t key = 0; key <= count * 2; key++)
+	{
+		blob value = dt->find(key);
+		if(key % 2 || key == count * 2)
+		{
+			if(value.exists())
+				bad_lookups++;
+		}
+		else if(value.size() != sizeof(key) || value.index<uint32_t>(0) != key)
+			bad_lookups++;
+	}
+	EXPECT_SIZET("bad lookups", 0, bad_lookups);
+	/* batches go to each partition separately */
+	for(uint32_t i = 0; i <= count * 2; i++)
+		keys.push_back(dtype((uint32_t) ((i * 7919ull) % (count * 2 + 1))));
+	EXPECT_SIZET("wrong batch lookups", 0, lookup_many_check(dt, keys));
+}
+
+static void partition_insert(managed_dtable * mdt, uint32_t start, uint32_t end)
+{
+	int r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = start; i < end; i++)
+	{
+		uint32_t key = i * 2;
+		r = mdt->insert(key, blob(sizeof(key), &key));
+		EXPECT_NOFAIL_SILENT_BREAK("mdt->insert", r);
+	}
+	r = mdt->digest();
+	EXPECT_NOFAIL("mdt->digest", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+}
+
+/* combines enough keys for a managed dtable to split the result in two with a
+ * keydiv dtable, then reopens it and combines the partitioned dtable again */
+static void partition_test()
+{
+	int r;
+	managed_dtable * mdt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	params config;
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"combine_partitions" int 2
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = managed_dtable::create(AT_FDCWD, "kddp_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "kddp_test", config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	partition_insert(mdt, 0, PARTITION_TEST_KEYS / 2);
+	partition_insert(mdt, PARTITION_TEST_KEYS / 2, PARTITION_TEST_KEYS);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdt->combine();
+	EXPECT_NOFAIL("mdt->combine", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("disk dtables", 1, mdt->disk_dtables());
+	EXPECT_SIZET("partitions", 2, count_partitions("kddp_test"));
+	partition_check(mdt, PARTITION_TEST_KEYS);
+	mdt->destroy();
+	
+	/* reopen the partitioned dtable, add to it, and combine it again */
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "kddp_test", config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	partition_check(mdt, PARTITION_TEST_KEYS);
+	partition_insert(mdt, PARTITION_TEST_KEYS, PARTITION_TEST_KEYS + 1000);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdt->combine();
+	EXPECT_NOFAIL("mdt->combine", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("disk dtables", 1, mdt->disk_dtables());
+	EXPECT_SIZET("partitions", 2, count_partitions("kddp_test"));
+	partition_check(mdt, PARTITION_TEST_KEYS + 1000);
+	mdt->destroy();
+	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "kddp_test", config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	partition_check(mdt, PARTITION_TEST_KEYS + 1000);
+	mdt->destroy();
+}
+
+int command_kddtable(int argc, const char * argv[])
+{
+	int r;
+	size_t count = 0;
+	bool verbose = false;
+	params config;
+	
+	if(argc > 1 && !strcmp(argv[1], "perf"))
+		return kddtable_perf();
+	
+	if(argc > 1 && !strcmp(argv[1], "-v"))
+	{
+		verbose = true;
+		argc--;
+		argv++;
+	}
+	if(argc > 1)
+		count = atoi(argv[1]);
+	if(!count)
+		count = 2000000;
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) managed_dtable
+		"base_config" config [
+			"base" class(dt) simple_dtable
+			"digest_interval" int 2
+		]
+		"divider_0" int 8
+		"divider_1" int 11
+		"divider_2" int 12
+		"divider_3" int 15
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	
+	iterator_test("keydiv_dtable", "kddt_test", config, count, verbose);
+	
+	partition_test();
+	
+	return 0;
+}
+
+struct uniq_insert
+{
+	double key;
+	size_t index;
+};
+
+struct uniq_key
+{
+	double key;
+	size_t size;
+};
 
 static void verify_uniq_alts(const char ** strings, const uniq_insert * alts, size_t count, const char * type, const char * path, const params & config, sys_journal * sysj)
 {
@@ -1423,205 +2360,1059 @@ int command_consistency(int argc, const char * argv[])
 	
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
-	
-	r = ctable_factory::setup("column_ctable", AT_FDCWD, "cons_test", config, dtype::UINT32);
-	EXPECT_NOFAIL("setup", r);
-	
-	ct = ctable_factory::load("column_ctable", AT_FDCWD, "cons_test", config, sysj);
-	EXPECT_NONULL("load", ct);
-	for(uint32_t i = 0; i < 500; i++)
+	
+	r = ctable_factory::setup("column_ctable", AT_FDCWD, "cons_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("setup", r);
+	
+	ct = ctable_factory::load("column_ctable", AT_FDCWD, "cons_test", config, sysj);
+	EXPECT_NONULL("load", ct);
+	for(uint32_t i = 0; i < 500; i++)
+	{
+		r = ct->insert(i, values, CONS_TEST_COLS);
+		assert(r >= 0);
+	}
+	delete ct;
+	
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	
+	ct = ctable_factory::load("column_ctable", AT_FDCWD, "cons_test", config, sysj);
+	EXPECT_NONULL("load", ct);
+	
+	printf("Consistency check: ");
+	fflush(stdout);
+	if(consistency_check(ct, buckets))
+		printf("OK!\n");
+	else
+		EXPECT_NEVER("failed.");
+	print_buckets(buckets);
+	
+	for(uint32_t i = 0; i < CONS_TEST_ITERATIONS; i++)
+	{
+		char column[24];
+		uint32_t key = rand() % CONS_TEST_ROWS;
+		sprintf(column, "%d", rand() % CONS_TEST_COLS);
+		blob value = ct->find(key, column);
+		assert(value.size() == sizeof(uint32_t));
+		initial = value.index<uint32_t>(0) - CONS_TEST_SPREAD;
+		value = blob(sizeof(initial), &initial);
+		r = ct->insert(key, column, value);
+		assert(r >= 0);
+		for(int j = 0; j < CONS_TEST_SPREAD; j++)
+		{
+			key = rand() % CONS_TEST_ROWS;
+			sprintf(column, "%d", rand() % CONS_TEST_COLS);
+			value = ct->find(key, column);
+			assert(value.size() == sizeof(uint32_t));
+			initial = value.index<uint32_t>(0) + 1;
+			value = blob(sizeof(initial), &initial);
+			r = ct->insert(key, column, value);
+			assert(r >= 0);
+		}
+		if(!(i % 1000))
+			ct->maintain();
+		if((i % CONS_TEST_TX_SIZE) == CONS_TEST_TX_SIZE - 1)
+		{
+			r = tx_end(0);
+			assert(r >= 0);
+			r = tx_start();
+			assert(r >= 0);
+			printf(".");
+			fflush(stdout);
+		}
+		if((i % (CONS_TEST_ITERATIONS / 10)) == CONS_TEST_ITERATIONS / 10 - 1)
+			printf(" %d%% done\n", (i + 1) / (CONS_TEST_ITERATIONS / 100));
+	}
+	
+	printf("Consistency check: ");
+	fflush(stdout);
+	if(consistency_check(ct, buckets))
+		printf("OK!\n");
+	else
+		EXPECT_NEVER("failed.");
+	print_buckets(buckets);
+	
+	wait_digest(5);
+	
+	ct->maintain();
+	delete ct;
+	
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+/* checks that the records played back are the numbers 0, 1, 2, ... */
+static int count_records(void * data, size_t length, void * param)
+{
+	uint32_t * count = (uint32_t *) param;
+	if(length != sizeof(*count) || memcmp(data, count, sizeof(*count)))
+		return -EINVAL;
+	++*count;
+	return 0;
+}
+
+/* writes a journal with both MD5 and CRC32C commit records, then checks that
+ * all of it is played back when it is reopened, and that it is rejected once
+ * a record covered by a CRC32C commit record is corrupted */
+static void journal_checksum_test(bool hardware)
+{
+	int r, fd;
+	uint8_t byte;
+	off_t offset;
+	journal * j;
+	journal * reopened = NULL;
+	journal * corrupted = NULL;
+	uint32_t record, count = 0;
+	
+	crc32c_set_hardware(hardware);
+	printf("CRC32C using %s\n", crc32c_hardware() ? "hardware" : "slicing-by-8");
+	
+	j = journal::create(AT_FDCWD, "cksum_journal", NULL);
+	EXPECT_NONULL("journal::create", j);
+	if(!j)
+		return;
+	for(record = 0; record < 20; record++)
+	{
+		/* the first two commits use MD5, like older versions */
+		journal::set_md5_commits(record < 10);
+		r = j->append(&record, sizeof(record));
+		EXPECT_NOFAIL_SILENT_BREAK("append", r);
+		if(record % 5 == 4)
+		{
+			r = j->commit();
+			EXPECT_NOFAIL_SILENT_BREAK("commit", r);
+			r = j->playback(count_records, NULL, &count);
+			EXPECT_NOFAIL_SILENT_BREAK("playback", r);
+		}
+	}
+	journal::set_md5_commits(false);
+	EXPECT_SIZET("played back", 20, count);
+	
+	count = 0;
+	r = journal::reopen(AT_FDCWD, "cksum_journal", "cksum_journal" J_COMMIT_EXT "4", &reopened, NULL);
+	EXPECT_NOFAIL("journal::reopen", r);
+	EXPECT_NONULL("reopened", reopened);
+	if(reopened)
+	{
+		r = reopened->playback(count_records, NULL, &count);
+		EXPECT_NOFAIL("playback", r);
+		EXPECT_SIZET("replayed", 20, count);
+	}
+	
+	/* flip a bit in the last record, which is covered by a CRC32C */
+	fd = open("cksum_journal", O_RDWR);
+	offset = (fd < 0) ? -1 : lseek(fd, -1, SEEK_END);
+	if(offset < 0 || pread(fd, &byte, 1, offset) != 1)
+		EXPECT_NEVER("cannot read cksum_journal");
+	byte ^= 1;
+	if(offset < 0 || pwrite(fd, &byte, 1, offset) != 1)
+		EXPECT_NEVER("cannot write cksum_journal");
+	if(fd >= 0)
+		close(fd);
+	r = journal::reopen(AT_FDCWD, "cksum_journal", "cksum_journal" J_COMMIT_EXT "4", &corrupted, NULL);
+	EXPECT_NOFAIL("journal::reopen", r);
+	EXPECT_TRUE("corrupted journal rejected", !corrupted);
+	
+	if(reopened)
+	{
+		r = reopened->erase();
+		EXPECT_NOFAIL("erase", r);
+		reopened->release();
+	}
+	r = j->erase();
+	EXPECT_NOFAIL("erase", r);
+	j->release();
+	crc32c_set_hardware(1);
+}
+
+static bool durability_stop = false;
+
+static void durable_death(int signal)
+{
+	durability_stop = true;
+}
+
+#define GROUP_COMMIT_THREADS 4
+#define GROUP_COMMIT_PER_THREAD 8
+#define GROUP_COMMIT_ROUNDS 24
+
+/* syncs a few transactions from its own thread */
+struct group_syncer
+{
+	pthread_t thread;
+	tx_id ids[GROUP_COMMIT_PER_THREAD];
+	size_t failures;
+};
+
+static void * group_syncer_main(void * arg)
+{
+	group_syncer * syncer = (group_syncer *) arg;
+	for(size_t i = 0; i < GROUP_COMMIT_PER_THREAD; i++)
+		if(tx_sync(syncer->ids[i]) < 0)
+			syncer->failures++;
+	return NULL;
+}
+
+/* with group commit on, several threads sync transactions at once while the
+ * main thread keeps committing more; then everything must be there when the
+ * dtable is reopened */
+static void group_commit_test()
+{
+	int r;
+	dtable * dt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	group_syncer syncers[2][GROUP_COMMIT_THREADS];
+	const uint32_t per_round = GROUP_COMMIT_THREADS * GROUP_COMMIT_PER_THREAD;
+	size_t failures = 0, wrong = 0;
+	tx_id last = -1;
+	params config;
+	
+	printf("group commit test\n");
+	config.set_class("base", simple_dtable);
+	r = tx_set_group_commit(2000, GROUP_COMMIT_THREADS);
+	EXPECT_NOFAIL("tx_set_group_commit", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "grpc_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	dt = dtable_factory::load("managed_dtable", AT_FDCWD, "grpc_test", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	for(uint32_t round = 0; round <= GROUP_COMMIT_ROUNDS; round++)
+	{
+		group_syncer * batch = syncers[round % 2];
+		group_syncer * previous = syncers[(round + 1) % 2];
+		if(round < GROUP_COMMIT_ROUNDS)
+			for(uint32_t i = 0; i < per_round; i++)
+			{
+				uint32_t key = round * per_round + i;
+				r = tx_start();
+				EXPECT_NOFAIL_SILENT_BREAK("tx_start", r);
+				r = dt->insert(key, blob(sizeof(key), &key));
+				EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+				last = tx_end(1);
+				EXPECT_NOFAIL_SILENT_BREAK("tx_end", last);
+				batch[i % GROUP_COMMIT_THREADS].ids[i / GROUP_COMMIT_THREADS] = last;
+			}
+		/* the previous round's syncs overlap with these commits */
+		if(round)
+			for(size_t t = 0; t < GROUP_COMMIT_THREADS; t++)
+			{
+				pthread_join(previous[t].thread, NULL);
+				failures += previous[t].failures;
+			}
+		if(round < GROUP_COMMIT_ROUNDS)
+			for(size_t t = 0; t < GROUP_COMMIT_THREADS; t++)
+			{
+				batch[t].failures = 0;
+				r = pthread_create(&batch[t].thread, NULL, group_syncer_main, &batch[t]);
+				assert(!r);
+			}
+	}
+	EXPECT_SIZET("sync failures", 0, failures);
+	/* each transaction can only be synced once */
+	EXPECT_FAIL("tx_sync again", tx_sync(last));
+	dt->destroy();
+	
+	r = tx_set_group_commit(0, 0);
+	EXPECT_NOFAIL("tx_set_group_commit", r);
+	dt = dtable_factory::load("managed_dtable", AT_FDCWD, "grpc_test", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	for(uint32_t key = 0; key < GROUP_COMMIT_ROUNDS * per_round; key++)
+	{
+		blob value = dt->find(key);
+		if(value.size() != sizeof(key) || value.index<uint32_t>(0) != key)
+			wrong++;
+	}
+	EXPECT_SIZET("wrong values", 0, wrong);
+	dt->destroy();
+}
+
+int command_durability(int argc, const char * argv[])
+{
+	params config;
+	tx_id transaction_id;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	uint32_t tx_seq;
+	dtable * dt;
+	bool check;
+	int r;
+	
+	check = argc > 1 && !strcmp(argv[1], "check");
+	
+	if(!check)
+	{
+		/* journals with both kinds of commit records must be recoverable */
+		journal_checksum_test(true);
+		journal_checksum_test(false);
+		group_commit_test();
+	}
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"digest_interval" int 2
+		"combine_interval" int 4
+		"combine_count" int 4
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	
+	if(!check)
+	{
+		r = dtable_factory::setup("managed_dtable", AT_FDCWD, "dura_test", config, dtype::UINT32);
+		EXPECT_NOFAIL("dtable::create", r);
+	}
+	
+	dt = dtable_factory::load("managed_dtable", AT_FDCWD, "dura_test", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	if(check)
+	{
+		blob value = dt ? dt->find(0u) : blob();
+		if(value.exists())
+		{
+			tx_seq = value.index<uint32_t>(0);
+			printf("Transaction ID: %u\n", tx_seq);
+		}
+		else
+			printf("No transactions!\n");
+	}
+	else
+	{
+		void (*original_death)(int);
+		
+		durability_stop = false;
+		original_death = signal(SIGALRM, durable_death);
+		
+		for(tx_seq = 0; tx_seq < 10000; tx_seq++)
+		{
+			bool stop = durability_stop;
+			if(stop)
+				printf("Durability test committing transaction ID: %u\n", tx_seq);
+			
+			r = tx_start();
+			assert(r >= 0);
+			
+			r = dt->insert(0u, blob(sizeof(tx_seq), &tx_seq));
+			assert(r >= 0);
+			
+			if((tx_seq % 1000) == 999)
+			{
+				r = dt->maintain();
+				assert(r >= 0);
+			}
+			
+			transaction_id = tx_end(1);
+			r = tx_sync(transaction_id);
+			assert(r >= 0);
+			
+			if(stop && original_death != SIG_DFL && original_death != SIG_IGN)
+				original_death(SIGALRM);
+		}
+	}
+	
+	dt->destroy();
+	
+	return 0;
+}
+
+/* makes a dtype of the requested type from the numeric key */
+static dtype idtype(uint32_t value, dtype::ctype key_type)
+{
+	switch(key_type)
+	{
+		case dtype::UINT32:
+			return dtype(value);
+		case dtype::DOUBLE:
+			return dtype((double) value);
+		case dtype::STRING:
+			char string[32];
+			sprintf(string, "%u", value);
+			return dtype(string);
+		case dtype::BLOB:
+			/* endianness-sensitive... whatever */
+			return dtype(blob(sizeof(value), &value));
+	}
+	abort();
+}
+
+/* the value index_test() stores for a key; overwritten keys get a longer one */
+static blob index_value(uint32_t key, bool overwritten)
+{
+	uint32_t data[2] = {key, ~key};
+	return blob(overwritten ? sizeof(data) : sizeof(key), data);
+}
+
+static bool index_value_ok(uint32_t key, const blob & value)
+{
+	if(!value.exists())
+		return true;
+	if(value.size() != sizeof(uint32_t) && value.size() != 2 * sizeof(uint32_t))
+		return false;
+	if(value.index<uint32_t>(0) != key)
+		return false;
+	return value.size() == sizeof(uint32_t) || value.index<uint32_t>(1) == ~key;
+}
+
+/* walks both dtables forward and backward, and looks up every key below
+ * limit in both, checking that they agree; each entry the walk finds must
+ * also match what a lookup returns (from the hash, except with the skiplist) */
+static void index_compare(const dtable * dt, const dtable * ref, uint32_t limit)
+{
+	size_t entries = 0, bad = 0;
+	dtable::iter * it = dt->iterator();
+	dtable::iter * rit = ref->iterator();
+	for(; it->valid() && rit->valid(); it->next(), rit->next())
+	{
+		if(it->key().compare(rit->key()) || it->value().compare(rit->value()))
+			bad++;
+		if(dt->find(it->key()).compare(it->value()))
+			bad++;
+		entries++;
+	}
+	if(it->valid() || rit->valid())
+		bad++;
+	if(it->last() != rit->last())
+		bad++;
+	else if(rit->valid())
+		for(;;)
+		{
+			bool more;
+			if(it->key().compare(rit->key()) || it->value().compare(rit->value()))
+				bad++;
+			more = rit->prev();
+			if(it->prev() != more)
+			{
+				bad++;
+				break;
+			}
+			if(!more)
+				break;
+		}
+	delete rit;
+	delete it;
+	for(uint32_t key = 0; key < limit; key++)
+	{
+		bool found, ref_found;
+		blob value = dt->lookup(key, &found);
+		blob ref_value = ref->lookup(key, &ref_found);
+		if(found != ref_found || value.compare(ref_value))
+			bad++;
+	}
+	EXPECT_SIZET("entries", ref->size(), entries);
+	EXPECT_SIZET("size", ref->size(), dt->size());
+	EXPECT_SIZET("differences", 0, bad);
+}
+
+/* fills a journal dtable using the given ordered index, as managed_dtable does
+ * for its journal_index parameter, along with one using the default index, and
+ * checks that they agree; the count should not be a multiple of 7919 */
+static void index_test(const char * index, uint32_t count)
+{
+	int r;
+	size_t steps = 0, bad = 0;
+	uint32_t seek = count & ~1u, extra = count * 2;
+	sys_journal * sysj;
+	journal_dtable * dt;
+	journal_dtable * ref;
+	dtable::iter * it;
+	dtable::iter * rit;
+	journal_dtable::journal_dtable_warehouse warehouse;
+	sys_journal::listener_id dt_id, ref_id;
+	
+	printf("%s index test (%u keys)\n", index, count);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("index_journal", &warehouse, NULL, true);
+	EXPECT_NONULL("sysj spawn", sysj);
+	dt_id = sys_journal::get_unique_id(false);
+	ref_id = sys_journal::get_unique_id(false);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	dt = warehouse.obtain(dt_id, dtype::UINT32, sysj);
+	ref = warehouse.obtain(ref_id, dtype::UINT32, sysj);
+	r = dt->set_index(index);
+	EXPECT_NOFAIL("set_index", r);
+	
+	/* even keys in a scattered order, then overwrite and remove some */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint32_t key = (uint32_t) ((i * 7919ull) % count) * 2;
+		r = dt->insert(key, index_value(key, false));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+		r = ref->insert(key, index_value(key, false));
+		EXPECT_NOFAIL_SILENT_BREAK("ref insert", r);
+	}
+	for(uint32_t key = 0; key < count * 2; key += 6)
+	{
+		r = dt->insert(key, index_value(key, true));
+		EXPECT_NOFAIL_SILENT_BREAK("overwrite", r);
+		r = ref->insert(key, index_value(key, true));
+		EXPECT_NOFAIL_SILENT_BREAK("ref overwrite", r);
+	}
+	for(uint32_t key = 0; key < count * 2; key += 10)
+	{
+		r = dt->remove(key);
+		EXPECT_NOFAIL_SILENT_BREAK("remove", r);
+		r = ref->remove(key);
+		EXPECT_NOFAIL_SILENT_BREAK("ref remove", r);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	index_compare(dt, ref, count * 2);
+	
+	/* iterators must find their place again after inserts move entries
+	 * around, and see keys inserted ahead of them as they go */
+	it = dt->iterator();
+	EXPECT_TRUE("seek", it->seek(seek));
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t key = 1; key < count * 2; key += 2)
+	{
+		r = dt->insert(key, index_value(key, false));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+		r = ref->insert(key, index_value(key, false));
+		EXPECT_NOFAIL_SILENT_BREAK("ref insert", r);
+	}
+	rit = ref->iterator();
+	rit->seek(seek);
+	for(; it->valid() && rit->valid(); it->next(), rit->next())
+	{
+		if(it->key().compare(rit->key()) || it->value().compare(rit->value()))
+			bad++;
+		if(!(++steps % 64))
+		{
+			r = dt->insert(extra, index_value(extra, false));
+			EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+			r = ref->insert(extra, index_value(extra, false));
+			EXPECT_NOFAIL_SILENT_BREAK("ref insert", r);
+			extra++;
+		}
+	}
+	if(it->valid() || rit->valid())
+		bad++;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	delete rit;
+	delete it;
+	EXPECT_SIZET("steps", extra - seek, steps);
+	EXPECT_SIZET("differences", 0, bad);
+	index_compare(dt, ref, extra);
+	
+	/* playback fills in the index again */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	delete sysj;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("index_journal", &warehouse, NULL, false);
+	EXPECT_NONULL("sysj spawn", sysj);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	dt = warehouse.lookup(dt_id);
+	ref = warehouse.lookup(ref_id);
+	EXPECT_NONULL("dt", dt);
+	EXPECT_NONULL("ref", ref);
+	r = dt->set_index(index);
+	EXPECT_NOFAIL("set_index", r);
+	index_compare(dt, ref, extra);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj->deinit(true);
+	delete sysj;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+}
+
+struct index_reader
+{
+	const journal_dtable * dt;
+	uint32_t limit;
+	bool done;
+	size_t lookups, scans, errors;
+};
+
+/* looks up keys and scans the skiplist while the main thread inserts */
+static void * index_reader_main(void * arg)
+{
+	index_reader * reader = (index_reader *) arg;
+	uint32_t seed = 1;
+	size_t last_size = 0;
+	while(!__atomic_load_n(&reader->done, __ATOMIC_ACQUIRE))
+	{
+		uint32_t key, previous = 0;
+		size_t size;
+		dtable::iter * it;
+		for(int i = 0; i < 256; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			key = (seed >> 8) % reader->limit;
+			if(!index_value_ok(key, reader->dt->find(key)))
+				reader->errors++;
+		}
+		__atomic_add_fetch(&reader->lookups, 256, __ATOMIC_RELEASE);
+		size = reader->dt->size();
+		if(size < last_size)
+			reader->errors++;
+		last_size = size;
+		it = reader->dt->iterator();
+		for(int i = 0; i < 1024 && it->valid(); i++, it->next())
+		{
+			dtype key = it->key();
+			if(i && key.u32 <= previous)
+				reader->errors++;
+			if(!index_value_ok(key.u32, it->value()))
+				reader->errors++;
+			previous = key.u32;
+		}
+		delete it;
+		reader->scans++;
+	}
+	return NULL;
+}
+
+/* the skiplist index allows lookups and iteration in other threads while one
+ * thread inserts, so check that readers always see consistent values */
+static void index_reader_test(uint32_t count)
+{
+	int r;
+	pthread_t thread;
+	sys_journal * sysj;
+	journal_dtable * dt;
+	journal_dtable::journal_dtable_warehouse warehouse;
+	sys_journal::listener_id dt_id;
+	index_reader reader;
+	
+	printf("skiplist reader test (%u keys)\n", count);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("index_journal", &warehouse, NULL, true);
+	EXPECT_NONULL("sysj spawn", sysj);
+	dt_id = sys_journal::get_unique_id(false);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	dt = warehouse.obtain(dt_id, dtype::UINT32, sysj);
+	r = dt->set_index("skiplist");
+	EXPECT_NOFAIL("set_index", r);
+	
+	reader.dt = dt;
+	reader.limit = count;
+	reader.done = false;
+	reader.lookups = 0;
+	reader.scans = 0;
+	reader.errors = 0;
+	r = pthread_create(&thread, NULL, index_reader_main, &reader);
+	EXPECT_NOFAIL("pthread_create", -r);
+	/* make sure the reader is running before we start */
+	while(!__atomic_load_n(&reader.lookups, __ATOMIC_ACQUIRE))
+		sched_yield();
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < count * 2; i++)
+	{
+		/* insert the keys in a scattered order, then overwrite them */
+		uint32_t key = (uint32_t) ((i * 7919ull) % count);
+		r = dt->insert(key, index_value(key, i >= count));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+		if(!(i % 64))
+		{
+			r = dt->remove((key + 1) % count);
+			EXPECT_NOFAIL_SILENT_BREAK("remove", r);
+		}
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	__atomic_store_n(&reader.done, true, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	printf("lookups = %zu, scans = %zu\n", reader.lookups, reader.scans);
+	EXPECT_SIZET("reader errors", 0, reader.errors);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj->deinit(true);
+	delete sysj;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+}
+
+#define SEGMENT_TEST_VALUE 100
+
+static int segment_insert(journal_dtable * dt, uint32_t key)
+{
+	uint8_t value[SEGMENT_TEST_VALUE];
+	memset(value, key, sizeof(value));
+	return dt->insert(key, blob(sizeof(value), value));
+}
+
+/* checks that the listener has the keys 0 to count - 1 inserted above */
+static void segment_check(journal_dtable * dt, uint32_t count)
+{
+	size_t bad = 0;
+	EXPECT_NONULL("listener", dt);
+	EXPECT_SIZET("listener size", count, dt->size());
+	for(uint32_t key = 0; key < count; key++)
+	{
+		blob value = dt->find(key);
+		if(value.size() != SEGMENT_TEST_VALUE || value[0] != (uint8_t) key || value[SEGMENT_TEST_VALUE - 1] != (uint8_t) key)
+			bad++;
+	}
+	EXPECT_SIZET("bad values", 0, bad);
+}
+
+/* fills both listeners, with four entries in c for each one in b */
+static void segment_interleave(journal_dtable * b, journal_dtable * c, uint32_t start)
+{
+	int r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < 64; i++)
+	{
+		r = segment_insert(c, i);
+		EXPECT_NOFAIL_SILENT_BREAK("c insert", r);
+		if(i % 4)
+			continue;
+		r = segment_insert(b, start + i / 4);
+		EXPECT_NOFAIL_SILENT_BREAK("b insert", r);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+}
+
+/* with a background compaction, the discard that starts it returns right
+ * away; keep calling filter() until the result has been installed */
+static void segment_wait(sys_journal * sysj, size_t before)
+{
+	for(int i = 0; i < 500 && sysj->segment_count() >= before; i++)
+	{
+		int r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		r = sysj->filter();
+		EXPECT_NOFAIL("filter", r);
+		r = tx_end(0);
+		EXPECT_NOFAIL("tx_end", r);
+		if(sysj->segment_count() < before)
+			break;
+		usleep(10000);
+	}
+}
+
+static sys_journal * segment_reopen(sys_journal * sysj, journal_dtable::journal_dtable_warehouse * warehouse)
+{
+	int r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	delete sysj;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("total", 0, warehouse->size());
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("seg_journal", warehouse, NULL, false);
+	EXPECT_NONULL("sysj spawn", sysj);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	return sysj;
+}
+
+/* splits the journal into small segments, so that discarding listeners
+ * retires the oldest ones and compacts those that are mostly dead */
+static void segment_test(bool background)
+{
+	int r;
+	size_t before;
+	sys_journal * sysj;
+	journal_dtable * a;
+	journal_dtable * b;
+	journal_dtable * c;
+	journal_dtable::journal_dtable_warehouse warehouse;
+	sys_journal::listener_id a_id, b_id, c_id;
+	
+	printf("segment test (%s compaction)\n", background ? "background" : "foreground");
+	sys_journal::set_segments(1024, background);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("seg_journal", &warehouse, NULL, true);
+	EXPECT_NONULL("sysj spawn", sysj);
+	a_id = sys_journal::get_unique_id(false);
+	b_id = sys_journal::get_unique_id(false);
+	c_id = sys_journal::get_unique_id(false);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	a = warehouse.obtain(a_id, dtype::UINT32, sysj);
+	b = warehouse.obtain(b_id, dtype::UINT32, sysj);
+	c = warehouse.obtain(c_id, dtype::UINT32, sysj);
+	
+	/* a gets segments of its own at the head of the log */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < 32; i++)
 	{
-		r = ct->insert(i, values, CONS_TEST_COLS);
-		assert(r >= 0);
+		r = segment_insert(a, i);
+		EXPECT_NOFAIL_SILENT_BREAK("a insert", r);
 	}
-	delete ct;
-	
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
+	segment_interleave(b, c, 0);
+	before = sysj->segment_count();
+	printf("segments = %zu\n", before);
+	EXPECT_TRUE("several segments", before > 4);
 	
+	/* discarding a retires the segments holding only its entries */
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
+	r = a->discard();
+	EXPECT_NOFAIL("a discard", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	printf("segments = %zu\n", sysj->segment_count());
+	EXPECT_TRUE("retired", sysj->segment_count() < before);
 	
-	ct = ctable_factory::load("column_ctable", AT_FDCWD, "cons_test", config, sysj);
-	EXPECT_NONULL("load", ct);
-	
-	printf("Consistency check: ");
-	fflush(stdout);
-	if(consistency_check(ct, buckets))
-		printf("OK!\n");
-	else
-		EXPECT_NEVER("failed.");
-	print_buckets(buckets);
-	
-	for(uint32_t i = 0; i < CONS_TEST_ITERATIONS; i++)
-	{
-		char column[24];
-		uint32_t key = rand() % CONS_TEST_ROWS;
-		sprintf(column, "%d", rand() % CONS_TEST_COLS);
-		blob value = ct->find(key, column);
-		assert(value.size() == sizeof(uint32_t));
-		initial = value.index<uint32_t>(0) - CONS_TEST_SPREAD;
-		value = blob(sizeof(initial), &initial);
-		r = ct->insert(key, column, value);
-		assert(r >= 0);
-		for(int j = 0; j < CONS_TEST_SPREAD; j++)
-		{
-			key = rand() % CONS_TEST_ROWS;
-			sprintf(column, "%d", rand() % CONS_TEST_COLS);
-			value = ct->find(key, column);
-			assert(value.size() == sizeof(uint32_t));
-			initial = value.index<uint32_t>(0) + 1;
-			value = blob(sizeof(initial), &initial);
-			r = ct->insert(key, column, value);
-			assert(r >= 0);
-		}
-		if(!(i % 1000))
-			ct->maintain();
-		if((i % CONS_TEST_TX_SIZE) == CONS_TEST_TX_SIZE - 1)
-		{
-			r = tx_end(0);
-			assert(r >= 0);
-			r = tx_start();
-			assert(r >= 0);
-			printf(".");
-			fflush(stdout);
-		}
-		if((i % (CONS_TEST_ITERATIONS / 10)) == CONS_TEST_ITERATIONS / 10 - 1)
-			printf(" %d%% done\n", (i + 1) / (CONS_TEST_ITERATIONS / 100));
-	}
+	/* discarding c leaves the rest of the log mostly dead */
+	before = sysj->segment_count();
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = c->discard();
+	EXPECT_NOFAIL("c discard", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	if(background)
+		segment_wait(sysj, before);
+	printf("segments = %zu\n", sysj->segment_count());
+	EXPECT_TRUE("compacted", sysj->segment_count() < before);
+	segment_check(b, 16);
 	
-	printf("Consistency check: ");
-	fflush(stdout);
-	if(consistency_check(ct, buckets))
-		printf("OK!\n");
-	else
-		EXPECT_NEVER("failed.");
-	print_buckets(buckets);
+	sysj = segment_reopen(sysj, &warehouse);
+	EXPECT_SIZET("total", 1, warehouse.size());
+	b = warehouse.lookup(b_id);
+	segment_check(b, 16);
 	
-	wait_digest(5);
+	/* discarding b while a compaction might still be running leaves no live
+	 * entries, so filter() cancels the compaction and rewrites the log */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	c_id = sys_journal::get_unique_id(false);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	c = warehouse.obtain(c_id, dtype::UINT32, sysj);
+	segment_interleave(b, c, 16);
+	segment_check(b, 32);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = c->discard();
+	EXPECT_NOFAIL("c discard", r);
+	r = b->discard();
+	EXPECT_NOFAIL("b discard", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("segments", 1, sysj->segment_count());
 	
-	ct->maintain();
-	delete ct;
+	sysj = segment_reopen(sysj, &warehouse);
+	EXPECT_SIZET("total", 0, warehouse.size());
+	EXPECT_SIZET("segments", 1, sysj->segment_count());
 	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj->deinit(true);
+	delete sysj;
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
-	
-	return 0;
+	sys_journal::set_segments(0);
 }
 
-static bool durability_stop = false;
+#define REPLAY_TEST_LISTENERS 8
+#define REPLAY_TEST_ROUNDS 12
 
-static void durable_death(int signal)
+typedef std::vector<std::pair<uint32_t, blob> > replay_contents;
+
+static blob replay_value(size_t listener, uint32_t round, uint32_t key)
 {
-	durability_stop = true;
+	uint32_t data[3] = {(uint32_t) listener, round, key};
+	return blob(sizeof(data), data);
 }
 
-int command_durability(int argc, const char * argv[])
+/* copies out the contents of each of the listeners, noting which exist */
+static void replay_snapshot(const journal_dtable::journal_dtable_warehouse & warehouse, const std::vector<sys_journal::listener_id> & ids, std::vector<bool> * present, std::vector<replay_contents> * contents)
+{
+	present->clear();
+	contents->clear();
+	for(size_t i = 0; i < ids.size(); i++)
+	{
+		dtable::iter * it;
+		journal_dtable * dt = warehouse.lookup(ids[i]);
+		present->push_back(dt != NULL);
+		contents->push_back(replay_contents());
+		if(!dt)
+			continue;
+		for(it = dt->iterator(); it->valid(); it->next())
+			contents->back().push_back(std::make_pair(it->key().u32, it->value()));
+		delete it;
+	}
+}
+
+static sys_journal * replay_reopen(sys_journal * sysj, journal_dtable::journal_dtable_warehouse * warehouse, size_t threads)
 {
-	params config;
-	tx_id transaction_id;
-	sys_journal * sysj = sys_journal::get_global_journal();
-	uint32_t tx_seq;
-	dtable * dt;
-	bool check;
 	int r;
-	
-	check = argc > 1 && !strcmp(argv[1], "check");
-	
-	r = params::parse(LITERAL(
-	config [
-		"base" class(dt) simple_dtable
-		"digest_interval" int 2
-		"combine_interval" int 4
-		"combine_count" int 4
-	]), &config);
-	EXPECT_NOFAIL("params::parse", r);
-	config.print();
-	printf("\n");
-	
+	printf("replay with %zu threads\n", threads);
+	sys_journal::set_playback(threads);
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
+	delete sysj;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("replay_journal", warehouse, NULL, false);
+	EXPECT_NONULL("sysj spawn", sysj);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	sys_journal::set_playback(1);
+	return sysj;
+}
+
+/* writes interleaved records for several listeners across several segments,
+ * with rollovers from temporary listeners and discards along the way, and
+ * checks that replaying with a pool of threads gives every listener the same
+ * state that replaying on one thread does */
+static void replay_test(size_t threads)
+{
+	int r;
+	size_t bad = 0;
+	sys_journal * sysj;
+	journal_dtable * dts[REPLAY_TEST_LISTENERS];
+	journal_dtable::journal_dtable_warehouse warehouse;
+	std::vector<sys_journal::listener_id> ids;
+	std::vector<bool> present, parallel_present;
+	std::vector<replay_contents> contents, parallel_contents;
 	
-	if(!check)
-	{
-		r = dtable_factory::setup("managed_dtable", AT_FDCWD, "dura_test", config, dtype::UINT32);
-		EXPECT_NOFAIL("dtable::create", r);
-	}
-	
-	dt = dtable_factory::load("managed_dtable", AT_FDCWD, "dura_test", config, sysj);
-	EXPECT_NONULL("dtable_factory::load", dt);
-	
+	printf("parallel replay test\n");
+	sys_journal::set_segments(16384, false);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("replay_journal", &warehouse, NULL, true);
+	EXPECT_NONULL("sysj spawn", sysj);
+	for(size_t l = 0; l < REPLAY_TEST_LISTENERS; l++)
+		ids.push_back(sys_journal::get_unique_id(false));
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
+	for(size_t l = 0; l < REPLAY_TEST_LISTENERS; l++)
+		dts[l] = warehouse.obtain(ids[l], dtype::UINT32, sysj);
 	
-	if(check)
+	for(uint32_t round = 0; round < REPLAY_TEST_ROUNDS; round++)
 	{
-		blob value = dt ? dt->find(0u) : blob();
-		if(value.exists())
+		journal_dtable * temp;
+		size_t target = round % REPLAY_TEST_LISTENERS;
+		r = tx_start();
+		EXPECT_NOFAIL_SILENT_BREAK("tx_start", r);
+		/* every few rounds, replace one of them with a new listener */
+		if(round % 4 == 3)
 		{
-			tx_seq = value.index<uint32_t>(0);
-			printf("Transaction ID: %u\n", tx_seq);
+			size_t doomed = (target + 1) % REPLAY_TEST_LISTENERS;
+			r = dts[doomed]->discard();
+			EXPECT_NOFAIL_SILENT_BREAK("discard", r);
+			ids.push_back(sys_journal::get_unique_id(false));
+			dts[doomed] = warehouse.obtain(ids.back(), dtype::UINT32, sysj);
+			if(!dts[doomed])
+			{
+				EXPECT_NEVER("obtain failure");
+				break;
+			}
 		}
-		else
-			printf("No transactions!\n");
-	}
-	else
-	{
-		void (*original_death)(int);
-		
-		durability_stop = false;
-		original_death = signal(SIGALRM, durable_death);
-		
-		for(tx_seq = 0; tx_seq < 10000; tx_seq++)
-		{
-			bool stop = durability_stop;
-			if(stop)
-				printf("Durability test committing transaction ID: %u\n", tx_seq);
-			
-			r = tx_start();
-			assert(r >= 0);
-			
-			r = dt->insert(0u, blob(sizeof(tx_seq), &tx_seq));
-			assert(r >= 0);
-			
-			if((tx_seq % 1000) == 999)
+		for(uint32_t i = 0; i < 300; i++)
+			for(size_t l = 0; l < REPLAY_TEST_LISTENERS; l++)
 			{
-				r = dt->maintain();
-				assert(r >= 0);
+				uint32_t key = (i * 7 + round * 31 + l) % 1000;
+				if(i % 5 == 4)
+					r = dts[l]->remove(key);
+				else
+					r = dts[l]->insert(key, replay_value(l, round, key));
+				EXPECT_NOFAIL_SILENT_BREAK("insert", r);
 			}
-			
-			transaction_id = tx_end(1);
-			r = tx_sync(transaction_id);
-			assert(r >= 0);
-			
-			if(stop && original_death != SIG_DFL && original_death != SIG_IGN)
-				original_death(SIGALRM);
+		
+		/* a temporary listener rolled over into one of them; the last one
+		 * is abandoned instead, so playback discards it */
+		temp = warehouse.obtain(sys_journal::get_unique_id(true), dtype::UINT32, sysj);
+		if(!temp)
+		{
+			EXPECT_NEVER("temp obtain failure");
+			break;
+		}
+		for(uint32_t key = round * 50; key < round * 50 + 100; key++)
+		{
+			r = temp->insert(key, replay_value(REPLAY_TEST_LISTENERS, round, key));
+			EXPECT_NOFAIL_SILENT_BREAK("temp insert", r);
+		}
+		if(round < REPLAY_TEST_ROUNDS - 1)
+		{
+			r = temp->rollover(dts[target]);
+			EXPECT_NOFAIL_SILENT_BREAK("rollover", r);
+			r = temp->discard();
+			EXPECT_NOFAIL_SILENT_BREAK("temp discard", r);
 		}
+
+		r = tx_end(0);
+		EXPECT_NOFAIL_SILENT_BREAK("tx_end", r);
 	}
+	printf("segments = %zu\n", sysj->segment_count());
+	EXPECT_TRUE("several segments", sysj->segment_count() > 4);
 	
-	dt->destroy();
+	sysj = replay_reopen(sysj, &warehouse, 1);
+	EXPECT_SIZET("total", REPLAY_TEST_LISTENERS, warehouse.size());
+	replay_snapshot(warehouse, ids, &present, &contents);
+	sysj = replay_reopen(sysj, &warehouse, threads);
+	EXPECT_SIZET("total", REPLAY_TEST_LISTENERS, warehouse.size());
+	replay_snapshot(warehouse, ids, &parallel_present, &parallel_contents);
 	
-	return 0;
-}
-
-/* makes a dtype of the requested type from the numeric key */
-static dtype idtype(uint32_t value, dtype::ctype key_type)
-{
-	switch(key_type)
+	for(size_t i = 0; i < ids.size(); i++)
 	{
-		case dtype::UINT32:
-			return dtype(value);
-		case dtype::DOUBLE:
-			return dtype((double) value);
-		case dtype::STRING:
-			char string[32];
-			sprintf(string, "%u", value);
-			return dtype(string);
-		case dtype::BLOB:
-			/* endianness-sensitive... whatever */
-			return dtype(blob(sizeof(value), &value));
+		if(present[i] != parallel_present[i] || contents[i].size() != parallel_contents[i].size())
+		{
+			bad++;
+			continue;
+		}
+		for(size_t j = 0; j < contents[i].size(); j++)
+			if(contents[i][j].first != parallel_contents[i][j].first || contents[i][j].second.compare(parallel_contents[i][j].second))
+				bad++;
 	}
-	abort();
+	EXPECT_SIZET("differences", 0, bad);
+	
+	for(size_t i = 0; i < ids.size(); i++)
+	{
+		journal_dtable * dt = warehouse.lookup(ids[i]);
+		if(!dt)
+			continue;
+		r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		r = dt->discard();
+		EXPECT_NOFAIL("discard", r);
+		r = tx_end(0);
+		EXPECT_NOFAIL("tx_end", r);
+	}
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	delete sysj;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	sys_journal::set_segments(0);
 }
 
 int command_rollover(int argc, const char * argv[])
@@ -1844,6 +3635,19 @@ int command_rollover(int argc, const char * argv[])
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
 	
+	segment_test(false);
+	segment_test(true);
+	
+	index_test("skiplist", 5000);
+	/* enough for several levels of inner nodes */
+	index_test("btree", 20000);
+	/* enough unsorted keys that they are sorted in pieces and merged */
+	bg_pool::get_global_pool()->set_threads(4);
+	index_test("deferred", 140000);
+	bg_pool::get_global_pool()->set_threads(0);
+	index_reader_test(20000);
+	replay_test(4);
+	
 	reverse->release();
 	return 0;
 }
@@ -2012,13 +3816,14 @@ int command_abort(int argc, const char * argv[])
 	return 0;
 }
 
-static void rwatx_tests(dtable * dt, sys_journal * sysj, const sys_journal::listening_dtable_warehouse & warehouse)
+static void rwatx_tests(dtable * dt, sys_journal * sysj, const sys_journal::listening_dtable_warehouse & warehouse, bool snapshot)
 {
 	int r;
 #define MAX_ACTIONS 10
 #define ATX_COUNT 2
 	enum action {
 		READ,    /* read key */
+		FIND,    /* read key, expecting it to exist or not */
 		WRITE,   /* write key */
 		COMMIT,  /* commit atx */
 		ABORT,   /* abort atx */
@@ -2033,7 +3838,7 @@ static void rwatx_tests(dtable * dt, sys_journal * sysj, const sys_journal::list
 			int txn;
 			bool expect_ok;
 		} actions[MAX_ACTIONS];
-	} tests[] = {
+	} lock_tests[] = {
 		{"commit empty transactions",
 			{{COMMIT, 0, 1, true}, {COMMIT, 0, 2, true}, {END_TEST}}},
 		{"read, then write in same transaction",
@@ -2067,7 +3872,28 @@ static void rwatx_tests(dtable * dt, sys_journal * sysj, const sys_journal::list
 		{"read and abort one transaction, then write in another",
 			{{READ, 1, 1, true}, {ABORT, 0, 1, true}, {WRITE, 1, 2, true}, {CHECK, 0, 2, true}, {COMMIT, 0, 2, true}, {END_TEST}}},
 		{NULL}
+	}, snapshot_tests[] = {
+		/* with snapshot isolation, both transactions start before any of
+		 * these steps, so neither sees the other's writes even once committed */
+		{"commit empty transactions",
+			{{COMMIT, 0, 1, true}, {COMMIT, 0, 2, true}, {END_TEST}}},
+		{"read in one transaction, then write in another",
+			{{READ, 1, 1, true}, {WRITE, 1, 2, true}, {CHECK, 0, 1, true}, {CHECK, 0, 2, true}, {COMMIT, 0, 1, true}, {COMMIT, 0, 2, true}, {END_TEST}}},
+		{"write in one transaction, then read in another",
+			{{WRITE, 2, 1, true}, {FIND, 2, 2, false}, {FIND, 2, 1, true}, {CHECK, 0, 1, true}, {CHECK, 0, 2, true}, {COMMIT, 0, 1, true}, {FIND, 2, 2, false}, {COMMIT, 0, 2, true}, {END_TEST}}},
+		{"write in one transaction, then write in another",
+			{{WRITE, 3, 1, true}, {WRITE, 3, 2, true}, {CHECK, 0, 1, true}, {CHECK, 0, 2, true}, {COMMIT, 0, 1, true}, {CHECK, 0, 2, false}, {COMMIT, 0, 2, false}, {END_TEST}}},
+		{"write different keys in both transactions",
+			{{WRITE, 4, 1, true}, {WRITE, 5, 2, true}, {READ, 5, 1, true}, {READ, 4, 2, true}, {COMMIT, 0, 2, true}, {COMMIT, 0, 1, true}, {END_TEST}}},
+		{"write and commit one transaction, then write in another",
+			{{WRITE, 6, 1, true}, {COMMIT, 0, 1, true}, {WRITE, 6, 2, false}, {CHECK, 0, 2, false}, {COMMIT, 0, 2, false}, {END_TEST}}},
+		{"write and abort one transaction, then write in another",
+			{{WRITE, 7, 1, true}, {ABORT, 0, 1, true}, {WRITE, 7, 2, true}, {CHECK, 0, 2, true}, {COMMIT, 0, 2, true}, {END_TEST}}},
+		{"read a key committed before both transactions",
+			{{FIND, 6, 1, true}, {FIND, 6, 2, true}, {COMMIT, 0, 1, true}, {COMMIT, 0, 2, true}, {END_TEST}}},
+		{NULL}
 	};
+	const struct test * tests = snapshot ? snapshot_tests : lock_tests;
 	EXPECT_SIZET("total", 1, warehouse.size());
 	for(int i = 0; tests[i].name; i++)
 	{
@@ -2090,6 +3916,9 @@ static void rwatx_tests(dtable * dt, sys_journal * sysj, const sys_journal::list
 				case READ:
 					dt->find(tests[i].actions[j].key, atx[tests[i].actions[j].txn]);
 					break;
+				case FIND:
+					EXPECT_BOOL("find", tests[i].actions[j].expect_ok, dt->find(tests[i].actions[j].key, atx[tests[i].actions[j].txn]).exists());
+					break;
 				case WRITE:
 					{ blob value(tests[i].name);
 					r = dt->insert(tests[i].actions[j].key, value, false, atx[tests[i].actions[j].txn]); }
@@ -2200,7 +4029,24 @@ int command_rwatx(int argc, const char * argv[])
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
 	
-	rwatx_tests(dt, sysj, warehouse);
+	rwatx_tests(dt, sysj, warehouse, false);
+	
+	util::rm_r(AT_FDCWD, "rwtx_test");
+	
+	/* and the same with snapshot isolation instead of locking */
+	config.set("snapshot_isolation", true);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup(AT_FDCWD, "rwtx_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	sysj = sys_journal::spawn_init("test_journal", &warehouse, NULL, true);
+	EXPECT_NONULL("sysj spawn", sysj);
+	dt = dtable_factory::load(AT_FDCWD, "rwtx_test", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	rwatx_tests(dt, sysj, warehouse, true);
 	
 	util::rm_r(AT_FDCWD, "rwtx_test");
 	
@@ -6,12 +6,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <stdlib.h>
+
+#include <algorithm>
 
 #include "openat.h"
 #include "transaction.h"
 
 #include "util.h"
+#include "keydiv_dtable.h"
 #include "managed_dtable.h"
+#include "dtable_wrap_iter.h"
 
 /* FIXME: we need to explicitly store the blob comparator name in the
  * managed_dtable; counting on subordinate dtables to store it is insufficient,
@@ -51,9 +56,31 @@ int managed_dtable::init(int dfd, const char * name, const params & config, sys_
 		return -EINVAL;
 	if(!config.get("bg_default", &bg_default, false))
 		return -EINVAL;
+	if(!config.get("combine_partitions", &size, 1) || size < 1)
+		return -EINVAL;
+	combine_partitions = size;
+	if(!config.get("journal_index", &journal_index))
+		return -EINVAL;
+	if(config.contains("combine_policy"))
+	{
+		istr policy_name;
+		params policy_config;
+		if(!config.get("combine_policy", &policy_name) || !config.get("combine_policy_config", &policy_config, params()))
+			return -EINVAL;
+		policy = combine_policy_factory::load(policy_name, policy_config);
+		if(!policy)
+			return -EINVAL;
+		/* the policy replaces the autocombine schedule */
+		autocombine = false;
+		policy_lookups = prune.lookups.get();
+		policy_probed = prune.probed.get();
+	}
 	md_dfd = openat(dfd, name, O_RDONLY);
 	if(md_dfd < 0)
-		return md_dfd;
+	{
+		r = md_dfd;
+		goto fail_open;
+	}
 	meta = tx_open(md_dfd, "md_meta", 0);
 	if(!meta)
 		goto fail_meta;
@@ -92,26 +119,34 @@ int managed_dtable::init(int dfd, const char * name, const params & config, sys_
 		{
 			sys_journal::listener_id jid = ddt.ddt_number;
 			sys_journal::listening_dtable * source = sysj->warehouse_obtain(jid, ktype);
+			r = source->set_index(journal_index);
+			if(r < 0)
+				goto fail_disks;
+			/* like shift_journal(), since a background combine may read it */
+			source->finish_index();
 			if(!cmp_name)
 				cmp_name = source->get_cmp_name();
-			disks.push_back(dtable_list_entry(journal, jid));
+			disks.push_back(dtable_list_entry(source, jid));
 		}
 		else
 		{
 			char name[32];
 			dtable * source;
+			off_t bytes;
 			sprintf(name, "md_data.%u", ddt.ddt_number);
-			if(ddt.type == MDTE_TYPE_FASTBASE)
-				source = fastbase->open(md_dfd, name, fastbase_config, sysj);
-			else
-				source = base->open(md_dfd, name, base_config, sysj);
+			source = open_disk(name, ddt.type);
 			if(!source)
 				goto fail_disks;
 			disks.push_back(dtable_list_entry(source, ddt));
+			bytes = util::du(md_dfd, name);
+			disks.back().bytes = (bytes > 0) ? bytes : 0;
 		}
 	}
 	
 	journal = sysj->warehouse_obtain(header.journal_id, ktype);
+	r = journal->set_index(journal_index);
+	if(r < 0)
+		goto fail_disks;
 	if(!cmp_name)
 	{
 		cmp_name = journal->get_cmp_name();
@@ -133,11 +168,10 @@ int managed_dtable::init(int dfd, const char * name, const params & config, sys_
 			array[count - i] = disks[i].disk;
 		array[0] = journal;
 		overlay = new overlay_dtable;
+		overlay->share_stats(&prune);
 		overlay->init(array, count + 1);
 	}
 	
-	digest_thread.start();
-	
 	return 0;
 	
 fail_disks:
@@ -149,6 +183,12 @@ fail_header:
 fail_meta:
 	close(md_dfd);
 	md_dfd = -1;
+fail_open:
+	if(policy)
+	{
+		delete policy;
+		policy = NULL;
+	}
 	return (r < 0) ? r : -1;
 }
 
@@ -159,10 +199,8 @@ void managed_dtable::deinit()
 	if(bg_digesting)
 		background_join();
 	assert(!bg_digesting);
-	digest_thread.request_stop();
-	/* send a STOP message to the queue */
-	digest_queue.send(digest_msg());
-	digest_thread.wait_for_stop();
+	/* the job may still be returning after sending its reply */
+	bg_pool::get_global_pool()->wait(&bg_job);
 	if(!doomed_dtables.empty())
 	{
 		/* FIXME: handle doomed dtables */
@@ -182,11 +220,35 @@ void managed_dtable::deinit()
 	for(size_t i = 0; i < disks.size(); i++)
 		disks[i].disk->destroy();
 	disks.clear();
+	if(policy)
+	{
+		delete policy;
+		policy = NULL;
+	}
 	close(md_dfd);
 	md_dfd = -1;
 	dtable::deinit();
 }
 
+dtable * managed_dtable::open_disk(const char * name, uint8_t type) const
+{
+	bool fast = (type & ~MDTE_TYPE_PARTITIONED) == MDTE_TYPE_FASTBASE;
+	const dtable_factory * factory = fast ? fastbase : base;
+	const params & config = fast ? fastbase_config : base_config;
+	if(type & MDTE_TYPE_PARTITIONED)
+	{
+		keydiv_dtable * partitioned = new keydiv_dtable;
+		int r = partitioned->init(md_dfd, name, factory, config, sysj);
+		if(r < 0)
+		{
+			partitioned->destroy();
+			return NULL;
+		}
+		return partitioned;
+	}
+	return factory->open(md_dfd, name, config, sysj);
+}
+
 dtable::iter * managed_dtable::iterator(ATX_DEF) const
 {
 	if(atx != NO_ABORTABLE_TX)
@@ -214,9 +276,33 @@ bool managed_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 		}
 		return it->second.overlay->present(key, found);
 	}
+	rate_limiter::timer timer(&background_limiter);
 	return overlay->present(key, found);
 }
 
+void managed_dtable::present_many(const dtype * keys, size_t count, bool * out, bool * found, ATX_DEF) const
+{
+	if(atx != NO_ABORTABLE_TX)
+	{
+		atx_map::const_iterator it = open_atx_map.find(atx);
+		if(it == open_atx_map.end())
+		{
+			/* bad abortable transaction ID */
+			for(size_t i = 0; i < count; i++)
+			{
+				out[i] = false;
+				found[i] = false;
+			}
+			return;
+		}
+		it->second.overlay->present_many(keys, count, out, found);
+		return;
+	}
+	/* reports the average latency of the lookups */
+	rate_limiter::timer timer(&background_limiter, count);
+	overlay->present_many(keys, count, out, found);
+}
+
 blob managed_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
 	if(atx != NO_ABORTABLE_TX)
@@ -230,12 +316,38 @@ blob managed_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 		}
 		return it->second.overlay->lookup(key, found);
 	}
+	rate_limiter::timer timer(&background_limiter);
 	return overlay->lookup(key, found);
 }
 
+void managed_dtable::lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	if(atx != NO_ABORTABLE_TX)
+	{
+		atx_map::const_iterator it = open_atx_map.find(atx);
+		if(it == open_atx_map.end())
+		{
+			/* bad abortable transaction ID */
+			for(size_t i = 0; i < count; i++)
+			{
+				found[i] = false;
+				values[i] = blob();
+			}
+			return;
+		}
+		it->second.overlay->lookup_many(keys, count, values, found);
+		return;
+	}
+	/* reports the average latency of the lookups */
+	rate_limiter::timer timer(&background_limiter, count);
+	overlay->lookup_many(keys, count, values, found);
+}
+
 int managed_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
 	int r;
+	/* install the background operation's result, if it's done */
+	background_loan();
 	if(!blob.exists() && !contains(key, atx))
 		return 0;
 	if(atx != NO_ABORTABLE_TX)
@@ -255,6 +367,8 @@ int managed_dtable::insert(const dtype & key, const blob & blob, bool append, AT
 int managed_dtable::remove(const dtype & key, ATX_DEF)
 {
 	int r;
+	/* install the background operation's result, if it's done */
+	background_loan();
 	if(!find(key, atx).exists())
 		return 0;
 	if(atx != NO_ABORTABLE_TX)
@@ -290,6 +404,7 @@ abortable_tx managed_dtable::create_tx()
 	assert(lid != sys_journal::NO_ID);
 	state->journal = sysj->warehouse_obtain(lid, ktype);
 	assert(state->journal);
+	state->journal->set_index(journal_index);
 	if(blob_cmp)
 		state->journal->set_blob_cmp(blob_cmp);
 	
@@ -381,38 +496,52 @@ int managed_dtable::combine(size_t first, size_t last, bool use_fastbase, bool b
 {
 	if(bg_digesting)
 		return -EBUSY;
-	int r = 0;
 	if(background)
 	{
-		digest_msg msg;
-		msg.init_combine(first, last, use_fastbase);
-		digest_queue.send(msg);
-		bg_digesting = true;
+		bg_submit token;
+		return combine(first, last, use_fastbase, &token);
 	}
-	else
-	{
-		fg_token token;
-		r = combine(first, last, use_fastbase, &token);
-	}
-	return r;
+	fg_token token;
+	return combine(first, last, use_fastbase, &token);
 }
 
 template <class T>
 int managed_dtable::combine(size_t first, size_t last, bool use_fastbase, T * token)
 {
-	size_t holds;
-	scopetoken<T> scope(token);
-	combiner worker(this, first, last, use_fastbase);
-	int r = worker.prepare(token);
+	combiner * worker = new combiner(this, first, last, use_fastbase);
+	int r = worker->prepare(token);
 	if(r < 0)
+	{
+		delete worker;
 		return r;
-	holds = scope.full_release();
-	r = worker.run();
-	scope.full_acquire(holds);
-	if(r < 0)
-		/* will call worker.fail() */
-		return r;
-	return worker.finish();
+	}
+	return run_combine(worker, token);
+}
+
+int managed_dtable::run_combine(combiner * worker, fg_token * token)
+{
+	int r = worker->run();
+	if(r >= 0)
+		r = worker->build();
+	if(r >= 0)
+		r = worker->install();
+	/* will call worker->fail() if run() failed */
+	delete worker;
+	return r;
+}
+
+int managed_dtable::run_combine(combiner * worker, bg_submit * token)
+{
+	bg_pool * pool = bg_pool::get_global_pool();
+	assert(!bg_digesting && !bg_combine);
+	/* the previous job may still be returning after sending its reply */
+	pool->wait(&bg_job);
+	bg_combine = worker;
+	/* managed dtables with more disk dtables have slower lookups, and
+	 * benefit more from combining, so their jobs go first */
+	pool->submit(&bg_job, disks.size());
+	bg_digesting = true;
+	return 0;
 }
 
 /* set up the source and shadow overlay dtables */
@@ -435,6 +564,7 @@ int managed_dtable::combiner::prepare(bool shift_journal)
 		/* FIXME: in the event of a later digest error, this will cause there to
 		 * be an extra dtable that the digest schedule won't take into account,
 		 * hurting future performance */
+		mdt->journal->finish_index();
 		mdt->disks.push_back(dtable_list_entry(mdt->journal, mdt->header.journal_id));
 		mdt->header.journal_id = sys_journal::get_unique_id();
 		assert(mdt->header.journal_id != sys_journal::NO_ID);
@@ -452,6 +582,8 @@ int managed_dtable::combiner::prepare(bool shift_journal)
 		}
 		
 		mdt->journal = mdt->sysj->warehouse_obtain(mdt->header.journal_id, mdt->ktype);
+		/* init() already checked that this will work */
+		mdt->journal->set_index(mdt->journal_index);
 		if(mdt->blob_cmp)
 			mdt->journal->set_blob_cmp(mdt->blob_cmp);
 		
@@ -466,6 +598,7 @@ int managed_dtable::combiner::prepare(bool shift_journal)
 				doomed_dtable * doomed = new doomed_dtable(mdt, mdt->overlay);
 				mdt->doomed_dtables.insert(doomed);
 				mdt->overlay = new overlay_dtable;
+				mdt->overlay->share_stats(&mdt->prune);
 			}
 			mdt->overlay->init(array, mdt->header.ddt_count + 1);
 			if(mdt->blob_cmp)
@@ -500,21 +633,24 @@ int managed_dtable::combiner::prepare(bool shift_journal)
 		if(last != (size_t) -1)
 			for(size_t i = first; i <= last; i++)
 				array[last - i + reset_journal] = mdt->disks[i].disk;
+		inputs.assign(array, array + count);
 		source = new overlay_dtable;
 		source->init(array, count);
 		if(mdt->blob_cmp)
 			source->set_blob_cmp(mdt->blob_cmp);
 	}
 	
-	sprintf(name, "md_data.%u", mdt->header.ddt_next);
+	number = mdt->header.ddt_next;
+	sprintf(name, "md_data.%u", number);
 	
 	return 0;
 }
 
 /* create the combined dtable - this can optionally run in a background thread */
-int managed_dtable::combiner::run() const
+int managed_dtable::combiner::run()
 {
 	int r;
+	std::vector<dtype> dividers;
 	
 	/* make the current transaction depend on having written the new file */
 	r = tx_start_external();
@@ -523,10 +659,25 @@ int managed_dtable::combiner::run() const
 	
 	/* there might be one around from a previous failed combine */
 	util::rm_r(mdt->md_dfd, name);
-	if(use_fastbase)
-		r = mdt->fastbase->create(mdt->md_dfd, name, mdt->fastbase_config, source, shadow);
-	else
-		r = mdt->base->create(mdt->md_dfd, name, mdt->base_config, source, shadow);
+	if(mdt->combine_partitions > 1)
+		r = choose_dividers(&dividers);
+	if(r >= 0)
+	{
+		partitioned = !dividers.empty();
+		if(partitioned)
+			r = create_partitions(dividers);
+		else
+		{
+			dtable::iter * iter = source_iterator();
+			if(!iter)
+				r = -ENOMEM;
+			else if(use_fastbase)
+				r = mdt->fastbase->create(mdt->md_dfd, name, mdt->fastbase_config, iter, shadow);
+			else
+				r = mdt->base->create(mdt->md_dfd, name, mdt->base_config, iter, shadow);
+			delete iter;
+		}
+	}
 	
 	tx_end_external(r >= 0);
 	
@@ -534,23 +685,285 @@ int managed_dtable::combiner::run() const
 	return r;
 }
 
-/* update the metadata to refer to the new dtable, and remove the now-obsolete ones */
-int managed_dtable::combiner::finish()
+/* limits an iterator to the keys from low (inclusive) to high (exclusive),
+ * either of which may be NULL to leave that end of the range open */
+class range_iter : public dtable_wrap_iter_noindex
 {
-	sys_journal::listener_id old_id = sys_journal::NO_ID;
-	dtable_list copy;
-	dtable * result;
-	int r;
+public:
+	virtual bool valid() const
+	{
+		return base->valid() && (!high || base->key().compare(*high, base->get_blob_cmp()) < 0);
+	}
+	virtual bool next()
+	{
+		if(!valid())
+			return false;
+		base->next();
+		return valid();
+	}
+	virtual bool prev()
+	{
+		if(!base->prev())
+			return false;
+		if(above_low())
+			return true;
+		base->next();
+		return false;
+	}
+	virtual bool first()
+	{
+		if(low)
+			base->seek(*low);
+		else
+			base->first();
+		return valid();
+	}
+	virtual bool last()
+	{
+		if(high)
+		{
+			base->seek(*high);
+			return prev();
+		}
+		if(!base->last())
+			return false;
+		if(above_low())
+			return true;
+		/* the range is empty; move past the end */
+		base->next();
+		return false;
+	}
+	virtual bool seek(const dtype & key)
+	{
+		if(low && key.compare(*low, base->get_blob_cmp()) < 0)
+		{
+			first();
+			return false;
+		}
+		return base->seek(key) && valid();
+	}
+	virtual bool seek(const dtype_test & test)
+	{
+		bool found = base->seek(test);
+		if(base->valid() && !above_low())
+		{
+			first();
+			return false;
+		}
+		return found && valid();
+	}
+	
+	inline range_iter(dtable::iter * base, const dtype * low, const dtype * high)
+		: dtable_wrap_iter_noindex(base, true), low(low), high(high)
+	{
+	}
+	
+private:
+	inline bool above_low() const
+	{
+		return !low || base->key().compare(*low, base->get_blob_cmp()) >= 0;
+	}
+	
+	const dtype * low;
+	const dtype * high;
+};
+
+/* charges a rate limiter for the keys and values read through an iterator */
+class throttle_iter : public dtable_wrap_iter_noindex
+{
+public:
+	virtual bool next()
+	{
+		if(!base->valid())
+			return false;
+		pending += key_size() + base->meta().size();
+		if(pending >= MDTE_THROTTLE_BYTES)
+		{
+			limiter->consume(pending);
+			pending = 0;
+		}
+		return base->next();
+	}
+	
+	inline throttle_iter(dtable::iter * base, rate_limiter * limiter)
+		: dtable_wrap_iter_noindex(base, true), limiter(limiter), pending(0)
+	{
+	}
+	
+private:
+	inline size_t key_size() const
+	{
+		switch(base->key_type())
+		{
+			case dtype::UINT32:
+				return sizeof(uint32_t);
+			case dtype::DOUBLE:
+				return sizeof(double);
+			default:
+				return base->key().flatten().size();
+		}
+	}
+	
+	rate_limiter * limiter;
+	size_t pending;
+};
+
+rate_limiter managed_dtable::background_limiter;
+
+dtable::iter * managed_dtable::combiner::source_iterator() const
+{
+	dtable::iter * iter = source->iterator();
+	if(iter && throttle)
+	{
+		/* claims iter and will delete it */
+		dtable::iter * wrapper = new throttle_iter(iter, &background_limiter);
+		if(!wrapper)
+			delete iter;
+		iter = wrapper;
+	}
+	return iter;
+}
+
+/* Choose the dividers for a partitioned combine by sampling keys from the
+ * source dtables that support indexed access, in proportion to their sizes.
+ * Leaves the list empty if the combine is too small to be worth splitting. */
+int managed_dtable::combiner::choose_dividers(std::vector<dtype> * dividers) const
+{
+	std::vector<dtype> samples;
+	size_t partitions = mdt->combine_partitions;
+	size_t total = 0;
+	dividers->clear();
+	for(size_t i = 0; i < inputs.size(); i++)
+	{
+		size_t size = inputs[i]->size();
+		if(size != (size_t) -1)
+			total += size;
+	}
+	if(partitions > total / MDTE_PARTITION_MIN_KEYS)
+		partitions = total / MDTE_PARTITION_MIN_KEYS;
+	if(partitions < 2)
+		return 0;
+	
+	for(size_t i = 0; i < inputs.size(); i++)
+	{
+		size_t count, size = inputs[i]->size();
+		dtable::iter * iter;
+		if(!size || size == (size_t) -1)
+			continue;
+		count = (size * partitions * MDTE_PARTITION_SAMPLES + total - 1) / total;
+		iter = inputs[i]->iterator();
+		if(!iter)
+			return -ENOMEM;
+		/* take the key in the middle of each of count equal slices */
+		for(size_t j = 0; j < count; j++)
+		{
+			if(!iter->seek_index((2 * j + 1) * size / (2 * count)))
+				break;
+			samples.push_back(iter->key());
+		}
+		delete iter;
+	}
+	if(samples.size() < partitions)
+		return 0;
+	
+	std::sort(samples.begin(), samples.end(), dtype_comparator_object(mdt->blob_cmp));
+	for(size_t i = 1; i < partitions; i++)
+	{
+		const dtype & divider = samples[i * samples.size() / partitions];
+		/* skip duplicates, which would leave empty partitions */
+		if(dividers->empty() || dividers->back().compare(divider, mdt->blob_cmp) < 0)
+			dividers->push_back(divider);
+	}
+	return 0;
+}
+
+/* create a keydiv dtable with the given dividers, building each of the
+ * underlying dtables from its range of the source in a separate thread */
+int managed_dtable::combiner::create_partitions(const std::vector<dtype> & dividers) const
+{
+	int r = 0, kdd_dfd;
+	size_t count = dividers.size() + 1;
+	partition * parts;
+	
+	kdd_dfd = keydiv_dtable::create_dir(mdt->md_dfd, name, mdt->ktype, dividers);
+	if(kdd_dfd < 0)
+		return kdd_dfd;
+	parts = new partition[count];
+	if(!parts)
+	{
+		close(kdd_dfd);
+		return -ENOMEM;
+	}
+	
+	for(size_t i = 0; i < count; i++)
+	{
+		parts[i].owner = this;
+		parts[i].dfd = kdd_dfd;
+		parts[i].index = i;
+		parts[i].low = i ? &dividers[i - 1] : NULL;
+		parts[i].high = (i < dividers.size()) ? &dividers[i] : NULL;
+		parts[i].result = 0;
+		/* this thread does the first partition itself, below */
+		parts[i].started = i && !pthread_create(&parts[i].thread, NULL, partition_thread, &parts[i]);
+	}
+	for(size_t i = 0; i < count; i++)
+	{
+		if(parts[i].started)
+			pthread_join(parts[i].thread, NULL);
+		else
+			/* also any partitions we could not start a thread for */
+			parts[i].result = create_partition(&parts[i]);
+		if(parts[i].result < 0 && r >= 0)
+			r = parts[i].result;
+	}
+	
+	delete[] parts;
+	close(kdd_dfd);
+	/* fail() will remove the whole directory */
+	return r;
+}
+
+int managed_dtable::combiner::create_partition(const partition * part) const
+{
+	char sub[32];
+	dtable::iter * iter = source_iterator();
+	if(!iter)
+		return -ENOMEM;
+	/* range claims iter and will delete it */
+	range_iter range(iter, part->low, part->high);
+	keydiv_dtable::sub_name(sub, part->index);
+	if(use_fastbase)
+		return mdt->fastbase->create(part->dfd, sub, mdt->fastbase_config, &range, shadow);
+	return mdt->base->create(part->dfd, sub, mdt->base_config, &range, shadow);
+}
+
+void * managed_dtable::combiner::partition_thread(void * arg)
+{
+	partition * part = (partition *) arg;
+	part->result = part->owner->create_partition(part);
+	return NULL;
+}
+
+/* open the combined dtable and make the new list of dtables - this can also
+ * run in a background thread, so it must not change anything in mdt */
+int managed_dtable::combiner::build()
+{
+	mdtable_entry entry;
+	off_t bytes;
 	
 	delete source;
 	source = NULL;
 	if(shadow)
+	{
 		delete shadow;
+		shadow = NULL;
+	}
 	
-	if(use_fastbase)
-		result = mdt->fastbase->open(mdt->md_dfd, name, mdt->fastbase_config, mdt->sysj);
-	else
-		result = mdt->base->open(mdt->md_dfd, name, mdt->base_config, mdt->sysj);
+	entry.ddt_number = number;
+	entry.type = use_fastbase ? MDTE_TYPE_FASTBASE : MDTE_TYPE_REGBASE;
+	if(partitioned)
+		entry.type |= MDTE_TYPE_PARTITIONED;
+	result = mdt->open_disk(name, entry.type);
 	if(!result)
 	{
 		fail();
@@ -560,9 +973,19 @@ int managed_dtable::combiner::finish()
 		result->set_blob_cmp(mdt->blob_cmp);
 	for(size_t i = 0; i < first; i++)
 		copy.push_back(mdt->disks[i]);
-	copy.push_back(dtable_list_entry(result, mdt->header.ddt_next, use_fastbase));
+	copy.push_back(dtable_list_entry(result, entry));
+	bytes = util::du(mdt->md_dfd, name);
+	copy.back().bytes = (bytes > 0) ? bytes : 0;
 	for(size_t i = last + 1; i < mdt->disks.size(); i++)
 		copy.push_back(mdt->disks[i]);
+	return 0;
+}
+
+/* update the metadata to refer to the new dtable, and remove the now-obsolete ones */
+int managed_dtable::combiner::install()
+{
+	sys_journal::listener_id old_id = sys_journal::NO_ID;
+	int r;
 	
 	if(reset_journal)
 	{
@@ -623,6 +1046,7 @@ int managed_dtable::combiner::finish()
 			doomed_dtable * doomed = new doomed_dtable(mdt, mdt->overlay);
 			mdt->doomed_dtables.insert(doomed);
 			mdt->overlay = new overlay_dtable;
+			mdt->overlay->share_stats(&mdt->prune);
 		}
 		mdt->overlay->init(array, mdt->header.ddt_count + 1);
 		if(mdt->blob_cmp)
@@ -637,6 +1061,7 @@ int managed_dtable::combiner::finish()
 			/* FIXME: we can actually discard the sysj entries now, as long as we keep them in memory */
 			mdt->doomed_dtables.insert(doomed);
 			mdt->journal = mdt->sysj->warehouse_obtain(mdt->header.journal_id, mdt->ktype);
+			mdt->journal->set_index(mdt->journal_index);
 		}
 		else
 			mdt->journal->reinit(mdt->header.journal_id);
@@ -707,14 +1132,9 @@ void managed_dtable::combiner::fail()
 
 void managed_dtable::background_loan()
 {
-	if(bg_digesting)
-	{
-		reply_msg reply;
-		if(digest_thread.wants_token())
-			digest_thread.loan_token();
-		if(reply_queue.try_receive(&reply))
-			bg_digesting = false;
-	}
+	reply_msg reply;
+	if(bg_digesting && reply_queue.try_receive(&reply))
+		finish_background(reply.return_value);
 }
 
 int managed_dtable::background_join()
@@ -722,38 +1142,49 @@ int managed_dtable::background_join()
 	if(!bg_digesting)
 		return -EBUSY;
 	reply_msg reply;
-	while(!reply_queue.try_receive(&reply))
+	if(bg_pool::get_global_pool()->cancel(&bg_job))
 	{
-		if(digest_thread.wants_token())
-			digest_thread.loan_token();
-		else
-			usleep(50000); /* 1/20 sec */
+		/* no pool thread has started it yet, so just do it here instead of
+		 * waiting behind other managed dtables' jobs */
+		reply.return_value = bg_combine->run();
+		if(reply.return_value >= 0)
+			reply.return_value = bg_combine->build();
 	}
-	bg_digesting = false;
-	return reply.return_value;
+	else
+		reply_queue.receive(&reply);
+	return finish_background(reply.return_value);
 }
 
-void managed_dtable::digest_thread_main(bg_token * token)
+int managed_dtable::finish_background(int r)
 {
-	while(!digest_thread.stop_requested())
+	combiner * worker = bg_combine;
+	bg_combine = NULL;
+	bg_digesting = false;
+	if(r >= 0)
 	{
-		reply_msg reply;
-		digest_msg message;
-		digest_queue.receive(&message);
-		switch(message.type)
+		/* make sure we have a transaction */
+		r = tx_start_r();
+		if(r >= 0)
 		{
-			case digest_msg::COMBINE:
-				reply.return_value = combine(message.combine.first, message.combine.last, message.combine.use_fastbase, token);
-				reply_queue.send(reply);
-				break;
-			case digest_msg::MAINTAIN:
-				reply.return_value = maintain(message.maintain.force, token);
-				reply_queue.send(reply);
-				break;
-			case digest_msg::STOP:
-				/* fall out */ ;
+			r = worker->install();
+			int e = tx_end_r();
+			if(r >= 0)
+				r = e;
 		}
 	}
+	/* will call worker->fail() if run(), build(), or tx_start_r() failed */
+	delete worker;
+	return r;
+}
+
+void managed_dtable::digest_job::run()
+{
+	reply_msg reply;
+	reply.return_value = mdt->bg_combine->run();
+	if(reply.return_value >= 0)
+		reply.return_value = mdt->bg_combine->build();
+	/* this must be the last use of mdt; see deinit() */
+	mdt->reply_queue.send(reply);
 }
 
 void managed_dtable::doomed_dtable::invoke()
@@ -790,7 +1221,6 @@ void managed_dtable::doomed_dtable::invoke()
 template<class T>
 int managed_dtable::maintain_autocombine(T * token)
 {
-	scopetoken<T> scope(token);
 	size_t count = header.autocombine_digests;
 	header.autocombine_combine_count++;
 	count += ffs(header.autocombine_combine_count) - 1;
@@ -812,24 +1242,51 @@ int managed_dtable::maintain(bool force, bool background)
 {
 	if(bg_digesting)
 	{
-		/* sync with the background thread and finish its work first */
+		/* install the background operation's result first, if it's done */
 		background_loan();
 		if(bg_digesting)
 			/* this is not an error */
 			return 0;
 	}
-	int r = 0;
 	if(background)
 	{
-		digest_msg msg;
-		msg.init_maintain(force);
-		digest_queue.send(msg);
-		bg_digesting = true;
+		bg_submit token;
+		return maintain(force, &token);
 	}
-	else
+	fg_token token;
+	return maintain(force, &token);
+}
+
+template<class T>
+int managed_dtable::maintain_policy(T * token)
+{
+	combine_policy::generation_list gens(disks.size());
+	combine_policy::read_stats reads;
+	size_t first, last, lookups, probed;
+	int r;
+	/* can't do combining if we don't have the requisite comparator */
+	if(cmp_name && !blob_cmp)
+		return 0;
+	for(size_t i = 0; i < disks.size(); i++)
 	{
-		fg_token token;
-		r = maintain(force, &token);
+		gens[i].bytes = disks[i].bytes;
+		gens[i].keys = disks[i].disk->size();
+		gens[i].bounded = disks[i].disk->key_bounds(&gens[i].min, &gens[i].max);
+	}
+	lookups = prune.lookups.get();
+	probed = prune.probed.get();
+	reads.lookups = lookups - policy_lookups;
+	reads.probed = probed - policy_probed;
+	r = policy->choose(gens, reads, blob_cmp, &first, &last);
+	if(r <= 0)
+		return r;
+	assert(first <= last && last < disks.size());
+	r = combine(first, last, false, token);
+	if(r >= 0)
+	{
+		/* the generations have changed, so start counting again */
+		policy_lookups = lookups;
+		policy_probed = probed;
 	}
 	return r;
 }
@@ -841,11 +1298,9 @@ int managed_dtable::maintain(bool force, T * token)
 	time_t now = time(NULL);
 	/* check if we even need to digest */
 	if(!force && header.digested + header.digest_interval > now &&
-	   (header.combined + header.combine_interval > now || autocombine))
-		return 0;
-	scopetoken<T> scope(token);
-	/* get the time again in case it has changed significantly since acquiring the token */
-	now = time(NULL);
+	   (header.combined + header.combine_interval > now || autocombine || policy) && !autocombine_due())
+		/* the combine policy might want to combine anyway */
+		return policy ? maintain_policy(token) : 0;
 	/* well, the journal probably doesn't really need maintenance, but just in case */
 	r = journal->maintain(force);
 	for(size_t i = 0; i < disks.size(); i++)
@@ -886,19 +1341,22 @@ int managed_dtable::maintain(bool force, T * token)
 				header.digested = old;
 				return r;
 			}
-			if(autocombine && header.autocombine_digest_count == header.autocombine_digests)
-			{
-				header.autocombine_digest_count = 0;
-				/* will rewrite header for us! */
-				r = maintain_autocombine(token);
-				if(r < 0)
-				{
-					header.autocombine_digest_count = header.autocombine_digests;
-					return r;
-				}
-			}
 		}
 	}
+	/* anything else will have to wait for a background digest to finish */
+	if(bg_digesting)
+		return 0;
+	if(autocombine_due())
+	{
+		header.autocombine_digest_count = 0;
+		/* will rewrite header for us! */
+		r = maintain_autocombine(token);
+		if(r < 0)
+			header.autocombine_digest_count = header.autocombine_digests;
+		return r;
+	}
+	if(policy)
+		return maintain_policy(token);
 	if(header.combined + header.combine_interval <= now && !autocombine)
 	{
 		time_t old = header.combined;
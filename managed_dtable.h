@@ -20,9 +20,12 @@
 
 #include "dtable_factory.h"
 #include "overlay_dtable.h"
+#include "combine_policy.h"
+#include "rate_limiter.h"
 #include "sys_journal.h"
 
-#include "bg_thread.h"
+#include "bg_pool.h"
+#include "bg_token.h"
 #include "msg_queue.h"
 
 /* A managed dtable is really a collection of dtables: zero or more disk dtables
@@ -39,7 +42,9 @@ public:
 	/* send to overlay_dtable */
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void present_many(const dtype * keys, size_t count, bool * out, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	
 	inline virtual bool writable() const { return true; }
 	
@@ -59,25 +64,39 @@ public:
 		return disks.size();
 	}
 	
+	/* the number of disk dtables (and the journal) that point lookups have
+	 * skipped using their key bounds and filters, and that they searched */
+	inline size_t pruned_tables() const { return prune.pruned.get(); }
+	inline size_t probed_tables() const { return prune.probed.get(); }
+	inline size_t lookup_count() const { return prune.lookups.get(); }
+	
 	/* A note on background operation: the combine(), digest(), and
 	 * maintain() methods frequently have a "bool background" argument. This
 	 * is meant to be used by external callers in the main thread. Passing
 	 * false (usually the default) causes these methods to assume they are
 	 * running in the main thread, and perform the requested operation
-	 * before returning. Passing true causes them to send a message to the
-	 * background thread, requesting it to perform the operation. They will
-	 * return success immediately.
+	 * before returning. Passing true causes them to submit a job to the
+	 * global bg_pool (see bg_pool.h), whose threads are shared by all
+	 * managed dtables, requesting it to perform the operation. They will
+	 * return success immediately. Each managed dtable has at most one such
+	 * operation queued or running at a time, and background maintain() only
+	 * starts one combine or digest per call.
 	 * 
 	 * For internal calls to these methods, for instance in calls to
 	 * combine() or digest() from within maintain(), the private template
-	 * versions below should be used instead. These template versions can
-	 * take a bg_token to allow methods already running in the background
-	 * thread to pass the background token to another method.
+	 * versions below should be used instead. These template versions take
+	 * an fg_token to do the work immediately, or a bg_submit to prepare it
+	 * in the main thread and then submit it to the background.
 	 * 
-	 * When background operation is requested, it must periodically grab the
-	 * background token to allow it to make certain changes atomically
-	 * without interference from the main thread. To allow this, the main
-	 * thread should call background_loan() or maintain() periodically.
+	 * The background thread never changes anything the main thread uses:
+	 * when it has written and opened the new combined dtable, it publishes
+	 * the new list of dtables and is done. The main thread installs it the
+	 * next time it calls insert(), remove(), maintain(), background_loan(),
+	 * or background_join(), which never has to wait for anything. Until
+	 * then, lookups just use the old (equivalent) list of dtables. Since
+	 * lookups are const, they never install it: a caller that only reads
+	 * after starting a background combine keeps the old list (and its
+	 * files) until it calls background_loan() or background_join().
 	 * */
 	
 	/* combine some dtables; first and last are inclusive */
@@ -87,6 +106,12 @@ public:
 	 * disk_dtables() (the journal dtable being the "newest") */
 	/* note that there is always a journal dtable - if it is combined, a new
 	 * one is created to take its place */
+	/* if the combine_partitions parameter is greater than 1, large combines
+	 * split the key range into that many partitions by sampling the keys of
+	 * the dtables being combined, build each partition in its own thread,
+	 * and then join them together with a keydiv_dtable */
+	/* the journal_index parameter chooses the structure the journal dtables
+	 * use to keep keys in order (see journal_dtable::set_index()) */
 	int combine(size_t first, size_t last, bool use_fastbase = false, bool background = false);
 	
 	/* combine everything - no internal version of this */
@@ -102,21 +127,33 @@ public:
 	}
 	
 	/* do maintenance based on parameters */
+	/* if the combine_policy parameter names a combine policy (see
+	 * combine_policy.h), it replaces the combine_interval and autocombine
+	 * schedules: maintain() asks the policy whether to combine each time it
+	 * is called, and does at most one combine per call */
 	inline virtual int maintain(bool force = false) { return maintain(force, bg_default); }
 	int maintain(bool force, bool background);
 	
 	virtual int set_blob_cmp(const blob_comparator * cmp);
 	
-	/* loan the background thread the token, if it wants it, so it can proceed */
+	/* install the result of the background operation, if it has finished */
 	void background_loan();
 	/* wait for a background operation to finish and return its return value */
 	int background_join();
 	
+	/* Background combines and digests (from all managed dtables) share a rate
+	 * limiter for the data they read, in bytes per second with 0 meaning no
+	 * limit. They can also pause while lookups are taking longer than a
+	 * target latency in microseconds, with 0 meaning never to pause. Both
+	 * can be changed at any time; neither affects foreground operations. */
+	static inline void set_background_rate(size_t rate, size_t burst = 0) { background_limiter.set_rate(rate, burst); }
+	static inline void set_background_latency(uint32_t usec) { background_limiter.set_target_latency(usec); }
+	
 	static int create(int dfd, const char * name, const params & config, dtype::ctype key_type);
 	DECLARE_RW_FACTORY(managed_dtable);
 	
 	inline managed_dtable()
-		: digest_thread(this, &managed_dtable::digest_thread_main), bg_digesting(false), bg_default(false), md_dfd(-1), chain(this)
+		: bg_job(this), bg_combine(NULL), bg_digesting(false), bg_default(false), md_dfd(-1), chain(this), policy(NULL)
 	{
 	}
 	int init(int dfd, const char * name, const params & config, sys_journal * sysj);
@@ -150,6 +187,14 @@ private:
 #define MDTE_TYPE_REGBASE 0
 #define MDTE_TYPE_FASTBASE 1
 #define MDTE_TYPE_JOURNAL 2
+/* or'ed into REGBASE or FASTBASE for keydiv dtables made by partitioned combines */
+#define MDTE_TYPE_PARTITIONED 0x80
+/* don't bother partitioning combines with fewer keys than this per partition */
+#define MDTE_PARTITION_MIN_KEYS 16384
+/* how many keys to sample per partition to choose the partition dividers */
+#define MDTE_PARTITION_SAMPLES 32
+/* how much data background combines read between calls to the rate limiter */
+#define MDTE_THROTTLE_BYTES 65536
 	struct mdtable_entry
 	{
 		uint32_t ddt_number;
@@ -170,16 +215,18 @@ private:
 			};
 		};
 		uint8_t type; /* one of the MDTE_TYPE_* types */
+		/* size on disk, for the combine policy (0 for journals) */
+		size_t bytes;
 		inline dtable_list_entry(dtable * dtable, const mdtable_entry & entry)
-			: disk(dtable), ddt_number(entry.ddt_number), type(entry.type)
+			: disk(dtable), ddt_number(entry.ddt_number), type(entry.type), bytes(0)
 		{
 		}
 		inline dtable_list_entry(dtable * dtable, uint32_t number, bool fastbase)
-			: disk(dtable), ddt_number(number), type(fastbase ? MDTE_TYPE_FASTBASE : MDTE_TYPE_REGBASE)
+			: disk(dtable), ddt_number(number), type(fastbase ? MDTE_TYPE_FASTBASE : MDTE_TYPE_REGBASE), bytes(0)
 		{
 		}
 		inline dtable_list_entry(sys_journal::listening_dtable * journal, sys_journal::listener_id jid)
-			: disk(journal), journal(journal), jid(jid), type(MDTE_TYPE_JOURNAL)
+			: disk(journal), journal(journal), jid(jid), type(MDTE_TYPE_JOURNAL), bytes(0)
 		{
 		}
 	};
@@ -191,6 +238,20 @@ private:
 	int maintain(bool force, T * token);
 	template<class T>
 	int maintain_autocombine(T * token);
+	template<class T>
+	int maintain_policy(T * token);
+	
+	/* opens a disk dtable given its name and MDTE_TYPE_* type */
+	dtable * open_disk(const char * name, uint8_t type) const;
+	
+	/* passed to the template methods above to run combines in the background */
+	struct bg_submit {};
+	
+	/* true if enough digests have been done to start an autocombine */
+	inline bool autocombine_due() const
+	{
+		return autocombine && header.autocombine_digest_count && header.autocombine_digest_count == header.autocombine_digests;
+	}
 	
 	template<class T>
 	int digest_internal(bool use_fastbase, T extra)
@@ -204,15 +265,17 @@ private:
 	{
 	public:
 		inline combiner(managed_dtable * mdt, size_t first, size_t last, bool use_fastbase)
-			: mdt(mdt), first(first), last(last), use_fastbase(use_fastbase), source(NULL), shadow(NULL), reset_journal(false)
+			: mdt(mdt), first(first), last(last), use_fastbase(use_fastbase), source(NULL), shadow(NULL), result(NULL), reset_journal(false), partitioned(false), throttle(false)
 		{
 		}
 		int prepare(bool shift_journal);
 		/* we only care about the type of the parameter */
-		inline int prepare(bg_token * token) { return prepare(true); }
+		inline int prepare(bg_submit * token) { throttle = true; return prepare(true); }
 		inline int prepare(fg_token * token) { return prepare(false); }
-		int run() const;
-		int finish();
+		/* run() and build() can run in a background thread */
+		int run();
+		int build();
+		int install();
 		void fail();
 		inline ~combiner()
 		{
@@ -222,56 +285,67 @@ private:
 		
 	private:
 		int write_meta(const dtable_list & copy) const;
+		/* returns a source iterator, rate limited if running in the background */
+		dtable::iter * source_iterator() const;
+		
+		/* one range of keys in a partitioned combine */
+		struct partition
+		{
+			const combiner * owner;
+			int dfd;
+			uint32_t index;
+			/* NULL for the first and last partitions, respectively */
+			const dtype * low;
+			const dtype * high;
+			pthread_t thread;
+			bool started;
+			int result;
+		};
+		int choose_dividers(std::vector<dtype> * dividers) const;
+		int create_partitions(const std::vector<dtype> & dividers) const;
+		int create_partition(const partition * part) const;
+		static void * partition_thread(void * arg);
 		
 		managed_dtable * mdt;
 		size_t first, last;
 		const bool use_fastbase;
 		overlay_dtable * source;
 		overlay_dtable * shadow;
-		bool reset_journal;
+		/* the new combined dtable, and the list of dtables including it */
+		dtable * result;
+		dtable_list copy;
+		uint32_t number;
+		/* the dtables in source, for sampling keys */
+		std::vector<dtable *> inputs;
+		bool reset_journal, partitioned, throttle;
 		char name[32];
 	};
 	
-	/* each managed dtable has a background thread for doing
-	 * digest/combine operations; these members are used for it */
-	struct digest_msg
-	{
-		enum { STOP, COMBINE, MAINTAIN } type;
-		union
-		{
-			struct
-			{
-				size_t first, last;
-				bool use_fastbase;
-			} combine;
-			struct
-			{
-				bool force;
-			} maintain;
-		};
-		inline digest_msg() : type(STOP) {}
-		inline void init_combine(size_t first, size_t last, bool use_fastbase)
-		{
-			type = COMBINE;
-			combine.first = first;
-			combine.last = last;
-			combine.use_fastbase = use_fastbase;
-		}
-		inline void init_maintain(bool force)
-		{
-			type = MAINTAIN;
-			maintain.force = force;
-		}
-	};
+	/* managed dtables do digest/combine operations in the background by
+	 * submitting jobs to the global bg_pool; these members are used for it */
 	struct reply_msg
 	{
 		int return_value;
 	};
-	bg_thread<managed_dtable> digest_thread;
-	msg_queue<digest_msg> digest_queue;
+	class digest_job : public bg_pool::job
+	{
+	public:
+		virtual void run();
+		inline digest_job(managed_dtable * mdt) : mdt(mdt) {}
+	private:
+		managed_dtable * const mdt;
+	};
+	digest_job bg_job;
+	/* the combine that bg_job is running */
+	combiner * bg_combine;
 	msg_queue<reply_msg> reply_queue;
 	bool bg_digesting, bg_default;
-	void digest_thread_main(bg_token * token);
+	/* runs a prepared combine now, or submits it to bg_job */
+	int run_combine(combiner * worker, fg_token * token);
+	int run_combine(combiner * worker, bg_submit * token);
+	/* installs the result of bg_combine, given the value bg_job returned */
+	int finish_background(int r);
+	static rate_limiter background_limiter;
 	
 	/* preexisting iterators may be using dtables that will be destroyed by
 	 * a combine - we delay destroying these dtables and register callbacks
@@ -329,14 +403,20 @@ private:
 	
 	dtable_list disks;
 	overlay_dtable * overlay;
+	/* shared by all the overlays we create for lookups, which get replaced */
+	overlay_dtable::prune_stats prune;
 	mutable chain_callback chain;
 	sys_journal::listening_dtable * journal;
 	sys_journal * sysj;
 	const dtable_factory * base;
 	const dtable_factory * fastbase;
 	params base_config, fastbase_config;
-	size_t digest_size;
+	istr journal_index;
+	size_t digest_size, combine_partitions;
 	bool digest_on_close, close_digest_fastbase, autocombine;
+	combine_policy * policy;
+	/* the lookup statistics as of the last policy combine */
+	size_t policy_lookups, policy_probed;
 };
 
 #endif /* __MANAGED_DTABLE_H */
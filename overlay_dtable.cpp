@@ -4,11 +4,14 @@
 #include <errno.h>
 #include <stdarg.h>
 
+#include <vector>
+#include <algorithm>
+
 #include "util.h"
 #include "overlay_dtable.h"
 
 overlay_dtable::iter::iter(const overlay_dtable * source)
-	: iter_source<overlay_dtable>(source), lastdir(FORWARD), past_beginning(false)
+	: iter_source<overlay_dtable>(source), lastdir(FORWARD), past_beginning(false), heap_ready(false)
 {
 	subs = new sub[source->table_count];
 	for(size_t i = 0; i < source->table_count; i++)
@@ -35,13 +38,30 @@ bool overlay_dtable::iter::valid() const
 	return current_index < dt_source->table_count;
 }
 
+void overlay_dtable::iter::build_heap()
+{
+	heap.clear();
+	consumed.clear();
+	for(size_t i = 0; i < dt_source->table_count; i++)
+	{
+		/* the heap finds shadowed entries by itself */
+		subs[i].shadow = false;
+		if(!subs[i].valid)
+			continue;
+		if(subs[i].empty)
+			consumed.push_back(i);
+		else
+			heap.push_back(i);
+	}
+	std::make_heap(heap.begin(), heap.end(), sub_order(subs, dt_source->blob_cmp));
+	heap_ready = true;
+}
+
 /* this will let non-existent blobs shadow extant ones just like we want
  * without any special handling, since next() and valid() still return true */
 bool overlay_dtable::iter::next()
 {
-	bool first = true;
-	dtype min_key(0u);
-	const blob_comparator * blob_cmp = dt_source->blob_cmp;
+	sub_order order(subs, dt_source->blob_cmp);
 	current_index = dt_source->table_count;
 	
 	if(lastdir == BACKWARD)
@@ -64,47 +84,47 @@ bool overlay_dtable::iter::next()
 			subs[i].shadow = false;
 		}
 		lastdir = FORWARD;
+		heap_ready = false;
 		if(past_beginning)
 		{
 			past_beginning = false;
 			next();
 		}
 	}
+	if(!heap_ready)
+		build_heap();
 	
-	for(size_t i = 0; i < dt_source->table_count; i++)
+	/* fill in empty slots */
+	for(size_t i = 0; i < consumed.size(); i++)
 	{
-		int c;
-		if(subs[i].empty && subs[i].valid)
-		{
-			/* fill in empty slots */
-			subs[i].valid = subs[i].iter->next();
-			subs[i].empty = !subs[i].valid;
-			if(!subs[i].empty)
-				subs[i].key = subs[i].iter->key();
-		}
-		if(!subs[i].valid || subs[i].shadow)
-			/* skip exhausted and shadowed tables */
+		sub * slot = &subs[consumed[i]];
+		slot->valid = slot->iter->next();
+		slot->empty = !slot->valid;
+		if(slot->empty)
+			/* exhausted */
 			continue;
-		if(first || (c = subs[i].key.compare(min_key, blob_cmp)) < 0)
-		{
-			first = false;
-			current_index = i;
-			min_key = subs[i].key;
-		}
-		else if(!c)
-			/* shadow this entry */
-			subs[i].shadow = true;
+		slot->key = slot->iter->key();
+		heap.push_back(consumed[i]);
+		std::push_heap(heap.begin(), heap.end(), order);
 	}
-	if(current_index == dt_source->table_count)
+	consumed.clear();
+	
+	if(heap.empty())
 		return false;
+	/* ties go to the lowest index, so this is the entry that shadows any others */
+	std::pop_heap(heap.begin(), heap.end(), order);
+	current_index = heap.back();
+	heap.pop_back();
 	subs[current_index].empty = true;
-	for(size_t i = current_index + 1; i < dt_source->table_count; i++)
-		if(subs[i].shadow)
-		{
-			/* skip shadowed entry */
-			subs[i].empty = true;
-			subs[i].shadow = false;
-		}
+	consumed.push_back(current_index);
+	while(!heap.empty() && !subs[heap.front()].key.compare(subs[current_index].key, dt_source->blob_cmp))
+	{
+		/* skip shadowed entry */
+		std::pop_heap(heap.begin(), heap.end(), order);
+		subs[heap.back()].empty = true;
+		consumed.push_back(heap.back());
+		heap.pop_back();
+	}
 	return true;
 }
 
@@ -115,6 +135,7 @@ bool overlay_dtable::iter::prev()
 	const blob_comparator * blob_cmp = dt_source->blob_cmp;
 	size_t next_index = dt_source->table_count;
 	
+	heap_ready = false;
 	if(lastdir == FORWARD)
 	{
 		for(size_t i = 0; i < dt_source->table_count; i++)
@@ -185,6 +206,7 @@ bool overlay_dtable::iter::first()
 	}
 	lastdir = FORWARD;
 	past_beginning = false;
+	heap_ready = false;
 	return next();
 }
 
@@ -201,6 +223,7 @@ bool overlay_dtable::iter::last()
 	}
 	lastdir = FORWARD;
 	past_beginning = false;
+	heap_ready = false;
 	return prev();
 }
 
@@ -224,6 +247,7 @@ bool overlay_dtable::iter::seek(const dtype & key)
 	}
 	lastdir = FORWARD;
 	past_beginning = false;
+	heap_ready = false;
 	next();
 	return found;
 }
@@ -243,6 +267,7 @@ bool overlay_dtable::iter::seek(const dtype_test & test)
 	}
 	lastdir = FORWARD;
 	past_beginning = false;
+	heap_ready = false;
 	next();
 	return found;
 }
@@ -269,28 +294,174 @@ dtable::iter * overlay_dtable::iterator(ATX_DEF) const
 
 bool overlay_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 {
+	size_t pruned = 0;
 	for(size_t i = 0; i < table_count; i++)
 	{
+		if(!table_may_contain(i, key))
+		{
+			pruned++;
+			continue;
+		}
 		bool result = tables[i]->present(key, found);
 		if(*found)
+		{
+			add_stats(pruned, i + 1 - pruned);
 			return result;
+		}
 	}
+	add_stats(pruned, table_count - pruned);
 	*found = false;
 	return false;
 }
 
+void overlay_dtable::present_many(const dtype * keys, size_t count, bool * out, bool * found, ATX_DEF) const
+{
+	/* like lookup_many(), pass the whole batch to each table in turn, minus
+	 * the keys found in the tables above it */
+	size_t left = count, pruned = 0, probed = 0;
+	std::vector<size_t> pending(count);
+	std::vector<size_t> probe;
+	std::vector<dtype> batch;
+	bool * batch_out;
+	bool * batch_found;
+	if(!count)
+		return;
+	batch_out = new bool[count];
+	batch_found = new bool[count];
+	for(size_t i = 0; i < count; i++)
+	{
+		pending[i] = i;
+		out[i] = false;
+		found[i] = false;
+	}
+	probe.reserve(count);
+	batch.reserve(count);
+	for(size_t i = 0; i < table_count && left; i++)
+	{
+		size_t kept = 0;
+		probe.clear();
+		batch.clear();
+		for(size_t j = 0; j < left; j++)
+			if(table_may_contain(i, keys[pending[j]]))
+			{
+				probe.push_back(pending[j]);
+				batch.push_back(keys[pending[j]]);
+			}
+		pruned += left - probe.size();
+		probed += probe.size();
+		if(probe.empty())
+			continue;
+		tables[i]->present_many(&batch[0], probe.size(), batch_out, batch_found);
+		for(size_t j = 0; j < probe.size(); j++)
+			if(batch_found[j])
+			{
+				found[probe[j]] = true;
+				out[probe[j]] = batch_out[j];
+			}
+		/* keep the keys not yet found, in order */
+		for(size_t j = 0; j < left; j++)
+			if(!found[pending[j]])
+				pending[kept++] = pending[j];
+		left = kept;
+	}
+	add_stats(pruned, probed, count);
+	delete[] batch_found;
+	delete[] batch_out;
+}
+
 blob overlay_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
+	size_t pruned = 0;
 	for(size_t i = 0; i < table_count; i++)
 	{
+		if(!table_may_contain(i, key))
+		{
+			pruned++;
+			continue;
+		}
 		blob value = tables[i]->lookup(key, found);
 		if(*found)
+		{
+			add_stats(pruned, i + 1 - pruned);
 			return value;
+		}
 	}
+	add_stats(pruned, table_count - pruned);
 	*found = false;
 	return blob();
 }
 
+void overlay_dtable::lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	/* rather than walking all the tables for each key, pass the whole batch
+	 * to each table in turn, minus the keys found in the tables above it */
+	size_t left = count, pruned = 0, probed = 0;
+	std::vector<size_t> pending(count);
+	std::vector<size_t> probe;
+	std::vector<dtype> batch;
+	std::vector<blob> batch_values(count);
+	bool * batch_found;
+	if(!count)
+		return;
+	batch_found = new bool[count];
+	for(size_t i = 0; i < count; i++)
+	{
+		pending[i] = i;
+		found[i] = false;
+		values[i] = blob();
+	}
+	probe.reserve(count);
+	batch.reserve(count);
+	for(size_t i = 0; i < table_count && left; i++)
+	{
+		size_t kept = 0;
+		probe.clear();
+		batch.clear();
+		for(size_t j = 0; j < left; j++)
+			if(table_may_contain(i, keys[pending[j]]))
+			{
+				probe.push_back(pending[j]);
+				batch.push_back(keys[pending[j]]);
+			}
+		pruned += left - probe.size();
+		probed += probe.size();
+		if(probe.empty())
+			continue;
+		tables[i]->lookup_many(&batch[0], probe.size(), &batch_values[0], batch_found);
+		for(size_t j = 0; j < probe.size(); j++)
+			if(batch_found[j])
+			{
+				found[probe[j]] = true;
+				values[probe[j]] = batch_values[j];
+			}
+		/* keep the keys not yet found, in order */
+		for(size_t j = 0; j < left; j++)
+			if(!found[pending[j]])
+				pending[kept++] = pending[j];
+		left = kept;
+	}
+	add_stats(pruned, probed, count);
+	delete[] batch_found;
+}
+
+bool overlay_dtable::key_bounds(dtype * min, dtype * max) const
+{
+	const table_bounds * all = &bounds[table_count];
+	if(!all->known)
+		return false;
+	*min = all->min;
+	*max = all->max;
+	return true;
+}
+
+bool overlay_dtable::may_contain(const dtype & key) const
+{
+	for(size_t i = 0; i < table_count; i++)
+		if(table_may_contain(i, key))
+			return true;
+	return false;
+}
+
 int overlay_dtable::set_blob_cmp(const blob_comparator * cmp)
 {
 	for(size_t i = 0; i < table_count; i++)
@@ -334,6 +505,7 @@ int overlay_dtable::init(dtable * dt1, ...)
 	for(count = 1; count < table_count; count++)
 		tables[count] = va_arg(ap, dtable *);
 	va_end(ap);
+	init_bounds();
 	return 0;
 }
 
@@ -354,15 +526,52 @@ int overlay_dtable::init(dtable ** dts, size_t count)
 		return -ENOMEM;
 	table_count = count;
 	util::memcpy(tables, dts, sizeof(*dts) * count);
+	init_bounds();
 	return 0;
 }
 
+void overlay_dtable::init_bounds()
+{
+	table_bounds * all;
+	bounds = new table_bounds[table_count + 1];
+	all = &bounds[table_count];
+	all->known = true;
+	for(size_t i = 0; i < table_count; i++)
+	{
+		table_bounds * b = &bounds[i];
+		b->known = tables[i]->key_bounds(&b->min, &b->max);
+		if(!b->known)
+			all->known = false;
+		else if(!i)
+		{
+			all->min = b->min;
+			all->max = b->max;
+		}
+		else if(all->known)
+		{
+			/* blob keys are compared with the blob comparator at lookup time, but
+			 * it may not be set yet, so don't try to combine blob bounds here */
+			if(ktype == dtype::BLOB)
+				all->known = false;
+			else
+			{
+				if(b->min.compare(all->min) < 0)
+					all->min = b->min;
+				if(b->max.compare(all->max) > 0)
+					all->max = b->max;
+			}
+		}
+	}
+}
+
 void overlay_dtable::deinit()
 {
 	if(!tables)
 		return;
 	delete[] tables;
 	tables = NULL;
+	delete[] bounds;
+	bounds = NULL;
 	table_count = 0;
 	dtable::deinit();
 }
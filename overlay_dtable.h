@@ -12,22 +12,46 @@
 #error overlay_dtable.h is a C++ header file
 #endif
 
+#include <vector>
+
+#include "atomic.h"
 #include "dtable.h"
 
 /* The overlay dtable just combines underlying dtables in the order specified.
  * Note that it does not propagate blob comparators to them, but it does need
  * its own blob comparator set if one is in use by the underlying dtables. */
 
+/* Point lookups skip any underlying dtable whose key_bounds() exclude the key
+ * or whose may_contain() rejects it, so that a miss need not search every one
+ * of many disk dtables. The bounds are collected once, in init(). */
+
 class overlay_dtable : public dtable
 {
 public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void present_many(const dtype * keys, size_t count, bool * out, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
+	virtual bool key_bounds(dtype * min, dtype * max) const;
+	virtual bool may_contain(const dtype & key) const;
 	
 	virtual int set_blob_cmp(const blob_comparator * cmp);
 	
-	inline overlay_dtable() : tables(NULL), table_count(0) {}
+	/* counts of underlying dtables skipped and searched by lookups, and of
+	 * the lookups themselves (so probed / lookups is the read amplification) */
+	struct prune_stats
+	{
+		atomic<size_t> pruned, probed, lookups;
+	};
+	inline size_t pruned_tables() const { return stats->pruned.get(); }
+	inline size_t probed_tables() const { return stats->probed.get(); }
+	inline size_t lookup_count() const { return stats->lookups.get(); }
+	/* count into the given statistics instead, e.g. to share them with other
+	 * overlays; pass NULL to go back to this overlay's own statistics */
+	inline void share_stats(prune_stats * shared) { stats = shared ? shared : &own_stats; }
+	
+	inline overlay_dtable() : tables(NULL), table_count(0), bounds(NULL), stats(&own_stats) {}
 	int init(dtable * dt1, ...);
 	int init(dtable ** dts, size_t count);
 	/* overlay_dtable has a public destructor (and no factory) */
@@ -67,14 +91,66 @@ private:
 			inline sub() : key(0u) {}
 		};
 		
+		/* orders sub indices by key and then index, but reversed, since
+		 * the standard heap algorithms put the largest element first */
+		struct sub_order
+		{
+			const sub * subs;
+			const blob_comparator * blob_cmp;
+			inline sub_order(const sub * subs, const blob_comparator * blob_cmp) : subs(subs), blob_cmp(blob_cmp) {}
+			inline bool operator()(size_t a, size_t b) const
+			{
+				int c = subs[a].key.compare(subs[b].key, blob_cmp);
+				return c ? c > 0 : a > b;
+			}
+		};
+		
+		void build_heap();
+		
 		sub * subs;
 		size_t current_index;
 		enum direction {FORWARD, BACKWARD} lastdir;
 		bool past_beginning;
+		/* When moving forward, the valid subs which are not empty are kept in
+		 * a heap, so next() takes O(log n) comparisons rather than O(n), and
+		 * the ones made empty by the last call to next() are listed in
+		 * consumed. Anything else that moves the subs clears heap_ready. */
+		bool heap_ready;
+		std::vector<size_t> heap, consumed;
 	};
 	
+	struct table_bounds
+	{
+		bool known;
+		dtype min, max;
+		inline table_bounds() : known(false), min(0u), max(0u) {}
+	};
+	
+	void init_bounds();
+	inline bool table_may_contain(size_t i, const dtype & key) const
+	{
+		const table_bounds * b = &bounds[i];
+		/* blob bounds are useless until we have the right blob comparator */
+		if(b->known && (key.type != dtype::BLOB || blob_cmp || !cmp_name))
+			if(key.compare(b->min, blob_cmp) < 0 || key.compare(b->max, blob_cmp) > 0)
+				return false;
+		return tables[i]->may_contain(key);
+	}
+	inline void add_stats(size_t pruned, size_t probed, size_t lookups = 1) const
+	{
+		stats->lookups.add(lookups);
+		if(pruned)
+			stats->pruned.add(pruned);
+		if(probed)
+			stats->probed.add(probed);
+	}
+	
 	dtable ** tables;
 	size_t table_count;
+	/* one for each table, and then one more for all of them together */
+	table_bounds * bounds;
+	prune_stats own_stats;
+	prune_stats * stats;
 };
 
 #endif /* __OVERLAY_DTABLE_H */
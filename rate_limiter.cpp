@@ -0,0 +1,78 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <unistd.h>
+
+#include "rate_limiter.h"
+
+/* how long to pause at a time while foreground operations are slow */
+#define RL_YIELD_USEC 10000
+/* don't pause for more than this long per consume() call, so background
+ * work still makes some progress even if foreground operations stay slow */
+#define RL_MAX_YIELDS 100
+/* latency reports older than this are no longer considered recent */
+#define RL_RECENT_USEC 100000
+
+void rate_limiter::set_rate(size_t rate, size_t burst)
+{
+	scopelock scope(lock);
+	if(!burst)
+		burst = rate / 4;
+	this->rate.set(rate);
+	this->burst = burst;
+	if(tokens > burst)
+		tokens = burst;
+}
+
+void rate_limiter::consume(size_t bytes)
+{
+	uint64_t delay = 0;
+	if(rate.get())
+	{
+		scopelock scope(lock);
+		size_t rate = this->rate.get();
+		uint64_t now = now_usec();
+		if(rate)
+		{
+			/* refill the bucket for the time since the last call */
+			if(filled)
+			{
+				tokens += (now - filled) * (double) rate / 1000000;
+				if(tokens > burst)
+					tokens = burst;
+			}
+			else
+				tokens = burst;
+			filled = now;
+			/* go into debt if necessary, and sleep until it's paid off */
+			tokens -= bytes;
+			if(tokens < 0)
+				delay = (uint64_t) (-tokens * 1000000 / rate);
+		}
+	}
+	/* sleep without holding the lock, so others can get in debt too */
+	while(delay)
+	{
+		uint64_t sleep = (delay > 500000) ? 500000 : delay;
+		usleep(sleep);
+		delay -= sleep;
+	}
+	for(int i = 0; i < RL_MAX_YIELDS && foreground_slow(); i++)
+		usleep(RL_YIELD_USEC);
+}
+
+void rate_limiter::report_latency(uint32_t usec, uint64_t now)
+{
+	uint32_t average = latency.get();
+	/* concurrent reports may lose updates, which is fine for an average */
+	latency.set(average - average / 8 + usec / 8);
+	reported.set(now);
+}
+
+bool rate_limiter::foreground_slow() const
+{
+	uint32_t target = this->target.get();
+	if(!target || latency.get() <= target)
+		return false;
+	return now_usec() - reported.get() < RL_RECENT_USEC;
+}
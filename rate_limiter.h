@@ -0,0 +1,96 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __RATE_LIMITER_H
+#define __RATE_LIMITER_H
+
+#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error rate_limiter.h is a C++ header file
+#endif
+
+#include "atomic.h"
+#include "locking.h"
+
+/* A token bucket rate limiter for background I/O. Background threads call
+ * consume() with the number of bytes they have just read or written, and it
+ * sleeps as necessary to keep their combined average rate at or below the
+ * configured limit, while allowing bursts of up to the bucket size. It can
+ * also be told how long foreground operations are taking: if a target
+ * latency is set and recent foreground operations are slower than that,
+ * consume() additionally pauses to let them have the disk to themselves.
+ * The rate and target latency can be changed at any time. */
+
+class rate_limiter
+{
+public:
+	/* bytes per second, or 0 for no limit; burst is the size of the bucket
+	 * in bytes, or 0 to allow a quarter of a second's worth of data */
+	void set_rate(size_t rate, size_t burst = 0);
+	inline size_t get_rate() const { return rate.get(); }
+	
+	/* in microseconds, or 0 to never yield to foreground operations */
+	inline void set_target_latency(uint32_t usec) { target.set(usec); }
+	inline uint32_t get_target_latency() const { return target.get(); }
+	
+	/* called from background threads; may sleep */
+	void consume(size_t bytes);
+	
+	/* called from foreground threads with the latency of an operation */
+	void report_latency(uint32_t usec, uint64_t now);
+	
+	static inline uint64_t now_usec()
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec * (uint64_t) 1000000 + now.tv_nsec / 1000;
+	}
+	
+	/* times a foreground operation from construction to destruction, but
+	 * only if the limiter has a target latency to compare it against */
+	class timer
+	{
+	public:
+		inline timer(rate_limiter * limiter, size_t count = 1)
+			: limiter(limiter->get_target_latency() ? limiter : NULL), count(count)
+		{
+			if(this->limiter)
+				start = now_usec();
+		}
+		inline ~timer()
+		{
+			if(limiter && count)
+			{
+				uint64_t now = now_usec();
+				limiter->report_latency((now - start) / count, now);
+			}
+		}
+	private:
+		rate_limiter * limiter;
+		size_t count;
+		uint64_t start;
+	};
+	
+	inline rate_limiter() : rate(0), burst(0), tokens(0), filled(0), target(0), latency(0), reported(0) {}
+	
+private:
+	/* true if foreground operations have recently been slower than the target */
+	bool foreground_slow() const;
+	
+	atomic<size_t> rate;
+	size_t burst;
+	double tokens;
+	uint64_t filled;
+	/* protects burst, tokens, and filled */
+	init_mutex lock;
+	
+	atomic<uint32_t> target;
+	/* a moving average of the reported latencies, and when it last changed */
+	atomic<uint32_t> latency;
+	atomic<uint64_t> reported;
+};
+
+#endif /* __RATE_LIMITER_H */
@@ -17,6 +17,7 @@
 #include "istr.h"
 #include "util.h"
 #include "locking.h"
+#include "block_cache.h"
 
 /* This class provides a stdio-like wrapper around a read-only file descriptor,
  * keeping track of several buffers for file data preread from different parts
@@ -24,10 +25,19 @@
  * the file system buffer cache to do most of the real caching work; this class
  * just amortizes the cost of system calls over many small read requests. */
 
+/* Because the buffers are shared by all readers, reads must hold the lock below.
+ * Alternatively, open_mapped() maps the whole file at once and keeps no cursor
+ * or buffer state at all, so reads from it need no lock and can proceed from
+ * many threads concurrently. Disk dtables select it with "concurrent_reads". */
+
+/* When the global block cache (see block_cache.h) has a budget, open() and
+ * open_mmap() instead return rofiles that keep no buffers of their own, and
+ * read through the shared cache, using their buffer size as the block size. */
+
 class rofile
 {
 public:
-	inline rofile() : fd(-1) {}
+	inline rofile() : fd(-1), no_lock(false) {}
 	inline virtual ~rofile()
 	{
 		if(fd >= 0)
@@ -73,12 +83,20 @@ public:
 	template<ssize_t buffer_size, int buffer_count>
 	static rofile * open_mmap(int dfd, const char * file);
 	
+	/* page_size is in KiB, and is only used by page() */
+	template<ssize_t page_size>
+	static rofile * open_mapped(int dfd, const char * file);
+	
 	/* size of file in bytes */
 	inline off_t size() const { return f_size; }
 	
 	/* public so callers can lock it with scopelocks */
 	mutable init_mutex lock;
 	
+	/* true if read() and page() need not be protected by the lock above; page()
+	 * pointers from such an rofile also remain valid until it is destroyed */
+	inline bool lock_free() const { return no_lock; }
+	
 protected:
 	/* reset all buffers */
 	virtual void reset() = 0;
@@ -86,6 +104,7 @@ protected:
 	int fd;
 	off_t f_size;
 	mutable size_t last_buffer;
+	bool no_lock;
 
 private:
 	struct buffer_base
@@ -302,6 +321,119 @@ private:
 	}
 };
 
+/* page_size is in bytes */
+template<ssize_t page_size>
+class rofile_mapped : public rofile
+{
+public:
+	inline rofile_mapped() : data(NULL), mapped(0) { no_lock = true; }
+	inline virtual ~rofile_mapped() { unmap(); }
+	
+	virtual ssize_t read(off_t offset, void * buffer, ssize_t size, bool do_lock) const
+	{
+		if(!data)
+			/* the mapping failed, but pread() is also safe without the lock */
+			return pread(fd, buffer, size, offset);
+		if(offset >= mapped)
+			return 0;
+		if(size > mapped - offset)
+			size = mapped - offset;
+		util::memcpy(buffer, &data[offset], size);
+		return size;
+	}
+	
+	virtual const void * page(off_t index)
+	{
+		off_t offset = index * page_size;
+		if(!data || offset >= mapped)
+			return NULL;
+		return &data[offset];
+	}
+	
+private:
+	uint8_t * data;
+	off_t mapped;
+	
+	virtual void reset()
+	{
+		unmap();
+		if(f_size <= 0)
+			return;
+		data = (uint8_t *) mmap(NULL, f_size, PROT_READ, MAP_SHARED, fd, 0);
+		if(data == MAP_FAILED)
+		{
+			data = NULL;
+			return;
+		}
+		mapped = f_size;
+	}
+	
+	inline void unmap()
+	{
+		if(data)
+		{
+			munmap(data, mapped);
+			data = NULL;
+			mapped = 0;
+		}
+	}
+};
+
+/* block_size is in bytes */
+template<ssize_t block_size>
+class rofile_cached : public rofile
+{
+public:
+	virtual ssize_t read(off_t offset, void * data, ssize_t size, bool do_lock) const
+	{
+		ssize_t left = size;
+		if(size > block_size)
+			return pread(fd, data, size, offset);
+		/* the block cache has its own locks, and we have no state to protect */
+		while(left)
+		{
+			off_t index = offset / block_size;
+			size_t start = offset % block_size;
+			ssize_t r = block_cache::global.read(fd, file_id, index, block_size, start, data, left);
+			if(r <= 0)
+				break;
+			offset += r;
+			data = &((uint8_t *) data)[r];
+			left -= r;
+			/* a short block means end of file */
+			if(start + r < block_size && left)
+				break;
+		}
+		return size - left;
+	}
+	
+	virtual const void * page(off_t index)
+	{
+		ssize_t r;
+		lock.assert_locked();
+		if(index == page_index)
+			return page_data;
+		page_index = -1;
+		r = block_cache::global.read(fd, file_id, index, block_size, 0, page_data, block_size);
+		if(r <= 0)
+			return NULL;
+		page_index = index;
+		return page_data;
+	}
+	
+private:
+	uint64_t file_id;
+	/* page() returns a copy of the block, which stays valid until the next call */
+	off_t page_index;
+	uint8_t page_data[block_size];
+	
+	virtual void reset()
+	{
+		file_id = block_cache::new_file_id();
+		page_index = -1;
+	}
+};
+
 /* the buffer sizes must all match */
 #define ROFILE_IMPL(buffer_size, buffer_count, method) \
 	rofile_impl<(buffer_size) * 1024, buffer_count, buffer<(buffer_size) * 1024, method##_buffer<(buffer_size) * 1024> > >
@@ -309,7 +441,11 @@ private:
 template<ssize_t buffer_size, int buffer_count>
 rofile * rofile::open(int dfd, const char * file)
 {
-	rofile * size = new ROFILE_IMPL(buffer_size, buffer_count, pread);
+	rofile * size;
+	if(block_cache::global.enabled())
+		size = new rofile_cached<buffer_size * 1024>;
+	else
+		size = new ROFILE_IMPL(buffer_size, buffer_count, pread);
 	if(size)
 	{
 		int r = size->open(dfd, file);
@@ -325,7 +461,27 @@ rofile * rofile::open(int dfd, const char * file)
 template<ssize_t buffer_size, int buffer_count>
 rofile * rofile::open_mmap(int dfd, const char * file)
 {
-	rofile * size = new ROFILE_IMPL(buffer_size, buffer_count, mmap);
+	rofile * size;
+	if(block_cache::global.enabled())
+		size = new rofile_cached<buffer_size * 1024>;
+	else
+		size = new ROFILE_IMPL(buffer_size, buffer_count, mmap);
+	if(size)
+	{
+		int r = size->open(dfd, file);
+		if(r < 0)
+		{
+			delete size;
+			size = NULL;
+		}
+	}
+	return size;
+}
+
+template<ssize_t page_size>
+rofile * rofile::open_mapped(int dfd, const char * file)
+{
+	rofile * size = new rofile_mapped<page_size * 1024>;
 	if(size)
 	{
 		int r = size->open(dfd, file);
@@ -8,6 +8,12 @@ dtable::iter * rwatx_dtable::iterator(ATX_DEF) const
 	if(atx == NO_ABORTABLE_TX)
 		/* use the underlying iterator directly; returns base->iterator() */
 		return iterator_chain_usage(&chain, base, atx);
+	if(snapshots)
+	{
+		const snapshot * snap = find_snapshot(atx);
+		/* the snapshot will not be deleted until this iterator is */
+		return snap ? snap->view.iterator() : NULL;
+	}
 	dtable::iter * bit = base->iterator();
 	if(!bit)
 		return NULL;
@@ -20,32 +26,60 @@ dtable::iter * rwatx_dtable::iterator(ATX_DEF) const
 bool rwatx_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 {
 	if(atx != NO_ABORTABLE_TX)
+	{
+		if(snapshots)
+		{
+			const snapshot * snap = find_snapshot(atx);
+			if(snap)
+				return snap->view.present(key, found);
+			*found = false;
+			return false;
+		}
 		/* probably best not to report conflicts when reading */
 		note_read(key, atx);
+	}
 	return base->present(key, found, atx);
 }
 
 blob rwatx_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
 	if(atx != NO_ABORTABLE_TX)
+	{
+		if(snapshots)
+		{
+			const snapshot * snap = find_snapshot(atx);
+			if(snap)
+				return snap->view.lookup(key, found);
+			*found = false;
+			return blob();
+		}
 		/* probably best not to report conflicts when reading */
 		note_read(key, atx);
+	}
 	return base->lookup(key, found, atx);
 }
 
 int rwatx_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
 	if(atx != NO_ABORTABLE_TX)
-		if(!note_write(key, atx))
+	{
+		if(!(snapshots ? note_snapshot_write(key, atx) : note_write(key, atx)))
 			return -EBUSY;
+	}
+	else if(snapshots)
+		preserve(key, atx);
 	return base->insert(key, blob, append, atx);
 }
 
 int rwatx_dtable::remove(const dtype & key, ATX_DEF)
 {
 	if(atx != NO_ABORTABLE_TX)
-		if(!note_write(key, atx))
+	{
+		if(!(snapshots ? note_snapshot_write(key, atx) : note_write(key, atx)))
 			return -EBUSY;
+	}
+	else if(snapshots)
+		preserve(key, atx);
 	return base->remove(key, atx);
 }
 
@@ -120,16 +154,97 @@ bool rwatx_dtable::note_write(const dtype & key, ATX_DEF)
 	return true;
 }
 
+bool rwatx_dtable::note_snapshot_write(const dtype & key, ATX_DEF)
+{
+	bool found;
+	atx_status_map::iterator it = rwatx.find(atx);
+	if(it == rwatx.end() || it->second.aborted)
+		return false;
+	/* no locks here: other transactions can read (their own snapshots of)
+	 * this key, and concurrent writes are only a conflict if both commit */
+	it->second.snap->before.present(key, &found);
+	if(found)
+	{
+		/* some other transaction has committed a change to this key since
+		 * this transaction started, so it would be overwritten: conflict */
+		it->second.aborted = true;
+		return false;
+	}
+	it->second.writes.insert(key);
+	return true;
+}
+
+void rwatx_dtable::preserve(const dtype & key, abortable_tx writer)
+{
+	atx_status_map::iterator it;
+	bool loaded = false;
+	blob value;
+	for(it = rwatx.begin(); it != rwatx.end(); ++it)
+	{
+		bool found;
+		/* aborted transactions can still read, so keep their snapshots too */
+		if(it->first == writer)
+			continue;
+		if(it->second.writes.find(key) != it->second.writes.end())
+		{
+			/* it has written this key too, and we are committing first */
+			it->second.aborted = true;
+			continue;
+		}
+		it->second.snap->before.present(key, &found);
+		if(found)
+			/* it already has the value from before it started */
+			continue;
+		if(!loaded)
+		{
+			/* nonexistent if not found, which is what we want */
+			value = base->lookup(key, &found);
+			loaded = true;
+		}
+		int r = it->second.snap->before.insert(key, value);
+		assert(r >= 0);
+	}
+}
+
+const rwatx_dtable::snapshot * rwatx_dtable::find_snapshot(ATX_DEF) const
+{
+	atx_status_map::const_iterator it = rwatx.find(atx);
+	if(it == rwatx.end())
+		return NULL;
+	return it->second.snap;
+}
+
 abortable_tx rwatx_dtable::create_tx()
 {
+	snapshot * snap = NULL;
 	abortable_tx atx = base->create_tx();
-	if(atx != NO_ABORTABLE_TX)
+	if(atx == NO_ABORTABLE_TX)
+		return atx;
+	if(snapshots)
+	{
+		snap = new snapshot(base, atx);
+		if(!snap)
+			goto fail;
+		if(snap->before.init(ktype) < 0)
+			goto fail_snap;
+		if(snap->view.init(&snap->before, &snap->current, NULL) < 0)
+			goto fail_snap;
+		if(blob_cmp && snap->view.set_blob_cmp(blob_cmp) < 0)
+			goto fail_snap;
+	}
 	{
 		atx_status_map::value_type pair(atx, atx_status(blob_cmp));
+		pair.second.snap = snap;
 		bool ok = rwatx.insert(pair).second;
 		assert(ok);
 	}
 	return atx;
+	
+fail_snap:
+	delete snap;
+fail:
+	base->abort_tx(atx);
+	return NO_ABORTABLE_TX;
 }
 
 int rwatx_dtable::check_tx(ATX_DEF) const
@@ -150,6 +265,12 @@ int rwatx_dtable::commit_tx(ATX_DEF)
 		return -ENOENT;
 	if(it->second.aborted)
 		return -EBUSY;
+	if(snapshots && rwatx.size() > 1)
+	{
+		key_set::iterator kit;
+		for(kit = it->second.writes.begin(); kit != it->second.writes.end(); ++kit)
+			preserve(*kit, atx);
+	}
 	r = base->commit_tx(atx);
 	if(r >= 0)
 		remove_tx(it);
@@ -167,6 +288,14 @@ void rwatx_dtable::abort_tx(ATX_DEF)
 void rwatx_dtable::remove_tx(const atx_status_map::iterator & it)
 {
 	key_set::iterator kit;
+	if(it->second.snap)
+	{
+		/* there are no locks to release; just get rid of the snapshot */
+		retired.push_back(it->second.snap);
+		rwatx.erase(it);
+		collect_snapshots();
+		return;
+	}
 	/* remove all the read keys from the global map */
 	for(kit = it->second.reads.begin(); kit != it->second.reads.end(); ++kit)
 	{
@@ -186,6 +315,20 @@ void rwatx_dtable::remove_tx(const atx_status_map::iterator & it)
 	rwatx.erase(it);
 }
 
+void rwatx_dtable::collect_snapshots(bool all)
+{
+	size_t kept = 0;
+	for(size_t i = 0; i < retired.size(); i++)
+	{
+		/* iterators from the overlay keep it (and so the snapshot) in use */
+		if(!all && retired[i]->view.in_use())
+			retired[kept++] = retired[i];
+		else
+			delete retired[i];
+	}
+	retired.resize(kept);
+}
+
 int rwatx_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	const dtable_factory * factory;
@@ -197,6 +340,8 @@ int rwatx_dtable::init(int dfd, const char * file, const params & config, sys_jo
 		return -EINVAL;
 	if(!config.get("base_config", &base_config, params()))
 		return -EINVAL;
+	if(!config.get("snapshot_isolation", &snapshots, false))
+		return -EINVAL;
 	base = factory->open(dfd, file, base_config, sysj);
 	if(!base)
 		return -1;
@@ -209,6 +354,14 @@ void rwatx_dtable::deinit()
 {
 	if(base)
 	{
+		atx_status_map::iterator it;
+		for(it = rwatx.begin(); it != rwatx.end(); ++it)
+			if(it->second.snap)
+			{
+				retired.push_back(it->second.snap);
+				it->second.snap = NULL;
+			}
+		collect_snapshots(true);
 		base->destroy();
 		base = NULL;
 		dtable::deinit();
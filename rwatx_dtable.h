@@ -12,11 +12,14 @@
 #error rwatx_dtable.h is a C++ header file
 #endif
 
+#include <vector>
 #include <ext/hash_map>
 #include <ext/hash_set>
 #include <ext/pool_allocator.h>
 
 #include "rwtag.h"
+#include "memory_dtable.h"
+#include "overlay_dtable.h"
 #include "dtable_factory.h"
 #include "dtable_wrap_iter.h"
 
@@ -29,6 +32,19 @@
  * circular wait), the famous Ethernet 1/e utilization effect applies. (Well,
  * except it is probably much worse due to the way read-write locks work.) */
 
+/* With the "snapshot_isolation" parameter set, it instead provides snapshot
+ * isolation: each transaction reads the committed state of the dtable as of
+ * when it was created (plus its own writes), reads never conflict with
+ * anything, and only write-write conflicts abort, with the first transaction
+ * to commit winning. There is no global store of old versions; instead, before
+ * the changes to a key are committed (or written outside a transaction), its
+ * current value is saved in a memory_dtable belonging to each transaction still
+ * in progress that does not already have it, and transactions read through an
+ * overlay of that table on top of the base dtable. A transaction that writes a
+ * key which is in its table, or which has already written a key that another
+ * transaction commits, is aborted. Note that snapshot isolation still allows
+ * write skew, so it is not serializable like the default mode. */
+
 class rwatx_dtable : public dtable
 {
 public:
@@ -59,7 +75,7 @@ public:
 	
 	DECLARE_WRAP_FACTORY(rwatx_dtable);
 	
-	inline rwatx_dtable() : base(NULL), keys(10, blob_cmp, blob_cmp), chain(this) {}
+	inline rwatx_dtable() : base(NULL), snapshots(false), keys(10, blob_cmp, blob_cmp), chain(this) {}
 	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
 	
 protected:
@@ -103,6 +119,36 @@ private:
 		abortable_tx atx;
 	};
 	
+	/* presents a transaction's view of the base dtable as a dtable of its own,
+	 * so it can be put in an overlay_dtable */
+	class atx_view : public dtable
+	{
+	public:
+		virtual iter * iterator(ATX_OPT) const { return base->iterator(view_atx); }
+		virtual bool present(const dtype & key, bool * found, ATX_OPT) const { return base->present(key, found, view_atx); }
+		virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const { return base->lookup(key, found, view_atx); }
+		inline atx_view(dtable * base, abortable_tx view_atx) : base(base), view_atx(view_atx)
+		{
+			ktype = base->key_type();
+			cmp_name = base->get_cmp_name();
+		}
+		virtual ~atx_view() { dtable::deinit(); }
+	private:
+		dtable * base;
+		abortable_tx view_atx;
+	};
+	
+	struct snapshot
+	{
+		/* the values, as of the start of the transaction, of keys that
+		 * have been changed since then by other transactions */
+		memory_dtable before;
+		atx_view current;
+		/* before on top of current */
+		overlay_dtable view;
+		inline snapshot(dtable * base, abortable_tx atx) : current(base, atx) {}
+	};
+	
 	typedef rwtag<int> key_status;
 	typedef __gnu_cxx::hash_map<dtype, key_status, dtype_hashing_comparator, dtype_hashing_comparator> key_status_map;
 	
@@ -113,8 +159,10 @@ private:
 		mutable key_set reads;
 		key_set writes;
 		mutable bool aborted;
+		/* only used with snapshot isolation */
+		snapshot * snap;
 		inline atx_status(const blob_comparator * const & blob_cmp)
-			: reads(64, blob_cmp, blob_cmp), writes(64, blob_cmp, blob_cmp), aborted(false) {}
+			: reads(64, blob_cmp, blob_cmp), writes(64, blob_cmp, blob_cmp), aborted(false), snap(NULL) {}
 	};
 	typedef __gnu_cxx::__pool_alloc<std::pair<abortable_tx, atx_status> > atx_status_map_pool_allocator;
 	typedef __gnu_cxx::hash_map<abortable_tx, atx_status, __gnu_cxx::hash<abortable_tx>, std::equal_to<abortable_tx>, atx_status_map_pool_allocator> atx_status_map;
@@ -122,11 +170,20 @@ private:
 	/* these return false on failure, e.g. if a conflict is detected */
 	bool note_read(const dtype & key, ATX_REQ) const;
 	bool note_write(const dtype & key, ATX_REQ);
+	bool note_snapshot_write(const dtype & key, ATX_REQ);
+	/* with snapshot isolation, call before changing the key in the base
+	 * dtable, except as part of the given transaction */
+	void preserve(const dtype & key, abortable_tx writer);
+	const snapshot * find_snapshot(ATX_REQ) const;
 	
 	/* helper for commit_tx() and abort_tx() */
 	void remove_tx(const atx_status_map::iterator & it);
+	/* deletes retired snapshots that no longer have iterators */
+	void collect_snapshots(bool all = false);
 	
 	dtable * base;
+	bool snapshots;
+	std::vector<snapshot *> retired;
 	mutable key_status_map keys;
 	atx_status_map rwatx;
 	/* used for iterator requests that aren't part of an abortable transaction */
@@ -13,6 +13,99 @@
 #include "transaction.h"
 #include "rwfile.h"
 
+/* direct writes are aligned to this many bytes */
+#define RWFILE_DIRECT_BLOCK 4096
+#define RWFILE_BLOCK_MASK ((off_t) RWFILE_DIRECT_BLOCK - 1)
+
+int rwfile::set_buffer(ssize_t buffer_size, bool direct)
+{
+	void * replace;
+	assert(fd < 0);
+	buffer_size *= 1024;
+#ifdef __linux__
+	if(direct)
+	{
+		/* the buffer must hold whole blocks */
+		buffer_size = (buffer_size + RWFILE_BLOCK_MASK) & ~RWFILE_BLOCK_MASK;
+		if(!buffer_size)
+			buffer_size = RWFILE_DIRECT_BLOCK;
+		if(posix_memalign(&replace, RWFILE_DIRECT_BLOCK, buffer_size))
+			return -ENOMEM;
+	}
+	else
+#else
+	direct = false;
+#endif
+	{
+		replace = malloc(buffer_size);
+		if(!replace)
+			return -ENOMEM;
+	}
+	if(buffer)
+		free(buffer);
+	buffer = (uint8_t *) replace;
+	this->buffer_size = buffer_size;
+	this->direct = direct;
+	return 0;
+}
+
+int rwfile::preallocate(off_t size)
+{
+	int r;
+	if(fd < 0)
+		return -EBADF;
+#ifdef __linux__
+	r = fallocate(fd, 0, 0, size);
+#else
+	r = posix_fallocate(fd, 0, size);
+	if(r > 0)
+	{
+		errno = r;
+		r = -1;
+	}
+#endif
+	return (r < 0) ? -errno : 0;
+}
+
+void rwfile::open_direct(int dfd, const char * file)
+{
+#ifdef __linux__
+	if(direct)
+		/* not all file systems support O_DIRECT; if
+		 * this fails, we just use normal writes */
+		direct_fd = openat(dfd, file, O_WRONLY | O_DIRECT);
+#endif
+}
+
+int rwfile::load_tail(off_t end_offset)
+{
+	ssize_t tail = end_offset & RWFILE_BLOCK_MASK;
+	assert(direct_fd >= 0);
+	write_offset = end_offset - tail;
+	filled = 0;
+	clean = 0;
+	while(filled < tail)
+	{
+		ssize_t r = pread(fd, &buffer[filled], tail - filled, write_offset + filled);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return r;
+		}
+		if(!r)
+		{
+			/* the file is shorter than end_offset */
+			util::memset(&buffer[filled], 0, tail - filled);
+			break;
+		}
+		filled += r;
+	}
+	filled = tail;
+	clean = tail;
+	return 0;
+}
+
 int rwfile::create(int dfd, const char * file, bool tx_external, mode_t mode)
 {
 	if(fd >= 0)
@@ -27,8 +120,10 @@ int rwfile::create(int dfd, const char * file, bool tx_external, mode_t mode)
 	write_mode = true;
 	external = tx_external;
 	filled = 0;
+	clean = 0;
 	write_offset = 0;
 	handler = NULL;
+	open_direct(dfd, file);
 	return 0;
 }
 
@@ -46,15 +141,26 @@ int rwfile::open(int dfd, const char * file, off_t end_offset, bool tx_external)
 	write_mode = true;
 	external = tx_external;
 	filled = 0;
+	clean = 0;
 	write_offset = end_offset;
 	handler = NULL;
+	open_direct(dfd, file);
+	if(direct_fd >= 0)
+	{
+		int r = load_tail(end_offset);
+		if(r < 0)
+		{
+			close();
+			return r;
+		}
+	}
 	return 0;
 }
 
 int rwfile::flush()
 {
 	ssize_t r = 0, written = 0;
-	if(!write_mode || !filled)
+	if(!write_mode || filled == clean)
 		return 0;
 	if(handler)
 	{
@@ -64,27 +170,57 @@ int rwfile::flush()
 	}
 	if(external)
 		tx_start_external();
-	while(written < filled)
+	if(direct_fd >= 0)
 	{
-		r = pwrite(fd, &buffer[written], filled - written, write_offset);
-		if(r <= 0)
+		/* write whole blocks, padding the last one with zeroes */
+		ssize_t length = (filled + RWFILE_BLOCK_MASK) & ~RWFILE_BLOCK_MASK;
+		ssize_t tail = filled & RWFILE_BLOCK_MASK;
+		util::memset(&buffer[filled], 0, length - filled);
+		while(written < length)
 		{
-			if(errno == EINTR)
-				continue;
-			if(written)
-				/* part of the buffer was written, so move the rest */
-				memmove(buffer, &buffer[written], filled - written);
-			break;
+			r = pwrite(direct_fd, &buffer[written], length - written, write_offset + written);
+			if(r <= 0)
+			{
+				if(errno == EINTR)
+					continue;
+				break;
+			}
+			written += r;
+		}
+		if(written == length)
+		{
+			/* keep the partial block to rewrite it with the next data */
+			if(tail)
+				memmove(buffer, &buffer[filled - tail], tail);
+			write_offset += filled - tail;
+			filled = tail;
+			clean = tail;
 		}
-		written += r;
-		write_offset += r;
+		/* otherwise, just try the whole thing again next time */
 	}
+	else
+		while(written < filled)
+		{
+			r = pwrite(fd, &buffer[written], filled - written, write_offset);
+			if(r <= 0)
+			{
+				if(errno == EINTR)
+					continue;
+				if(written)
+					/* part of the buffer was written, so move the rest */
+					memmove(buffer, &buffer[written], filled - written);
+				break;
+			}
+			written += r;
+			write_offset += r;
+		}
 	if(handler)
 		handler->post();
 	if(external)
 		tx_end_external(true);
-	filled -= written;
-	return (!filled) ? 0 : (r < 0) ? (int) r : -1;
+	if(direct_fd < 0)
+		filled -= written;
+	return (filled == clean) ? 0 : (r < 0) ? (int) r : -1;
 }
 
 int rwfile::close()
@@ -97,6 +233,11 @@ int rwfile::close()
 	}
 	::close(fd);
 	fd = -1;
+	if(direct_fd >= 0)
+	{
+		::close(direct_fd);
+		direct_fd = -1;
+	}
 	return 0;
 }
 
@@ -112,12 +253,16 @@ int rwfile::truncate(off_t end_offset)
 		if(write_offset <= end_offset && end_offset <= write_offset + filled)
 		{
 			filled = end_offset - write_offset;
+			if(clean > filled)
+				clean = filled;
 			return 0;
 		}
 		r = flush();
 		if(r < 0)
 			return r;
 	}
+	if(direct_fd >= 0 && write_mode)
+		return load_tail(end_offset);
 	write_offset = end_offset;
 	return 0;
 }
@@ -157,8 +302,18 @@ ssize_t rwfile::append(const void * data, ssize_t size)
 	{
 		write_mode = true;
 		filled = 0;
+		if(direct_fd >= 0)
+		{
+			r = load_tail(write_offset);
+			if(r < 0)
+				return r;
+		}
 	}
 	
+	/* direct writes must come from the buffer */
+	if(direct_fd >= 0)
+		return append_direct(data, size);
+	
 	/* handle large writes without the buffer */
 	if(size > buffer_size)
 	{
@@ -218,6 +373,33 @@ ssize_t rwfile::append(const void * data, ssize_t size)
 	return orig;
 }
 
+ssize_t rwfile::append_direct(const void * data, ssize_t size)
+{
+	ssize_t orig = size;
+	while(size)
+	{
+		ssize_t copy = buffer_size - filled;
+		if(copy > size)
+			copy = size;
+		util::memcpy(&buffer[filled], data, copy);
+		filled += copy;
+		size -= copy;
+		/* can't use void * in arithmetic... */
+		data = &((const uint8_t *) data)[copy];
+		if(filled == buffer_size)
+		{
+			int r = flush();
+			if(r < 0)
+			{
+				/* the data is still in the buffer, but we can't add more */
+				size = orig - size;
+				return size ? size : r;
+			}
+		}
+	}
+	return orig;
+}
+
 int rwfile::pad(ssize_t size)
 {
 	/* this should suffice for now; it can certainly be improved */
@@ -242,7 +424,7 @@ ssize_t rwfile::read(off_t offset, void * data, ssize_t size)
 	
 	/* negative offsets are taken to be relative to the end of the file */
 	if(offset < 0)
-		offset += write_offset;
+		offset += end();
 	
 	/* handle large reads without the buffer */
 	if(size > buffer_size)
@@ -251,6 +433,9 @@ ssize_t rwfile::read(off_t offset, void * data, ssize_t size)
 	if(write_mode || offset < read_offset || read_offset + filled <= offset)
 	{
 		/* current buffer is useless, switch it out */
+		if(write_mode)
+			/* with direct writes, the last partial block was in the buffer */
+			write_offset = end();
 		write_mode = false;
 		read_offset = offset;
 		filled = pread(fd, buffer, buffer_size, offset);
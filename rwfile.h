@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -19,17 +20,18 @@
 /* This class provides a stdio-like wrapper around a read/write file descriptor,
  * allowing data to be appended to the file (starting at a given position) and
  * optionally either calling a given handler or starting an external transaction
- * dependency before doing any writes. Both reads and writes are buffered. */
+ * dependency before doing any writes. Both reads and writes are buffered, and
+ * writes can optionally bypass the page cache (see set_buffer() below). */
 
 class rwfile
 {
 public:
 	/* buffer_size is in KiB */
 	inline rwfile(ssize_t buffer_size = 8)
-		: fd(-1), write_mode(true), external(false), filled(0), write_offset(0), handler(NULL), buffer(NULL)
+		: fd(-1), direct_fd(-1), write_mode(true), external(false), direct(false), filled(0), clean(0), write_offset(0), handler(NULL), buffer(NULL)
 	{
 		this->buffer_size = buffer_size * 1024;
-		buffer = new uint8_t[this->buffer_size];
+		buffer = (uint8_t *) malloc(this->buffer_size);
 	}
 	
 	inline ~rwfile()
@@ -40,9 +42,20 @@ public:
 			assert(r >= 0);
 		}
 		if(buffer)
-			delete[] buffer;
+			free(buffer);
 	}
 	
+	/* Changes the buffer size (in KiB), and whether writes should use O_DIRECT
+	 * where it is available; the file must not be open. Direct writes are made
+	 * in whole blocks from an aligned buffer, so the contents of the file after
+	 * end() in its last block are undefined, and the last partial block is
+	 * rewritten by each flush. Reads still go through the page cache. */
+	int set_buffer(ssize_t buffer_size, bool direct = false);
+	
+	/* allocates space for the file up to the given size, so that appending
+	 * to it will not need to allocate; extends the file if necessary */
+	int preallocate(off_t size);
+	
 	int create(int dfd, const char * file, bool tx_external = false, mode_t mode = 0644);
 	int open(int dfd, const char * file, off_t end_offset, bool tx_external = false);
 	
@@ -76,6 +89,11 @@ public:
 		return external;
 	}
 	
+	inline bool get_direct()
+	{
+		return direct_fd >= 0;
+	}
+	
 	/* return the current idea of the end of the file */
 	inline off_t end() const
 	{
@@ -136,12 +154,20 @@ public:
 	}
 	
 private:
-	int fd;
-	bool write_mode, external;
-	ssize_t filled, buffer_size;
+	int fd, direct_fd;
+	bool write_mode, external, direct;
+	/* in write mode with direct writes, the buffer starts at a block
+	 * boundary and the first clean bytes of it are already written */
+	ssize_t filled, clean, buffer_size;
 	off_t read_offset, write_offset;
 	flush_handler * handler;
 	uint8_t * buffer;
+	
+	/* opens direct_fd, if direct writes were requested and are supported */
+	void open_direct(int dfd, const char * file);
+	/* reads the last partial block before end_offset into the buffer */
+	int load_tail(off_t end_offset);
+	ssize_t append_direct(const void * data, ssize_t size);
 };
 
 #endif /* __RWFILE_H */
@@ -171,20 +171,79 @@ dtype simple_dtable::get_key(size_t index, size_t * data_length, off_t * data_of
 			return dtype(value);
 		}
 		case dtype::STRING:
-			return dtype(st.get(util::read_bytes(bytes, 0, key_size), lock));
+			return dtype(st.fetch(util::read_bytes(bytes, 0, key_size), lock));
 		case dtype::BLOB:
-			return dtype(st.get_blob(util::read_bytes(bytes, 0, key_size), lock));
+			return dtype(st.fetch_blob(util::read_bytes(bytes, 0, key_size), lock));
 	}
 	abort();
 }
 
+/* narrows [min, max] to the one sparse index block that could contain the key */
 template<class T>
-int simple_dtable::find_key(const T & test, size_t * index, size_t * data_length, off_t * data_offset) const
+void simple_dtable::find_sparse(const T & test, ssize_t * min, ssize_t * max) const
+{
+	/* binary search, but in memory */
+	ssize_t low = 0, high = sparse_keys.size() - 1;
+	while(low <= high)
+	{
+		/* watch out for overflow! */
+		ssize_t mid = low + (high - low) / 2;
+		int c = test(sparse_keys[mid]);
+		if(c < 0)
+			low = mid + 1;
+		else if(c > 0)
+			high = mid - 1;
+		else
+		{
+			*min = mid * sparse_interval;
+			*max = *min;
+			return;
+		}
+	}
+	/* the key sorts before the first sparse key, so it is not present */
+	if(!low)
+	{
+		*min = 0;
+		*max = -1;
+		return;
+	}
+	*min = (low - 1) * sparse_interval;
+	*max = *min + sparse_interval - 1;
+	if(*max >= (ssize_t) key_count)
+		*max = key_count - 1;
+}
+
+template<class T>
+int simple_dtable::find_key(const T & test, size_t * index, size_t * data_length, off_t * data_offset, size_t start) const
 {
 	/* binary search */
-	ssize_t min = 0, max = key_count - 1;
+	ssize_t min = start, max = key_count - 1;
 	assert(ktype != dtype::BLOB || !cmp_name == !blob_cmp);
-	scopelock scope(fp->lock);
+	if(sparse_interval)
+	{
+		ssize_t sparse_min;
+		find_sparse(test, &sparse_min, &max);
+		if(sparse_min > min)
+			min = sparse_min;
+	}
+	scopelock scope(fp->lock, !fp->lock_free());
+	if(start && !sparse_interval)
+	{
+		/* gallop forward from start to bracket the key, so nearby keys
+		 * in a sorted batch only cost a few reads in the same buffer */
+		for(size_t step = 1; min <= max; step *= 2)
+		{
+			ssize_t probe = start + step - 1;
+			if(probe > max)
+				break;
+			if(test(get_key(probe, NULL, NULL, false)) >= 0)
+			{
+				max = probe;
+				break;
+			}
+			min = probe + 1;
+		}
+	}
 	while(min <= max)
 	{
 		/* watch out for overflow! */
@@ -244,6 +303,35 @@ blob simple_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return get_value(data_length, data_offset);
 }
 
+void simple_dtable::lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	size_t start = 0;
+	std::vector<size_t> order(count);
+	if(!count)
+		return;
+	sort_keys(keys, count, &order[0]);
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t k = order[i], index;
+		size_t data_length;
+		off_t data_offset;
+		int r = find_key(dtype_static_test(keys[k], blob_cmp), &index, &data_length, &data_offset, start);
+		/* the remaining keys are all at or after this one */
+		start = index;
+		if(r < 0)
+		{
+			found[k] = false;
+			values[k] = blob();
+			continue;
+		}
+		found[k] = true;
+		if(data_length == (size_t) -1)
+			values[k] = blob();
+		else
+			values[k] = get_value(data_length, data_offset);
+	}
+}
+
 blob simple_dtable::index(size_t index) const
 {
 	if(index < 0 || index >= key_count)
@@ -263,10 +351,16 @@ bool simple_dtable::contains_index(size_t index) const
 int simple_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	int r = -1;
+	bool concurrent;
 	dtable_header header;
 	if(fp)
 		deinit();
-	fp = rofile::open_mmap<64, 24>(dfd, file);
+	if(!config.get("concurrent_reads", &concurrent, false))
+		return -EINVAL;
+	if(concurrent)
+		fp = rofile::open_mapped<64>(dfd, file);
+	else
+		fp = rofile::open_mmap<64, 24>(dfd, file);
 	if(!fp)
 		return -1;
 	if(fp->read_type(0, &header) < 0)
@@ -318,6 +412,20 @@ int simple_dtable::init(int dfd, const char * file, const params & config, sys_j
 	}
 	data_start_off = key_start_off + (key_size + length_size + offset_size) * key_count;
 	
+	if(!config.get("sparse_index", &r, 0) || r < 0)
+	{
+		r = -EINVAL;
+		goto fail;
+	}
+	init_sparse(r);
+	
+	if(key_count)
+	{
+		/* remember the first and last keys for key_bounds() */
+		first_key = get_key(0);
+		last_key = get_key(key_count - 1);
+	}
+	
 	return 0;
 	
 fail:
@@ -326,10 +434,27 @@ fail:
 	return (r < 0) ? r : -1;
 }
 
+void simple_dtable::init_sparse(size_t interval)
+{
+	sparse_keys.clear();
+	sparse_interval = 0;
+	/* no point if the whole table would be one block */
+	if(!interval || interval >= key_count)
+		return;
+	sparse_keys.reserve((key_count + interval - 1) / interval);
+	for(size_t i = 0; i < key_count; i += interval)
+		sparse_keys.push_back(get_key(i));
+	sparse_interval = interval;
+}
+
 void simple_dtable::deinit()
 {
 	if(fp)
 	{
+		sparse_keys.clear();
+		sparse_interval = 0;
+		first_key = dtype(0u);
+		last_key = dtype(0u);
 		if(ktype == dtype::STRING)
 			st.deinit();
 		delete fp;
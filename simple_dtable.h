@@ -8,6 +8,8 @@
 #include <inttypes.h>
 #include <sys/types.h>
 
+#include <vector>
+
 #include "stringtbl.h"
 
 #ifndef __cplusplus
@@ -28,6 +30,16 @@ class rofile;
  * input iterator to attempt to get an alternate value to store. See dtable.h
  * for further information. */
 
+/* The "sparse_index" parameter, if nonzero, causes every sparse_index-th key to
+ * be kept in memory after init(). Lookups binary search this sparse index first
+ * and then only the one small contiguous block of the key array that it selects
+ * in the file, rather than probing scattered keys across the whole file. */
+
+/* The "concurrent_reads" parameter maps the whole file with rofile::open_mapped()
+ * so that lookups and iterators in different threads do not serialize on the
+ * rofile lock. (The same parameter is also understood by fixed_dtable,
+ * ustr_dtable, and btree_dtable.) */
+
 #define SDTABLE_MAGIC 0xF029DDE3
 #define SDTABLE_VERSION 1
 
@@ -37,7 +49,16 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	virtual blob index(size_t index) const;
+	inline virtual bool key_bounds(dtype * min, dtype * max) const
+	{
+		if(!key_count)
+			return false;
+		*min = first_key;
+		*max = last_key;
+		return true;
+	}
 	virtual bool contains_index(size_t index) const;
 	inline virtual size_t size() const { return key_count; }
 	
@@ -46,7 +67,7 @@ public:
 	static int create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow = NULL);
 	DECLARE_RO_FACTORY(simple_dtable);
 	
-	inline simple_dtable() : fp(NULL) {}
+	inline simple_dtable() : fp(NULL), first_key(0u), last_key(0u), sparse_interval(0) {}
 	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
 	
 protected:
@@ -95,16 +116,26 @@ private:
 	{
 		return find_key(dtype_static_test(key, blob_cmp), index, data_length, data_offset);
 	}
+	/* only searches at or after start, which must not be after the key's position */
 	template<class T>
-	int find_key(const T & test, size_t * index, size_t * data_length = NULL, off_t * data_offset = NULL) const;
+	int find_key(const T & test, size_t * index, size_t * data_length = NULL, off_t * data_offset = NULL, size_t start = 0) const;
 	blob get_value(size_t data_length, off_t data_offset) const;
 	blob get_value(size_t index) const;
 	
+	void init_sparse(size_t interval);
+	template<class T>
+	inline void find_sparse(const T & test, ssize_t * min, ssize_t * max) const;
+	
 	rofile * fp;
 	size_t key_count;
+	/* for key_bounds() */
+	dtype first_key, last_key;
 	stringtbl st;
 	uint8_t key_size, length_size, offset_size;
 	off_t key_start_off, data_start_off;
+	/* the sparse index: the key at every sparse_interval-th index */
+	size_t sparse_interval;
+	std::vector<dtype> sparse_keys;
 };
 
 #endif /* __SIMPLE_DTABLE_H */
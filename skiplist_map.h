@@ -0,0 +1,282 @@
+/* This file is part of the Casa Mia Datastore Project at UBC. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __SKIPLIST_MAP_H
+#define __SKIPLIST_MAP_H
+
+#include <new>
+#include <errno.h>
+#include <assert.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error skiplist_map.h is a C++ header file
+#endif
+
+#include "arena.h"
+#include "magic_test.h"
+
+/* An insert-only skiplist map that one writer thread can change while any
+ * number of reader threads look up keys and iterate over it without locks.
+ * New nodes are completely filled in before they are linked in, from the
+ * bottom level up, with release stores that pair with the readers' acquire
+ * loads, so readers see each node either fully or not at all. Nodes are never
+ * unlinked (removes are stored as values, like in journal_dtable), so readers
+ * never find themselves on a node that has been freed, and iterators stay valid
+ * across inserts. Changing the value of an existing key replaces it atomically,
+ * so V should be a pointer; the writer is responsible for keeping the old value
+ * alive as long as readers might still be using it. Only clear() and the
+ * destructor require that there be no readers. Nodes have on average 4/3
+ * forward pointers, and backward steps search again from the top. Like
+ * bplus_map, nodes come from an arena belonging to the owner of the map. */
+
+template<class K, class V, class C, size_t LEVELS = 12>
+class skiplist_map
+{
+private:
+	struct node
+	{
+		/* not constructed in the head node */
+		K key;
+		V value;
+		size_t height;
+		/* actually height entries long */
+		node * next[1];
+	};
+
+	static inline node * load(node * const & pointer)
+	{
+		return __atomic_load_n(&pointer, __ATOMIC_ACQUIRE);
+	}
+	static inline void store(node *& pointer, node * value)
+	{
+		__atomic_store_n(&pointer, value, __ATOMIC_RELEASE);
+	}
+
+public:
+	class const_iterator
+	{
+	public:
+		inline const K & key() const { return current->key; }
+		/* the value may be replaced at any time; this is its current value */
+		inline V value() const { return __atomic_load_n(&current->value, __ATOMIC_ACQUIRE); }
+
+		inline const_iterator & operator++()
+		{
+			if(current)
+				current = load(current->next[0]);
+			return *this;
+		}
+
+		/* decrementing end() gives the last entry, if there is one */
+		inline const_iterator & operator--()
+		{
+			if(current)
+				current = map->find_last(key_below(map->comp, current->key));
+			else
+				current = map->find_last(always_below());
+			return *this;
+		}
+
+		inline bool operator==(const const_iterator & x) const { return current == x.current; }
+		inline bool operator!=(const const_iterator & x) const { return current != x.current; }
+
+		inline const_iterator() : map(NULL), current(NULL) {}
+
+	private:
+		inline const_iterator(const skiplist_map * map, const node * current) : map(map), current(current) {}
+
+		const skiplist_map * map;
+		/* NULL at the end */
+		const node * current;
+
+		friend class skiplist_map;
+	};
+
+	inline const_iterator begin() const { return const_iterator(this, load(head->next[0])); }
+	inline const_iterator end() const { return const_iterator(this, NULL); }
+
+	/* the first entry not less than the key */
+	inline const_iterator lower_bound(const K & key) const
+	{
+		return const_iterator(this, find_first(key_below(comp, key)));
+	}
+
+	/* the first entry for which the test is not negative */
+	inline const_iterator lower_bound(const magic_test<K> & test) const
+	{
+		return const_iterator(this, find_first(test_below(test)));
+	}
+
+	inline const_iterator find(const K & key) const
+	{
+		const node * n = find_first(key_below(comp, key));
+		if(n && comp(key, n->key))
+			n = NULL;
+		return const_iterator(this, n);
+	}
+
+	/* for the writer only: adds the key and returns 1, or if it is already
+	 * present, replaces its value and returns 0 with the old value in *old;
+	 * returns -ENOMEM, changing nothing, if the arena is out of memory */
+	int insert(const K & key, const V & value, V * old = NULL);
+	/* for the writer only, and only when there are no readers */
+	void clear();
+
+	/* for the writer only */
+	inline bool empty() const { return !entries; }
+	/* readers can call this too, though it may be out of date right away */
+	inline size_t size() const { return __atomic_load_n(&entries, __ATOMIC_RELAXED); }
+
+	inline skiplist_map(const C & comp, arena * nodes) : comp(comp), nodes(nodes), entries(0), levels(1), seed(0x2545f491)
+	{
+		head = (node *) operator new(sizeof(node) + (LEVELS - 1) * sizeof(node *));
+		head->height = LEVELS;
+		for(size_t i = 0; i < LEVELS; i++)
+			head->next[i] = NULL;
+	}
+	inline ~skiplist_map()
+	{
+		clear();
+		operator delete(head);
+	}
+
+private:
+	/* predicates for find_first() and find_last(), true for keys before the one we want */
+	struct key_below
+	{
+		const C & comp;
+		const K & key;
+		inline bool operator()(const K & x) const { return comp(x, key); }
+		inline key_below(const C & comp, const K & key) : comp(comp), key(key) {}
+	};
+	struct test_below
+	{
+		const magic_test<K> & test;
+		inline bool operator()(const K & x) const { return test(x) < 0; }
+		inline test_below(const magic_test<K> & test) : test(test) {}
+	};
+	struct always_below
+	{
+		inline bool operator()(const K & x) const { return true; }
+	};
+
+	/* returns the first node for which the predicate is false, or NULL if
+	 * none, and sets *before to the last node for which it is true, or the
+	 * head if none; the writer may link in new nodes between them as soon as
+	 * we have looked, so we must not load *before's next pointer again */
+	template<class P>
+	inline const node * find_between(const P & below, const node ** before) const
+	{
+		const node * x = head;
+		const node * next = NULL;
+		for(size_t level = LEVELS; level--;)
+			while((next = load(x->next[level])) && below(next->key))
+				x = next;
+		*before = x;
+		return next;
+	}
+
+	template<class P>
+	inline const node * find_first(const P & below) const
+	{
+		const node * before;
+		return find_between(below, &before);
+	}
+
+	template<class P>
+	inline const node * find_last(const P & below) const
+	{
+		const node * x;
+		find_between(below, &x);
+		return (x == head) ? NULL : x;
+	}
+
+	/* each level has a quarter as many nodes as the one below it */
+	inline size_t random_height()
+	{
+		size_t height = 1;
+		/* xorshift, since rand() has a lock and this only needs to be cheap */
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		for(uint32_t bits = seed; height < LEVELS && !(bits & 3); bits >>= 2)
+			height++;
+		return height;
+	}
+
+	const C comp;
+	arena * nodes;
+	/* not from the arena, since it outlives clear() */
+	node * head;
+	size_t entries;
+	/* the writer only needs to search the levels in use */
+	size_t levels;
+	uint32_t seed;
+
+	/* no copying */
+	void operator=(const skiplist_map &);
+	skiplist_map(const skiplist_map &);
+};
+
+template<class K, class V, class C, size_t LEVELS>
+int skiplist_map<K, V, C, LEVELS>::insert(const K & key, const V & value, V * old)
+{
+	node * preds[LEVELS];
+	node * x = head;
+	node * n;
+	size_t height;
+
+	/* only this thread changes the links, so it need not load them atomically */
+	for(size_t level = levels; level--;)
+	{
+		node * next;
+		while((next = x->next[level]) && comp(next->key, key))
+			x = next;
+		preds[level] = x;
+	}
+	n = x->next[0];
+	if(n && !comp(key, n->key))
+	{
+		if(old)
+			*old = n->value;
+		__atomic_store_n(&n->value, value, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	height = random_height();
+	n = (node *) nodes->allocate(sizeof(node) + (height - 1) * sizeof(node *));
+	if(!n)
+		return -ENOMEM;
+	for(; levels < height; levels++)
+		preds[levels] = head;
+	new (&n->key) K(key);
+	n->value = value;
+	n->height = height;
+	for(size_t i = 0; i < height; i++)
+		n->next[i] = preds[i]->next[i];
+	/* publish it from the bottom up */
+	for(size_t i = 0; i < height; i++)
+		store(preds[i]->next[i], n);
+	__atomic_store_n(&entries, entries + 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+template<class K, class V, class C, size_t LEVELS>
+void skiplist_map<K, V, C, LEVELS>::clear()
+{
+	node * n = head->next[0];
+	while(n)
+	{
+		node * next = n->next[0];
+		n->key.~K();
+		n = next;
+	}
+	for(size_t i = 0; i < LEVELS; i++)
+		head->next[i] = NULL;
+	entries = 0;
+	levels = 1;
+}
+
+#endif /* __SKIPLIST_MAP_H */
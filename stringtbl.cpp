@@ -160,9 +160,61 @@ const blob & stringtbl::get_blob(ssize_t index, bool do_lock) const
 	return lru[i].binary;
 }
 
+/* reads the length and offset of an entry; the lock must be held if needed */
+ssize_t stringtbl::read_entry(ssize_t index, off_t * offset) const
+{
+	int bc = 0;
+	uint8_t buffer[8];
+	ssize_t length;
+	off_t entry = start + sizeof(st_header) + index * bytes[2];
+	if(fp->read(entry, buffer, bytes[2], false) != bytes[2])
+		return -1;
+	length = util::read_bytes(buffer, &bc, bytes[0]);
+	*offset = util::read_bytes(buffer, &bc, bytes[1]) + start;
+	return length;
+}
+
+istr stringtbl::fetch(ssize_t index, bool do_lock) const
+{
+	off_t offset;
+	ssize_t length;
+	if(!fp->lock_free())
+		return get(index, do_lock);
+	if(index < 0 || index >= count)
+		return NULL;
+	length = read_entry(index, &offset);
+	if(length < 0)
+		return NULL;
+	/* the length comes from the file, so don't put this on the stack */
+	blob_buffer string(length);
+	string.set_size(length, false);
+	if(length && fp->read(offset, &string[0], length, false) != length)
+		return NULL;
+	return istr(blob(string));
+}
+
+blob stringtbl::fetch_blob(ssize_t index, bool do_lock) const
+{
+	off_t offset;
+	ssize_t length;
+	if(!fp->lock_free())
+		return get_blob(index, do_lock);
+	if(index < 0 || index >= count)
+		return blob::dne;
+	length = read_entry(index, &offset);
+	if(length <= 0)
+		return blob::dne;
+	blob_buffer data(length);
+	data.set_size(length, false);
+	if(fp->read(offset, &data[0], length, false) != length)
+		return blob::dne;
+	return data;
+}
+
 ssize_t stringtbl::locate(const char * string, bool do_lock) const
 {
-	scopelock scope(fp->lock, do_lock);
+	bool lock_free = fp->lock_free();
+	scopelock scope(fp->lock, do_lock && !lock_free);
 	/* binary search */
 	ssize_t min = 0, max = count - 1;
 	while(min <= max)
@@ -170,7 +222,9 @@ ssize_t stringtbl::locate(const char * string, bool do_lock) const
 		int c;
 		/* watch out for overflow! */
 		ssize_t index = min + (max - min) / 2;
-		const char * value = get(index, false);
+		/* only the lock-free path needs a copy; get() uses the LRU */
+		istr copy = lock_free ? fetch(index, false) : istr();
+		const char * value = lock_free ? copy.str() : get(index, false);
 		if(!value)
 			return -1;
 		c = strcmp(value, string);
@@ -186,7 +240,7 @@ ssize_t stringtbl::locate(const char * string, bool do_lock) const
 
 ssize_t stringtbl::locate(const blob & search, const blob_comparator * blob_cmp, bool do_lock) const
 {
-	scopelock scope(fp->lock, do_lock);
+	scopelock scope(fp->lock, do_lock && !fp->lock_free());
 	/* binary search */
 	ssize_t min = 0, max = count - 1;
 	while(min <= max)
@@ -194,7 +248,7 @@ ssize_t stringtbl::locate(const blob & search, const blob_comparator * blob_cmp,
 		int c;
 		/* watch out for overflow! */
 		ssize_t index = min + (max - min) / 2;
-		blob value = get_blob(index);
+		blob value = fetch_blob(index, false);
 		if(!value.exists())
 			return -1;
 		c = blob_cmp ? blob_cmp->compare(value, search) : value.compare(search);
@@ -51,6 +51,10 @@ public:
 	 * more calls to get(), or one call to locate(). */
 	const char * get(ssize_t index, bool do_lock = true) const;
 	const blob & get_blob(ssize_t index, bool do_lock = true) const;
+	/* These return copies instead. If the rofile is lock-free, they bypass the
+	 * LRU completely, so they can be called from several threads at once. */
+	istr fetch(ssize_t index, bool do_lock = true) const;
+	blob fetch_blob(ssize_t index, bool do_lock = true) const;
 	ssize_t locate(const char * string, bool do_lock = true) const;
 	ssize_t locate(const blob & search, const blob_comparator * blob_cmp = NULL, bool do_lock = true) const;
 	
@@ -60,6 +64,8 @@ public:
 	static int create(rwfile * fp, const std::vector<blob> & blobs);
 	
 private:
+	ssize_t read_entry(ssize_t index, off_t * offset) const;
+	
 	struct lru_ent
 	{
 		ssize_t index;
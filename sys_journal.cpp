@@ -6,8 +6,12 @@
 #include <errno.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <pthread.h>
+
+#include <deque>
 
 #include "openat.h"
+#include "locking.h"
 #include "transaction.h"
 
 #include "sys_journal.h"
@@ -49,7 +53,14 @@
  * that ID using a "warehouse" (which is like a factory, but it also stores the
  * objects it creates). When discard and rollover records are found, the same
  * actions are taken on the objects in the warehouse. At the end of playback the
- * warehouse should contain the same listeners it did during the last run. */
+ * warehouse should contain the same listeners it did during the last run.
+ * 
+ * Filtering copies the whole log, which gets expensive as it grows. So the log
+ * can instead be split into fixed-size segments (see set_segments()), listed
+ * in the meta file; only the last one is appended to, and the others are said
+ * to be "sealed." The number of live bytes in each segment is tracked as
+ * entries are discarded and rolled over, which lets checkpoint() below delete
+ * or compact old segments without scanning the rest of the log. */
 
 #if DEBUG_SYSJ
 #define SYSJ_DEBUG(format, args...) printf("%s @%p[%u %u/%u] (" format ")\n", __FUNCTION__, this, (unsigned) data.end(), (unsigned) data_size, (unsigned) info_size, ##args)
@@ -60,13 +71,25 @@
 #endif
 
 #define SYSJ_META_MAGIC 0xBAFE9BDA
-#define SYSJ_META_VERSION 1
+#define SYSJ_META_VERSION 2
+/* version 1 has no list of sealed segments, and is still
+ * written when there are none, as it was before segments */
+#define SYSJ_META_VERSION_SINGLE 1
 
 #define SYSJ_DATA_MAGIC 0x874C74FD
 #define SYSJ_DATA_VERSION 1
 
 #define assert_data_size() assert(data_size == (size_t) data.end())
 
+/* playback reads the data file in chunks of this size */
+#define SYSJ_PLAYBACK_CHUNK 1048576
+/* and reports progress (if requested) every this many bytes */
+#define SYSJ_PROGRESS_INTERVAL 16777216
+/* each replay thread queues at most this many records */
+#define SYSJ_REPLAY_QUEUE 4096
+
+/* describes the last segment; in version 2, followed by a
+ * uint32_t count and that many meta_segment structures */
 struct meta_journal
 {
 	uint32_t magic;
@@ -75,6 +98,13 @@ struct meta_journal
 	size_t size;
 } __attribute__((packed));
 
+/* a sealed segment, in log order */
+struct meta_segment
+{
+	uint32_t seq;
+	size_t size;
+} __attribute__((packed));
+
 struct data_header
 {
 	uint32_t magic;
@@ -87,6 +117,51 @@ struct entry_header
 	size_t length;
 } __attribute__((packed));
 
+/* reads a data file sequentially in large chunks during playback and filtering */
+class playback_reader
+{
+public:
+	inline playback_reader(rwfile * data) : data(data), offset(0), filled(0)
+	{
+		buffer = (uint8_t *) malloc(SYSJ_PLAYBACK_CHUNK);
+	}
+	inline ~playback_reader()
+	{
+		if(buffer)
+			free(buffer);
+	}
+	
+	ssize_t read(size_t start, void * out, size_t size)
+	{
+		if(!buffer || size > SYSJ_PLAYBACK_CHUNK / 2)
+			return data->read(start, out, size);
+		if(start < offset || offset + filled < start + size)
+		{
+			ssize_t r = data->read(start, buffer, SYSJ_PLAYBACK_CHUNK);
+			if(r < 0)
+				return r;
+			offset = start;
+			filled = r;
+			if(filled < size)
+				size = filled;
+		}
+		util::memcpy(out, &buffer[start - offset], size);
+		return size;
+	}
+	
+	template<class T>
+	inline int read(size_t start, T * out)
+	{
+		ssize_t r = read(start, out, sizeof(T));
+		return (r == sizeof(T)) ? 0 : (r < 0) ? (int) r : -1;
+	}
+	
+private:
+	rwfile * data;
+	uint8_t * buffer;
+	size_t offset, filled;
+};
+
 int sys_journal::append(listening_dtable * listener, void * entry, size_t length)
 {
 	int r;
@@ -102,12 +177,9 @@ int sys_journal::append(listening_dtable * listener, void * entry, size_t length
 	header.length = length;
 	
 	assert_data_size();
-	if(!dirty)
-	{
-		if(!handle.registered)
-			tx_register_pre_end(&handle);
-		dirty = true;
-	}
+	r = prepare_append();
+	if(r < 0)
+		return r;
 	r = data.append(&header);
 	if(r < 0)
 		return r;
@@ -125,6 +197,7 @@ int sys_journal::append(listening_dtable * listener, void * entry, size_t length
 	else
 		live_entry_count[header.id] = 1;
 	live_entries++;
+	add_live_bytes(header.id, segments.back().seq, sizeof(header) + length);
 	
 	assert_data_size();
 	return 0;
@@ -147,23 +220,24 @@ int sys_journal::discard(listener_id lid)
 	header.length = (size_t) -1;
 	
 	assert_data_size();
-	if(!dirty)
-	{
-		if(!handle.registered)
-			tx_register_pre_end(&handle);
-		dirty = true;
-	}
+	r = prepare_append();
+	if(r < 0)
+		return r;
 	r = data.append(&header);
 	if(r < 0)
 		return r;
 	data_size += sizeof(header);
 	
-	discard_rollover_ids(lid);
+	discard_rollover_ids(lid, segments.back().seq);
+	discard_live_bytes(lid);
 	
 	live_entries -= count->second;
 	live_entry_count.erase(count);
 	if(!live_entries && filter_on_empty)
 		filter();
+	else if(segment_size)
+		/* like filter() above, failure here is not a problem for the discard */
+		checkpoint();
 	
 	assert_data_size();
 	return 0;
@@ -189,12 +263,9 @@ int sys_journal::rollover(listener_id from, listener_id to)
 	header.length = (size_t) -2;
 	
 	assert_data_size();
-	if(!dirty)
-	{
-		if(!handle.registered)
-			tx_register_pre_end(&handle);
-		dirty = true;
-	}
+	r = prepare_append();
+	if(r < 0)
+		return r;
 	r = data.append(&header);
 	if(r < 0)
 		return r;
@@ -213,6 +284,9 @@ int sys_journal::rollover(listener_id from, listener_id to)
 	else
 		to_count->second += from_count->second;
 	live_entry_count.erase(from_count);
+	/* the rollover record lives as long as the target does */
+	roll_over_live_bytes(from, to);
+	add_live_bytes(to, segments.back().seq, sizeof(header) + sizeof(to));
 	
 	/* update the rollover ID map */
 	roll_over_rollover_ids(from, to);
@@ -224,8 +298,9 @@ int sys_journal::rollover(listener_id from, listener_id to)
 int sys_journal::filter()
 {
 	int r;
-	char seq[16];
-	meta_journal info;
+	size_t size, live = 0;
+	uint32_t seq;
+	segment_list input;
 	SYSJ_DEBUG("");
 	
 	if(dirty)
@@ -236,57 +311,72 @@ int sys_journal::filter()
 		assert(!dirty);
 	}
 	
+	/* with segments, we only need to rewrite everything if it's all dead */
+	if(segment_size && live_entries)
+		return checkpoint();
+	
 	/* no discarded IDs? no need to filter */
 	if(!discarded.size())
 		return 0;
 	
-	info.magic = SYSJ_META_MAGIC;
-	info.version = SYSJ_META_VERSION;
-	info.seq = sequence + 1;
-	/* size will be filled in by filter() below */
-	snprintf(seq, sizeof(seq), ".%u", info.seq);
 	assert(info_size == data_size);
 	assert_data_size();
+	/* this will replace any segments being compacted */
+	cancel_compaction();
 	
-	istr data_name = meta_name + seq;
+	/* if there are no live entries, don't waste time scanning */
+	if(live_entries)
+	{
+		input = segments;
+		input.back().size = data_size;
+	}
+	seq = next_seq;
+	istr data_name = segment_name(seq);
 	r = tx_start_external();
 	if(r < 0)
 		return r;
-	r = filter(meta_dfd, data_name, &info.size);
+	r = copy_segments(meta_dfd, meta_name, input, discarded, data_name, &size, false);
 	tx_end_external(r >= 0);
-	if(r >= 0)
+	if(r < 0)
+		return r;
+	
+	input.clear();
+	input.push_back(segment(seq, 0, 0));
+	r = write_meta(input, size);
+	if(r < 0)
 	{
-		r = tx_write(meta_fd, &info, sizeof(info), 0);
-		if(r >= 0)
-		{
-			/* switch to the new data file */
-			r = data.close();
-			assert(r >= 0);
-			data_size = info.size;
-			info_size = info.size;
-			r = data.open(meta_dfd, data_name, data_size);
-			assert(r >= 0);
-			/* delete the old sys_journal data */
-			snprintf(seq, sizeof(seq), ".%u", sequence);
-			data_name = meta_name + seq;
-			tx_unlink(meta_dfd, data_name, 0);
-			sequence = info.seq;
-			discarded.clear();
-		}
-		else
-			unlinkat(meta_dfd, data_name, 0);
-	}
-	else
 		unlinkat(meta_dfd, data_name, 0);
+		return r;
+	}
+	/* switch to the new data file */
+	r = data.close();
+	assert(r >= 0);
+	data_size = size;
+	info_size = size;
+	r = data.open(meta_dfd, data_name, data_size, true);
+	assert(r >= 0);
+	preallocate();
+	next_seq++;
+	merge_live_bytes(segments, seq);
+	input.swap(segments);
+	/* delete the old sys_journal data */
+	for(segment_list::iterator it = input.begin(); it != input.end(); ++it)
+	{
+		live += it->live;
+		tx_unlink(meta_dfd, segment_name(it->seq), 0);
+	}
+	segments.back().live = live;
+	discarded.clear();
 	assert_data_size();
-	return r;
+	return 0;
 }
 
-int sys_journal::filter(int dfd, const char * file, size_t * new_size)
+int sys_journal::copy_segments(int dfd, const istr & name, const segment_list & input, const discard_map & discarded, const char * file, size_t * new_size, bool sync, bg_thread<sys_journal> * thread)
 {
 	rwfile out;
 	data_header header;
-	SYSJ_DEBUG("%d, %s", dfd, file);
+	size_t index;
+	SYSJ_DEBUG_IN("%d, %s", dfd, file);
 	int r = out.create(dfd, file);
 	if(r < 0)
 		return r;
@@ -295,16 +385,28 @@ int sys_journal::filter(int dfd, const char * file, size_t * new_size)
 	r = out.append(&header);
 	if(r < 0)
 		goto fail;
-	/* if there are no live entries, don't waste time scanning */
-	if(live_entries)
+	for(index = 0; index < input.size(); index++)
 	{
+		char seq[16];
+		rwfile in;
 		entry_header entry;
 		size_t offset = sizeof(header);
-		while(offset < data_size)
+		size_t size = input[index].size;
+		snprintf(seq, sizeof(seq), ".%u", input[index].seq);
+		r = in.open(dfd, name + seq, size);
+		if(r < 0)
+			goto fail;
+		playback_reader reader(&in);
+		while(offset < size)
 		{
 			void * entry_data;
 			size_t entry_length;
-			r = data.read(offset, &entry);
+			if(thread && thread->stop_requested())
+			{
+				r = -EINTR;
+				goto fail;
+			}
+			r = reader.read(offset, &entry);
 			if(r < 0)
 				goto fail;
 			offset += sizeof(entry);
@@ -327,7 +429,7 @@ int sys_journal::filter(int dfd, const char * file, size_t * new_size)
 				r = -ENOMEM;
 				goto fail;
 			}
-			if(data.read(offset, entry_data, entry_length) != (ssize_t) entry_length)
+			if(reader.read(offset, entry_data, entry_length) != (ssize_t) entry_length)
 			{
 				free(entry_data);
 				r = -EIO;
@@ -345,13 +447,31 @@ int sys_journal::filter(int dfd, const char * file, size_t * new_size)
 			if(r != (int) entry_length)
 				goto fail;
 		}
-		if(offset != data_size)
+		if(offset != size)
+		{
+			r = -EIO;
 			goto fail;
+		}
 	}
 	*new_size = out.end();
 	r = out.close();
 	if(r < 0)
 		goto fail;
+	if(sync)
+	{
+		/* the caller will make this file part of the log without an
+		 * external dependency on it, so make sure it's on disk first */
+		int fd = openat(dfd, file, O_RDONLY);
+		if(fd < 0)
+		{
+			r = fd;
+			goto fail;
+		}
+		r = fsync(fd);
+		close(fd);
+		if(r < 0)
+			goto fail;
+	}
 	return 0;
 	
 fail:
@@ -377,6 +497,11 @@ int sys_journal::init(int dfd, const char * file, listening_dtable_warehouse * r
 	this->reg_warehouse = reg_warehouse;
 	this->temp_warehouse = temp_warehouse;
 	this->filter_on_empty = filter_on_empty;
+	segments.clear();
+	live_bytes.clear();
+	r = data.set_buffer(write_buffer_size, direct_writes);
+	if(r < 0)
+		return r;
 	meta_fd = tx_open(dfd, file, 0);
 	if(!meta_fd)
 	{
@@ -402,7 +527,7 @@ int sys_journal::init(int dfd, const char * file, listening_dtable_warehouse * r
 			goto fail_append;
 		
 		info.magic = SYSJ_META_MAGIC;
-		info.version = SYSJ_META_VERSION;
+		info.version = SYSJ_META_VERSION_SINGLE;
 		info.seq = 0;
 		info.size = sizeof(header);
 		r = tx_write(meta_fd, &info, sizeof(info), 0);
@@ -417,10 +542,13 @@ int sys_journal::init(int dfd, const char * file, listening_dtable_warehouse * r
 			meta_fd = NULL;
 			return r;
 		}
+		segments.push_back(segment(0, 0, 0));
+		next_seq = 1;
 	}
 	else
 	{
 		char seq[16];
+		uint32_t count = 0;
 		if(tx_read(meta_fd, &info, sizeof(info), 0) != sizeof(info))
 		{
 			if(!tx_size(meta_fd))
@@ -429,17 +557,44 @@ int sys_journal::init(int dfd, const char * file, listening_dtable_warehouse * r
 			meta_fd = NULL;
 			return -1;
 		}
-		if(info.magic != SYSJ_META_MAGIC || info.version != SYSJ_META_VERSION)
+		if(info.magic != SYSJ_META_MAGIC || (info.version != SYSJ_META_VERSION && info.version != SYSJ_META_VERSION_SINGLE))
 		{
 			tx_close(meta_fd);
 			meta_fd = NULL;
 			return -EINVAL;
 		}
+		next_seq = info.seq + 1;
+		if(info.version == SYSJ_META_VERSION)
+		{
+			off_t offset = sizeof(info);
+			if(tx_read(meta_fd, &count, sizeof(count), offset) != sizeof(count))
+				count = (uint32_t) -1;
+			offset += sizeof(count);
+			for(uint32_t i = 0; i < count; i++)
+			{
+				meta_segment sealed;
+				if(tx_read(meta_fd, &sealed, sizeof(sealed), offset) != sizeof(sealed))
+					break;
+				offset += sizeof(sealed);
+				segments.push_back(segment(sealed.seq, sealed.size, 0));
+				if(sealed.seq >= next_seq)
+					next_seq = sealed.seq + 1;
+			}
+			if(segments.size() != count)
+			{
+				segments.clear();
+				tx_close(meta_fd);
+				meta_fd = NULL;
+				return -1;
+			}
+		}
+		segments.push_back(segment(info.seq, 0, 0));
 		snprintf(seq, sizeof(seq), ".%u", info.seq);
 		istr data_name = istr(file) + seq;
-		r = data.open(dfd, data_name, info.size);
+		r = data.open(dfd, data_name, info.size, true);
 		if(r < 0)
 		{
+			segments.clear();
 			tx_close(meta_fd);
 			meta_fd = NULL;
 			return r;
@@ -447,6 +602,7 @@ int sys_journal::init(int dfd, const char * file, listening_dtable_warehouse * r
 		r = data.read(0, &header);
 		if(r < 0)
 		{
+			segments.clear();
 			data.close();
 			tx_close(meta_fd);
 			meta_fd = NULL;
@@ -454,6 +610,7 @@ int sys_journal::init(int dfd, const char * file, listening_dtable_warehouse * r
 		}
 		if(header.magic != SYSJ_DATA_MAGIC || header.version != SYSJ_DATA_VERSION)
 		{
+			segments.clear();
 			data.close();
 			tx_close(meta_fd);
 			meta_fd = NULL;
@@ -463,16 +620,9 @@ int sys_journal::init(int dfd, const char * file, listening_dtable_warehouse * r
 	}
 	data_size = info.size;
 	info_size = info.size;
-	sequence = info.seq;
-	if(do_playback)
-	{
-		int r = playback();
-		if(r < 0)
-		{
-			deinit();
-			return r;
-		}
-	}
+	if(!do_playback)
+		preallocate();
+	/* playback needs these to find the sealed segments */
 	meta_name = file;
 	if(dfd != AT_FDCWD)
 	{
@@ -485,6 +635,15 @@ int sys_journal::init(int dfd, const char * file, listening_dtable_warehouse * r
 	}
 	else
 		meta_dfd = AT_FDCWD;
+	if(do_playback)
+	{
+		int r = playback();
+		if(r < 0)
+		{
+			deinit();
+			return r;
+		}
+	}
 	return 0;
 }
 
@@ -514,26 +673,557 @@ void sys_journal::roll_over_rollover_ids(listener_id from, listener_id to, liste
 	}
 }
 
-void sys_journal::discard_rollover_ids(listener_id lid)
+void sys_journal::discard_rollover_ids(listener_id lid, uint32_t seq)
 {
 	rollover_multimap::iterator it = rollover_ids.find(lid);
-	discarded.insert(lid);
+	discarded[lid] = seq;
 	if(it != rollover_ids.end())
 	{
 		listener_id_set::iterator ids;
 		for(ids = it->second.begin(); ids != it->second.end(); ++ids)
-			discarded.insert(*ids);
+			discarded[*ids] = seq;
 		rollover_ids.erase(it);
 	}
 }
 
+sys_journal::segment * sys_journal::find_segment(uint32_t seq)
+{
+	/* usually the last one, so search backward */
+	for(size_t i = segments.size(); i; i--)
+		if(segments[i - 1].seq == seq)
+			return &segments[i - 1];
+	return NULL;
+}
+
+void sys_journal::add_live_bytes(listener_id lid, uint32_t seq, size_t bytes)
+{
+	segment * seg = find_segment(seq);
+	assert(seg);
+	live_bytes[lid][seq] += bytes;
+	seg->live += bytes;
+}
+
+void sys_journal::discard_live_bytes(listener_id lid)
+{
+	live_bytes_map::iterator it = live_bytes.find(lid);
+	if(it == live_bytes.end())
+		return;
+	for(segment_bytes::iterator bytes = it->second.begin(); bytes != it->second.end(); ++bytes)
+	{
+		segment * seg = find_segment(bytes->first);
+		assert(seg && seg->live >= bytes->second);
+		seg->live -= bytes->second;
+	}
+	live_bytes.erase(it);
+}
+
+void sys_journal::roll_over_live_bytes(listener_id from, listener_id to)
+{
+	live_bytes_map::iterator it = live_bytes.find(from);
+	if(it == live_bytes.end())
+		return;
+	segment_bytes & target = live_bytes[to];
+	/* the insertion above may have moved from's entry */
+	it = live_bytes.find(from);
+	for(segment_bytes::iterator bytes = it->second.begin(); bytes != it->second.end(); ++bytes)
+		target[bytes->first] += bytes->second;
+	live_bytes.erase(it);
+}
+
+void sys_journal::merge_live_bytes(const segment_list & from, uint32_t to)
+{
+	live_bytes_map::iterator it;
+	for(it = live_bytes.begin(); it != live_bytes.end(); ++it)
+	{
+		size_t moved = 0;
+		for(segment_list::const_iterator seg = from.begin(); seg != from.end(); ++seg)
+		{
+			segment_bytes::iterator bytes = it->second.find(seg->seq);
+			if(bytes == it->second.end())
+				continue;
+			moved += bytes->second;
+			it->second.erase(bytes);
+		}
+		if(moved)
+			it->second[to] += moved;
+	}
+}
+
+void sys_journal::forget_discarded(const segment_list & gone)
+{
+	discard_map::iterator it = discarded.begin();
+	while(it != discarded.end())
+	{
+		discard_map::iterator next = it;
+		++next;
+		for(segment_list::const_iterator seg = gone.begin(); seg != gone.end(); ++seg)
+			if(it->second == seg->seq)
+			{
+				/* all the entries for this ID were at or before its
+				 * discard record, so none of them are left either */
+				discarded.erase(it);
+				break;
+			}
+		it = next;
+	}
+}
+
+int sys_journal::prepare_append()
+{
+	/* a failed compaction is just abandoned, so ignore errors */
+	if(compacting)
+		finish_compaction();
+	if(segment_size && data_size >= segment_size)
+	{
+		int r = seal_segment();
+		if(r < 0)
+			return r;
+	}
+	mark_dirty();
+	return 0;
+}
+
+int sys_journal::seal_segment()
+{
+	int r;
+	data_header header;
+	uint32_t seq = next_seq;
+	istr data_name = segment_name(seq);
+	SYSJ_DEBUG("%u", seq);
+	
+	assert_data_size();
+	/* compaction will read the sealed segment through another file descriptor */
+	r = data.flush();
+	if(r < 0)
+		return r;
+	r = data.create(meta_dfd, data_name, true);
+	if(r < 0)
+		goto fail_create;
+	header.magic = SYSJ_DATA_MAGIC;
+	header.version = SYSJ_DATA_VERSION;
+	r = data.append(&header);
+	if(r < 0)
+	{
+		data.close();
+		unlinkat(meta_dfd, data_name, 0);
+	fail_create:
+		/* keep appending to the old segment */
+		int r2 = data.open(meta_dfd, segment_name(segments.back().seq), data_size, true);
+		assert(r2 >= 0);
+		return r;
+	}
+	/* the meta file will be updated by flush_tx() */
+	segments.back().size = data_size;
+	segments.push_back(segment(seq, 0, 0));
+	next_seq++;
+	data_size = sizeof(header);
+	info_size = 0;
+	preallocate();
+	assert_data_size();
+	return 0;
+}
+
+int sys_journal::write_meta(const segment_list & list, size_t size)
+{
+	int r;
+	meta_journal info;
+	uint32_t count = list.size() - 1;
+	off_t offset = sizeof(info);
+	
+	info.magic = SYSJ_META_MAGIC;
+	info.version = count ? SYSJ_META_VERSION : SYSJ_META_VERSION_SINGLE;
+	info.seq = list.back().seq;
+	info.size = size;
+	r = tx_write(meta_fd, &info, sizeof(info), 0);
+	if(r < 0 || !count)
+		return r;
+	r = tx_write(meta_fd, &count, sizeof(count), offset);
+	if(r < 0)
+		return r;
+	offset += sizeof(count);
+	for(uint32_t i = 0; i < count; i++)
+	{
+		meta_segment sealed;
+		sealed.seq = list[i].seq;
+		sealed.size = list[i].size;
+		r = tx_write(meta_fd, &sealed, sizeof(sealed), offset);
+		if(r < 0)
+			return r;
+		offset += sizeof(sealed);
+	}
+	return 0;
+}
+
+size_t sys_journal::segment_size = 0;
+bool sys_journal::background_compaction = true;
+bool sys_journal::preallocate_segments = false;
+size_t sys_journal::write_buffer_size = 8;
+bool sys_journal::direct_writes = false;
+
+void sys_journal::set_segments(size_t segment_size, bool background, bool preallocate)
+{
+	sys_journal::segment_size = segment_size;
+	background_compaction = background;
+	preallocate_segments = preallocate;
+}
+
+void sys_journal::set_write_buffer(size_t buffer_size, bool direct)
+{
+	write_buffer_size = buffer_size;
+	direct_writes = direct;
+}
+
+void sys_journal::preallocate()
+{
+	if(!preallocate_segments || !segment_size || data_size >= segment_size)
+		return;
+	/* the sizes in the meta file say how much of each segment is used,
+	 * so it's fine for the file itself to be larger; if this fails, the
+	 * file will just grow as usual, so we can ignore errors */
+	data.preallocate(segment_size);
+}
+
+/* Checkpointing bounds the size of a segmented journal without rewriting it
+ * all. Sealed segments at the start of the log with no live entries left are
+ * simply deleted. Otherwise, if a run of sealed segments at the start of the
+ * log is at least half dead, the live entries in it are copied into a new
+ * segment, which then replaces the whole run. Since the new segment goes at
+ * the start of the log, the entries in it stay in order with respect to any
+ * discard and rollover records in later segments. */
+int sys_journal::checkpoint()
+{
+	int r;
+	size_t count, best = 0, live = 0, size = 0;
+	SYSJ_DEBUG("");
+	
+	if(compacting)
+	{
+		r = finish_compaction();
+		/* only one compaction at a time */
+		if(r < 0 || compacting)
+			return r;
+	}
+	r = retire_segments();
+	if(r < 0)
+		return r;
+	
+	for(count = 1; count < segments.size(); count++)
+	{
+		live += segments[count - 1].live;
+		size += segments[count - 1].size;
+		if(live * 2 <= size && size - live >= segment_size / 2)
+			best = count;
+	}
+	if(!best)
+		return 0;
+	return start_compaction(best);
+}
+
+int sys_journal::retire_segments()
+{
+	int r;
+	size_t count = 0;
+	segment_list retired;
+	
+	/* never retire the last segment */
+	while(count + 1 < segments.size() && !segments[count].live)
+		count++;
+	if(!count)
+		return 0;
+	SYSJ_DEBUG("%zu", count);
+	
+	r = tx_start_r();
+	if(r < 0)
+		return r;
+	retired.assign(segments.begin(), segments.begin() + count);
+	segments.erase(segments.begin(), segments.begin() + count);
+	forget_discarded(retired);
+	mark_dirty();
+	for(segment_list::iterator it = retired.begin(); it != retired.end(); ++it)
+		tx_unlink(meta_dfd, segment_name(it->seq), 0);
+	return tx_end_r();
+}
+
+int sys_journal::start_compaction(size_t count)
+{
+	compaction * c;
+	SYSJ_DEBUG("%zu", count);
+	
+	assert(!compacting && count < segments.size());
+	c = new compaction;
+	if(!c)
+		return -ENOMEM;
+	/* the background thread gets its own copies of everything */
+	c->dfd = meta_dfd;
+	c->name = istr(meta_name.str());
+	c->input.assign(segments.begin(), segments.begin() + count);
+	c->discarded = discarded;
+	c->seq = next_seq++;
+	c->output = segment_name(c->seq);
+	compacting = c;
+	
+	if(!background_compaction)
+	{
+		c->result = copy_segments(c->dfd, c->name, c->input, c->discarded, c->output, &c->size, true);
+		c->done = true;
+		return finish_compaction();
+	}
+	/* wait for the previous thread to exit completely */
+	compact_thread.wait_for_stop();
+	compact_thread.start();
+	return 0;
+}
+
+void sys_journal::compact_thread_main(bg_token * token)
+{
+	/* compacting does not change until we set done */
+	compaction * c = compacting;
+	size_t size = 0;
+	int r = copy_segments(c->dfd, c->name, c->input, c->discarded, c->output, &size, true, &compact_thread);
+	scopelock scope(c->lock);
+	c->result = r;
+	c->size = size;
+	c->done = true;
+}
+
+int sys_journal::finish_compaction()
+{
+	int r;
+	size_t live = 0;
+	compaction * c = compacting;
+	
+	c->lock.lock();
+	if(!c->done)
+	{
+		c->lock.unlock();
+		return 0;
+	}
+	c->lock.unlock();
+	compact_thread.wait_for_stop();
+	compacting = NULL;
+	SYSJ_DEBUG("%u, %d", c->seq, c->result);
+	
+	if(c->result < 0)
+	{
+		r = c->result;
+		delete c;
+		return r;
+	}
+	r = tx_start_r();
+	if(r < 0)
+	{
+		unlinkat(c->dfd, c->output, 0);
+		delete c;
+		return r;
+	}
+	/* nothing else removes segments while a compaction is running */
+	for(size_t i = 0; i < c->input.size(); i++)
+	{
+		assert(segments[i].seq == c->input[i].seq);
+		live += segments[i].live;
+	}
+	merge_live_bytes(c->input, c->seq);
+	forget_discarded(c->input);
+	segments.erase(segments.begin(), segments.begin() + c->input.size());
+	segments.insert(segments.begin(), segment(c->seq, c->size, live));
+	mark_dirty();
+	for(segment_list::iterator it = c->input.begin(); it != c->input.end(); ++it)
+		tx_unlink(meta_dfd, segment_name(it->seq), 0);
+	delete c;
+	return tx_end_r();
+}
+
+void sys_journal::cancel_compaction()
+{
+	if(!compacting)
+		return;
+	compact_thread.request_stop();
+	compact_thread.wait_for_stop();
+	/* the copy cleans up after itself if it fails */
+	if(compacting->result >= 0)
+		unlinkat(compacting->dfd, compacting->output, 0);
+	delete compacting;
+	compacting = NULL;
+}
+
+/* A pool of threads to replay data records during playback. Each listener is
+ * assigned to one thread, so its records are replayed in order; before doing
+ * anything else with a listener, playback must call drain() on it. */
+class sys_journal::replay_pool
+{
+public:
+	int init(size_t threads);
+	/* queues the record to be replayed, and takes ownership of entry */
+	int replay(listening_dtable * listener, void * entry, size_t length);
+	/* waits for all the queued records of this listener to be replayed */
+	int drain(const listening_dtable * listener);
+	/* waits for all queued records and stops the threads */
+	int finish();
+	
+	inline replay_pool() : workers(NULL), count(0) {}
+	inline ~replay_pool()
+	{
+		if(workers)
+			finish();
+	}
+	
+private:
+	struct work
+	{
+		listening_dtable * listener;
+		void * entry;
+		size_t length;
+	};
+	
+	struct worker
+	{
+		pthread_t thread;
+		init_mutex lock;
+		/* the thread waits on wake; playback waits on changed */
+		init_cond wake, changed;
+		std::deque<work> queue;
+		bool busy, stop;
+		int error;
+		inline worker() : busy(false), stop(false), error(0) {}
+	};
+	
+	inline worker * get_worker(const listening_dtable * listener) const
+	{
+		size_t hash = (size_t) listener;
+		return &workers[((hash >> 4) ^ (hash >> 12)) % count];
+	}
+	
+	static void * run(void * arg);
+	
+	worker * workers;
+	size_t count;
+};
+
+int sys_journal::replay_pool::init(size_t threads)
+{
+	assert(!workers);
+	workers = new worker[threads];
+	if(!workers)
+		return -ENOMEM;
+	for(count = 0; count < threads; count++)
+		if(pthread_create(&workers[count].thread, NULL, run, &workers[count]))
+		{
+			if(!count)
+			{
+				delete[] workers;
+				workers = NULL;
+				return -EAGAIN;
+			}
+			/* just use the threads we have */
+			break;
+		}
+	return 0;
+}
+
+void * sys_journal::replay_pool::run(void * arg)
+{
+	worker * w = (worker *) arg;
+	scopelock scope(w->lock);
+	for(;;)
+	{
+		int r = 0;
+		work item;
+		while(w->queue.empty() && !w->stop)
+			scope.wait(w->wake);
+		if(w->queue.empty())
+			break;
+		item = w->queue.front();
+		w->queue.pop_front();
+		w->busy = true;
+		scope.unlock();
+		/* after an error, just throw away the rest of the records */
+		if(!w->error)
+			/* data is passed by reference */
+			r = sys_journal::replay(item.listener, item.entry, item.length);
+		if(item.entry)
+			free(item.entry);
+		scope.lock();
+		w->busy = false;
+		if(r < 0 && !w->error)
+			w->error = r;
+		scope.broadcast(w->changed);
+	}
+	return NULL;
+}
+
+int sys_journal::replay_pool::replay(listening_dtable * listener, void * entry, size_t length)
+{
+	worker * w = get_worker(listener);
+	work item;
+	item.listener = listener;
+	item.entry = entry;
+	item.length = length;
+	scopelock scope(w->lock);
+	while(w->queue.size() >= SYSJ_REPLAY_QUEUE)
+		scope.wait(w->changed);
+	if(w->error)
+	{
+		free(entry);
+		return w->error;
+	}
+	w->queue.push_back(item);
+	scope.signal(w->wake);
+	return 0;
+}
+
+int sys_journal::replay_pool::drain(const listening_dtable * listener)
+{
+	worker * w = get_worker(listener);
+	scopelock scope(w->lock);
+	while(!w->queue.empty() || w->busy)
+		scope.wait(w->changed);
+	return w->error;
+}
+
+int sys_journal::replay_pool::finish()
+{
+	int error = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		workers[i].lock.lock();
+		workers[i].stop = true;
+		workers[i].wake.signal();
+		workers[i].lock.unlock();
+	}
+	for(size_t i = 0; i < count; i++)
+	{
+		/* the threads finish their queues before exiting */
+		pthread_join(workers[i].thread, NULL);
+		if(workers[i].error && !error)
+			error = workers[i].error;
+	}
+	delete[] workers;
+	workers = NULL;
+	count = 0;
+	return error;
+}
+
+size_t sys_journal::playback_threads = 1;
+sys_journal::playback_progress sys_journal::playback_report = NULL;
+void * sys_journal::playback_param = NULL;
+
+void sys_journal::set_playback(size_t threads, playback_progress progress, void * param)
+{
+	playback_threads = threads;
+	playback_report = progress;
+	playback_param = param;
+}
+
 int sys_journal::playback()
 {
+	int r = 0;
 	listener_id_set temporary;
-	size_t offset = sizeof(data_header);
+	replay_pool * pool = NULL;
+	segment_list log = segments;
+	size_t done = 0, total = 0;
 	SYSJ_DEBUG("");
 	
-	assert(offset <= info_size);
+	assert(sizeof(data_header) <= info_size);
 	assert(info_size <= data_size);
 	assert_data_size();
 	
@@ -541,14 +1231,87 @@ int sys_journal::playback()
 		return -EINVAL;
 	live_entries = 0;
 	live_entry_count.clear();
+	live_bytes.clear();
+	log.back().size = info_size;
+	for(size_t i = 0; i < log.size(); i++)
+		total += log[i].size;
+	
+	if(playback_threads > 1)
+	{
+		pool = new replay_pool;
+		if(pool && pool->init(playback_threads) < 0)
+		{
+			/* just do it all on this thread */
+			delete pool;
+			pool = NULL;
+		}
+	}
+	/* rolling over replayed listeners appends to the journal, which may seal
+	 * the last segment, so read each segment through its own file */
+	for(size_t i = 0; i < log.size() && r >= 0; i++)
+	{
+		rwfile file;
+		data_header header;
+		r = file.open(meta_dfd, segment_name(log[i].seq), log[i].size);
+		if(r >= 0)
+			r = file.read(0, &header);
+		if(r >= 0 && (header.magic != SYSJ_DATA_MAGIC || header.version != SYSJ_DATA_VERSION))
+			r = -EINVAL;
+		if(r >= 0)
+			r = playback_log(pool, &temporary, &file, log[i].seq, log[i].size, &done, total);
+	}
+	if(pool)
+	{
+		/* wait for the rest of the records even if there was an error,
+		 * since they refer to listeners which will be destroyed */
+		int error = pool->finish();
+		delete pool;
+		if(r >= 0)
+			r = error;
+	}
+	if(r < 0)
+		return r;
+	if(playback_report)
+		playback_report(total, total, playback_param);
 	
-	while(offset < info_size)
+	if(!temporary.empty())
+	{
+		/* abandoned temporary IDs were found, discard them */
+		listener_id_set::iterator it;
+		for(it = temporary.begin(); it != temporary.end(); ++it)
+		{
+			listening_dtable * listener = warehouse_lookup(*it);
+			assert(listener);
+			discard(*it);
+			/* these are supposed to be in the temp warehouse */
+			assert(listener->get_warehouse() == temp_warehouse);
+			warehouse_remove(listener);
+			delete listener;
+		}
+	}
+	assert_data_size();
+	return 0;
+}
+
+int sys_journal::playback_log(replay_pool * pool, listener_id_set * temporary, rwfile * file, uint32_t seq, size_t size, size_t * done, size_t total)
+{
+	playback_reader reader(file);
+	size_t offset = sizeof(data_header);
+	size_t base = *done;
+	size_t next_report = (base / SYSJ_PROGRESS_INTERVAL + 1) * SYSJ_PROGRESS_INTERVAL;
+	
+	while(offset < size)
 	{
 		int r;
 		void * entry_data;
 		entry_header entry;
 		listening_dtable * listener;
-		if(data.read(offset, &entry) < 0)
+		if(playback_report && base + offset >= next_report)
+		{
+			playback_report(base + offset, total, playback_param);
+			next_report = base + offset + SYSJ_PROGRESS_INTERVAL;
+		}
+		if(reader.read(offset, &entry) < 0)
 			return -EIO;
 		offset += sizeof(entry);
 		if(entry.length == (size_t) -1)
@@ -561,12 +1324,15 @@ int sys_journal::playback()
 				live_entries -= count->second;
 				live_entry_count.erase(count);
 			}
-			discard_rollover_ids(entry.id);
+			discard_rollover_ids(entry.id, seq);
+			discard_live_bytes(entry.id);
 			if(is_temporary(entry.id))
-				temporary.erase(entry.id);
+				temporary->erase(entry.id);
 			listener = warehouse_lookup(entry.id);
 			if(listener)
 			{
+				if(pool && (r = pool->drain(listener)) < 0)
+					return r;
 				warehouse_remove(listener);
 				delete listener;
 			}
@@ -576,7 +1342,7 @@ int sys_journal::playback()
 		{
 			/* this is a rollover record */
 			listener_id to;
-			if(data.read(offset, &to) < 0)
+			if(reader.read(offset, &to) < 0)
 				return -EIO;
 			offset += sizeof(to);
 			assert(is_temporary(entry.id));
@@ -585,8 +1351,12 @@ int sys_journal::playback()
 			if(from_ldt)
 			{
 				listening_dtable * to_ldt = warehouse_lookup(to);
+				if(pool && (r = pool->drain(from_ldt)) < 0)
+					return r;
 				if(to_ldt)
 				{
+					if(pool && (r = pool->drain(to_ldt)) < 0)
+						return r;
 					r = from_ldt->rollover(to_ldt);
 					assert(r >= 0);
 					warehouse_remove(from_ldt);
@@ -595,13 +1365,15 @@ int sys_journal::playback()
 				else
 					from_ldt->set_id(to);
 			}
+			roll_over_live_bytes(entry.id, to);
+			add_live_bytes(to, seq, sizeof(entry) + sizeof(to));
 			if(is_temporary(to))
 			{
-				temporary.insert(to);
+				temporary->insert(to);
 				roll_over_rollover_ids(entry.id, to);
 			}
 			else
-				roll_over_rollover_ids(entry.id, to, &temporary);
+				roll_over_rollover_ids(entry.id, to, temporary);
 			continue;
 		}
 		SYSJ_DEBUG_IN("record for ID %d, length %zu", entry.id, entry.length);
@@ -611,14 +1383,15 @@ int sys_journal::playback()
 		else
 			live_entry_count[entry.id] = 1;
 		live_entries++;
+		add_live_bytes(entry.id, seq, sizeof(entry) + entry.length);
 		
 		if(is_temporary(entry.id))
-			temporary.insert(entry.id);
+			temporary->insert(entry.id);
 		
 		entry_data = malloc(entry.length);
 		if(!entry_data)
 			return -ENOMEM;
-		if(data.read(offset, entry_data, entry.length) != (ssize_t) entry.length)
+		if(reader.read(offset, entry_data, entry.length) != (ssize_t) entry.length)
 		{
 			free(entry_data);
 			return -EIO;
@@ -631,6 +1404,13 @@ int sys_journal::playback()
 			free(entry_data);
 			return -EIO;
 		}
+		if(pool)
+		{
+			r = pool->replay(listener, entry_data, entry.length);
+			if(r < 0)
+				return r;
+			continue;
+		}
 		/* data is passed by reference */
 		r = listener->journal_replay(entry_data, entry.length);
 		if(entry_data)
@@ -638,24 +1418,9 @@ int sys_journal::playback()
 		if(r < 0)
 			return r;
 	}
-	if(offset != info_size)
+	if(offset != size)
 		return -EIO;
-	if(!temporary.empty())
-	{
-		/* abandoned temporary IDs were found, discard them */
-		listener_id_set::iterator it;
-		for(it = temporary.begin(); it != temporary.end(); ++it)
-		{
-			listening_dtable * listener = warehouse_lookup(*it);
-			assert(listener);
-			discard(*it);
-			/* these are supposed to be in the temp warehouse */
-			assert(listener->get_warehouse() == temp_warehouse);
-			warehouse_remove(listener);
-			delete listener;
-		}
-	}
-	assert_data_size();
+	*done = base + size;
 	return 0;
 }
 
@@ -665,6 +1430,7 @@ void sys_journal::deinit(bool erase)
 	if(meta_fd)
 	{
 		int r;
+		cancel_compaction();
 		if(dirty)
 			flush_tx();
 		assert(!dirty);
@@ -678,10 +1444,9 @@ void sys_journal::deinit(bool erase)
 		tx_close(meta_fd);
 		if(erase)
 		{
-			char seq[16];
-			snprintf(seq, sizeof(seq), ".%u", sequence);
-			istr data_name = meta_name + seq;
-			tx_unlink(meta_dfd, data_name, 0);
+			segment_list::iterator it;
+			for(it = segments.begin(); it != segments.end(); ++it)
+				tx_unlink(meta_dfd, segment_name(it->seq), 0);
 			tx_unlink(meta_dfd, meta_name, 0);
 		}
 		meta_fd = NULL;
@@ -691,6 +1456,8 @@ void sys_journal::deinit(bool erase)
 			close(meta_dfd);
 			meta_dfd = -1;
 		}
+		segments.clear();
+		live_bytes.clear();
 		discarded.clear();
 	}
 }
@@ -777,7 +1544,6 @@ sys_journal::listener_id sys_journal::get_unique_id(bool temporary)
 int sys_journal::flush_tx()
 {
 	int r;
-	meta_journal info;
 	SYSJ_DEBUG("");
 	
 	if(!dirty)
@@ -787,11 +1553,7 @@ int sys_journal::flush_tx()
 	if(r < 0)
 		return r;
 	
-	info.magic = SYSJ_META_MAGIC;
-	info.version = SYSJ_META_VERSION;
-	info.seq = sequence;
-	info.size = data_size;
-	r = tx_write(meta_fd, &info, sizeof(info), 0);
+	r = write_meta(segments, data_size);
 	if(r < 0)
 		return r;
 	
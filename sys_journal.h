@@ -4,6 +4,7 @@
 #ifndef __SYS_JOURNAL_H
 #define __SYS_JOURNAL_H
 
+#include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -15,6 +16,8 @@
 #error journal++.h is a C++ header file
 #endif
 
+#include <map>
+#include <vector>
 #include <ext/hash_set>
 #include <ext/hash_map>
 #include <ext/pool_allocator.h>
@@ -23,6 +26,7 @@
 #include "istr.h"
 #include "rwfile.h"
 #include "dtable.h"
+#include "bg_thread.h"
 
 class sys_journal
 {
@@ -83,6 +87,14 @@ public:
 		/* listening dtables must implement size() */
 		virtual size_t size() const = 0;
 		
+		/* choose the structure used to keep keys in order, for listening dtables
+		 * that support more than one; NULL always means the default */
+		inline virtual int set_index(const istr & type) { return type ? -ENOSYS : 0; }
+		/* called when no more changes will be made, after which more than one
+		 * thread may read the dtable at a time; indices built lazily on first
+		 * use must be finished here, since building them is not thread safe */
+		inline virtual void finish_index() const {}
+		
 		inline listener_id id() const { return local_id; }
 		inline listening_dtable_warehouse * get_warehouse() const { return warehouse; }
 		inline sys_journal * get_journal() const { return journal; }
@@ -292,10 +304,15 @@ public:
 		id_ptr_map map;
 	};
 	
-	/* remove any discarded entries from this journal */
+	/* remove any discarded entries from this journal; when the journal is
+	 * split into segments (see set_segments() below), this just retires dead
+	 * segments and compacts old ones if enough of their data is dead, unless
+	 * there are no live entries left at all */
 	int filter();
 	
-	inline sys_journal() : meta_dfd(-1), meta_fd(NULL), dirty(false), data_size(0), info_size(0)
+	inline sys_journal()
+		: meta_dfd(-1), meta_fd(NULL), dirty(false), data_size(0), info_size(0),
+		  compacting(NULL), compact_thread(this, &sys_journal::compact_thread_main)
 	{
 		handle.data = this;
 		handle.handle = flush_tx_static;
@@ -333,6 +350,33 @@ public:
 	/* allocates and initializes a new sys_journal in the same directory as the global journal */
 	static sys_journal * spawn_init(const char * file, listening_dtable_warehouse * reg_warehouse, listening_dtable_warehouse * temp_warehouse, bool create = false, bool filter_on_empty = true);
 	
+	/* Recovery settings, used when init() plays back an existing journal. The
+	 * data records of different listeners are replayed on up to this many
+	 * threads (the default, 1, replays everything on the calling thread), but
+	 * each listener still sees its own records in order and discards and
+	 * rollovers are still handled in log order. If progress is not NULL, it
+	 * is called periodically with the number of bytes played back so far. */
+	typedef void (*playback_progress)(size_t done, size_t total, void * param);
+	static void set_playback(size_t threads, playback_progress progress = NULL, void * param = NULL);
+	
+	/* If segment_size is nonzero, the data log is split into segments of
+	 * about this size, each in its own file, instead of being a single file
+	 * rewritten in full by filter(). Segments are retired as soon as all the
+	 * entries in them (and all older segments) have been discarded, and a run
+	 * of old segments that are mostly dead is copied, minus the dead entries,
+	 * into a single new segment; if background is set, the copy is done by a
+	 * background thread, and the result installed by a later journal call.
+	 * If preallocate is set, space for each new segment is allocated when it
+	 * is created, so that appends do not need to allocate disk space. */
+	static void set_segments(size_t segment_size, bool background = true, bool preallocate = false);
+	/* the number of data log segments, including the one being appended to */
+	inline size_t segment_count() const { return segments.size(); }
+	
+	/* Sets the size (in KiB) of the buffer used to append to the journal, and
+	 * whether to write it with O_DIRECT (see rwfile::set_buffer()); these take
+	 * effect on the next init(). The default is an 8 KiB buffered write. */
+	static void set_write_buffer(size_t buffer_size, bool direct = false);
+	
 	static int set_unique_id_file(int dfd, const char * file, bool create = false);
 	/* temporary IDs are odd rather than even and are automatically discarded
 	 * during recovery unless they have been rolled into a non-temporary ID */
@@ -347,8 +391,8 @@ private:
 	tx_fd meta_fd;
 	
 	bool dirty, filter_on_empty;
+	/* data_size and info_size are for the last segment */
 	size_t data_size, info_size;
-	uint32_t sequence;
 	tx_pre_end handle;
 	size_t live_entries;
 	listening_dtable_warehouse * reg_warehouse;
@@ -390,7 +434,55 @@ private:
 	live_entry_map live_entry_count;
 	
 	typedef __gnu_cxx::hash_set<listener_id> listener_id_set;
-	listener_id_set discarded;
+	/* maps discarded IDs to the segment in which they were discarded; they
+	 * can be forgotten once that segment (and so all older ones) is gone */
+	typedef __gnu_cxx::hash_map<listener_id, uint32_t> discard_map;
+	discard_map discarded;
+	
+	/* The data log is a list of segments, each in its own file named by its
+	 * sequence number. Only the last segment (in data) is appended to. */
+	struct segment
+	{
+		uint32_t seq;
+		/* the size is kept up to date only for sealed segments */
+		size_t size;
+		/* bytes of entries that have not been discarded */
+		size_t live;
+		inline segment(uint32_t seq, size_t size, size_t live) : seq(seq), size(size), live(live) {}
+	};
+	typedef std::vector<segment> segment_list;
+	segment_list segments;
+	uint32_t next_seq;
+	
+	/* the live bytes of each listener in each segment, by sequence number */
+	typedef std::map<uint32_t, size_t> segment_bytes;
+	typedef __gnu_cxx::hash_map<listener_id, segment_bytes> live_bytes_map;
+	live_bytes_map live_bytes;
+	
+	/* a copy of old segments into a new one, minus the discarded entries */
+	struct compaction
+	{
+		int dfd;
+		istr name;
+		segment_list input;
+		discard_map discarded;
+		uint32_t seq;
+		istr output;
+		/* filled in by the copy, under lock if it runs in the background */
+		init_mutex lock;
+		bool done;
+		int result;
+		size_t size;
+		inline compaction() : done(false), result(0), size(0) {}
+	};
+	compaction * compacting;
+	bg_thread<sys_journal> compact_thread;
+	
+	static size_t segment_size;
+	static bool background_compaction;
+	static bool preallocate_segments;
+	static size_t write_buffer_size;
+	static bool direct_writes;
 	
 	typedef __gnu_cxx::hash_map<listener_id, listener_id_set> rollover_multimap;
 	rollover_multimap rollover_ids;
@@ -412,12 +504,68 @@ private:
 	
 	/* if remove is not NULL, remove all the rolled over (temporary) IDs from it */
 	void roll_over_rollover_ids(listener_id from, listener_id to, listener_id_set * remove = NULL);
-	void discard_rollover_ids(listener_id lid);
+	/* marks the ID and those rolled over into it discarded in the given segment */
+	void discard_rollover_ids(listener_id lid, uint32_t seq);
+	
+	/* keep segment live byte counts up to date */
+	void add_live_bytes(listener_id lid, uint32_t seq, size_t bytes);
+	void discard_live_bytes(listener_id lid);
+	void roll_over_live_bytes(listener_id from, listener_id to);
+	/* moves all live bytes in the given segments to the new one */
+	void merge_live_bytes(const segment_list & from, uint32_t to);
+	segment * find_segment(uint32_t seq);
+	/* forgets discarded IDs whose discard records are in the given segments */
+	void forget_discarded(const segment_list & gone);
+	
+	inline istr segment_name(uint32_t seq) const
+	{
+		char suffix[16];
+		snprintf(suffix, sizeof(suffix), ".%u", seq);
+		return meta_name + suffix;
+	}
+	inline void mark_dirty()
+	{
+		if(!dirty)
+		{
+			if(!handle.registered)
+				tx_register_pre_end(&handle);
+			dirty = true;
+		}
+	}
+	/* marks the journal dirty and seals the last segment if necessary */
+	int prepare_append();
+	int seal_segment();
+	/* preallocates the last segment, if requested */
+	void preallocate();
+	/* writes the meta file, listing the segments; the last one has the given size */
+	int write_meta(const segment_list & list, size_t size);
+	/* retire dead segments and start compactions as necessary */
+	int checkpoint();
+	int retire_segments();
+	int start_compaction(size_t count);
+	/* installs the current compaction if it has finished */
+	int finish_compaction();
+	void cancel_compaction();
+	void compact_thread_main(bg_token * token);
+	
+	/* replays data records on worker threads during playback */
+	class replay_pool;
+	static size_t playback_threads;
+	static playback_progress playback_report;
+	static void * playback_param;
 	
 	/* play back the entire journal, creating listeners as necessary */
 	int playback();
-	/* copy the entries in this journal to a new one, omitting the discarded entries */
-	int filter(int dfd, const char * file, size_t * new_size);
+	/* the main loop of playback() for one segment, which leaves abandoned
+	 * temporary IDs in temporary; done is updated for progress reports */
+	int playback_log(replay_pool * pool, listener_id_set * temporary, rwfile * file, uint32_t seq, size_t size, size_t * done, size_t total);
+	/* replay_pool is not a friend of listening_dtable, so it calls this */
+	static inline int replay(listening_dtable * listener, void *& entry, size_t length)
+	{
+		return listener->journal_replay(entry, length);
+	}
+	/* copy the entries in the given segments to a new one, omitting the discarded entries */
+	static int copy_segments(int dfd, const istr & name, const segment_list & input, const discard_map & discarded, const char * file, size_t * new_size, bool sync, bg_thread<sys_journal> * thread = NULL);
 	/* flushes the data file and tx_write()s the meta file */
 	int flush_tx();
 	/* actual function used for tx_register_pre_end */
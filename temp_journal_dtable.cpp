@@ -2,6 +2,7 @@
  * version 2 of the GNU GPL. See the file LICENSE for details. */
 
 #include <errno.h>
+#include <string.h>
 
 #include "temp_journal_dtable.h"
 
@@ -60,11 +61,18 @@ int temp_journal_dtable::accept(const dtype & key, const blob & value, bool appe
 	return 0;
 }
 
+int temp_journal_dtable::set_index(const istr & type)
+{
+	if(type && !strcmp(type, "skiplist"))
+		return journal_dtable::set_index(NULL);
+	return journal_dtable::set_index(type);
+}
+
 int temp_journal_dtable::degrade()
 {
-	journal_dtable_hash::iterator it;
+	journal_dtable_hash::const_iterator it;
 	for(it = jdt_hash.begin(); it != jdt_hash.end(); ++it)
-		jdt_map[it->first] = &it->second;
+		add_index(&*it, false);
 	temporary = false;
 	return 0;
 }
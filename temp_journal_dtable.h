@@ -31,6 +31,10 @@ public:
 	/* for rollover */
 	virtual int accept(const dtype & key, const blob & value, bool append = false);
 	
+	/* temporary journal dtables belong to a single transaction, and look up
+	 * keys in the hash until they degrade, so they never use the skiplist */
+	virtual int set_index(const istr & type);
+	
 	class temp_journal_dtable_warehouse : public sys_journal::listening_dtable_warehouse_impl<temp_journal_dtable>
 	{
 	protected:
@@ -31,10 +31,13 @@
  * for threads to concurrently use the tx_open(), tx_close(), tx_read(), and
  * tx_write() functions, as long as each tx_fd is used by only one thread. (And
  * note that opening the same file more than once will return the same tx_fd.)
- * It is also safe to call tx_register_pre_end() and tx_unregister_pre_end().
- * All other calls must be made by a single thread; furthermore, it is not safe
- * for other threads to use tx_write() while that single thread executes any
- * other transaction library function (e.g. tx_start() or tx_end()). */
+ * It is also safe to call tx_register_pre_end() and tx_unregister_pre_end(),
+ * and to call tx_sync() and tx_forget() for different transaction IDs, so that
+ * several threads can wait for their transactions to become durable at once
+ * (see tx_set_group_commit()). All other calls must be made by a single
+ * thread; furthermore, it is not safe for other threads to use tx_write() while
+ * that single thread executes any other transaction library function (e.g.
+ * tx_start() or tx_end()). */
 
 #define MF_TX_WRITE 1
 #define MF_TX_UNLINK 2
@@ -170,6 +173,7 @@ tx_id metafile::last_tx_id = -1;
 tx_pre_end * metafile::pre_end_handlers = NULL;
 init_mutex metafile::pre_end_handler_lock;
 metafile::tx_map_t metafile::tx_map;
+init_mutex metafile::tx_map_lock;
 
 int metafile::record_processor(void * data, size_t length, void * param)
 {
@@ -382,6 +386,7 @@ int metafile::tx_start()
 		if(journal_dir < 0)
 			return -EBUSY;
 		snprintf(name, sizeof(name), "%08x.jnl", last_tx_id + 1);
+		scopelock scope(tx_map_lock);
 		current_journal = journal::create(journal_dir, name, last_journal);
 		if(!current_journal)
 			return -1;
@@ -398,6 +403,7 @@ int metafile::tx_start()
 
 int metafile::switch_journal()
 {
+	scopelock scope(tx_map_lock);
 	int r = current_journal->erase();
 	if(r < 0)
 		return r;
@@ -438,8 +444,11 @@ tx_id metafile::tx_end(bool assign_id)
 	}
 	MF_S_DEBUG("%d", tx_recursion);
 	if(assign_id)
+	{
+		scopelock scope(tx_map_lock);
 		if(!tx_map.insert(std::make_pair(last_tx_id, current_journal)).second)
 			return -ENOENT;
+	}
 	r = current_journal->commit();
 	if(r < 0)
 		goto fail;
@@ -459,7 +468,10 @@ tx_id metafile::tx_end(bool assign_id)
 	
 fail:
 	if(assign_id) 
+	{
+		scopelock scope(tx_map_lock);
 		tx_map.erase(last_tx_id);
+	}
 	return r;
 }
 
@@ -500,13 +512,19 @@ void metafile::tx_unregister_pre_end(tx_pre_end * handle)
 int metafile::tx_sync(tx_id id)
 {
 	int r;
+	journal * j;
+	scopelock scope(tx_map_lock);
 	tx_map_t::iterator itr = tx_map.find(id);
 	if(itr == tx_map.end())
 		return -EINVAL;
-	journal * j = itr->second;
+	j = itr->second;
+	/* the map still holds its reference to j, so we can wait without the
+	 * lock and let other threads sync (and share the sync) meanwhile */
+	scope.unlock();
 	r = j->wait();
 	if(r < 0)
 		return r;
+	scope.lock();
 	tx_map.erase(id);
 	if(j != last_journal)
 		j->release();
@@ -515,6 +533,7 @@ int metafile::tx_sync(tx_id id)
 
 int metafile::tx_forget(tx_id id)
 {
+	scopelock scope(tx_map_lock);
 	tx_map_t::iterator itr = tx_map.find(id);
 	if(itr == tx_map.end())
 		return -EINVAL;
@@ -525,6 +544,11 @@ int metafile::tx_forget(tx_id id)
 	return 0;
 }
 
+int metafile::tx_set_group_commit(unsigned int max_delay, size_t max_batch)
+{
+	return journal::set_group_commit(max_delay, max_batch);
+}
+
 int metafile::tx_start_r()
 {
 	if(!tx_recursion)
@@ -640,6 +664,11 @@ int tx_forget(tx_id id)
 	return metafile::tx_forget(id);
 }
 
+int tx_set_group_commit(unsigned int max_delay, size_t max_batch)
+{
+	return metafile::tx_set_group_commit(max_delay, max_batch);
+}
+
 int tx_start_r(void)
 {
 	return metafile::tx_start_r();
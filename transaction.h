@@ -45,6 +45,9 @@ void tx_unregister_pre_end(struct tx_pre_end * handle);
 int tx_sync(tx_id id);
 int tx_forget(tx_id id);
 
+/* makes concurrent tx_sync() calls share syncs - see journal::set_group_commit() */
+int tx_set_group_commit(unsigned int max_delay, size_t max_batch);
+
 /* metafiles */
 typedef struct metafile * tx_fd;
 
@@ -159,6 +162,8 @@ public:
 	static int tx_sync(tx_id id);
 	static int tx_forget(tx_id id);
 	
+	static int tx_set_group_commit(unsigned int max_delay, size_t max_batch);
+	
 	static int tx_start_r();
 	static int tx_end_r();
 	
@@ -204,6 +209,8 @@ private:
 	static init_mutex pre_end_handler_lock;
 	typedef std::map<tx_id, journal *> tx_map_t;
 	static tx_map_t tx_map; 
+	/* protects tx_map and journal usage counts, so tx_sync() can be called from other threads */
+	static init_mutex tx_map_lock;
 	
 	static int switch_journal();
 	static istr full_path(int dfd, const char * name);
@@ -180,9 +180,9 @@ dtype ustr_dtable::get_key(size_t index, size_t * data_length, off_t * data_offs
 			return dtype(value);
 		}
 		case dtype::STRING:
-			return dtype(st.get(util::read_bytes(bytes, 0, key_size), lock));
+			return dtype(st.fetch(util::read_bytes(bytes, 0, key_size), lock));
 		case dtype::BLOB:
-			return dtype(st.get_blob(util::read_bytes(bytes, 0, key_size), lock));
+			return dtype(st.fetch_blob(util::read_bytes(bytes, 0, key_size), lock));
 	}
 	abort();
 }
@@ -193,7 +193,7 @@ int ustr_dtable::find_key(const T & test, size_t * index, size_t * data_length,
 	/* binary search */
 	ssize_t min = 0, max = key_count - 1;
 	assert(ktype != dtype::BLOB || !cmp_name == !blob_cmp);
-	scopelock scope(fp->lock);
+	scopelock scope(fp->lock, !fp->lock_free());
 	while(min <= max)
 	{
 		/* watch out for overflow! */
@@ -225,7 +225,7 @@ blob ustr_dtable::unpack_blob(const blob & source, size_t unpacked_size) const
 		if(!memcmp(dup_escape, &source[i], dup_escape_len))
 		{
 			ssize_t index = util::read_bytes(&source[i += dup_escape_len], 0, dup_index_size);
-			const char * string = dup.get(index);
+			istr string = dup.fetch(index);
 			if(string)
 			{
 				uint8_t length = strlen(string);
@@ -307,10 +307,16 @@ bool ustr_dtable::contains_index(size_t index) const
 int ustr_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	int r = -1;
+	bool concurrent;
 	dtable_header header;
 	if(fp)
 		deinit();
-	fp = rofile::open_mmap<64, 32>(dfd, file);
+	if(!config.get("concurrent_reads", &concurrent, false))
+		return -EINVAL;
+	if(concurrent)
+		fp = rofile::open_mapped<64>(dfd, file);
+	else
+		fp = rofile::open_mmap<64, 32>(dfd, file);
 	if(!fp)
 		return -1;
 	if(fp->read_type(0, &header) < 0)
@@ -378,6 +384,13 @@ int ustr_dtable::init(int dfd, const char * file, const params & config, sys_jou
 		dup_escape_len = 0;
 	}
 	
+	if(key_count)
+	{
+		/* remember the first and last keys for key_bounds() */
+		first_key = get_key(0);
+		last_key = get_key(key_count - 1);
+	}
+	
 	return 0;
 	
 fail_st:
@@ -393,6 +406,8 @@ void ustr_dtable::deinit()
 {
 	if(fp)
 	{
+		first_key = dtype(0u);
+		last_key = dtype(0u);
 		if(dup_index_size)
 			dup.deinit();
 		if(ktype == dtype::STRING)
@@ -40,6 +40,14 @@ public:
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob index(size_t index) const;
+	inline virtual bool key_bounds(dtype * min, dtype * max) const
+	{
+		if(!key_count)
+			return false;
+		*min = first_key;
+		*max = last_key;
+		return true;
+	}
 	virtual bool contains_index(size_t index) const;
 	inline virtual size_t size() const { return key_count; }
 	
@@ -48,7 +56,7 @@ public:
 	static int create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow = NULL);
 	DECLARE_RO_FACTORY(ustr_dtable);
 	
-	inline ustr_dtable() : fp(NULL) {}
+	inline ustr_dtable() : fp(NULL), first_key(0u), last_key(0u) {}
 	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
 	
 protected:
@@ -114,6 +122,8 @@ private:
 	
 	rofile * fp;
 	size_t key_count;
+	/* for key_bounds() */
+	dtype first_key, last_key;
 	stringtbl st, dup;
 	uint8_t key_size, length_size, offset_size;
 	uint8_t dup_index_size, dup_escape_len, dup_escape[2];
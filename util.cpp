@@ -52,6 +52,45 @@ int util::rm_r(int dfd, const char * path)
 	return unlinkat(dfd, path, AT_REMOVEDIR);
 }
 
+off_t util::du(int dfd, const char * path)
+{
+	DIR * dir;
+	struct stat64 st;
+	struct dirent * ent;
+	off_t total;
+	int fd, r = fstatat64(dfd, path, &st, AT_SYMLINK_NOFOLLOW);
+	if(r < 0)
+		return r;
+	if(!S_ISDIR(st.st_mode))
+		return st.st_size;
+	fd = openat(dfd, path, O_RDONLY);
+	if(fd < 0)
+		return fd;
+	/* closedir() will close fd */
+	dir = fdopendir(fd);
+	if(!dir)
+	{
+		close(fd);
+		return -1;
+	}
+	total = 0;
+	while((ent = readdir(dir)))
+	{
+		off_t size;
+		if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		size = du(fd, ent->d_name);
+		if(size < 0)
+		{
+			total = size;
+			break;
+		}
+		total += size;
+	}
+	closedir(dir);
+	return total;
+}
+
 istr util::tilde_home(const istr & path)
 {
 	size_t length;
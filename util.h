@@ -134,8 +134,51 @@ public:
 		}
 	}
 	
+	/* a fast non-cryptographic 64-bit hash (MurmurHash64A) */
+	static inline uint64_t hash64(const void * data, size_t size, uint64_t seed = 0)
+	{
+		const uint64_t mul = 0xC6A4A7935BD1E995ULL;
+		const uint8_t * bytes = (const uint8_t *) data;
+		const uint8_t * end = bytes + (size & ~(size_t) 7);
+		uint64_t hash = seed ^ (size * mul);
+		for(; bytes != end; bytes += 8)
+		{
+			uint64_t word;
+			memcpy(&word, bytes, 8);
+			word *= mul;
+			word ^= word >> 47;
+			word *= mul;
+			hash ^= word;
+			hash *= mul;
+		}
+		switch(size & 7)
+		{
+			case 7:
+				hash ^= (uint64_t) bytes[6] << 48;
+			case 6:
+				hash ^= (uint64_t) bytes[5] << 40;
+			case 5:
+				hash ^= (uint64_t) bytes[4] << 32;
+			case 4:
+				hash ^= (uint64_t) bytes[3] << 24;
+			case 3:
+				hash ^= (uint64_t) bytes[2] << 16;
+			case 2:
+				hash ^= (uint64_t) bytes[1] << 8;
+			case 1:
+				hash ^= (uint64_t) bytes[0];
+				hash *= mul;
+		}
+		hash ^= hash >> 47;
+		hash *= mul;
+		hash ^= hash >> 47;
+		return hash;
+	}
+	
 	/* rm -r */
 	static int rm_r(int dfd, const char * path);
+	/* du -s (in bytes, not blocks) */
+	static off_t du(int dfd, const char * path);
 	static istr tilde_home(const istr & path);
 };
 